@@ -22,6 +22,12 @@
 #include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
+#ifdef HAVE_PREADV
+#include <sys/uio.h>
+#endif
+#ifdef HAVE_COPY_FILE_RANGE
+#include <sys/syscall.h>
+#endif
 #include "xfs_copy.h"
 #include "libxlog.h"
 
@@ -49,7 +55,9 @@ unsigned int	num_targets;
 target_control	*target;
 
 wbuf		w_buf;
-wbuf		btree_buf;
+
+unsigned int	ag_threads = 1;		/* AGs read in parallel */
+int		clone_data;		/* clone used space into the targets */
 
 pid_t		parent_pid;
 unsigned int	kids;
@@ -57,11 +65,21 @@ unsigned int	kids;
 thread_control	glob_masks;
 thread_args	*targ;
 
-pthread_mutex_t	mainwait;
-
 #define ACTIVE		1
 #define INACTIVE	2
 
+/* target_control clone modes */
+#define CLONE_NONE	0
+#define CLONE_REFLINK	1		/* share the source's blocks */
+#define CLONE_COPY	2		/* copy_file_range(2) */
+
+/* hands out AGs to the readers, and serialises the progress bar */
+static pthread_mutex_t	progress_lock = PTHREAD_MUTEX_INITIALIZER;
+static xfs_agnumber_t	next_agno;
+static xfs_daddr_t	merge_gap;
+static __uint64_t	numblocks;
+static int		howfar;
+
 xfs_off_t	write_log_trailer(int fd, wbuf *w, xfs_mount_t *mp);
 xfs_off_t	write_log_header(int fd, wbuf *w, xfs_mount_t *mp);
 static int	format_logs(struct xfs_mount *);
@@ -185,59 +203,165 @@ do_write(
 	thread_args	*args,
 	wbuf		*buf)
 {
-	int		res;
-	int		error = 0;
+	ssize_t		res;
 
 	if (!buf)
 		buf = &w_buf;
 
-	if (target[args->id].position != buf->position)  {
-		if (lseek(args->fd, buf->position, SEEK_SET) < 0)  {
-			error = target[args->id].err_type = 1;
-		} else  {
-			target[args->id].position = buf->position;
-		}
+	res = pwrite(target[args->id].fd, buf->data, buf->length,
+		     buf->position);
+	if (res != buf->length)  {
+		target[args->id].error = res < 0 ? errno : EIO;
+		target[args->id].position = buf->position;
+		return 2;
 	}
+	target[args->id].position = buf->position + res;
+	return 0;
+}
 
-	if ((res = write(target[args->id].fd, buf->data,
-				buf->length)) == buf->length)  {
-		target[args->id].position += res;
-	} else  {
-		error = 2;
+/*
+ * Write out @nbufs ring buffers, with a single pwritev for each run of
+ * them that is contiguous on disk.
+ */
+static int
+do_writev(
+	thread_args	*args,
+	wbuf		**bufs,
+	int		nbufs)
+{
+#ifdef HAVE_PREADV
+	struct iovec	iov[NUM_WBUFS];
+	xfs_off_t	pos;
+	size_t		len;
+	ssize_t		res;
+	int		i, j;
+
+	for (i = 0; i < nbufs; i = j)  {
+		pos = bufs[i]->position;
+		len = 0;
+		for (j = i; j < nbufs && bufs[j]->position == pos + len; j++)  {
+			iov[j - i].iov_base = bufs[j]->data;
+			iov[j - i].iov_len = bufs[j]->length;
+			len += bufs[j]->length;
+		}
+
+		res = pwritev(target[args->id].fd, iov, j - i, pos);
+		if (res != len)  {
+			target[args->id].error = res < 0 ? errno : EIO;
+			target[args->id].position = pos;
+			return 2;
+		}
+		target[args->id].position = pos + len;
 	}
+	return 0;
+#else
+	int		i;
 
-	if (error) {
-		target[args->id].error = errno;
-		target[args->id].position = buf->position;
+	for (i = 0; i < nbufs; i++)
+		if (do_write(args, bufs[i]))
+			return 2;
+	return 0;
+#endif
+}
+
+/*
+ * Clone [pos, pos + len) of the source into the same range of target @i,
+ * without the data passing through us. Ranges the filesystem won't remap,
+ * such as ones not aligned to its block size, are copied by the kernel
+ * instead.
+ */
+static int
+clone_range(
+	int		i,
+	xfs_off_t	pos,
+	size_t		len)
+{
+	struct xfs_clone_args	args;
+#ifdef HAVE_COPY_FILE_RANGE
+	loff_t		soff = pos, doff = pos;
+	ssize_t		res;
+#endif
+
+	if (target[i].clone == CLONE_REFLINK)  {
+		args.src_fd = source_fd;
+		args.src_offset = pos;
+		args.src_length = len;
+		args.dest_offset = pos;
+		if (ioctl(target[i].fd, XFS_IOC_CLONE_RANGE, &args) == 0)
+			return 0;
+		if (errno != EINVAL)
+			return errno;
 	}
-	return error;
+#ifdef HAVE_COPY_FILE_RANGE
+	while (len > 0)  {
+		res = syscall(__NR_copy_file_range, source_fd, &soff,
+			      target[i].fd, &doff, len, 0);
+		if (res < 0)
+			return errno;
+		if (res == 0)		/* end of the source file */
+			break;
+		len -= res;
+	}
+	return 0;
+#else
+	return EOPNOTSUPP;
+#endif
+}
+
+/*
+ * See how, if at all, used space can be cloned into target @i. The probe
+ * clones the first block, which the first AG header overwrites later.
+ */
+static int
+probe_clone(
+	int		i)
+{
+	target[i].clone = CLONE_REFLINK;
+	if (clone_range(i, 0, source_blocksize) == 0)
+		return CLONE_REFLINK;
+	target[i].clone = CLONE_COPY;
+	if (clone_range(i, 0, source_blocksize) == 0)
+		return CLONE_COPY;
+	target[i].clone = CLONE_NONE;
+	return CLONE_NONE;
 }
 
 void *
 begin_reader(void *arg)
 {
 	thread_args	*args = arg;
+	wbuf		*bufs[NUM_WBUFS];
+	int		nbufs;
+	int		i;
 
 	for (;;) {
-		pthread_mutex_lock(&args->wait);
-		if (do_write(args, NULL))
-			goto handle_error;
-	        pthread_mutex_lock(&glob_masks.mutex);
-		if (--glob_masks.num_working == 0)
-			pthread_mutex_unlock(&mainwait);
+		/* take everything queued since we last looked */
+		pthread_mutex_lock(&glob_masks.mutex);
+		while (args->next == glob_masks.queued)
+			pthread_cond_wait(&glob_masks.queued_cv,
+					  &glob_masks.mutex);
+		for (nbufs = 0; args->next + nbufs < glob_masks.queued; nbufs++)
+			bufs[nbufs] = &glob_masks.buffers[
+				(args->next + nbufs) % NUM_WBUFS];
+		pthread_mutex_unlock(&glob_masks.mutex);
+
+		/*
+		 * Once a target has failed we keep consuming the ring without
+		 * writing, so the others aren't held up waiting for it. The
+		 * error will be logged by the primary thread.
+		 */
+		if (target[args->id].state != INACTIVE &&
+		    do_writev(args, bufs, nbufs))
+			target[args->id].state = INACTIVE;
+
+		pthread_mutex_lock(&glob_masks.mutex);
+		for (i = 0; i < nbufs; i++)
+			bufs[i]->refs--;
+		args->next += nbufs;
+		pthread_cond_broadcast(&glob_masks.written_cv);
 		pthread_mutex_unlock(&glob_masks.mutex);
 	}
 	/* NOTREACHED */
-
-handle_error:
-	/* error will be logged by primary thread */
-
-	pthread_mutex_lock(&glob_masks.mutex);
-	target[args->id].state = INACTIVE;
-	if (--glob_masks.num_working == 0)
-		pthread_mutex_unlock(&mainwait);
-	pthread_mutex_unlock(&glob_masks.mutex);
-	pthread_exit(NULL);
 	return NULL;
 }
 
@@ -307,7 +431,7 @@ void
 usage(void)
 {
 	fprintf(stderr,
-		_("Usage: %s [-bdV] [-L logfile] source target [target ...]\n"),
+	_("Usage: %s [-bcdV] [-L logfile] [-t threads] source target [target ...]\n"),
 		progname);
 	exit(1);
 }
@@ -351,8 +475,6 @@ bump_bar(int tenths, __uint64_t numblocks)
 	return tenths;
 }
 
-static xfs_off_t source_position = -1;
-
 wbuf *
 wbuf_init(wbuf *buf, int data_size, int data_align, int min_io_size, int id)
 {
@@ -374,9 +496,9 @@ void
 read_wbuf(int fd, wbuf *buf, xfs_mount_t *mp)
 {
 	int		res = 0;
-	xfs_off_t	lres = 0;
 	xfs_off_t	newpos;
 	size_t		diff;
+	xfs_off_t	source_position;
 
 	newpos = rounddown(buf->position, (xfs_off_t) buf->min_io_size);
 
@@ -387,15 +509,7 @@ read_wbuf(int fd, wbuf *buf, xfs_mount_t *mp)
 		buf->length += diff;
 	}
 
-	if (source_position != buf->position)  {
-		lres = lseek(fd, buf->position, SEEK_SET);
-		if (lres < 0LL)  {
-			do_warn(_("%s:  lseek failure at offset %lld\n"),
-				progname, source_position);
-			die_perror();
-		}
-		source_position = buf->position;
-	}
+	source_position = buf->position;
 
 	ASSERT(source_position % source_sectorsize == 0);
 
@@ -410,7 +524,7 @@ read_wbuf(int fd, wbuf *buf, xfs_mount_t *mp)
 		exit(1);
 	}
 
-	if ((res = read(fd, buf->data, buf->length)) < 0)  {
+	if ((res = pread(fd, buf->data, buf->length, buf->position)) < 0)  {
 		do_warn(_("%s:  read failure at offset %lld\n"),
 				progname, source_position);
 		die_perror();
@@ -421,7 +535,6 @@ read_wbuf(int fd, wbuf *buf, xfs_mount_t *mp)
 		res = buf->length;
 	else
 		ASSERT(res == buf->length);
-	source_position += res;
 	buf->length = res;
 }
 
@@ -472,24 +585,66 @@ read_ag_header(int fd, xfs_agnumber_t agno, wbuf *buf, ag_header_t *ag,
 }
 
 
-void
-write_wbuf(void)
+/*
+ * Get the next ring buffer to read into, waiting for the slowest target to
+ * finish writing out its previous contents.
+ */
+wbuf *
+get_wbuf(void)
 {
-	int		i;
+	wbuf		*buf;
+	__uint64_t	seq;
 
-	/* verify target threads */
-	for (i = 0; i < num_targets; i++)
-		if (target[i].state != INACTIVE)
-			glob_masks.num_working++;
+	pthread_mutex_lock(&glob_masks.mutex);
+	seq = glob_masks.reserved++;
+	buf = &glob_masks.buffers[seq % NUM_WBUFS];
+	signal_maskfunc(SIGCHLD, SIG_UNBLOCK);
+	while (buf->refs != 0 || buf->seq != seq)
+		pthread_cond_wait(&glob_masks.written_cv, &glob_masks.mutex);
+	signal_maskfunc(SIGCHLD, SIG_BLOCK);
+	buf->refs = WBUF_FILLING;
+	pthread_mutex_unlock(&glob_masks.mutex);
+	return buf;
+}
 
-	/* release target threads */
-	for (i = 0; i < num_targets; i++)
-		if (target[i].state != INACTIVE)
-			pthread_mutex_unlock(&targ[i].wait);	/* wake up */
+/*
+ * Hand a ring buffer filled by read_wbuf() to the target threads, along
+ * with any later ones that were only waiting for this one to be filled.
+ */
+void
+write_wbuf(
+	wbuf		*buf)
+{
+	pthread_mutex_lock(&glob_masks.mutex);
+	buf->refs = WBUF_FILLED;
+	for (;;)  {
+		buf = &glob_masks.buffers[glob_masks.queued % NUM_WBUFS];
+		if (buf->refs != WBUF_FILLED)
+			break;
+		buf->refs = num_targets;
+		buf->seq += NUM_WBUFS;
+		glob_masks.queued++;
+	}
+	pthread_cond_broadcast(&glob_masks.queued_cv);
+	pthread_mutex_unlock(&glob_masks.mutex);
+}
+
+/*
+ * Wait for every target to write out everything queued.
+ */
+void
+drain_wbufs(void)
+{
+	int		i;
 
+	pthread_mutex_lock(&glob_masks.mutex);
 	signal_maskfunc(SIGCHLD, SIG_UNBLOCK);
-	pthread_mutex_lock(&mainwait);
+	for (i = 0; i < NUM_WBUFS; i++)
+		while (glob_masks.buffers[i].refs != 0)
+			pthread_cond_wait(&glob_masks.written_cv,
+					  &glob_masks.mutex);
 	signal_maskfunc(SIGCHLD, SIG_BLOCK);
+	pthread_mutex_unlock(&glob_masks.mutex);
 }
 
 void
@@ -525,18 +680,315 @@ sb_update_uuid(
 							 XFS_SB_CRC_OFF);
 }
 
+/*
+ * Read the by-block freespace btree block @bno of @agno into @buf.
+ */
+static struct xfs_btree_block *
+read_bnobt_block(
+	xfs_mount_t	*mp,
+	xfs_agnumber_t	agno,
+	xfs_agblock_t	bno,
+	wbuf		*buf)
+{
+	struct xfs_btree_block *block;
+	xfs_off_t	pos;
+
+	buf->position = pos = (xfs_off_t)
+		XFS_AGB_TO_DADDR(mp, agno, bno) << BBSHIFT;
+	buf->length = source_blocksize;
+
+	/* let read_wbuf handle alignment */
+	read_wbuf(source_fd, buf, mp);
+	block = (struct xfs_btree_block *)(buf->data + pos - buf->position);
+
+	if (be32_to_cpu(block->bb_magic) !=
+	    (xfs_sb_version_hascrc(&mp->m_sb) ?
+	     XFS_ABTB_CRC_MAGIC : XFS_ABTB_MAGIC)) {
+		do_log(_("Bad btree magic 0x%x\n"),
+		        be32_to_cpu(block->bb_magic));
+		exit(1);
+	}
+	return block;
+}
+
+/*
+ * Add [begin, end) to the map of used space in an AG. Reading a little
+ * free space costs much less than issuing another I/O, so any gap of up
+ * to merge_gap is merged into the previous extent.
+ */
+static void
+add_extent(
+	extent_map_t	*map,
+	xfs_daddr_t	begin,
+	xfs_daddr_t	end)
+{
+	copy_extent_t	*last;
+	xfs_daddr_t	min_io = w_buf.min_io_size >> BBSHIFT;
+
+	if (end <= begin)
+		return;
+
+	/* round size up to ensure we copy a range bigger than required */
+	end = begin + roundup(end - begin, min_io);
+
+	if (map->nextents > 0)  {
+		last = &map->extents[map->nextents - 1];
+		if (begin - last->end <= merge_gap)  {
+			last->end = MAX(last->end, end);
+			return;
+		}
+	}
+
+	if (map->nextents == map->maxextents)  {
+		map->maxextents = map->maxextents ? map->maxextents * 2 : 64;
+		map->extents = realloc(map->extents,
+				map->maxextents * sizeof(copy_extent_t));
+		if (map->extents == NULL)  {
+			do_log(_("Couldn't allocate extent map\n"));
+			die_perror();
+		}
+	}
+	last = &map->extents[map->nextents++];
+	last->begin = begin;
+	last->end = end;
+}
+
+/*
+ * Build the map of used space in @agno from its by-block freespace btree,
+ * skipping the AG headers already copied up to @ag_begin. The AGF must
+ * have been saved at the start of @btree_buf.
+ */
+static void
+scan_ag(
+	xfs_mount_t	*mp,
+	xfs_agnumber_t	agno,
+	xfs_daddr_t	ag_begin,
+	wbuf		*btree_buf,
+	extent_map_t	*map)
+{
+	xfs_agf_t	*agf = (xfs_agf_t *)btree_buf->data;
+	struct xfs_btree_block *block;
+	xfs_alloc_ptr_t	*ptr;
+	xfs_alloc_rec_t	*rec_ptr;
+	xfs_agblock_t	bno;
+	uint		btree_levels, current_level;
+	xfs_daddr_t	begin, next_begin, ag_end;
+	int		i;
+
+	bno = be32_to_cpu(agf->agf_roots[XFS_BTNUM_BNOi]);
+	btree_levels = be32_to_cpu(agf->agf_levels[XFS_BTNUM_BNOi]);
+	ag_end = XFS_AGB_TO_DADDR(mp, agno, be32_to_cpu(agf->agf_length) - 1)
+			+ source_blocksize / BBSIZE;
+
+	map->nextents = 0;
+	next_begin = ag_begin;
+
+	/* traverse btree until we get to the leftmost leaf node */
+
+	for (current_level = 0; ; current_level++)  {
+		if (current_level >= btree_levels) {
+			do_log(
+		_("Error: current level %d >= btree levels %d\n"),
+				current_level, btree_levels);
+			exit(1);
+		}
+
+		block = read_bnobt_block(mp, agno, bno, btree_buf);
+		if (be16_to_cpu(block->bb_level) == 0)
+			break;
+
+		ptr = XFS_ALLOC_PTR_ADDR(mp, block, 1, mp->m_alloc_mxr[1]);
+		bno = be32_to_cpu(ptr[0]);
+	}
+
+	/* used space lies between the free extents */
+
+	for (;;) {
+		if (be16_to_cpu(block->bb_level) != 0)  {
+			do_log(
+		_("WARNING:  source filesystem inconsistent.\n"));
+			do_log(
+		_("  A leaf btree rec isn't a leaf.  Aborting now.\n"));
+			exit(1);
+		}
+
+		rec_ptr = XFS_ALLOC_REC_ADDR(mp, block, 1);
+		for (i = 0; i < be16_to_cpu(block->bb_numrecs);
+						i++, rec_ptr++)  {
+			/*
+			 * protect against pathological case of a
+			 * hole right after the ag header in a
+			 * mis-aligned case
+			 */
+			begin = MAX(next_begin, ag_begin);
+			add_extent(map, begin, XFS_AGB_TO_DADDR(mp, agno,
+					be32_to_cpu(rec_ptr->ar_startblock)));
+
+			/* round next starting point down */
+			next_begin = rounddown(XFS_AGB_TO_DADDR(mp, agno,
+					be32_to_cpu(rec_ptr->ar_startblock) +
+					be32_to_cpu(rec_ptr->ar_blockcount)),
+					(xfs_daddr_t)(w_buf.min_io_size >> BBSHIFT));
+		}
+
+		bno = be32_to_cpu(block->bb_u.s.bb_rightsib);
+		if (bno == NULLAGBLOCK)
+			break;
+		block = read_bnobt_block(mp, agno, bno, btree_buf);
+	}
+
+	/* and the used space after the last free extent */
+	add_extent(map, next_begin, ag_end);
+}
+
+/*
+ * Clone one extent of used space into every target that is still going.
+ * A target that fails is dropped, as it would be on a write error.
+ */
+static void
+clone_extent(
+	copy_extent_t	*ext)
+{
+	xfs_off_t	pos = (xfs_off_t)ext->begin << BBSHIFT;
+	size_t		len = (ext->end - ext->begin) << BBSHIFT;
+	int		i, error;
+
+	for (i = 0; i < num_targets; i++)  {
+		if (target[i].state == INACTIVE)
+			continue;
+		error = clone_range(i, pos, len);
+		if (error)  {
+			target[i].error = error;
+			target[i].position = pos;
+			target[i].state = INACTIVE;
+			do_warn(_("%s:  clone failed on target %d \"%s\" at offset %lld\n"),
+				progname, i, target[i].name, pos);
+		}
+	}
+
+	pthread_mutex_lock(&progress_lock);
+	numblocks += len >> BBSHIFT;
+	howfar = bump_bar(howfar, numblocks);
+	pthread_mutex_unlock(&progress_lock);
+}
+
+/*
+ * Copy one extent of used space through the ring. It is split on
+ * buffer-size boundaries so that every read and write but the first
+ * and last is a full, aligned buffer.
+ */
+static void
+copy_extent(
+	xfs_mount_t	*mp,
+	copy_extent_t	*ext)
+{
+	wbuf		*wb;
+	xfs_off_t	pos = (xfs_off_t)ext->begin << BBSHIFT;
+	xfs_off_t	end = (xfs_off_t)ext->end << BBSHIFT;
+
+	if (clone_data)  {
+		clone_extent(ext);
+		return;
+	}
+
+	while (pos < end)  {
+		wb = get_wbuf();
+		wb->position = pos;
+		wb->length = MIN(end - pos, wb->size - pos % wb->size);
+
+		read_wbuf(source_fd, wb, mp);
+		pos = wb->position + wb->length;
+		write_wbuf(wb);
+
+		pthread_mutex_lock(&progress_lock);
+		numblocks += wb->length >> BBSHIFT;
+		howfar = bump_bar(howfar, numblocks);
+		pthread_mutex_unlock(&progress_lock);
+	}
+}
+
+static void
+copy_ag(
+	xfs_mount_t	*mp,
+	xfs_agnumber_t	agno,
+	wbuf		*btree_buf,
+	extent_map_t	*map)
+{
+	ag_header_t	ag_hdr;
+	wbuf		*wb;
+	xfs_daddr_t	ag_begin;
+	int		i;
+
+	/* read in first blocks of the ag */
+
+	wb = get_wbuf();
+	read_ag_header(source_fd, agno, wb, &ag_hdr, mp,
+		source_blocksize, source_sectorsize);
+
+	/* set the in_progress bit for the first AG */
+
+	if (agno == 0)
+		ag_hdr.xfs_sb->sb_inprogress = 1;
+
+	/* save what we need (agf) in the btree buffer */
+
+	memmove(btree_buf->data, ag_hdr.xfs_agf, source_sectorsize);
+
+	/* align first data copy but don't overwrite ag header */
+
+	ag_begin = (wb->position + wb->length) >> BBSHIFT;
+
+	ASSERT(wb->position % source_sectorsize == 0);
+
+	/* write the ag header out */
+
+	write_wbuf(wb);
+
+	scan_ag(mp, agno, ag_begin, btree_buf, map);
+	for (i = 0; i < map->nextents; i++)
+		copy_extent(mp, &map->extents[i]);
+}
+
+/*
+ * Reader thread: copy AGs until there are none left. Each reader has its
+ * own btree buffer and extent map, and only shares the ring.
+ */
+static void *
+copy_ags(
+	void		*arg)
+{
+	xfs_mount_t	*mp = arg;
+	wbuf		btree_buf;
+	extent_map_t	map = { NULL, 0, 0 };
+	xfs_agnumber_t	agno;
+
+	if (wbuf_init(&btree_buf, MAX(source_blocksize, w_buf.min_io_size),
+			w_buf.data_align, w_buf.min_io_size, 1) == NULL)  {
+		do_log(_("Error initializing btree buf 1\n"));
+		die_perror();
+	}
+
+	for (;;)  {
+		pthread_mutex_lock(&progress_lock);
+		agno = next_agno++;
+		pthread_mutex_unlock(&progress_lock);
+
+		if (agno >= mp->m_sb.sb_agcount || kids == 0)
+			break;
+		copy_ag(mp, agno, &btree_buf, &map);
+	}
+
+	free(map.extents);
+	free(btree_buf.data);
+	return NULL;
+}
+
 int
 main(int argc, char **argv)
 {
 	int		i, j;
-	int		howfar = 0;
 	int		open_flags;
-	xfs_off_t	pos;
-	size_t		length;
 	int		c;
-	__uint64_t	size, sizeb;
-	__uint64_t	numblocks = 0;
-	int		wblocks = 0;
 	int		num_threads = 0;
 	struct dioattr	d;
 	int		wbuf_size;
@@ -545,19 +997,14 @@ main(int argc, char **argv)
 	int		source_is_file = 0;
 	int		buffered_output = 0;
 	int		duplicate = 0;
-	uint		btree_levels, current_level;
 	ag_header_t	ag_hdr;
 	xfs_mount_t	*mp;
 	xfs_mount_t	mbuf;
 	struct xlog	xlog;
 	xfs_buf_t	*sbp;
 	xfs_sb_t	*sb;
-	xfs_agnumber_t	num_ags, agno;
-	xfs_agblock_t	bno;
-	xfs_daddr_t	begin, next_begin, ag_begin, new_begin, ag_end;
-	struct xfs_btree_block *block;
-	xfs_alloc_ptr_t	*ptr;
-	xfs_alloc_rec_t	*rec_ptr;
+	xfs_agnumber_t	num_ags;
+	pthread_t	*readers;
 	extern char	*optarg;
 	extern int	optind;
 	libxfs_init_t	xargs;
@@ -570,17 +1017,25 @@ main(int argc, char **argv)
 	bindtextdomain(PACKAGE, LOCALEDIR);
 	textdomain(PACKAGE);
 
-	while ((c = getopt(argc, argv, "bdL:V")) != EOF)  {
+	while ((c = getopt(argc, argv, "bcdL:t:V")) != EOF)  {
 		switch (c) {
 		case 'b':
 			buffered_output = 1;
 			break;
+		case 'c':
+			clone_data = 1;
+			break;
 		case 'd':
 			duplicate = 1;
 			break;
 		case 'L':
 			logfile_name = optarg;
 			break;
+		case 't':
+			ag_threads = atoi(optarg);
+			if (ag_threads == 0)
+				usage();
+			break;
 		case 'V':
 			printf(_("%s version %s\n"), progname, VERSION);
 			exit(0);
@@ -629,6 +1084,7 @@ main(int argc, char **argv)
 		target[i].state = INACTIVE;
 		target[i].error = 0;
 		target[i].err_type = 0;
+		target[i].clone = CLONE_NONE;
 	}
 
 	parent_pid = getpid();
@@ -854,6 +1310,8 @@ main(int argc, char **argv)
 								wbuf_miniosize);
 				}
 			}
+			if (clone_data && source_is_file)
+				probe_clone(i);
 		} else  {
 			char	*lb[XFS_MAX_SECTORSIZE] = { NULL };
 			off64_t	off;
@@ -872,13 +1330,27 @@ main(int argc, char **argv)
 		}
 	}
 
+	/* cloning is all or nothing, the ring can't skip some targets */
+
+	for (i = 0; clone_data && i < num_targets; i++)  {
+		if (target[i].clone == CLONE_NONE)  {
+			do_log(
+	_("%s:  cannot clone from \"%s\" to \"%s\", copying instead.\n"),
+				progname, source_name, target[i].name);
+			clone_data = 0;
+		}
+	}
+
 	/* initialize locks and bufs */
 
-	if (pthread_mutex_init(&glob_masks.mutex, NULL) != 0)  {
+	if (pthread_mutex_init(&glob_masks.mutex, NULL) != 0 ||
+	    pthread_cond_init(&glob_masks.queued_cv, NULL) != 0 ||
+	    pthread_cond_init(&glob_masks.written_cv, NULL) != 0)  {
 		do_log(_("Couldn't initialize global thread mask\n"));
 		die_perror();
 	}
-	glob_masks.num_working = 0;
+	glob_masks.reserved = 0;
+	glob_masks.queued = 0;
 
 	if (wbuf_init(&w_buf, wbuf_size, wbuf_align,
 					wbuf_miniosize, 0) == NULL)  {
@@ -886,21 +1358,21 @@ main(int argc, char **argv)
 		die_perror();
 	}
 
-	wblocks = wbuf_size / BBSIZE;
-
-	if (wbuf_init(&btree_buf, MAX(source_blocksize, wbuf_miniosize),
-				wbuf_align, wbuf_miniosize, 1) == NULL)  {
-		do_log(_("Error initializing btree buf 1\n"));
-		die_perror();
+	for (i = 0; i < NUM_WBUFS; i++)  {
+		if (wbuf_init(&glob_masks.buffers[i], w_buf.size, wbuf_align,
+					wbuf_miniosize, i + 2) == NULL)  {
+			do_log(_("Error initializing ring buf %d\n"), i);
+			die_perror();
+		}
+		glob_masks.buffers[i].refs = 0;
+		glob_masks.buffers[i].seq = i;
 	}
 
-	if (pthread_mutex_init(&mainwait,NULL) != 0)  {
-		do_log(_("Error creating first semaphore.\n"));
-		die_perror();
-		exit(1);
-	}
-	/* need to start out blocking */
-	pthread_mutex_lock(&mainwait);
+	/*
+	 * When cloning, free space is left as holes in the targets however
+	 * little of it there is, and a larger extent costs nothing extra.
+	 */
+	merge_gap = clone_data ? 0 : (w_buf.size >> BBSHIFT) / 4;
 
 	/* set up sigchild signal handler */
 
@@ -920,14 +1392,7 @@ main(int argc, char **argv)
 			platform_uuid_generate(&tcarg->uuid);
 		else
 			platform_uuid_copy(&tcarg->uuid, &mp->m_sb.sb_uuid);
-
-		if (pthread_mutex_init(&tcarg->wait, NULL) != 0)  {
-			do_log(_("Error creating thread mutex %d\n"), i);
-			die_perror();
-			exit(1);
-		}
-		/* need to start out blocking */
-		pthread_mutex_lock(&tcarg->wait);
+		tcarg->next = 0;
 	}
 
 	for (i = 0, tcarg = targ; i < num_targets; i++, tcarg++)  {
@@ -956,222 +1421,30 @@ main(int argc, char **argv)
 
 	kids = num_targets;
 
-	for (agno = 0; agno < num_ags && kids > 0; agno++)  {
-		/* read in first blocks of the ag */
-
-		read_ag_header(source_fd, agno, &w_buf, &ag_hdr, mp,
-			source_blocksize, source_sectorsize);
-
-		/* set the in_progress bit for the first AG */
-
-		if (agno == 0)
-			ag_hdr.xfs_sb->sb_inprogress = 1;
-
-		/* save what we need (agf) in the btree buffer */
-
-		memmove(btree_buf.data, ag_hdr.xfs_agf, source_sectorsize);
-		ag_hdr.xfs_agf = (xfs_agf_t *) btree_buf.data;
-		btree_buf.length = source_blocksize;
-
-		/* write the ag header out */
-
-		write_wbuf();
-
-		/* traverse btree until we get to the leftmost leaf node */
-
-		bno = be32_to_cpu(ag_hdr.xfs_agf->agf_roots[XFS_BTNUM_BNOi]);
-		current_level = 0;
-		btree_levels = be32_to_cpu(ag_hdr.xfs_agf->
-						agf_levels[XFS_BTNUM_BNOi]);
-
-		ag_end = XFS_AGB_TO_DADDR(mp, agno,
-				be32_to_cpu(ag_hdr.xfs_agf->agf_length) - 1)
-				+ source_blocksize / BBSIZE;
-
-		for (;;) {
-			/* none of this touches the w_buf buffer */
-
-			if (current_level >= btree_levels) {
-				do_log(
-			_("Error: current level %d >= btree levels %d\n"),
-					current_level, btree_levels);
-				exit(1);
-			}
-
-			current_level++;
-
-			btree_buf.position = pos = (xfs_off_t)
-				XFS_AGB_TO_DADDR(mp,agno,bno) << BBSHIFT;
-			btree_buf.length = source_blocksize;
+	/* copy the AGs, several at a time if asked to */
 
-			read_wbuf(source_fd, &btree_buf, mp);
-			block = (struct xfs_btree_block *)
-				 ((char *)btree_buf.data +
-				  pos - btree_buf.position);
-
-			if (be32_to_cpu(block->bb_magic) !=
-			    (xfs_sb_version_hascrc(&mp->m_sb) ?
-			     XFS_ABTB_CRC_MAGIC : XFS_ABTB_MAGIC)) {
-				do_log(_("Bad btree magic 0x%x\n"),
-				        be32_to_cpu(block->bb_magic));
-				exit(1);
-			}
-
-			if (be16_to_cpu(block->bb_level) == 0)
-				break;
-
-			ptr = XFS_ALLOC_PTR_ADDR(mp, block, 1,
-							mp->m_alloc_mxr[1]);
-			bno = be32_to_cpu(ptr[0]);
-		}
-
-		/* align first data copy but don't overwrite ag header */
-
-		pos = w_buf.position >> BBSHIFT;
-		length = w_buf.length >> BBSHIFT;
-		next_begin = pos + length;
-		ag_begin = next_begin;
-
-		ASSERT(w_buf.position % source_sectorsize == 0);
-
-		/* handle the rest of the ag */
-
-		for (;;) {
-			if (be16_to_cpu(block->bb_level) != 0)  {
-				do_log(
-			_("WARNING:  source filesystem inconsistent.\n"));
-				do_log(
-			_("  A leaf btree rec isn't a leaf.  Aborting now.\n"));
-				exit(1);
-			}
-
-			rec_ptr = XFS_ALLOC_REC_ADDR(mp, block, 1);
-			for (i = 0; i < be16_to_cpu(block->bb_numrecs);
-							i++, rec_ptr++)  {
-				/* calculate in daddr's */
-
-				begin = next_begin;
-
-				/*
-				 * protect against pathological case of a
-				 * hole right after the ag header in a
-				 * mis-aligned case
-				 */
-
-				if (begin < ag_begin)
-					begin = ag_begin;
-
-				/*
-				 * round size up to ensure we copy a
-				 * range bigger than required
-				 */
-
-				sizeb = XFS_AGB_TO_DADDR(mp, agno,
-					be32_to_cpu(rec_ptr->ar_startblock)) -
-						begin;
-				size = roundup(sizeb <<BBSHIFT, wbuf_miniosize);
-				if (size > 0)  {
-					/* copy extent */
-
-					w_buf.position = (xfs_off_t)
-						begin << BBSHIFT;
-
-					while (size > 0)  {
-						/*
-						 * let lower layer do alignment
-						 */
-						if (size > w_buf.size)  {
-							w_buf.length = w_buf.size;
-							size -= w_buf.size;
-							sizeb -= wblocks;
-							numblocks += wblocks;
-						} else  {
-							w_buf.length = size;
-							numblocks += sizeb;
-							size = 0;
-						}
-
-						read_wbuf(source_fd, &w_buf, mp);
-						write_wbuf();
-
-						w_buf.position += w_buf.length;
-
-						howfar = bump_bar(
-							howfar, numblocks);
-					}
-				}
-
-				/* round next starting point down */
-
-				new_begin = XFS_AGB_TO_DADDR(mp, agno,
-						be32_to_cpu(rec_ptr->ar_startblock) +
-					 	be32_to_cpu(rec_ptr->ar_blockcount));
-				next_begin = rounddown(new_begin,
-						w_buf.min_io_size >> BBSHIFT);
-			}
-
-			if (be32_to_cpu(block->bb_u.s.bb_rightsib) == NULLAGBLOCK)
-				break;
-
-			/* read in next btree record block */
-
-			btree_buf.position = pos = (xfs_off_t)
-				XFS_AGB_TO_DADDR(mp, agno, be32_to_cpu(
-						block->bb_u.s.bb_rightsib)) << BBSHIFT;
-			btree_buf.length = source_blocksize;
-
-			/* let read_wbuf handle alignment */
-
-			read_wbuf(source_fd, &btree_buf, mp);
-
-			block = (struct xfs_btree_block *)
-				 ((char *) btree_buf.data +
-				  pos - btree_buf.position);
-
-			ASSERT(be32_to_cpu(block->bb_magic) == XFS_ABTB_MAGIC);
+	ag_threads = MIN(ag_threads, num_ags);
+	if (ag_threads == 1)  {
+		copy_ags(mp);
+	} else  {
+		if ((readers = malloc(ag_threads * sizeof(pthread_t))) == NULL)  {
+			do_log(_("Couldn't malloc space for reader threads\n"));
+			die_perror();
 		}
-
-		/*
-		 * write out range of used blocks after last range
-		 * of free blocks in AG
-		 */
-		if (next_begin < ag_end)  {
-			begin = next_begin;
-
-			sizeb = ag_end - begin;
-			size = roundup(sizeb << BBSHIFT, wbuf_miniosize);
-
-			if (size > 0)  {
-				/* copy extent */
-
-				w_buf.position = (xfs_off_t) begin << BBSHIFT;
-
-				while (size > 0)  {
-					/*
-					 * let lower layer do alignment
-					 */
-					if (size > w_buf.size)  {
-						w_buf.length = w_buf.size;
-						size -= w_buf.size;
-						sizeb -= wblocks;
-						numblocks += wblocks;
-					} else  {
-						w_buf.length = size;
-						numblocks += sizeb;
-						size = 0;
-					}
-
-					read_wbuf(source_fd, &w_buf, mp);
-					write_wbuf();
-
-					w_buf.position += w_buf.length;
-
-					howfar = bump_bar(howfar, numblocks);
-				}
+		for (i = 0; i < ag_threads; i++)  {
+			if (pthread_create(&readers[i], NULL, copy_ags, mp))  {
+				do_log(_("Error creating reader thread %d\n"), i);
+				die_perror();
 			}
 		}
+		for (i = 0; i < ag_threads; i++)
+			pthread_join(readers[i], NULL);
+		free(readers);
 	}
 
+	/* the rest is written synchronously, target by target */
+	drain_wbufs();
+
 	if (kids > 0)  {
 		if (!duplicate)
 			/* write a clean log using the specified UUID */
@@ -59,21 +59,55 @@ typedef struct {
 	size_t		length;		/* requested length (bytes) */
 	char		*data;		/* pointer to data buffer */
 	struct t_args	*owner;		/* for non-parallel writes */
+	int		refs;		/* targets yet to write it (ring) */
+	__uint64_t	seq;		/* next ring sequence it may take */
 } wbuf;
 
+/* ring buffer states other than queued (refs > 0) and free (refs == 0) */
+#define WBUF_FILLING	(-1)		/* being read into */
+#define WBUF_FILLED	(-2)		/* read, waiting for its turn */
+
 typedef struct t_args {
 	int		id;
 	uuid_t		uuid;
-	pthread_mutex_t	wait;
 	int		fd;
+	__uint64_t	next;		/* next ring buffer to write */
 } thread_args;
 
+/*
+ * The source is read into a ring of buffers which the target threads
+ * write out behind the readers, each at its own pace. A buffer can only
+ * be refilled once every target has written it, so the fastest target
+ * is at most NUM_WBUFS buffers ahead of the slowest. With more than one
+ * reader, buffers are handed out in ring order and queued in the same
+ * order however their reads complete.
+ */
+#define NUM_WBUFS	8
+
 typedef struct {
 	pthread_mutex_t mutex;
-	int		num_working;
-	wbuf		*buffer;
+	pthread_cond_t	queued_cv;	/* a buffer was queued */
+	pthread_cond_t	written_cv;	/* a target finished some buffers */
+	wbuf		buffers[NUM_WBUFS];
+	__uint64_t	reserved;	/* buffers handed to readers so far */
+	__uint64_t	queued;		/* buffers queued so far */
 } thread_control;
 
+/*
+ * A run of allocated space in an AG, in disk addresses. Runs separated
+ * by only a little free space are merged, see add_extent().
+ */
+typedef struct {
+	xfs_daddr_t	begin;
+	xfs_daddr_t	end;
+} copy_extent_t;
+
+typedef struct {
+	copy_extent_t	*extents;
+	int		nextents;
+	int		maxextents;
+} extent_map_t;
+
 typedef int thread_id;
 typedef int tm_index;			/* index into thread mask array */
 typedef __uint32_t thread_mask;		/* a thread mask */
@@ -86,4 +120,5 @@ typedef struct {
 	int		state;
 	int		error;
 	int		err_type;
+	int		clone;		/* how used space is cloned, if at all */
 } target_control;
@@ -1858,6 +1858,7 @@ init(
 		serious_error = 1;
 		return 0;
 	}
+	init_perag_data();
 	if (!sb_logcheck())
 		return 0;
 	rt = mp->m_sb.sb_rextents != 0;
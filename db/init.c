@@ -51,6 +51,33 @@ usage(void)
 	exit(1);
 }
 
+/*
+ * xfs_check needs corrected incore superblock values. With lazy counters
+ * they have to be summed from the headers of every AG, so that waits for
+ * the first command that wants them rather than holding up startup.
+ */
+void
+init_perag_data(void)
+{
+	static int	done;
+	int		error;
+
+	if (done)
+		return;
+	done = 1;
+
+	if (mp->m_sb.sb_rootino == NULLFSINO ||
+	    !xfs_sb_version_haslazysbcount(&mp->m_sb))
+		return;
+
+	error = -libxfs_initialize_perag_data(mp, mp->m_sb.sb_agcount);
+	if (error) {
+		fprintf(stderr,
+	_("%s: cannot init perag data (%d). Continuing anyway.\n"),
+			progname, error);
+	}
+}
+
 void
 init(
 	int		argc,
@@ -165,19 +192,6 @@ init(
 	if (sbp->sb_agcount != agcount)
 		exitcode = 1;
 
-	/*
-	 * xfs_check needs corrected incore superblock values
-	 */
-	if (sbp->sb_rootino != NULLFSINO &&
-	    xfs_sb_version_haslazysbcount(&mp->m_sb)) {
-		int error = -libxfs_initialize_perag_data(mp, sbp->sb_agcount);
-		if (error) {
-			fprintf(stderr,
-	_("%s: cannot init perag data (%d). Continuing anyway.\n"),
-				progname, error);
-		}
-	}
-
 	if (xfs_sb_version_hassparseinodes(&mp->m_sb))
 		type_set_tab_spcrc();
 	else if (xfs_sb_version_hascrc(&mp->m_sb))
@@ -16,6 +16,8 @@
  * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#include <signal.h>
+#include <sys/wait.h>
 #include "libxfs.h"
 #include "libxlog.h"
 #include "bmap.h"
@@ -57,7 +59,7 @@ static void	metadump_help(void);
 
 static const cmdinfo_t	metadump_cmd =
 	{ "metadump", NULL, metadump_f, 0, -1, 0,
-		N_("[-a] [-e] [-g] [-m max_extent] [-w] [-o] filename"),
+		N_("[-a] [-b base]... [-e] [-g] [-m max_extent] [-t workers] [-v version] [-w] [-o] filename"),
 		N_("dump metadata to a file"), metadump_help };
 
 static FILE		*outf;		/* metadump file */
@@ -69,6 +71,23 @@ static char		*block_buffer;
 static int		num_indices;
 static int		cur_index;
 
+/* v2 format output state */
+static int		metadump_version;
+static char		*md2_data;	/* extent data of the current frame */
+static int		md2_len;
+static struct xfs_md2_extent *md2_ext;	/* extent index of the current frame */
+static int		md2_nextents;
+static char		*md2_zbuf;	/* encoded payload */
+static size_t		md2_zbuf_len;
+static __uint64_t	md2_offset;	/* bytes written to outf so far */
+static struct xfs_md2_ftab *md2_ftab;	/* frame table */
+static __uint64_t	md2_nframes;
+static bool		md2_staging;	/* parallel dump worker */
+static struct xfs_mdimage *md2_base;	/* what a delta is taken against */
+static char		*md2_base_buf;	/* sectors read back from md2_base */
+static int		md2_base_len;
+static int		nr_workers;	/* parallel dump processes */
+
 static xfs_ino_t	cur_ino;
 
 static int		show_progress = 0;
@@ -95,10 +114,13 @@ metadump_help(void)
 " or xfs_repair failures.\n\n"
 " Options:\n"
 "   -a -- Copy full metadata blocks without zeroing unused space\n"
+"   -b -- Only dump what changed since this image (repeat for a chain of deltas)\n"
 "   -e -- Ignore read errors and keep going\n"
 "   -g -- Display dump progress\n"
 "   -m -- Specify max extent size in blocks to copy (default = %d blocks)\n"
 "   -o -- Don't obfuscate names and extended attributes\n"
+"   -t -- Dump this many AGs in parallel (version 2 images only)\n"
+"   -v -- Image format version, 1 (default) or 2 (compressed, seekable)\n"
 "   -w -- Show warnings of bad metadata information\n"
 "\n"), DEFAULT_MAX_EXT_SIZE);
 }
@@ -169,6 +191,287 @@ write_index(void)
 	return 0;
 }
 
+/*
+ * Version 2 images are written as a stream of independently compressed
+ * frames. Sectors are gathered into the current frame (merging runs that
+ * are contiguous on disk into one extent) until it holds XFS_MD2_FRAME_BYTES
+ * of data or XFS_MD2_FRAME_EXTENTS extents, and it is then encoded and
+ * written out. The frame table is kept in memory and written at the end.
+ */
+static int
+md2_write(
+	void		*buf,
+	size_t		len)
+{
+	if (len && fwrite(buf, len, 1, outf) != 1) {
+		print_warning("error writing to file: %s", strerror(errno));
+		return -errno;
+	}
+	md2_offset += len;
+	return 0;
+}
+
+/*
+ * Record a frame about to be written at the current output offset in the
+ * frame table.
+ */
+static int
+md2_ftab_add(
+	struct xfs_md2_extent	*ext,
+	int			nextents)
+{
+	struct xfs_md2_ftab	*ft;
+	__uint64_t		daddr = ULLONG_MAX;
+	__uint64_t		end = 0;
+	int			i;
+
+	if ((md2_nframes & (md2_nframes - 1)) == 0) {
+		ft = realloc(md2_ftab, (md2_nframes ?
+				md2_nframes * 2 : 1) * sizeof(*ft));
+		if (!ft) {
+			print_warning("memory allocation failure");
+			return -ENOMEM;
+		}
+		md2_ftab = ft;
+	}
+	for (i = 0; i < nextents; i++) {
+		daddr = min(daddr, be64_to_cpu(ext[i].me_daddr));
+		end = max(end, be64_to_cpu(ext[i].me_daddr) +
+			       be32_to_cpu(ext[i].me_len));
+	}
+	ft = &md2_ftab[md2_nframes++];
+	ft->ft_offset = cpu_to_be64(md2_offset);
+	ft->ft_daddr = cpu_to_be64(daddr);
+	ft->ft_end = cpu_to_be64(end);
+	return 0;
+}
+
+static int
+md2_write_frame(void)
+{
+	struct xfs_md2_frame	frame;
+	size_t			zlen = md2_zbuf_len;
+	char			*payload;
+	int			ret = 0;
+
+	memset(&frame, 0, sizeof(frame));
+	frame.mf_magic = cpu_to_be32(XFS_MD2_FRAME_MAGIC);
+	frame.mf_nextents = cpu_to_be16(md2_nextents);
+	frame.mf_len = cpu_to_be32(md2_len);
+	frame.mf_codec = libxfs_md2_compress(XFS_MD2_CODEC_ZLIB, md2_zbuf,
+					     &zlen, md2_data, md2_len);
+	payload = frame.mf_codec == XFS_MD2_CODEC_NONE ? md2_data : md2_zbuf;
+	frame.mf_zlen = cpu_to_be32(zlen);
+	frame.mf_crc = cpu_to_be32(crc32c(XFS_CRC_SEED, payload, zlen));
+	frame.mf_icrc = cpu_to_be32(crc32c(XFS_CRC_SEED, md2_ext,
+				md2_nextents * sizeof(struct xfs_md2_extent)));
+
+	/*
+	 * The terminating empty frame doesn't go in the frame table, and
+	 * neither do frames staged by a parallel dump worker; the writer
+	 * process adds those as it copies them to the real output.
+	 */
+	if (md2_nextents && !md2_staging)
+		ret = md2_ftab_add(md2_ext, md2_nextents);
+	if (!ret)
+		ret = md2_write(&frame, sizeof(frame));
+	if (!ret)
+		ret = md2_write(md2_ext,
+				md2_nextents * sizeof(struct xfs_md2_extent));
+	if (!ret)
+		ret = md2_write(payload, zlen);
+
+	md2_nextents = 0;
+	md2_len = 0;
+	return ret;
+}
+
+static int
+md2_write_segment(
+	char		*data,
+	__int64_t	off,
+	int		len)
+{
+	struct xfs_md2_extent	*ext;
+	int			count;
+	int			ret;
+
+	while (len > 0) {
+		ext = md2_nextents ? &md2_ext[md2_nextents - 1] : NULL;
+		if (md2_len == XFS_MD2_FRAME_BYTES ||
+		    (md2_nextents == XFS_MD2_FRAME_EXTENTS &&
+		     be64_to_cpu(ext->me_daddr) +
+				be32_to_cpu(ext->me_len) != off)) {
+			ret = md2_write_frame();
+			if (ret)
+				return ret;
+			continue;
+		}
+
+		count = min(len, (XFS_MD2_FRAME_BYTES - md2_len) >> BBSHIFT);
+		if (ext && be64_to_cpu(ext->me_daddr) +
+				be32_to_cpu(ext->me_len) == off) {
+			be32_add_cpu(&ext->me_len, count);
+		} else {
+			ext = &md2_ext[md2_nextents++];
+			ext->me_daddr = cpu_to_be64(off);
+			ext->me_len = cpu_to_be32(count);
+			ext->me_pad = 0;
+		}
+		memcpy(md2_data + md2_len, data, BBTOB(count));
+		md2_len += BBTOB(count);
+		data += BBTOB(count);
+		off += count;
+		len -= count;
+	}
+	return 0;
+}
+
+/*
+ * Write only the sectors that differ from what restoring md2_base would
+ * leave on disk, which reads as zeroes wherever it holds nothing.
+ */
+static int
+md2_write_delta(
+	char			*data,
+	__int64_t		off,
+	int			len)
+{
+	ssize_t			n;
+	bool			same;
+	int			i, j;
+	int			ret;
+
+	if (len > md2_base_len) {
+		free(md2_base_buf);
+		md2_base_buf = malloc(BBTOB(len));
+		if (!md2_base_buf) {
+			md2_base_len = 0;
+			print_warning("memory allocation failure");
+			return -ENOMEM;
+		}
+		md2_base_len = len;
+	}
+
+	/* sectors beyond the end of the base filesystem always differ */
+	n = libxfs_mdimage_pread(md2_base, md2_base_buf, BBTOB(len),
+				 BBTOB(off));
+	if (n < 0) {
+		print_warning("error reading delta base: %s", strerror(errno));
+		return -EIO;
+	}
+
+	for (i = 0; i < len; i = j) {
+		same = BBTOB(i + 1) <= n &&
+		       !memcmp(data + BBTOB(i), md2_base_buf + BBTOB(i), BBSIZE);
+		for (j = i + 1; j < len; j++) {
+			if (same != (BBTOB(j + 1) <= n &&
+				     !memcmp(data + BBTOB(j),
+					     md2_base_buf + BBTOB(j), BBSIZE)))
+				break;
+		}
+		if (same)
+			continue;
+		ret = md2_write_segment(data + BBTOB(i), off + i, j - i);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static int
+md2_start(
+	__uint8_t		info)
+{
+	struct xfs_md2_header	hdr;
+	uuid_t			uuid;
+
+	md2_zbuf_len = libxfs_md2_bound(XFS_MD2_FRAME_BYTES);
+	md2_data = malloc(XFS_MD2_FRAME_BYTES);
+	md2_zbuf = malloc(md2_zbuf_len);
+	md2_ext = calloc(XFS_MD2_FRAME_EXTENTS, sizeof(struct xfs_md2_extent));
+	if (!md2_data || !md2_zbuf || !md2_ext) {
+		print_warning("memory allocation failure");
+		return -ENOMEM;
+	}
+	md2_len = 0;
+	md2_nextents = 0;
+	md2_offset = 0;
+	md2_ftab = NULL;
+	md2_nframes = 0;
+	md2_staging = false;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.mh_magic = cpu_to_be32(XFS_MD2_MAGIC);
+	hdr.mh_version = cpu_to_be32(XFS_MD2_VERSION);
+	hdr.mh_info = cpu_to_be32(info);
+
+	/* deltas name the image they apply on top of */
+	platform_uuid_generate(&uuid);
+	memcpy(&hdr.mh_id, &uuid, sizeof(hdr.mh_id));
+	if (md2_base)
+		hdr.mh_base = cpu_to_be64(libxfs_mdimage_id(md2_base));
+	return md2_write(&hdr, sizeof(hdr));
+}
+
+/*
+ * Frames never span AGs, so that AGs dumped in parallel can simply be
+ * concatenated.
+ */
+static int
+md2_end_ag(void)
+{
+	if (!md2_nextents)
+		return 0;
+	return md2_write_frame();
+}
+
+/*
+ * Flush the last frame and write the end of stream marker, the frame table
+ * and the trailer.
+ */
+static int
+md2_finish(void)
+{
+	struct xfs_md2_trailer	trailer;
+	size_t			len = md2_nframes * sizeof(struct xfs_md2_ftab);
+	int			ret = 0;
+
+	if (md2_nextents)
+		ret = md2_write_frame();
+	if (!ret)
+		ret = md2_write_frame();	/* end of stream */
+	if (ret)
+		return ret;
+
+	memset(&trailer, 0, sizeof(trailer));
+	trailer.mt_magic = cpu_to_be32(XFS_MD2_TRAILER_MAGIC);
+	trailer.mt_crc = cpu_to_be32(crc32c(XFS_CRC_SEED, md2_ftab, len));
+	trailer.mt_nframes = cpu_to_be64(md2_nframes);
+	trailer.mt_table = cpu_to_be64(md2_offset);
+	ret = md2_write(md2_ftab, len);
+	if (!ret)
+		ret = md2_write(&trailer, sizeof(trailer));
+	return ret;
+}
+
+static void
+md2_free(void)
+{
+	free(md2_data);
+	free(md2_zbuf);
+	free(md2_ext);
+	free(md2_ftab);
+	free(md2_base_buf);
+	libxfs_mdimage_close(md2_base);
+	md2_base = NULL;
+	md2_base_buf = NULL;
+	md2_base_len = 0;
+	md2_data = md2_zbuf = NULL;
+	md2_ext = NULL;
+	md2_ftab = NULL;
+}
+
 /*
  * Return 0 for success, -errno for failure.
  */
@@ -181,6 +484,11 @@ write_buf_segment(
 	int		i;
 	int		ret;
 
+	if (metadump_version == 2 && md2_base)
+		return md2_write_delta(data, off, len);
+	if (metadump_version == 2)
+		return md2_write_segment(data, off, len);
+
 	for (i = 0; i < len; i++, off++, data += BBSIZE) {
 		block_index[cur_index] = cpu_to_be64(off);
 		memcpy(&block_buffer[cur_index << BBSHIFT], data, BBSIZE);
@@ -782,6 +1090,8 @@ is_orphanage_dir(
 			!memcmp(name, ORPHANAGE, ORPHANAGE_LEN);
 }
 
+static xfs_ino_t		orphanage_ino;
+
 /*
  * Determine whether a name is one we shouldn't obfuscate because
  * it's an orphan (or the "lost+found" directory itself).  Note
@@ -796,7 +1106,6 @@ in_lost_found(
 	int			namelen,
 	unsigned char		*name)
 {
-	static xfs_ino_t	orphanage_ino = 0;
 	char			s[24];	/* 21 is enough (64 bits in decimal) */
 	int			slen;
 
@@ -2505,6 +2814,14 @@ scan_ag(
 	int		stack_count = 0;
 	int		rval = 0;
 
+	/*
+	 * Obfuscated names are drawn from random(). Restart the sequence for
+	 * every AG so that the names in an AG don't depend on what was dumped
+	 * before it, and a parallel dump produces the same image as a serial
+	 * one.
+	 */
+	srandom(agno + 1);
+
 	/* copy the superblock of the AG */
 	push_cur();
 	stack_count++;
@@ -2742,6 +3059,259 @@ done:
 	return !write_buf(iocur_top);
 }
 
+/*
+ * Parallel dumps.
+ *
+ * The dump code is built around xfs_db's global cursor stack and a good deal
+ * of other global state, so rather than threads we fork worker processes.
+ * Worker N dumps AGs N, N + nr_workers, ... in order into its own unlinked
+ * staging file, and after each AG reports over a pipe where that AG's frames
+ * end. The parent is the only writer: it takes the AGs in order, waits for
+ * the owning worker to finish each one and copies its frames to the output,
+ * building the frame table as it goes. Frames don't span AGs, so the result
+ * is the same image a serial dump would have produced.
+ */
+struct md2_agdone {
+	__uint32_t	agno;
+	__uint32_t	status;		/* 1 if the AG was dumped */
+	__uint64_t	end;		/* staging file offset after the AG */
+};
+
+struct md2_worker {
+	pid_t		pid;
+	int		ctlfd;		/* read side of the status pipe */
+	int		stagefd;	/* staging file */
+	__uint64_t	pos;		/* next staged frame to copy */
+};
+
+/*
+ * Workers only see the root directory if they dump AG 0, so look up
+ * "lost+found" before forking; otherwise the other workers would
+ * obfuscate the names of orphans that a serial dump leaves alone.
+ */
+static void
+md2_find_orphanage(void)
+{
+	struct xfs_inode	*ip;
+	struct xfs_name		xname;
+	xfs_ino_t		ino;
+
+	if (orphanage_ino ||
+	    libxfs_iget(mp, NULL, mp->m_sb.sb_rootino, 0, &ip))
+		return;
+
+	xname.name = (unsigned char *)ORPHANAGE;
+	xname.len = ORPHANAGE_LEN;
+	xname.type = XFS_DIR3_FT_DIR;
+	if (libxfs_dir_lookup(NULL, ip, &xname, &ino, NULL) == 0)
+		orphanage_ino = ino;
+	IRELE(ip);
+}
+
+static void
+md2_worker_run(
+	int			worker,
+	int			ctlfd,
+	FILE			*stage)
+{
+	struct md2_agdone	done;
+	xfs_agnumber_t		agno;
+
+	outf = stage;
+	show_progress = 0;
+	md2_staging = true;
+	md2_offset = 0;
+
+	for (agno = worker; agno < mp->m_sb.sb_agcount; agno += nr_workers) {
+		done.agno = agno;
+		done.status = scan_ag(agno) && md2_end_ag() == 0 &&
+			      fflush(outf) == 0;
+		done.end = md2_offset;
+		if (write(ctlfd, &done, sizeof(done)) != sizeof(done) ||
+		    !done.status)
+			break;
+	}
+	_exit(0);
+}
+
+/*
+ * Copy a worker's staged frames up to @end to the output.
+ */
+static int
+md2_copy_staged(
+	struct md2_worker	*w,
+	__uint64_t		end)
+{
+	struct xfs_md2_frame	frame;
+	size_t			len;
+	size_t			zlen;
+	int			nextents;
+	int			ret;
+
+	while (w->pos < end) {
+		if (pread(w->stagefd, &frame, sizeof(frame), w->pos) !=
+				sizeof(frame) ||
+		    libxfs_md2_frame_check(&frame))
+			goto out_bad;
+		nextents = be16_to_cpu(frame.mf_nextents);
+		len = nextents * sizeof(struct xfs_md2_extent);
+		zlen = be32_to_cpu(frame.mf_zlen);
+		if (pread(w->stagefd, md2_ext, len, w->pos + sizeof(frame)) !=
+				len ||
+		    pread(w->stagefd, md2_zbuf, zlen,
+				w->pos + sizeof(frame) + len) != zlen)
+			goto out_bad;
+
+		ret = md2_ftab_add(md2_ext, nextents);
+		if (!ret)
+			ret = md2_write(&frame, sizeof(frame));
+		if (!ret)
+			ret = md2_write(md2_ext, len);
+		if (!ret)
+			ret = md2_write(md2_zbuf, zlen);
+		if (ret)
+			return ret;
+		w->pos += sizeof(frame) + len + zlen;
+	}
+	return 0;
+
+out_bad:
+	print_warning("error reading metadump staging file: %s",
+			strerror(errno));
+	return -EIO;
+}
+
+static int
+metadump_parallel(void)
+{
+	struct md2_worker	*workers;
+	struct md2_worker	*w;
+	struct md2_agdone	done;
+	xfs_agnumber_t		agno;
+	const char		*tmpdir;
+	char			*path;
+	int			fds[2];
+	int			rval = 0;
+	int			i;
+
+	tmpdir = getenv("TMPDIR");
+	if (!tmpdir)
+		tmpdir = "/tmp";
+	workers = calloc(nr_workers, sizeof(*workers));
+	path = malloc(strlen(tmpdir) + sizeof("/xfs_metadump.XXXXXX"));
+	if (!workers || !path) {
+		print_warning("memory allocation failure");
+		free(workers);
+		free(path);
+		return 0;
+	}
+
+	for (i = 0; i < nr_workers; i++)
+		workers[i].ctlfd = workers[i].stagefd = -1;
+
+	if (obfuscate)
+		md2_find_orphanage();
+
+	/* don't let the workers inherit unwritten output */
+	fflush(outf);
+	fflush(stdout);
+	fflush(stderr);
+
+	for (i = 0; i < nr_workers; i++) {
+		w = &workers[i];
+		sprintf(path, "%s/xfs_metadump.XXXXXX", tmpdir);
+		w->stagefd = mkstemp(path);
+		if (w->stagefd < 0) {
+			print_warning("cannot create staging file in %s: %s",
+					tmpdir, strerror(errno));
+			goto out_reap;
+		}
+		unlink(path);
+		if (pipe(fds) < 0) {
+			print_warning("cannot create pipe: %s",
+					strerror(errno));
+			goto out_reap;
+		}
+		w->pid = fork();
+		if (w->pid < 0) {
+			print_warning("cannot start worker: %s",
+					strerror(errno));
+			close(fds[0]);
+			close(fds[1]);
+			goto out_reap;
+		}
+		if (w->pid == 0) {
+			FILE	*stage = fdopen(w->stagefd, "w");
+
+			close(fds[0]);
+			if (!stage)
+				_exit(1);
+			md2_worker_run(i, fds[1], stage);
+		}
+		close(fds[1]);
+		w->ctlfd = fds[0];
+	}
+
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		w = &workers[agno % nr_workers];
+		if (read(w->ctlfd, &done, sizeof(done)) != sizeof(done) ||
+		    done.agno != agno || !done.status)
+			goto out_reap;
+		if (md2_copy_staged(w, done.end))
+			goto out_reap;
+		if (show_progress)
+			print_progress("Dumped AG %u of %u", agno + 1,
+					mp->m_sb.sb_agcount);
+	}
+	rval = 1;
+
+out_reap:
+	for (i = 0; i < nr_workers; i++) {
+		w = &workers[i];
+		if (w->pid > 0) {
+			if (!rval)
+				kill(w->pid, SIGTERM);
+			waitpid(w->pid, NULL, 0);
+		}
+		if (w->ctlfd >= 0)
+			close(w->ctlfd);
+		if (w->stagefd >= 0)
+			close(w->stagefd);
+	}
+	free(workers);
+	free(path);
+	return rval;
+}
+
+/*
+ * Add @path to the images a delta is taken against: the first is the full
+ * image, then its deltas in order. A bad image only fails this command.
+ */
+static int
+add_base_image(
+	const char	*path)
+{
+	if (!md2_base) {
+		if (libxfs_mdimage_open(path, &md2_base)) {
+			print_warning("cannot use %s as a base image", path);
+			return 1;
+		}
+		if (!md2_base) {
+			print_warning("%s is not a metadump image", path);
+			return 1;
+		}
+		return 0;
+	}
+
+	if (libxfs_mdimage_stack(md2_base, path)) {
+		print_warning("cannot stack %s on the base image", path);
+		libxfs_mdimage_close(md2_base);
+		md2_base = NULL;
+		return 1;
+	}
+	return 0;
+}
+
 static int
 metadump_f(
 	int 		argc,
@@ -2757,6 +3327,12 @@ metadump_f(
 	show_progress = 0;
 	show_warnings = 0;
 	stop_on_read_error = 0;
+	metadump_version = 1;
+	nr_workers = 1;
+
+	/* don't leak a base an earlier command gave up on */
+	libxfs_mdimage_close(md2_base);
+	md2_base = NULL;
 
 	if (mp->m_sb.sb_magicnum != XFS_SB_MAGIC) {
 		print_warning("bad superblock magic number %x, giving up",
@@ -2774,11 +3350,15 @@ metadump_f(
 		return 0;
 	}
 
-	while ((c = getopt(argc, argv, "aegm:ow")) != EOF) {
+	while ((c = getopt(argc, argv, "ab:egm:ot:v:w")) != EOF) {
 		switch (c) {
 			case 'a':
 				zero_stale_data = 0;
 				break;
+			case 'b':
+				if (add_base_image(optarg))
+					return 0;
+				break;
 			case 'e':
 				stop_on_read_error = 1;
 				break;
@@ -2796,6 +3376,23 @@ metadump_f(
 			case 'o':
 				obfuscate = 0;
 				break;
+			case 't':
+				nr_workers = (int)strtol(optarg, &p, 0);
+				if (*p != '\0' || nr_workers <= 0) {
+					print_warning("bad number of workers %s",
+							optarg);
+					return 0;
+				}
+				break;
+			case 'v':
+				metadump_version = (int)strtol(optarg, &p, 0);
+				if (*p != '\0' || (metadump_version != 1 &&
+						    metadump_version != 2)) {
+					print_warning("bad metadump version %s",
+							optarg);
+					return 0;
+				}
+				break;
 			case 'w':
 				show_warnings = 1;
 				break;
@@ -2810,6 +3407,17 @@ metadump_f(
 		return 0;
 	}
 
+	if (nr_workers > 1 && metadump_version != 2) {
+		print_warning("parallel metadump requires a version 2 image");
+		return 0;
+	}
+	if (md2_base && metadump_version != 2) {
+		print_warning("delta metadump requires a version 2 image");
+		return 0;
+	}
+	if (nr_workers > mp->m_sb.sb_agcount)
+		nr_workers = mp->m_sb.sb_agcount;
+
 	metablock = (xfs_metablock_t *)calloc(BBSIZE + 1, BBSIZE);
 	if (metablock == NULL) {
 		print_warning("memory allocation failure");
@@ -2885,8 +3493,18 @@ metadump_f(
 
 	exitcode = 0;
 
-	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
-		if (!scan_ag(agno)) {
+	if (metadump_version == 2 &&
+	    md2_start(metablock->mb_info |
+		      (md2_base ? XFS_METADUMP_DELTA : 0)) < 0)
+		exitcode = 1;
+
+	if (!exitcode && nr_workers > 1)
+		exitcode = !metadump_parallel();
+
+	for (agno = 0; !exitcode && nr_workers == 1 &&
+		       agno < mp->m_sb.sb_agcount; agno++) {
+		if (!scan_ag(agno) ||
+		    (metadump_version == 2 && md2_end_ag() < 0)) {
 			exitcode = 1;
 			break;
 		}
@@ -2901,7 +3519,9 @@ metadump_f(
 		exitcode = !copy_log();
 
 	/* write the remaining index */
-	if (!exitcode)
+	if (!exitcode && metadump_version == 2)
+		exitcode = md2_finish() < 0;
+	else if (!exitcode)
 		exitcode = write_index() < 0;
 
 	if (progress_since_warning)
@@ -2917,6 +3537,7 @@ metadump_f(
 		pop_cur();
 
 	free(metablock);
+	md2_free();
 
 	return 0;
 }
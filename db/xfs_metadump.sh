@@ -5,16 +5,19 @@
 
 OPTS=" "
 DBOPTS=" "
-USAGE="Usage: xfs_metadump [-aefFogwV] [-m max_extents] [-l logdev] source target"
+USAGE="Usage: xfs_metadump [-aefFogwV] [-b base]... [-m max_extents] [-t workers] [-v version] [-l logdev] source target"
 
-while getopts "aefgl:m:owFV" c
+while getopts "ab:efgl:m:ot:v:wFV" c
 do
 	case $c in
 	a)	OPTS=$OPTS"-a ";;
+	b)	OPTS=$OPTS"-b "$OPTARG" ";;
 	e)	OPTS=$OPTS"-e ";;
 	g)	OPTS=$OPTS"-g ";;
 	m)	OPTS=$OPTS"-m "$OPTARG" ";;
 	o)	OPTS=$OPTS"-o ";;
+	t)	OPTS=$OPTS"-t "$OPTARG" ";;
+	v)	OPTS=$OPTS"-v "$OPTARG" ";;
 	w)	OPTS=$OPTS"-w ";;
 	f)	DBOPTS=$DBOPTS" -f";;
 	l)	DBOPTS=$DBOPTS" -l "$OPTARG" ";;
@@ -28,6 +28,12 @@
  */
 #define CACHE_MISCOMPARE_PURGE	(1 << 0)
 
+/*
+ * Reclaim with the adaptive, scan resistant policy rather than purely by
+ * priority. See the reclaim policy notes in cache.c.
+ */
+#define CACHE_ADAPTIVE_RECLAIM	(1 << 1)
+
 /*
  * cache object campare return values
  */
@@ -39,6 +45,21 @@ enum {
 
 #define	HASH_CACHE_RATIO	8
 
+/*
+ * Each priority MRU is split into this many independently locked stripes,
+ * selected by the node's hash index, so that concurrent cache hits on
+ * unreferenced nodes don't all serialise on a single MRU lock.
+ */
+#define CACHE_MRU_STRIPES	16
+
+/*
+ * Reclaim policies may separate unreferenced nodes of the same priority into
+ * segments. The priority policy only uses the first one.
+ */
+#define CACHE_SEG_PROBATION	0
+#define CACHE_SEG_PROTECTED	1
+#define CACHE_NR_SEGMENTS	2
+
 /*
  * Cache priorities range from BASE to MAX.
  *
@@ -76,6 +97,30 @@ typedef unsigned int (*cache_node_hash_t)(cache_key_t, unsigned int,
 					  unsigned int);
 typedef int (*cache_node_compare_t)(struct cache_node *, cache_key_t);
 typedef unsigned int (*cache_bulk_relse_t)(struct cache *, struct list_head *);
+typedef void (*cache_bulk_flush_t)(struct cache *, struct cache_node **,
+				   unsigned int);
+
+/*
+ * Reclaim policy. All of the node hooks are called with the node locked.
+ *
+ * hit:		node found in the cache, after it has been removed from its
+ *		MRU and before its reference count is bumped.
+ * miss:	new node about to be inserted into hash chain @hashidx.
+ * evict:	node is being reclaimed by the shaker.
+ * shake:	reclaim up to CACHE_SHAKE_COUNT unreferenced nodes at
+ *		@priority (or all of them if purging) onto @temp, returning
+ *		the number of nodes reclaimed.
+ */
+struct cache_policy {
+	const char	*cp_name;
+	int		(*cp_init)(struct cache *);
+	void		(*cp_destroy)(struct cache *);
+	void		(*cp_hit)(struct cache *, struct cache_node *);
+	void		(*cp_miss)(struct cache *, unsigned int);
+	void		(*cp_evict)(struct cache *, struct cache_node *);
+	unsigned int	(*cp_shake)(struct cache *, unsigned int, bool,
+				    struct list_head *);
+};
 
 struct cache_operations {
 	cache_node_hash_t	hash;
@@ -84,12 +129,14 @@ struct cache_operations {
 	cache_node_relse_t	relse;
 	cache_node_compare_t	compare;
 	cache_bulk_relse_t	bulkrelse;	/* optional */
+	cache_bulk_flush_t	bulkflush;	/* optional */
 };
 
 struct cache_hash {
 	struct list_head	ch_list;	/* hash chain head */
 	unsigned int		ch_count;	/* hash chain length */
 	pthread_mutex_t		ch_mutex;	/* hash chain mutex */
+	unsigned long long	ch_hits;	/* cache hits on this chain */
 };
 
 struct cache_mru {
@@ -105,6 +152,7 @@ struct cache_node {
 	unsigned int		cn_hashidx;	/* hash chain index */
 	int			cn_priority;	/* priority, -1 = free list */
 	int			cn_old_priority;/* saved pre-dirty prio */
+	int			cn_segment;	/* reclaim policy segment */
 	pthread_mutex_t		cn_mutex;	/* node mutex */
 };
 
@@ -119,12 +167,16 @@ struct cache {
 	cache_node_relse_t	relse;		/* memory free function */
 	cache_node_compare_t	compare;	/* comparison routine */
 	cache_bulk_relse_t	bulkrelse;	/* bulk release routine */
+	cache_bulk_flush_t	bulkflush;	/* bulk flush routine */
 	unsigned int		c_hashsize;	/* hash bucket count */
 	unsigned int		c_hashshift;	/* hash key shift */
 	struct cache_hash	*c_hash;	/* hash table buckets */
-	struct cache_mru	c_mrus[CACHE_DIRTY_PRIORITY + 1];
+	struct cache_mru	c_mrus[CACHE_NR_SEGMENTS][CACHE_DIRTY_PRIORITY + 1]
+				      [CACHE_MRU_STRIPES];
+	const struct cache_policy *c_policy;	/* reclaim policy */
+	void			*c_policy_data;	/* policy private state */
+	unsigned int		c_shake_stripe;	/* first stripe to shake */
 	unsigned long long	c_misses;	/* cache misses */
-	unsigned long long	c_hits;		/* cache hits */
 	unsigned int 		c_max;		/* max nodes ever used */
 };
 
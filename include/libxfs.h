@@ -45,6 +45,8 @@
 /* CRC stuff, buffer API dependent on it */
 extern uint32_t crc32_le(uint32_t crc, unsigned char const *p, size_t len);
 extern uint32_t crc32c_le(uint32_t crc, unsigned char const *p, size_t len);
+extern void crc32c_le_multi(uint32_t *crc, unsigned char const *const *p,
+			    size_t len, unsigned int nr);
 
 #define crc32(c,p,l)	crc32_le((c),(unsigned char const *)(p),(l))
 #define crc32c(c,p,l)	crc32c_le((c),(unsigned char const *)(p),(l))
@@ -145,6 +147,11 @@ extern void	libxfs_destroy (void);
 extern int	libxfs_device_to_fd (dev_t);
 extern dev_t	libxfs_device_open (char *, int, int, int);
 extern void	libxfs_device_close (dev_t);
+struct iovec;
+extern bool	libxfs_device_is_image (dev_t);
+extern ssize_t	libxfs_device_pread (dev_t, void *, size_t, off64_t);
+extern ssize_t	libxfs_device_preadv (dev_t, const struct iovec *, int,
+				      off64_t);
 extern int	libxfs_device_alignment (void);
 extern void	libxfs_report(FILE *);
 extern void	platform_findsizes(char *path, int fd, long long *sz, int *bsz);
@@ -34,5 +34,97 @@ typedef struct xfs_metablock {
 #define XFS_METADUMP_OBFUSCATED	(1 << 1)
 #define XFS_METADUMP_FULLBLOCKS	(1 << 2)
 #define XFS_METADUMP_DIRTYLOG	(1 << 3)
+#define XFS_METADUMP_DELTA	(1 << 4) /* Only what changed since mh_base */
+
+/*
+ * Version 2 metadump images.
+ *
+ * A v2 image is an xfs_md2_header followed by a stream of frames, an empty
+ * frame marking the end of the stream, a frame table and finally a fixed
+ * size trailer. Each frame starts with an uncompressed index of the extents
+ * of disk sectors it holds, followed by the contents of those extents,
+ * concatenated and compressed as a unit. Frames are independent of each
+ * other, so they can be decompressed in parallel, and the frame table at the
+ * end (found through the trailer) lets a reader that can seek go straight
+ * to the frames covering the sectors it wants.
+ *
+ * Everything is big endian. Frame payloads and the frame table are covered
+ * by crc32c checksums.
+ *
+ * A delta image (XFS_METADUMP_DELTA) only holds the sectors that differ from
+ * what restoring the image with id mh_base, and whatever that was a delta
+ * of, would leave behind. It has to be restored on top of that chain.
+ */
+#define XFS_MD2_MAGIC		0x584d4432	/* 'XMD2' */
+#define XFS_MD2_FRAME_MAGIC	0x584d4446	/* 'XMDF' */
+#define XFS_MD2_TRAILER_MAGIC	0x584d4454	/* 'XMDT' */
+#define XFS_MD2_VERSION		2
+
+#define XFS_MD2_FRAME_BYTES	(1024 * 1024)	/* max extent data per frame */
+#define XFS_MD2_FRAME_EXTENTS	1024		/* max extents per frame */
+
+/* frame payload encodings */
+#define XFS_MD2_CODEC_NONE	0
+#define XFS_MD2_CODEC_ZLIB	1
+
+struct xfs_md2_header {
+	__be32		mh_magic;
+	__be32		mh_version;
+	__be32		mh_info;	/* XFS_METADUMP_* flags */
+	__be32		mh_pad;
+	__be64		mh_id;		/* random, identifies the image */
+	__be64		mh_base;	/* mh_id of the image this is a delta of */
+};
+
+struct xfs_md2_frame {
+	__be32		mf_magic;
+	__u8		mf_codec;	/* XFS_MD2_CODEC_* */
+	__u8		mf_pad;
+	__be16		mf_nextents;	/* 0 terminates the frame stream */
+	__be32		mf_len;		/* bytes of extent data */
+	__be32		mf_zlen;	/* bytes of encoded payload */
+	__be32		mf_crc;		/* crc32c of the encoded payload */
+	__be32		mf_icrc;	/* crc32c of the extent index */
+	/* followed by mf_nextents xfs_md2_extent, then the payload */
+};
+
+struct xfs_md2_extent {
+	__be64		me_daddr;	/* first sector */
+	__be32		me_len;		/* length in sectors */
+	__be32		me_pad;
+};
+
+struct xfs_md2_ftab {
+	__be64		ft_offset;	/* file offset of the frame */
+	__be64		ft_daddr;	/* lowest sector in the frame */
+	__be64		ft_end;		/* one past the highest sector */
+};
+
+struct xfs_md2_trailer {
+	__be32		mt_magic;
+	__be32		mt_crc;		/* crc32c of the frame table */
+	__be64		mt_nframes;
+	__be64		mt_table;	/* file offset of the frame table */
+};
+
+/* frame encoding helpers in libxfs/metadump.c */
+extern size_t	libxfs_md2_bound(size_t len);
+extern int	libxfs_md2_compress(int codec, void *dst, size_t *dst_len,
+				const void *src, size_t src_len);
+extern int	libxfs_md2_decompress(int codec, void *dst, size_t dst_len,
+				const void *src, size_t src_len);
+extern int	libxfs_md2_frame_check(struct xfs_md2_frame *frame);
+extern int	libxfs_md2_index_check(struct xfs_md2_frame *frame,
+				struct xfs_md2_extent *ext);
+
+/* read-only access to the filesystem in an image, in libxfs/mdimage.c */
+struct xfs_mdimage;
+extern int	libxfs_mdimage_open(const char *path, struct xfs_mdimage **mip);
+extern int	libxfs_mdimage_stack(struct xfs_mdimage *mi, const char *path);
+extern void	libxfs_mdimage_close(struct xfs_mdimage *mi);
+extern __uint64_t libxfs_mdimage_id(struct xfs_mdimage *mi);
+extern __uint64_t libxfs_mdimage_size(struct xfs_mdimage *mi);
+extern ssize_t	libxfs_mdimage_pread(struct xfs_mdimage *mi, void *buf,
+				size_t len, off64_t offset);
 
 #endif /* _XFS_METADUMP_H_ */
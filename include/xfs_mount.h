@@ -77,6 +77,9 @@ typedef struct xfs_mount {
 	uint			m_alloc_set_aside; /* space we can't use */
 	uint			m_ag_max_usable; /* max space per AG */
 	struct radix_tree_root	m_perag_tree;
+	struct xfs_perag	**m_perag_slots; /* lockless perag lookup */
+	xfs_agnumber_t		m_perag_nslots;	/* AGs at mount time */
+	pthread_mutex_t		m_perag_lock;	/* perag setup */
 	uint			m_flags;	/* global mount flags */
 	bool			m_inotbt_nores; /* no per-AG finobt resv. */
 	uint			m_qflags;	/* quota status flags */
@@ -0,0 +1,417 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>.  All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "libxfs_priv.h"
+#include "init.h"
+#include "xfs_fs.h"
+#include "xfs_shared.h"
+#include "xfs_format.h"
+#include "xfs_log_format.h"
+#include "xfs_trans_resv.h"
+#include "xfs_mount.h"
+
+#include "libxfs.h"		/* for LIBXFS_EXIT_ON_FAILURE */
+
+#ifdef HAVE_LINUX_AIO
+#include <sys/syscall.h>
+
+/*
+ * Kernel AIO ABI, as per <linux/aio_abi.h>. We can't include the uapi header
+ * directly as it drags in <linux/swab.h>, whose helpers clash with the ones
+ * in xfs_arch.h.
+ */
+typedef unsigned long	aio_context_t;
+
+enum {
+	IOCB_CMD_PREAD = 0,
+	IOCB_CMD_PWRITE = 1,
+};
+
+struct io_event {
+	__u64		data;
+	__u64		obj;
+	__s64		res;
+	__s64		res2;
+};
+
+struct iocb {
+	__u64		aio_data;
+	__u32		aio_key;	/* aio_rw_flags on big endian */
+	__u32		aio_rw_flags;	/* aio_key on big endian */
+	__u16		aio_lio_opcode;
+	__s16		aio_reqprio;
+	__u32		aio_fildes;
+	__u64		aio_buf;
+	__u64		aio_nbytes;
+	__s64		aio_offset;
+	__u64		aio_reserved2;
+	__u32		aio_flags;
+	__u32		aio_resfd;
+};
+#endif
+
+/*
+ * Asynchronous buffer I/O submission engine.
+ *
+ * The buffer cache read and write paths issue a single synchronous pread or
+ * pwrite per buffer, which limits each thread to one I/O in flight. An aio
+ * context lets a caller queue a batch of buffers against a buftarg and reap
+ * them as they complete, so the device queue can be kept full from a single
+ * thread.
+ *
+ * Each context is owned by one thread; callers that want deeper queues across
+ * several threads simply create a context per thread. Where the kernel does
+ * not support Linux native AIO (or the aio-max-nr limit has been reached) the
+ * context falls back to performing the I/O synchronously at submission time
+ * and handing the completed buffers back from libxfs_aio_reap(), so callers
+ * never need to care which mode they got.
+ *
+ * Discontiguous buffers are always serviced synchronously - they are rare and
+ * would otherwise need one iocb per map with completion tracking to match.
+ *
+ * Native AIO is only truly asynchronous for files opened with O_DIRECT. The
+ * devices are only opened that way with LIBXFS_DIRECT, and otherwise the
+ * kernel does each buffered write inside io_submit(), so the submission
+ * blocks much as pwrite would. Batching still saves a system call per buffer
+ * there, but only direct I/O gets the deeper device queue.
+ */
+
+struct xfs_aio_req {
+	struct xfs_aio_req	*ar_next;	/* free list linkage */
+	struct xfs_buf		*ar_bp;
+	int			ar_rw;		/* LIBXFS_BREAD/BWRITE */
+	int			ar_flags;	/* LIBXFS_EXIT_ON_FAILURE */
+#ifdef HAVE_LINUX_AIO
+	struct iocb		ar_iocb;
+#endif
+};
+
+struct xfs_aio_ctx {
+	struct xfs_buftarg	*ac_target;
+	int			ac_fd;
+	int			ac_depth;	/* max requests in flight */
+	int			ac_inflight;	/* submitted, not reaped */
+	bool			ac_sync;	/* synchronous fallback */
+	struct xfs_aio_req	*ac_reqs;	/* request slots */
+	struct xfs_aio_req	*ac_free;	/* unused request slots */
+	struct xfs_buf		**ac_done;	/* completed, not reaped */
+	int			ac_ndone;
+#ifdef HAVE_LINUX_AIO
+	aio_context_t		ac_ctx;
+	struct iocb		**ac_iocbs;	/* submission batch */
+	struct io_event		*ac_events;	/* completion batch */
+#endif
+};
+
+#ifdef HAVE_LINUX_AIO
+static inline int
+io_setup(unsigned int nr, aio_context_t *ctxp)
+{
+	return syscall(__NR_io_setup, nr, ctxp);
+}
+
+static inline int
+io_destroy(aio_context_t ctx)
+{
+	return syscall(__NR_io_destroy, ctx);
+}
+
+static inline int
+io_submit(aio_context_t ctx, long nr, struct iocb **iocbpp)
+{
+	return syscall(__NR_io_submit, ctx, nr, iocbpp);
+}
+
+static inline int
+io_getevents(aio_context_t ctx, long min_nr, long max_nr,
+		struct io_event *events, struct timespec *timeout)
+{
+	return syscall(__NR_io_getevents, ctx, min_nr, max_nr, events,
+			timeout);
+}
+#endif
+
+struct xfs_aio_ctx *
+libxfs_aio_init(
+	struct xfs_buftarg	*btp,
+	int			depth)
+{
+	struct xfs_aio_ctx	*ac;
+	int			i;
+
+	ac = calloc(1, sizeof(*ac));
+	if (!ac)
+		return NULL;
+	ac->ac_target = btp;
+	ac->ac_fd = libxfs_device_to_fd(btp->dev);
+	ac->ac_depth = max(depth, 1);
+	ac->ac_reqs = calloc(ac->ac_depth, sizeof(struct xfs_aio_req));
+	ac->ac_done = calloc(ac->ac_depth, sizeof(struct xfs_buf *));
+	if (!ac->ac_reqs || !ac->ac_done)
+		goto out_free;
+
+	for (i = 0; i < ac->ac_depth; i++) {
+		ac->ac_reqs[i].ar_next = ac->ac_free;
+		ac->ac_free = &ac->ac_reqs[i];
+	}
+
+	ac->ac_sync = true;
+#ifdef HAVE_LINUX_AIO
+	ac->ac_iocbs = calloc(ac->ac_depth, sizeof(struct iocb *));
+	ac->ac_events = calloc(ac->ac_depth, sizeof(struct io_event));
+	if (!ac->ac_iocbs || !ac->ac_events)
+		goto out_free;
+	/* metadump images have to be read through their index */
+	if (!libxfs_device_is_image(btp->dev) &&
+	    io_setup(ac->ac_depth, &ac->ac_ctx) == 0)
+		ac->ac_sync = false;
+#endif
+	return ac;
+
+out_free:
+	libxfs_aio_destroy(ac);
+	return NULL;
+}
+
+/*
+ * Tear down an aio context. Anything still in flight is waited for so that
+ * buffers are never left with I/O pending against freed request slots.
+ */
+void
+libxfs_aio_destroy(
+	struct xfs_aio_ctx	*ac)
+{
+	struct xfs_buf		*bp;
+
+	if (!ac)
+		return;
+	while (libxfs_aio_reap(ac, &bp, 1, 1) > 0)
+		;
+#ifdef HAVE_LINUX_AIO
+	if (!ac->ac_sync)
+		io_destroy(ac->ac_ctx);
+	free(ac->ac_iocbs);
+	free(ac->ac_events);
+#endif
+	free(ac->ac_done);
+	free(ac->ac_reqs);
+	free(ac);
+}
+
+bool
+libxfs_aio_is_async(
+	struct xfs_aio_ctx	*ac)
+{
+	return !ac->ac_sync;
+}
+
+int
+libxfs_aio_inflight(
+	struct xfs_aio_ctx	*ac)
+{
+	return ac->ac_inflight;
+}
+
+/*
+ * Perform the I/O for @bp synchronously and park it on the completion list.
+ */
+static void
+aio_submit_sync(
+	struct xfs_aio_ctx	*ac,
+	struct xfs_buf		*bp,
+	int			rw,
+	int			flags)
+{
+	if (rw == LIBXFS_BWRITE)
+		libxfs_writebufr(bp);
+	else if (bp->b_flags & LIBXFS_B_DISCONTIG)
+		libxfs_readbufr_map(ac->ac_target, bp, flags);
+	else
+		bp->b_error = libxfs_readbufr(ac->ac_target, bp->b_bn, bp,
+					      bp->b_length, flags);
+	ac->ac_done[ac->ac_ndone++] = bp;
+	ac->ac_inflight++;
+}
+
+/*
+ * Queue up to @nbufs buffers for reading (LIBXFS_BREAD) or writing
+ * (LIBXFS_BWRITE). Returns the number of buffers accepted, which is less than
+ * @nbufs once the context is full; the caller must reap completions to make
+ * room before submitting the rest. Write buffers that fail verification are
+ * completed immediately with b_error set and still count as accepted.
+ */
+int
+libxfs_aio_submit(
+	struct xfs_aio_ctx	*ac,
+	struct xfs_buf		**bpp,
+	int			nbufs,
+	int			rw,
+	int			flags)
+{
+	int			accepted = 0;
+#ifdef HAVE_LINUX_AIO
+	struct xfs_aio_req	*req;
+	int			nr = 0;
+	int			ret;
+	int			i;
+#endif
+
+	ASSERT(rw == LIBXFS_BREAD || rw == LIBXFS_BWRITE);
+
+	for (; accepted < nbufs; accepted++) {
+		struct xfs_buf	*bp = bpp[accepted];
+
+		if (ac->ac_inflight >= ac->ac_depth)
+			break;
+
+		if (ac->ac_sync || (bp->b_flags & LIBXFS_B_DISCONTIG)) {
+			aio_submit_sync(ac, bp, rw, flags);
+			continue;
+		}
+#ifdef HAVE_LINUX_AIO
+		if (rw == LIBXFS_BWRITE && libxfs_writebufr_verify(bp)) {
+			ac->ac_done[ac->ac_ndone++] = bp;
+			ac->ac_inflight++;
+			continue;
+		}
+
+		req = ac->ac_free;
+		ac->ac_free = req->ar_next;
+		req->ar_bp = bp;
+		req->ar_rw = rw;
+		req->ar_flags = rw == LIBXFS_BWRITE ? bp->b_flags : flags;
+
+		memset(&req->ar_iocb, 0, sizeof(req->ar_iocb));
+		req->ar_iocb.aio_data = (__u64)(uintptr_t)req;
+		req->ar_iocb.aio_lio_opcode = rw == LIBXFS_BWRITE ?
+					IOCB_CMD_PWRITE : IOCB_CMD_PREAD;
+		req->ar_iocb.aio_fildes = ac->ac_fd;
+		req->ar_iocb.aio_buf = (__u64)(uintptr_t)bp->b_addr;
+		req->ar_iocb.aio_nbytes = bp->b_bcount;
+		req->ar_iocb.aio_offset = LIBXFS_BBTOOFF64(bp->b_bn);
+		ac->ac_iocbs[nr++] = &req->ar_iocb;
+		ac->ac_inflight++;
+#endif
+	}
+
+#ifdef HAVE_LINUX_AIO
+	/*
+	 * Push the batch into the kernel. If it refuses part of it (e.g.
+	 * EAGAIN under memory pressure) service the remainder synchronously
+	 * rather than failing the buffers.
+	 */
+	i = 0;
+	while (i < nr) {
+		ret = io_submit(ac->ac_ctx, nr - i, &ac->ac_iocbs[i]);
+		if (ret > 0) {
+			i += ret;
+			continue;
+		}
+		for (; i < nr; i++) {
+			req = (struct xfs_aio_req *)(uintptr_t)
+					ac->ac_iocbs[i]->aio_data;
+			ac->ac_inflight--;
+			aio_submit_sync(ac, req->ar_bp, req->ar_rw,
+					req->ar_flags);
+			req->ar_next = ac->ac_free;
+			ac->ac_free = req;
+		}
+	}
+#endif
+	return accepted;
+}
+
+#ifdef HAVE_LINUX_AIO
+static int
+aio_complete(
+	struct xfs_aio_ctx	*ac,
+	struct io_event		*ev)
+{
+	struct xfs_aio_req	*req = (struct xfs_aio_req *)(uintptr_t)ev->data;
+	struct xfs_buf		*bp = req->ar_bp;
+	int			error = 0;
+	bool			fatal;
+
+	fatal = req->ar_rw == LIBXFS_BWRITE ?
+			(req->ar_flags & LIBXFS_B_EXIT) :
+			(req->ar_flags & LIBXFS_EXIT_ON_FAILURE);
+
+	if (ev->res < 0) {
+		error = ev->res;
+		fprintf(stderr, _("%s: async %s failed: %s\n"), progname,
+			req->ar_rw == LIBXFS_BWRITE ? "write" : "read",
+			strerror(-error));
+	} else if (ev->res != bp->b_bcount) {
+		error = -EIO;
+		fprintf(stderr, _("%s: error - async %s only %lld of %u bytes\n"),
+			progname,
+			req->ar_rw == LIBXFS_BWRITE ? "write" : "read",
+			(long long)ev->res, bp->b_bcount);
+	}
+	if (error && fatal)
+		exit(1);
+
+	libxfs_buf_ioend(bp, req->ar_rw, error);
+
+	req->ar_next = ac->ac_free;
+	ac->ac_free = req;
+	ac->ac_done[ac->ac_ndone++] = bp;
+	return error;
+}
+#endif
+
+/*
+ * Wait for at least @min_nr submitted buffers to complete and return up to
+ * @max_nr of them in @bpp. The I/O status of each buffer is in b_error.
+ * Returns the number of buffers returned, or 0 if nothing is in flight.
+ */
+int
+libxfs_aio_reap(
+	struct xfs_aio_ctx	*ac,
+	struct xfs_buf		**bpp,
+	int			min_nr,
+	int			max_nr)
+{
+	int			nr = 0;
+
+	max_nr = min(max_nr, ac->ac_inflight);
+	min_nr = min(min_nr, max_nr);
+
+#ifdef HAVE_LINUX_AIO
+	while (!ac->ac_sync && ac->ac_ndone < min_nr) {
+		int		ret;
+		int		i;
+
+		ret = io_getevents(ac->ac_ctx, min_nr - ac->ac_ndone,
+				   max_nr - ac->ac_ndone, ac->ac_events, NULL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, _("%s: io_getevents failed: %s\n"),
+				progname, strerror(errno));
+			exit(1);
+		}
+		for (i = 0; i < ret; i++)
+			aio_complete(ac, &ac->ac_events[i]);
+	}
+#endif
+
+	while (nr < max_nr && ac->ac_ndone > 0)
+		bpp[nr++] = ac->ac_done[--ac->ac_ndone];
+	ac->ac_inflight -= nr;
+	return nr;
+}
@@ -39,6 +39,20 @@
 #define CACHE_SHAKE_COUNT	64
 
 static unsigned int cache_generic_bulkrelse(struct cache *, struct list_head *);
+static const struct cache_policy cache_priority_policy;
+static const struct cache_policy cache_adaptive_policy;
+
+/*
+ * The MRU stripe a node lives on at its current segment and priority.
+ */
+static inline struct cache_mru *
+cache_node_mru(
+	struct cache *		cache,
+	struct cache_node *	node)
+{
+	return &cache->c_mrus[node->cn_segment][node->cn_priority]
+			     [node->cn_hashidx % CACHE_MRU_STRIPES];
+}
 
 struct cache *
 cache_init(
@@ -47,7 +61,7 @@ cache_init(
 	struct cache_operations	*cache_operations)
 {
 	struct cache *		cache;
-	unsigned int		i, maxcount;
+	unsigned int		i, j, k, maxcount;
 
 	maxcount = hashsize * HASH_CACHE_RATIO;
 
@@ -61,7 +75,7 @@ cache_init(
 	cache->c_flags = flags;
 	cache->c_count = 0;
 	cache->c_max = 0;
-	cache->c_hits = 0;
+	cache->c_shake_stripe = 0;
 	cache->c_misses = 0;
 	cache->c_maxcount = maxcount;
 	cache->c_hashsize = hashsize;
@@ -73,18 +87,34 @@ cache_init(
 	cache->compare = cache_operations->compare;
 	cache->bulkrelse = cache_operations->bulkrelse ?
 		cache_operations->bulkrelse : cache_generic_bulkrelse;
+	cache->bulkflush = cache_operations->bulkflush;
+	cache->c_policy = (flags & CACHE_ADAPTIVE_RECLAIM) ?
+		&cache_adaptive_policy : &cache_priority_policy;
+	cache->c_policy_data = NULL;
 	pthread_mutex_init(&cache->c_mutex, NULL);
 
 	for (i = 0; i < hashsize; i++) {
 		list_head_init(&cache->c_hash[i].ch_list);
 		cache->c_hash[i].ch_count = 0;
+		cache->c_hash[i].ch_hits = 0;
 		pthread_mutex_init(&cache->c_hash[i].ch_mutex, NULL);
 	}
 
-	for (i = 0; i <= CACHE_DIRTY_PRIORITY; i++) {
-		list_head_init(&cache->c_mrus[i].cm_list);
-		cache->c_mrus[i].cm_count = 0;
-		pthread_mutex_init(&cache->c_mrus[i].cm_mutex, NULL);
+	for (k = 0; k < CACHE_NR_SEGMENTS; k++) {
+		for (i = 0; i <= CACHE_DIRTY_PRIORITY; i++) {
+			for (j = 0; j < CACHE_MRU_STRIPES; j++) {
+				struct cache_mru *mru = &cache->c_mrus[k][i][j];
+
+				list_head_init(&mru->cm_list);
+				mru->cm_count = 0;
+				pthread_mutex_init(&mru->cm_mutex, NULL);
+			}
+		}
+	}
+
+	if (cache->c_policy->cp_init && cache->c_policy->cp_init(cache)) {
+		cache_destroy(cache);
+		return NULL;
 	}
 	return cache;
 }
@@ -147,16 +177,24 @@ void
 cache_destroy(
 	struct cache *		cache)
 {
-	unsigned int		i;
+	unsigned int		i, j, k;
 
 	cache_destroy_check(cache);
+	if (cache->c_policy->cp_destroy)
+		cache->c_policy->cp_destroy(cache);
 	for (i = 0; i < cache->c_hashsize; i++) {
 		list_head_destroy(&cache->c_hash[i].ch_list);
 		pthread_mutex_destroy(&cache->c_hash[i].ch_mutex);
 	}
-	for (i = 0; i <= CACHE_DIRTY_PRIORITY; i++) {
-		list_head_destroy(&cache->c_mrus[i].cm_list);
-		pthread_mutex_destroy(&cache->c_mrus[i].cm_mutex);
+	for (k = 0; k < CACHE_NR_SEGMENTS; k++) {
+		for (i = 0; i <= CACHE_DIRTY_PRIORITY; i++) {
+			for (j = 0; j < CACHE_MRU_STRIPES; j++) {
+				struct cache_mru *mru = &cache->c_mrus[k][i][j];
+
+				list_head_destroy(&mru->cm_list);
+				pthread_mutex_destroy(&mru->cm_mutex);
+			}
+		}
 	}
 	pthread_mutex_destroy(&cache->c_mutex);
 	free(cache->c_hash);
@@ -192,52 +230,38 @@ cache_add_to_dirty_mru(
 	struct cache		*cache,
 	struct cache_node	*node)
 {
-	struct cache_mru	*mru = &cache->c_mrus[CACHE_DIRTY_PRIORITY];
+	struct cache_mru	*mru;
 
-	pthread_mutex_lock(&mru->cm_mutex);
 	node->cn_old_priority = node->cn_priority;
 	node->cn_priority = CACHE_DIRTY_PRIORITY;
+	mru = cache_node_mru(cache, node);
+
+	pthread_mutex_lock(&mru->cm_mutex);
 	list_add(&node->cn_mru, &mru->cm_list);
 	mru->cm_count++;
 	pthread_mutex_unlock(&mru->cm_mutex);
 }
 
 /*
- * We've hit the limit on cache size, so we need to start reclaiming nodes we've
- * used. The MRU specified by the priority is shaken.  Returns new priority at
- * end of the call (in case we call again). We are not allowed to reclaim dirty
- * objects, so we have to flush them first. If flushing fails, we move them to
- * the "dirty, unreclaimable" list.
- *
- * Hence we skip priorities > CACHE_MAX_PRIORITY unless "purge" is set as we
- * park unflushable (and hence unreclaimable) buffers at these priorities.
- * Trying to shake unreclaimable buffer lists when there is memory pressure is a
- * waste of time and CPU and greatly slows down cache node recycling operations.
- * Hence we only try to free them if we are being asked to purge the cache of
- * all entries.
+ * Reclaim up to @limit unreferenced nodes from one MRU stripe onto @temp.
+ * Returns the number of nodes reclaimed.
  */
 static unsigned int
-cache_shake(
+cache_shake_mru(
 	struct cache *		cache,
+	struct cache_mru *	mru,
 	unsigned int		priority,
-	bool			purge)
+	bool			purge,
+	struct list_head *	temp,
+	unsigned int		limit)
 {
-	struct cache_mru	*mru;
 	struct cache_hash *	hash;
-	struct list_head	temp;
 	struct list_head *	head;
 	struct list_head *	pos;
 	struct list_head *	n;
 	struct cache_node *	node;
-	unsigned int		count;
-
-	ASSERT(priority <= CACHE_DIRTY_PRIORITY);
-	if (priority > CACHE_MAX_PRIORITY && !purge)
-		priority = 0;
+	unsigned int		count = 0;
 
-	mru = &cache->c_mrus[priority];
-	count = 0;
-	list_head_init(&temp);
 	head = &mru->cm_list;
 
 	pthread_mutex_lock(&mru->cm_mutex);
@@ -265,9 +289,11 @@ cache_shake(
 		}
 		ASSERT(node->cn_count == 0);
 		ASSERT(node->cn_priority == priority);
+		if (cache->c_policy->cp_evict)
+			cache->c_policy->cp_evict(cache, node);
 		node->cn_priority = -1;
 
-		list_move(&node->cn_mru, &temp);
+		list_move(&node->cn_mru, temp);
 		list_del_init(&node->cn_hash);
 		hash->ch_count--;
 		mru->cm_count--;
@@ -275,11 +301,78 @@ cache_shake(
 		pthread_mutex_unlock(&node->cn_mutex);
 
 		count++;
-		if (!purge && count == CACHE_SHAKE_COUNT)
+		if (!purge && count == limit)
 			break;
 	}
 	pthread_mutex_unlock(&mru->cm_mutex);
 
+	return count;
+}
+
+/*
+ * Reclaim up to @limit nodes from all the stripes of one segment's MRU at
+ * @priority. The stripes are shaken in turn, starting from a different stripe
+ * each time so that no stripe is preferentially emptied.
+ */
+static unsigned int
+cache_shake_segment(
+	struct cache *		cache,
+	int			segment,
+	unsigned int		priority,
+	bool			purge,
+	struct list_head *	temp,
+	unsigned int		limit)
+{
+	unsigned int		count = 0;
+	unsigned int		stripe;
+	unsigned int		i;
+
+	stripe = cache->c_shake_stripe++;	/* racy, but only a hint */
+	for (i = 0; i < CACHE_MRU_STRIPES; i++) {
+		struct cache_mru *mru;
+
+		mru = &cache->c_mrus[segment][priority]
+				    [(stripe + i) % CACHE_MRU_STRIPES];
+		count += cache_shake_mru(cache, mru, priority, purge, temp,
+					 limit - count);
+		if (!purge && count == limit)
+			break;
+	}
+	return count;
+}
+
+/*
+ * We've hit the limit on cache size, so we need to start reclaiming nodes we've
+ * used. The MRU specified by the priority is shaken.  Returns new priority at
+ * end of the call (in case we call again). We are not allowed to reclaim dirty
+ * objects, so we have to flush them first. If flushing fails, we move them to
+ * the "dirty, unreclaimable" list.
+ *
+ * Hence we skip priorities > CACHE_MAX_PRIORITY unless "purge" is set as we
+ * park unflushable (and hence unreclaimable) buffers at these priorities.
+ * Trying to shake unreclaimable buffer lists when there is memory pressure is a
+ * waste of time and CPU and greatly slows down cache node recycling operations.
+ * Hence we only try to free them if we are being asked to purge the cache of
+ * all entries.
+ *
+ * Which nodes at a given priority go first is up to the reclaim policy.
+ */
+static unsigned int
+cache_shake(
+	struct cache *		cache,
+	unsigned int		priority,
+	bool			purge)
+{
+	struct list_head	temp;
+	unsigned int		count;
+
+	ASSERT(priority <= CACHE_DIRTY_PRIORITY);
+	if (priority > CACHE_MAX_PRIORITY && !purge)
+		priority = 0;
+
+	list_head_init(&temp);
+	count = cache->c_policy->cp_shake(cache, priority, purge, &temp);
+
 	if (count > 0) {
 		cache->bulkrelse(cache, &temp);
 
@@ -291,6 +384,244 @@ cache_shake(
 	return (count == CACHE_SHAKE_COUNT) ? priority : ++priority;
 }
 
+/*
+ * Reclaim policies.
+ *
+ * The priority policy is the classic behaviour: nodes are reclaimed from the
+ * lowest priority MRU first, least recently used first within an MRU. Callers
+ * steer reclaim by raising and lowering node priorities.
+ *
+ * The adaptive policy is a scan resistant, ARC-like segmented LRU layered
+ * under the priorities. New nodes start in the probationary segment and are
+ * only promoted to the protected segment when they are looked up again, so a
+ * large one-pass scan (e.g. of a big directory) can only churn the
+ * probationary segment and cannot push out the protected working set. At
+ * each priority the probationary nodes are reclaimed first.
+ *
+ * The protected segment is kept to a target size; when it grows beyond that
+ * the least recently used protected nodes are demoted back to probation. The
+ * target adapts ARC-style: a miss on a hash chain we recently evicted a
+ * probationary node from means probation is too small, so the target
+ * shrinks; a miss on a chain we recently evicted a protected node from means
+ * the reverse. The ghost history is kept per hash chain rather than per key,
+ * which is coarse but needs no knowledge of the keys.
+ *
+ * A hit on a node at or above CACHE_PREFETCH_PRIORITY is the first use of a
+ * prefetched node rather than a reuse, so it does not promote the node.
+ */
+static unsigned int
+cache_priority_shake(
+	struct cache *		cache,
+	unsigned int		priority,
+	bool			purge,
+	struct list_head *	temp)
+{
+	return cache_shake_segment(cache, CACHE_SEG_PROBATION, priority,
+				   purge, temp, CACHE_SHAKE_COUNT);
+}
+
+static const struct cache_policy cache_priority_policy = {
+	.cp_name	= "priority",
+	.cp_shake	= cache_priority_shake,
+};
+
+struct cache_ghost {
+	unsigned int		cg_evicted[CACHE_NR_SEGMENTS];
+};
+
+struct cache_adaptive {
+	unsigned int		ca_target;	/* protected target size */
+	unsigned int		ca_evictions;	/* eviction sequence */
+	struct cache_ghost	*ca_ghosts;	/* per hash chain history */
+	unsigned long long	ca_promotions;
+	unsigned long long	ca_demotions;
+};
+
+static int
+cache_adaptive_init(
+	struct cache *		cache)
+{
+	struct cache_adaptive	*ca;
+
+	ca = calloc(1, sizeof(struct cache_adaptive));
+	if (!ca)
+		return ENOMEM;
+	ca->ca_ghosts = calloc(cache->c_hashsize, sizeof(struct cache_ghost));
+	if (!ca->ca_ghosts) {
+		free(ca);
+		return ENOMEM;
+	}
+	ca->ca_target = cache->c_maxcount / 2;
+	cache->c_policy_data = ca;
+	return 0;
+}
+
+static void
+cache_adaptive_destroy(
+	struct cache *		cache)
+{
+	struct cache_adaptive	*ca = cache->c_policy_data;
+
+	if (!ca)
+		return;
+	free(ca->ca_ghosts);
+	free(ca);
+	cache->c_policy_data = NULL;
+}
+
+static void
+cache_adaptive_hit(
+	struct cache *		cache,
+	struct cache_node *	node)
+{
+	struct cache_adaptive	*ca = cache->c_policy_data;
+
+	if (node->cn_segment == CACHE_SEG_PROTECTED ||
+	    node->cn_priority >= CACHE_PREFETCH_PRIORITY)
+		return;
+	node->cn_segment = CACHE_SEG_PROTECTED;
+	ca->ca_promotions++;
+}
+
+/*
+ * The adaptive state is updated without locking. Lost updates only make the
+ * target adapt a little more slowly, which isn't worth serialising misses for.
+ */
+static void
+cache_adaptive_miss(
+	struct cache *		cache,
+	unsigned int		hashidx)
+{
+	struct cache_adaptive	*ca = cache->c_policy_data;
+	struct cache_ghost	*cg = &ca->ca_ghosts[hashidx];
+	unsigned int		now = ca->ca_evictions;
+	unsigned int		prob = cg->cg_evicted[CACHE_SEG_PROBATION];
+	unsigned int		prot = cg->cg_evicted[CACHE_SEG_PROTECTED];
+
+	/* only the most recent eviction from this chain counts */
+	if (prob && (!prot || now - prob < now - prot)) {
+		if (now - prob < cache->c_maxcount && ca->ca_target > 0)
+			ca->ca_target--;
+	} else if (prot) {
+		if (now - prot < cache->c_maxcount &&
+		    ca->ca_target < cache->c_maxcount)
+			ca->ca_target++;
+	}
+	cg->cg_evicted[CACHE_SEG_PROBATION] = 0;
+	cg->cg_evicted[CACHE_SEG_PROTECTED] = 0;
+}
+
+static void
+cache_adaptive_evict(
+	struct cache *		cache,
+	struct cache_node *	node)
+{
+	struct cache_adaptive	*ca = cache->c_policy_data;
+
+	ca->ca_ghosts[node->cn_hashidx].cg_evicted[node->cn_segment] =
+							++ca->ca_evictions;
+}
+
+static unsigned int
+cache_segment_count(
+	struct cache *		cache,
+	int			segment)
+{
+	unsigned int		count = 0;
+	int			i, j;
+
+	for (i = 0; i <= CACHE_MAX_PRIORITY; i++)
+		for (j = 0; j < CACHE_MRU_STRIPES; j++)
+			count += cache->c_mrus[segment][i][j].cm_count;
+	return count;
+}
+
+/*
+ * Move up to @limit of the least recently used protected nodes at @priority to
+ * the most recently used end of the probationary MRU, giving them one more
+ * chance to be looked up before they are reclaimed.
+ */
+static void
+cache_adaptive_demote(
+	struct cache *		cache,
+	unsigned int		priority,
+	unsigned int		limit)
+{
+	struct cache_adaptive	*ca = cache->c_policy_data;
+	struct cache_mru *	from;
+	struct cache_mru *	to;
+	struct cache_node *	node;
+	struct list_head *	pos;
+	struct list_head *	n;
+	unsigned int		count = 0;
+	int			i;
+
+	for (i = 0; i < CACHE_MRU_STRIPES && count < limit; i++) {
+		from = &cache->c_mrus[CACHE_SEG_PROTECTED][priority][i];
+		to = &cache->c_mrus[CACHE_SEG_PROBATION][priority][i];
+
+		pthread_mutex_lock(&from->cm_mutex);
+		for (pos = from->cm_list.prev, n = pos->prev;
+		     pos != &from->cm_list && count < limit;
+		     pos = n, n = pos->prev) {
+			node = list_entry(pos, struct cache_node, cn_mru);
+			if (pthread_mutex_trylock(&node->cn_mutex) != 0)
+				continue;
+			if (pthread_mutex_trylock(&to->cm_mutex) != 0) {
+				pthread_mutex_unlock(&node->cn_mutex);
+				break;
+			}
+			list_move(&node->cn_mru, &to->cm_list);
+			from->cm_count--;
+			to->cm_count++;
+			node->cn_segment = CACHE_SEG_PROBATION;
+			pthread_mutex_unlock(&to->cm_mutex);
+			pthread_mutex_unlock(&node->cn_mutex);
+			count++;
+		}
+		pthread_mutex_unlock(&from->cm_mutex);
+	}
+	ca->ca_demotions += count;
+}
+
+static unsigned int
+cache_adaptive_shake(
+	struct cache *		cache,
+	unsigned int		priority,
+	bool			purge,
+	struct list_head *	temp)
+{
+	struct cache_adaptive	*ca = cache->c_policy_data;
+	unsigned int		count;
+
+	if (purge)
+		return cache_shake_segment(cache, CACHE_SEG_PROBATION,
+					   priority, true, temp, 0) +
+		       cache_shake_segment(cache, CACHE_SEG_PROTECTED,
+					   priority, true, temp, 0);
+
+	if (cache_segment_count(cache, CACHE_SEG_PROTECTED) > ca->ca_target)
+		cache_adaptive_demote(cache, priority, CACHE_SHAKE_COUNT);
+
+	count = cache_shake_segment(cache, CACHE_SEG_PROBATION, priority,
+				    false, temp, CACHE_SHAKE_COUNT);
+	if (count < CACHE_SHAKE_COUNT)
+		count += cache_shake_segment(cache, CACHE_SEG_PROTECTED,
+					     priority, false, temp,
+					     CACHE_SHAKE_COUNT - count);
+	return count;
+}
+
+static const struct cache_policy cache_adaptive_policy = {
+	.cp_name	= "adaptive",
+	.cp_init	= cache_adaptive_init,
+	.cp_destroy	= cache_adaptive_destroy,
+	.cp_hit		= cache_adaptive_hit,
+	.cp_miss	= cache_adaptive_miss,
+	.cp_evict	= cache_adaptive_evict,
+	.cp_shake	= cache_adaptive_shake,
+};
+
 /*
  * Allocate a new hash node (updating atomic counter in the process),
  * unless doing so will push us over the maximum cache size.
@@ -326,6 +657,7 @@ cache_node_allocate(
 	node->cn_count = 1;
 	node->cn_priority = 0;
 	node->cn_old_priority = -1;
+	node->cn_segment = CACHE_SEG_PROBATION;
 	return node;
 }
 
@@ -358,7 +690,7 @@ __cache_node_purge(
 		return 1;
 	}
 
-	mru = &cache->c_mrus[node->cn_priority];
+	mru = cache_node_mru(cache, node);
 	pthread_mutex_lock(&mru->cm_mutex);
 	list_del_init(&node->cn_mru);
 	mru->cm_count--;
@@ -430,7 +762,7 @@ cache_node_get(
 			if (node->cn_count == 0) {
 				ASSERT(node->cn_priority >= 0);
 				ASSERT(!list_empty(&node->cn_mru));
-				mru = &cache->c_mrus[node->cn_priority];
+				mru = cache_node_mru(cache, node);
 				pthread_mutex_lock(&mru->cm_mutex);
 				mru->cm_count--;
 				list_del_init(&node->cn_mru);
@@ -442,15 +774,14 @@ cache_node_get(
 					node->cn_old_priority = -1;
 				}
 			}
+			if (cache->c_policy->cp_hit)
+				cache->c_policy->cp_hit(cache, node);
 			node->cn_count++;
+			hash->ch_hits++;
 
 			pthread_mutex_unlock(&node->cn_mutex);
 			pthread_mutex_unlock(&hash->ch_mutex);
 
-			pthread_mutex_lock(&cache->c_mutex);
-			cache->c_hits++;
-			pthread_mutex_unlock(&cache->c_mutex);
-
 			*nodep = node;
 			return 0;
 next_object:
@@ -476,6 +807,8 @@ next_object:
 	}
 
 	node->cn_hashidx = hashidx;
+	if (cache->c_policy->cp_miss)
+		cache->c_policy->cp_miss(cache, hashidx);
 
 	/* add new node to appropriate hash */
 	pthread_mutex_lock(&hash->ch_mutex);
@@ -517,7 +850,7 @@ cache_node_put(
 
 	if (node->cn_count == 0) {
 		/* add unreferenced node to appropriate MRU for shaker */
-		mru = &cache->c_mrus[node->cn_priority];
+		mru = cache_node_mru(cache, node);
 		pthread_mutex_lock(&mru->cm_mutex);
 		mru->cm_count++;
 		list_add(&node->cn_mru, &mru->cm_list);
@@ -633,6 +966,63 @@ cache_purge(
 #endif
 }
 
+/*
+ * Gather every node in the cache and hand them to the bulk flush method in a
+ * single call, so that it can order and batch the writeback as it sees fit.
+ * The method may reorder the node array but must not drop entries from it.
+ * Each node's mutex is held until the bulk flush returns, which keeps the
+ * shaker and purgers away from nodes that are under I/O. Nodes added after we
+ * sized the gather array are flushed individually as we find them.
+ */
+static bool
+cache_flush_bulk(
+	struct cache *		cache)
+{
+	struct cache_hash *	hash;
+	struct list_head *	head;
+	struct list_head *	pos;
+	struct cache_node *	node;
+	struct cache_node **	nodes;
+	unsigned int		count;
+	unsigned int		nr = 0;
+	int			i;
+
+	pthread_mutex_lock(&cache->c_mutex);
+	count = cache->c_count;
+	pthread_mutex_unlock(&cache->c_mutex);
+	if (!count)
+		return true;
+
+	nodes = malloc(count * sizeof(struct cache_node *));
+	if (!nodes)
+		return false;
+
+	for (i = 0; i < cache->c_hashsize; i++) {
+		hash = &cache->c_hash[i];
+
+		pthread_mutex_lock(&hash->ch_mutex);
+		head = &hash->ch_list;
+		for (pos = head->next; pos != head; pos = pos->next) {
+			node = (struct cache_node *)pos;
+			pthread_mutex_lock(&node->cn_mutex);
+			if (nr < count) {
+				nodes[nr++] = node;
+				continue;
+			}
+			cache->flush(node);
+			pthread_mutex_unlock(&node->cn_mutex);
+		}
+		pthread_mutex_unlock(&hash->ch_mutex);
+	}
+
+	cache->bulkflush(cache, nodes, nr);
+
+	while (nr > 0)
+		pthread_mutex_unlock(&nodes[--nr]->cn_mutex);
+	free(nodes);
+	return true;
+}
+
 /*
  * Flush all nodes in the cache to disk.
  */
@@ -649,6 +1039,9 @@ cache_flush(
 	if (!cache->flush)
 		return;
 
+	if (cache->bulkflush && cache_flush_bulk(cache))
+		return;
+
 	for (i = 0; i < cache->c_hashsize; i++) {
 		hash = &cache->c_hash[i];
 
@@ -664,6 +1057,20 @@ cache_flush(
 	}
 }
 
+static unsigned int
+cache_mru_count(
+	struct cache	*cache,
+	int		priority)
+{
+	unsigned int	count = 0;
+	int		i, j;
+
+	for (i = 0; i < CACHE_NR_SEGMENTS; i++)
+		for (j = 0; j < CACHE_MRU_STRIPES; j++)
+			count += cache->c_mrus[i][priority][j].cm_count;
+	return count;
+}
+
 #define	HASH_REPORT	(3 * HASH_CACHE_RATIO)
 void
 cache_report(
@@ -674,8 +1081,12 @@ cache_report(
 	int		i;
 	unsigned long	count, index, total;
 	unsigned long	hash_bucket_lengths[HASH_REPORT + 2];
+	unsigned long long hits = 0;
+
+	for (i = 0; i < cache->c_hashsize; i++)
+		hits += cache->c_hash[i].ch_hits;
 
-	if ((cache->c_hits + cache->c_misses) == 0)
+	if ((hits + cache->c_misses) == 0)
 		return;
 
 	/* report cache summary */
@@ -692,21 +1103,32 @@ cache_report(
 			cache->c_max,
 			cache->c_count,
 			cache->c_hashsize,
-			cache->c_hits,
+			hits,
 			cache->c_misses,
-			(double)cache->c_hits * 100 /
-				(cache->c_hits + cache->c_misses)
+			(double)hits * 100 / (hits + cache->c_misses)
 	);
+	fprintf(fp, "Reclaim policy = %s\n", cache->c_policy->cp_name);
+	if (cache->c_policy == &cache_adaptive_policy) {
+		struct cache_adaptive	*ca = cache->c_policy_data;
+
+		fprintf(fp, "Probation entries = %u\n"
+				"Protected entries = %u (target %u)\n"
+				"Promotions = %llu\n"
+				"Demotions = %llu\n",
+			cache_segment_count(cache, CACHE_SEG_PROBATION),
+			cache_segment_count(cache, CACHE_SEG_PROTECTED),
+			ca->ca_target, ca->ca_promotions, ca->ca_demotions);
+	}
 
 	for (i = 0; i <= CACHE_MAX_PRIORITY; i++)
 		fprintf(fp, "MRU %d entries = %6u (%3u%%)\n",
-			i, cache->c_mrus[i].cm_count,
-			cache->c_mrus[i].cm_count * 100 / cache->c_count);
+			i, cache_mru_count(cache, i),
+			cache_mru_count(cache, i) * 100 / cache->c_count);
 
 	i = CACHE_DIRTY_PRIORITY;
 	fprintf(fp, "Dirty MRU %d entries = %6u (%3u%%)\n",
-		i, cache->c_mrus[i].cm_count,
-		cache->c_mrus[i].cm_count * 100 / cache->c_count);
+		i, cache_mru_count(cache, i),
+		cache_mru_count(cache, i) * 100 / cache->c_count);
 
 	/* report hash bucket lengths */
 	bzero(hash_bucket_lengths, sizeof(hash_bucket_lengths));
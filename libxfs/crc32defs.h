@@ -47,6 +47,17 @@
  */
 #define CRC32C_POLY_LE 0x82F63B78
 
+/*
+ * The hardware crc32c implementations run three independent crc32 streams
+ * over adjacent chunks of the buffer and then shift the partial crcs into
+ * place with a carryless multiply.  Chunks are CRC32C_STREAM_LEN(i) bytes
+ * long, longest first, and gen_crc32table emits the multiplication constants
+ * for each of them into crc32c_shift_le[].
+ */
+#define CRC32C_NR_STREAMS	3
+#define CRC32C_STREAM_LEN(i)	(1024 >> (2 * (i)))
+#define CRC32C_NR_STREAM_LENS	3
+
 /* Try to choose an implementation variant via Kconfig */
 #ifdef CONFIG_CRC32_SLICEBY8
 # define CRC_LE_BITS 64
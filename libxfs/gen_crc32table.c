@@ -22,6 +22,7 @@
 
 static uint32_t crc32table_le[LE_TABLE_ROWS][256];
 static uint32_t crc32ctable_le[LE_TABLE_ROWS][256];
+static uint32_t crc32c_shift_le[CRC32C_NR_STREAM_LENS][CRC32C_NR_STREAMS - 1];
 
 /*
  * big endian ordered CRC not used by XFS.
@@ -67,6 +68,41 @@ static void crc32cinit_le(void)
 	crc32init_le_generic(CRC32C_POLY_LE, crc32ctable_le);
 }
 
+/**
+ * crc32c_xpow_le() - calculate x^n mod the crc32c polynomial
+ *
+ * The result is bit-reflected like the crc itself, so x^0 is the top bit.
+ */
+static uint32_t crc32c_xpow_le(unsigned int n)
+{
+	uint32_t crc = 0x80000000;
+
+	while (n--)
+		crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY_LE : 0);
+	return crc;
+}
+
+/**
+ * crc32cinit_shift_le() - initialize the stream combining constants
+ *
+ * Multiplying a partial crc by x^(8 * len) appends len zero bytes to it.
+ * The carryless multiply leaves the product shifted up by one bit and the
+ * crc32 instruction that reduces it multiplies by another x^32, so the
+ * constant for shifting a crc over len bytes is x^(8 * len - 33).  The
+ * first stream is shifted over the other two, the second over the third.
+ */
+static void crc32cinit_shift_le(void)
+{
+	unsigned int i, j, len;
+
+	for (i = 0; i < CRC32C_NR_STREAM_LENS; i++) {
+		len = CRC32C_STREAM_LEN(i);
+		for (j = 0; j < CRC32C_NR_STREAMS - 1; j++)
+			crc32c_shift_le[i][j] = crc32c_xpow_le(
+				8 * len * (CRC32C_NR_STREAMS - 1 - j) - 33);
+	}
+}
+
 /**
  * crc32init_be() - allocate and initialize BE table data
  */
@@ -110,6 +146,8 @@ static void output_table(uint32_t (*table)[256], int rows, int len, char *trans)
 
 int main(int argc, char** argv)
 {
+	int i, j;
+
 	printf("/* this file is generated - do not edit */\n\n");
 
 	if (CRC_LE_BITS > 1) {
@@ -140,5 +178,17 @@ int main(int argc, char** argv)
 		printf("};\n");
 	}
 
+	crc32cinit_shift_le();
+	printf("static u32 __attribute__((__unused__))\n"
+	       "crc32c_shift_le[%d][%d] = {\n",
+	       CRC32C_NR_STREAM_LENS, CRC32C_NR_STREAMS - 1);
+	for (j = 0; j < CRC32C_NR_STREAM_LENS; j++) {
+		printf("{");
+		for (i = 0; i < CRC32C_NR_STREAMS - 1; i++)
+			printf("%s0x%8.8x", i ? ", " : "", crc32c_shift_le[j][i]);
+		printf("},\n");
+	}
+	printf("};\n");
+
 	return 0;
 }
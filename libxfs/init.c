@@ -17,6 +17,7 @@
  */
 
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include "init.h"
 
 #include "libxfs_priv.h"
@@ -35,6 +36,7 @@
 #include "xfs_refcount_btree.h"
 
 #include "libxfs.h"		/* for now */
+#include "xfs_metadump.h"
 
 char *progname = "libxfs";	/* default, changed by each tool */
 
@@ -55,6 +57,7 @@ int nextfakedev = -1;	/* device number to give to next fake device */
 static struct dev_to_fd {
 	dev_t	dev;
 	int	fd;
+	struct xfs_mdimage *md;	/* metadump image standing in for dev */
 } dev_map[MAX_DEVS]={{0}};
 
 /*
@@ -100,6 +103,68 @@ libxfs_device_to_fd(dev_t device)
 	/* NOTREACHED */
 }
 
+static struct xfs_mdimage *
+device_to_image(dev_t device)
+{
+	int	d;
+
+	for (d = 0; d < MAX_DEVS; d++)
+		if (dev_map[d].dev == device)
+			return dev_map[d].md;
+	return NULL;
+}
+
+/* libxfs_device_is_image:
+ *     is the device a metadump image rather than a filesystem?
+ */
+bool
+libxfs_device_is_image(dev_t device)
+{
+	return device_to_image(device) != NULL;
+}
+
+/* libxfs_device_pread:
+ *     pread(2) from a device, going through the metadump image
+ *     index if it is one
+ */
+ssize_t
+libxfs_device_pread(dev_t device, void *buf, size_t len, off64_t offset)
+{
+	struct xfs_mdimage *md = device_to_image(device);
+
+	if (md)
+		return libxfs_mdimage_pread(md, buf, len, offset);
+	return pread(libxfs_device_to_fd(device), buf, len, offset);
+}
+
+/* libxfs_device_preadv:
+ *     preadv(2) equivalent of libxfs_device_pread
+ */
+ssize_t
+libxfs_device_preadv(dev_t device, const struct iovec *iov, int iovcnt,
+		     off64_t offset)
+{
+	struct xfs_mdimage *md = device_to_image(device);
+	ssize_t	done = 0;
+	ssize_t	len;
+	int	i;
+
+#ifdef HAVE_PREADV
+	if (!md)
+		return preadv(libxfs_device_to_fd(device), iov, iovcnt, offset);
+#endif
+	for (i = 0; i < iovcnt; i++) {
+		len = libxfs_device_pread(device, iov[i].iov_base,
+					  iov[i].iov_len, offset + done);
+		if (len < 0)
+			return done ? done : len;
+		done += len;
+		if (len < iov[i].iov_len)
+			break;
+	}
+	return done;
+}
+
 /* libxfs_device_open:
  *     open a device and return its device number
  */
@@ -110,6 +175,7 @@ libxfs_device_open(char *path, int creat, int xflags, int setblksize)
 	int		fd, d, flags;
 	int		readonly, dio, excl;
 	struct stat	statb;
+	struct xfs_mdimage *md = NULL;
 
 	readonly = (xflags & LIBXFS_ISREADONLY);
 	excl = (xflags & LIBXFS_EXCLUSIVELY) && !creat;
@@ -135,6 +201,14 @@ retry:
 		exit(1);
 	}
 
+	/*
+	 * A metadump image opened read-only stands in for the filesystem it
+	 * was taken from. Anyone opening it for writing gets the file itself.
+	 */
+	if (readonly && S_ISREG(statb.st_mode) &&
+	    libxfs_mdimage_open(path, &md))
+		exit(1);
+
 	if (!readonly && setblksize && (statb.st_mode & S_IFMT) == S_IFBLK) {
 		if (setblksize == 1)
 			/* use the default blocksize */
@@ -164,6 +238,7 @@ retry:
 		if (!dev_map[d].dev) {
 			dev_map[d].dev = dev;
 			dev_map[d].fd = fd;
+			dev_map[d].md = md;
 
 			return dev;
 		}
@@ -184,7 +259,9 @@ libxfs_device_close(dev_t dev)
 			int	fd;
 
 			fd = dev_map[d].fd;
+			libxfs_mdimage_close(dev_map[d].md);
 			dev_map[d].dev = dev_map[d].fd = 0;
+			dev_map[d].md = NULL;
 
 			fsync(fd);
 			platform_flush_device(fd, dev);
@@ -299,6 +376,9 @@ libxfs_init(libxfs_init_t *a)
 			platform_findsizes(rawfile, a->dfd,
 					   &a->dsize, &a->dbsize);
 		}
+		if (device_to_image(a->ddev))
+			a->dsize = libxfs_mdimage_size(
+					device_to_image(a->ddev)) >> BBSHIFT;
 		needcd = 1;
 	} else
 		a->dsize = 0;
@@ -488,45 +568,104 @@ rtmount_init(
 	return 0;
 }
 
+/*
+ * Per-AG structures are only set up when xfs_perag_get first looks an AG up,
+ * so tools start quickly however many AGs the filesystem has. The radix tree
+ * can't be read while it is being inserted into, so lookups go through the
+ * mount's slot array instead, and only setting an AG up takes the lock.
+ */
+
+/*
+ * Work out whether inodes may be allocated in @agno, and whether its space
+ * is preferred for metadata, as the kernel does when mounting with inode32.
+ */
+static void
+libxfs_perag_set_flags(
+	struct xfs_mount	*mp,
+	struct xfs_perag	*pag)
+{
+	xfs_sb_t		*sbp = &mp->m_sb;
+	xfs_agnumber_t		max_metadata;
+	xfs_agino_t		agino;
+	__uint64_t		icount;
+
+	if (!(mp->m_flags & XFS_MOUNT_32BITINODES)) {
+		pag->pagi_inodeok = 1;
+		return;
+	}
+
+	agino = XFS_OFFBNO_TO_AGINO(mp, sbp->sb_agblocks - 1, 0);
+	if (XFS_AGINO_TO_INO(mp, pag->pag_agno, agino) > XFS_MAXINUMBER_32)
+		return;
+	pag->pagi_inodeok = 1;
+
+	/*
+	 * Calculate how much should be reserved for inodes to meet
+	 * the max inode percentage.
+	 */
+	if (mp->m_maxicount) {
+		icount = sbp->sb_dblocks * sbp->sb_imax_pct;
+		do_div(icount, 100);
+		icount += sbp->sb_agblocks - 1;
+		do_div(icount, sbp->sb_agblocks);
+		max_metadata = icount;
+	} else {
+		max_metadata = sbp->sb_agcount;
+	}
+	if (pag->pag_agno < max_metadata)
+		pag->pagf_metadata = 1;
+}
+
+/*
+ * Look up the per-AG structure for @agno for xfs_perag_get, setting it up if
+ * this is the first time.
+ */
+struct xfs_perag *
+libxfs_perag_lookup(
+	struct xfs_mount	*mp,
+	xfs_agnumber_t		agno)
+{
+	struct xfs_perag	*pag;
+
+	if (agno >= mp->m_perag_nslots)
+		return NULL;
+	pag = __atomic_load_n(&mp->m_perag_slots[agno], __ATOMIC_ACQUIRE);
+	if (pag)
+		return pag;
+
+	pthread_mutex_lock(&mp->m_perag_lock);
+	pag = mp->m_perag_slots[agno];
+	if (pag)
+		goto out;
+
+	pag = kmem_zalloc(sizeof(*pag), KM_MAYFAIL);
+	if (!pag)
+		goto out;
+	pag->pag_agno = agno;
+	pag->pag_mount = mp;
+	libxfs_perag_set_flags(mp, pag);
+
+	if (radix_tree_insert(&mp->m_perag_tree, agno, pag)) {
+		kmem_free(pag);
+		pag = NULL;
+		goto out;
+	}
+	__atomic_store_n(&mp->m_perag_slots[agno], pag, __ATOMIC_RELEASE);
+out:
+	pthread_mutex_unlock(&mp->m_perag_lock);
+	return pag;
+}
+
 static int
 libxfs_initialize_perag(
 	xfs_mount_t	*mp,
 	xfs_agnumber_t	agcount,
 	xfs_agnumber_t	*maxagi)
 {
-	xfs_agnumber_t	index, max_metadata;
-	xfs_agnumber_t	first_initialised = 0;
-	xfs_perag_t	*pag;
+	xfs_agnumber_t	index;
 	xfs_agino_t	agino;
 	xfs_ino_t	ino;
 	xfs_sb_t	*sbp = &mp->m_sb;
-	int		error = -ENOMEM;
-
-	/*
-	 * Walk the current per-ag tree so we don't try to initialise AGs
-	 * that already exist (growfs case). Allocate and insert all the
-	 * AGs we don't find ready for initialisation.
-	 */
-	for (index = 0; index < agcount; index++) {
-		pag = xfs_perag_get(mp, index);
-		if (pag) {
-			xfs_perag_put(pag);
-			continue;
-		}
-		if (!first_initialised)
-			first_initialised = index;
-
-		pag = kmem_zalloc(sizeof(*pag), KM_MAYFAIL);
-		if (!pag)
-			goto out_unwind;
-		pag->pag_agno = index;
-		pag->pag_mount = mp;
-
-		if (radix_tree_insert(&mp->m_perag_tree, index, pag)) {
-			error = -EEXIST;
-			goto out_unwind;
-		}
-	}
 
 	/*
 	 * If we mount with the inode64 option, or no inode overflows
@@ -540,41 +679,14 @@ libxfs_initialize_perag(
 	else
 		mp->m_flags &= ~XFS_MOUNT_32BITINODES;
 
+	index = agcount;
 	if (mp->m_flags & XFS_MOUNT_32BITINODES) {
-		/*
-		 * Calculate how much should be reserved for inodes to meet
-		 * the max inode percentage.
-		 */
-		if (mp->m_maxicount) {
-			__uint64_t	icount;
-
-			icount = sbp->sb_dblocks * sbp->sb_imax_pct;
-			do_div(icount, 100);
-			icount += sbp->sb_agblocks - 1;
-			do_div(icount, sbp->sb_agblocks);
-			max_metadata = icount;
-		} else {
-			max_metadata = agcount;
-		}
-
 		for (index = 0; index < agcount; index++) {
 			ino = XFS_AGINO_TO_INO(mp, index, agino);
 			if (ino > XFS_MAXINUMBER_32) {
 				index++;
 				break;
 			}
-
-			pag = xfs_perag_get(mp, index);
-			pag->pagi_inodeok = 1;
-			if (index < max_metadata)
-				pag->pagf_metadata = 1;
-			xfs_perag_put(pag);
-		}
-	} else {
-		for (index = 0; index < agcount; index++) {
-			pag = xfs_perag_get(mp, index);
-			pag->pagi_inodeok = 1;
-			xfs_perag_put(pag);
 		}
 	}
 
@@ -583,14 +695,6 @@ libxfs_initialize_perag(
 
 	mp->m_ag_prealloc_blocks = xfs_prealloc_blocks(mp);
 	return 0;
-
-out_unwind:
-	kmem_free(pag);
-	for (; index > first_initialised; index--) {
-		pag = radix_tree_delete(&mp->m_perag_tree, index);
-		kmem_free(pag);
-	}
-	return error;
 }
 
 static struct xfs_buftarg *
@@ -683,6 +787,10 @@ libxfs_mount(
 	mp->m_flags = (LIBXFS_MOUNT_32BITINODES|LIBXFS_MOUNT_32BITINOOPT);
 	mp->m_sb = *sb;
 	INIT_RADIX_TREE(&mp->m_perag_tree, GFP_KERNEL);
+	mp->m_perag_nslots = sb->sb_agcount;
+	mp->m_perag_slots = kmem_zalloc(sb->sb_agcount *
+					sizeof(struct xfs_perag *), 0);
+	pthread_mutex_init(&mp->m_perag_lock, NULL);
 	sbp = &(mp->m_sb);
 
 	xfs_sb_mount_common(mp, sb);
@@ -825,11 +933,11 @@ libxfs_mount(
 	}
 
 	/*
-	 * libxfs_initialize_perag will allocate a perag structure for each ag.
-	 * If agcount is corrupted and insanely high, this will OOM the box.
-	 * If the agount seems (arbitrarily) high, try to read what would be
-	 * the last AG, and if that fails for a relatively high agcount, just
-	 * read the first one and let the user know to check the geometry.
+	 * If agcount is corrupted and insanely high, tools that walk every
+	 * AG will take forever. If the agount seems (arbitrarily) high, try
+	 * to read what would be the last AG, and if that fails for a
+	 * relatively high agcount, just read the first one and let the user
+	 * know to check the geometry.
 	 */
 	if (sbp->sb_agcount > 1000000) {
 		bp = libxfs_readbuf(mp->m_dev,
@@ -877,12 +985,20 @@ libxfs_umount(xfs_mount_t *mp)
 	int			agno;
 
 	libxfs_rtmount_destroy(mp);
-	libxfs_bcache_purge();
+	/* mounts made just for the geometry may have no buffer cache */
+	if (libxfs_bcache)
+		libxfs_bcache_purge();
 
-	for (agno = 0; agno < mp->m_maxagi; agno++) {
+	for (agno = 0; agno < mp->m_perag_nslots; agno++) {
+		if (!mp->m_perag_slots[agno])
+			continue;
 		pag = radix_tree_delete(&mp->m_perag_tree, agno);
 		kmem_free(pag);
 	}
+	kmem_free(mp->m_perag_slots);
+	mp->m_perag_slots = NULL;
+	mp->m_perag_nslots = 0;
+	pthread_mutex_destroy(&mp->m_perag_lock);
 
 	kmem_free(mp->m_attr_geo);
 	kmem_free(mp->m_dir_geo);
@@ -917,6 +1033,7 @@ libxfs_report(FILE *fp)
 	char *c;
 
 	cache_report(fp, "libxfs_bcache", libxfs_bcache);
+	libxfs_buf_type_report(fp);
 
 	t = time(NULL);
 	c = asctime(localtime(&t));
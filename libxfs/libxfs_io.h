@@ -202,6 +202,7 @@ extern void	libxfs_bcache_flush(void);
 extern void	libxfs_purgebuf(xfs_buf_t *);
 extern int	libxfs_bcache_overflowed(void);
 extern int	libxfs_bcache_usage(void);
+extern void	libxfs_buf_type_report(FILE *);
 
 /* Buffer (Raw) Interfaces */
 extern xfs_buf_t *libxfs_getbufr(struct xfs_buftarg *, xfs_daddr_t, int);
@@ -211,11 +212,25 @@ extern int	libxfs_writebuf_int(xfs_buf_t *, int);
 extern int	libxfs_writebufr(struct xfs_buf *);
 extern int	libxfs_readbufr(struct xfs_buftarg *, xfs_daddr_t, xfs_buf_t *, int, int);
 extern int	libxfs_readbufr_map(struct xfs_buftarg *, struct xfs_buf *, int);
+extern int	libxfs_writebufr_verify(struct xfs_buf *);
+extern void	libxfs_buf_ioend(struct xfs_buf *, int, int);
 
 extern int	libxfs_device_zero(struct xfs_buftarg *, xfs_daddr_t, uint);
 
 extern int libxfs_bhash_size;
 
+/* Asynchronous Buffer I/O Interfaces */
+struct xfs_aio_ctx;
+
+extern struct xfs_aio_ctx *libxfs_aio_init(struct xfs_buftarg *, int);
+extern void	libxfs_aio_destroy(struct xfs_aio_ctx *);
+extern bool	libxfs_aio_is_async(struct xfs_aio_ctx *);
+extern int	libxfs_aio_inflight(struct xfs_aio_ctx *);
+extern int	libxfs_aio_submit(struct xfs_aio_ctx *, struct xfs_buf **, int,
+				  int, int);
+extern int	libxfs_aio_reap(struct xfs_aio_ctx *, struct xfs_buf **, int,
+				int);
+
 #define LIBXFS_BREAD	0x1
 #define LIBXFS_BWRITE	0x2
 #define LIBXFS_BZERO	0x4
@@ -229,6 +244,9 @@ xfs_buf_verify_cksum(struct xfs_buf *bp, unsigned long cksum_offset)
 				cksum_offset);
 }
 
+extern int	libxfs_verify_cksums(char **buffers, int nr, size_t length,
+				     unsigned long cksum_offset, bool *good);
+
 static inline void
 xfs_buf_update_cksum(struct xfs_buf *bp, unsigned long cksum_offset)
 {
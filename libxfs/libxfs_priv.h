@@ -69,6 +69,8 @@
 /* CRC stuff, buffer API dependent on it */
 extern uint32_t crc32_le(uint32_t crc, unsigned char const *p, size_t len);
 extern uint32_t crc32c_le(uint32_t crc, unsigned char const *p, size_t len);
+extern void crc32c_le_multi(uint32_t *crc, unsigned char const *const *p,
+			    size_t len, unsigned int nr);
 
 #define crc32(c,p,l)	crc32_le((c),(unsigned char const *)(p),(l))
 #define crc32c(c,p,l)	crc32c_le((c),(unsigned char const *)(p),(l))
@@ -441,6 +443,9 @@ void xfs_bmap_del_free(struct xfs_bmap_free *, struct xfs_bmap_free_item *);
 int xfs_initialize_perag_data(struct xfs_mount *, xfs_agnumber_t);
 void xfs_mount_common(struct xfs_mount *, struct xfs_sb *);
 
+/* init.c, per-AG structures are set up the first time they are looked up */
+struct xfs_perag *libxfs_perag_lookup(struct xfs_mount *, xfs_agnumber_t);
+
 /*
  * logitem.c and trans.c prototypes
  */
@@ -0,0 +1,787 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>.  All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "libxfs_priv.h"
+#include "xfs_fs.h"
+#include "xfs_shared.h"
+#include "xfs_format.h"
+#include "xfs_cksum.h"
+#include "xfs_metadump.h"
+
+/*
+ * Metadump images as read-only devices.
+ *
+ * Rather than restoring a metadump into a (sparse) filesystem image before
+ * looking at it, libxfs_device_open() can hand a v1 or v2 image to this
+ * code and serve reads of the filesystem straight out of it. The image is
+ * scanned once at open time to build an index of the disk extents it holds,
+ * sorted by disk address; reads copy from the image where the index has
+ * data and return zeroes everywhere else, exactly as a restore would have
+ * left the target.
+ *
+ * v1 images store sectors uncompressed, so an extent maps straight onto a
+ * range of the image file. v2 extents live in compressed frames; the frames
+ * needed by a read are decoded into a small cache, so walking a btree or a
+ * directory doesn't decompress the same frame for every block. The cache
+ * lock only covers finding or claiming a slot: frames are read and decoded,
+ * and data copied out of them, with the lock dropped, so threads reading
+ * different frames don't wait on each other's decompression.
+ *
+ * v2 delta images can be stacked on top of the image they were taken
+ * against. Their extents simply come later in the index than the base's,
+ * so they win wherever both hold a sector, just as they would on restore.
+ */
+
+#define MDI_NONE		(-1)	/* extent is stored raw (v1) */
+#define MDI_FCACHE_SLOTS	16	/* decoded v2 frames kept */
+
+struct mdi_extent {
+	__uint64_t		me_daddr;	/* first sector */
+	__uint64_t		me_len;		/* in sectors */
+	__uint64_t		me_off;		/* in file or frame, bytes */
+	int			me_frame;	/* v2 frame, or MDI_NONE */
+	int			me_seq;		/* order in the image */
+};
+
+struct mdi_frame {
+	int			mf_fd;		/* image file it is in */
+	off64_t			mf_off;		/* of the payload */
+	struct xfs_md2_frame	mf_hdr;
+};
+
+struct mdi_fslot {
+	int			fs_frame;	/* cached frame, or MDI_NONE */
+	int			fs_users;	/* copying out of or filling it */
+	bool			fs_filling;	/* fs_data not decoded yet */
+	char			*fs_data;
+	char			*fs_zbuf;	/* encoded payload */
+};
+
+struct xfs_mdimage {
+	int			mi_fd;		/* base image */
+	int			*mi_deltas;	/* stacked delta images */
+	int			mi_ndeltas;
+	__uint64_t		mi_id;		/* of the newest image */
+	__uint64_t		mi_size;	/* of the filesystem, bytes */
+	struct mdi_extent	*mi_ext;	/* sorted, no overlaps */
+	int			mi_next;
+	int			mi_maxext;
+	int			mi_seq;		/* next extent's me_seq */
+	struct mdi_frame	*mi_frames;
+	int			mi_nframes;
+
+	bool			mi_v2;		/* base image is v2 */
+
+	pthread_mutex_t		mi_lock;	/* protects the frame cache */
+	pthread_cond_t		mi_fcwait;	/* slot filled or released */
+	struct mdi_fslot	mi_fcache[MDI_FCACHE_SLOTS];
+	int			mi_fclock;	/* next slot to replace */
+};
+
+/*
+ * Say why an image can't be used. Problems with an image are never fatal
+ * here: xfs_db can be handed a bad one interactively, and has to carry on.
+ */
+static int
+mdi_error(
+	const char		*path,
+	const char		*msg)
+{
+	fprintf(stderr, _("%s: metadump image %s: %s\n"),
+		progname, path, msg);
+	return -1;
+}
+
+static int
+mdi_read(
+	int			fd,
+	const char		*path,
+	void			*buf,
+	size_t			len,
+	off64_t			off)
+{
+	ssize_t			ret = pread(fd, buf, len, off);
+
+	if (ret < 0)
+		return mdi_error(path, strerror(errno));
+	if (ret != len)
+		return mdi_error(path, _("image is truncated"));
+	return 0;
+}
+
+static int
+mdi_add_extent(
+	struct xfs_mdimage	*mi,
+	const char		*path,
+	__uint64_t		daddr,
+	__uint64_t		len,
+	__uint64_t		off,
+	int			frame)
+{
+	struct mdi_extent	*e = mi->mi_next ? &mi->mi_ext[mi->mi_next - 1]
+						 : NULL;
+
+	/* runs of sectors contiguous on disk and in the image merge */
+	if (e && e->me_frame == frame &&
+	    e->me_daddr + e->me_len == daddr &&
+	    e->me_off + BBTOB(e->me_len) == off) {
+		e->me_len += len;
+		return 0;
+	}
+
+	if (mi->mi_next == mi->mi_maxext) {
+		mi->mi_maxext = mi->mi_maxext ? mi->mi_maxext * 2 : 1024;
+		e = realloc(mi->mi_ext, mi->mi_maxext * sizeof(*e));
+		if (!e)
+			return mdi_error(path, strerror(ENOMEM));
+		mi->mi_ext = e;
+	}
+	e = &mi->mi_ext[mi->mi_next++];
+	e->me_daddr = daddr;
+	e->me_len = len;
+	e->me_off = off;
+	e->me_frame = frame;
+	e->me_seq = mi->mi_seq++;
+	return 0;
+}
+
+static int
+mdi_scan_v1(
+	struct xfs_mdimage	*mi,
+	const char		*path,
+	struct xfs_metablock	*tmb)
+{
+	struct xfs_metablock	*mb;
+	__be64			*index;
+	off64_t			pos = 0;
+	int			block_size = 1 << tmb->mb_blocklog;
+	int			max_indices;
+	int			mb_count;
+	int			error = 0;
+	int			i;
+
+	if (tmb->mb_blocklog < BBSHIFT || tmb->mb_blocklog > 16)
+		return mdi_error(path, _("bad block size"));
+	max_indices = (block_size - sizeof(*tmb)) / sizeof(__be64);
+	mb = malloc(block_size);
+	if (!mb)
+		return mdi_error(path, strerror(ENOMEM));
+	index = (__be64 *)((char *)mb + sizeof(*mb));
+
+	for (;;) {
+		error = mdi_read(mi->mi_fd, path, mb, block_size, pos);
+		if (error)
+			break;
+		if (be32_to_cpu(mb->mb_magic) != XFS_MD_MAGIC) {
+			error = mdi_error(path, _("bad metablock magic number"));
+			break;
+		}
+		mb_count = be16_to_cpu(mb->mb_count);
+		if (mb_count > max_indices) {
+			error = mdi_error(path, _("bad metablock block count"));
+			break;
+		}
+		pos += block_size;
+
+		for (i = 0; !error && i < mb_count; i++) {
+			error = mdi_add_extent(mi, path, be64_to_cpu(index[i]),
+				       block_size >> BBSHIFT, pos, MDI_NONE);
+			pos += block_size;
+		}
+		if (error || mb_count < max_indices)
+			break;
+	}
+	free(mb);
+	return error;
+}
+
+static int
+mdi_scan_v2(
+	struct xfs_mdimage	*mi,
+	const char		*path,
+	int			fd)
+{
+	struct xfs_md2_extent	*ext;
+	struct mdi_frame	*f;
+	off64_t			pos = sizeof(struct xfs_md2_header);
+	__uint64_t		off;
+	int			maxframes = mi->mi_nframes;
+	int			nextents;
+	int			error = 0;
+	int			i;
+
+	ext = calloc(XFS_MD2_FRAME_EXTENTS, sizeof(*ext));
+	if (!ext)
+		return mdi_error(path, strerror(ENOMEM));
+
+	for (;;) {
+		if (mi->mi_nframes == maxframes) {
+			maxframes = maxframes ? maxframes * 2 : 256;
+			f = realloc(mi->mi_frames, maxframes * sizeof(*f));
+			if (!f) {
+				error = mdi_error(path, strerror(ENOMEM));
+				break;
+			}
+			mi->mi_frames = f;
+		}
+		f = &mi->mi_frames[mi->mi_nframes];
+		f->mf_fd = fd;
+
+		error = mdi_read(fd, path, &f->mf_hdr, sizeof(f->mf_hdr), pos);
+		if (error)
+			break;
+		if (libxfs_md2_frame_check(&f->mf_hdr)) {
+			error = mdi_error(path, _("bad frame header"));
+			break;
+		}
+		nextents = be16_to_cpu(f->mf_hdr.mf_nextents);
+		if (!nextents)
+			break;
+		pos += sizeof(f->mf_hdr);
+
+		error = mdi_read(fd, path, ext, nextents * sizeof(*ext), pos);
+		if (error)
+			break;
+		if (libxfs_md2_index_check(&f->mf_hdr, ext)) {
+			error = mdi_error(path, _("bad frame index"));
+			break;
+		}
+		pos += nextents * sizeof(*ext);
+
+		for (i = 0, off = 0; !error && i < nextents; i++) {
+			__uint64_t	len = be32_to_cpu(ext[i].me_len);
+
+			error = mdi_add_extent(mi, path,
+					be64_to_cpu(ext[i].me_daddr),
+					len, off, mi->mi_nframes);
+			off += BBTOB(len);
+		}
+		if (error)
+			break;
+		f->mf_off = pos;
+		pos += be32_to_cpu(f->mf_hdr.mf_zlen);
+		mi->mi_nframes++;
+	}
+	free(ext);
+	return error;
+}
+
+static int
+mdi_extent_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct mdi_extent	*ea = a;
+	const struct mdi_extent	*eb = b;
+
+	if (ea->me_daddr != eb->me_daddr)
+		return ea->me_daddr < eb->me_daddr ? -1 : 1;
+	return ea->me_seq - eb->me_seq;
+}
+
+static int
+mdi_u64_cmp(
+	const void		*a,
+	const void		*b)
+{
+	__uint64_t		ua = *(const __uint64_t *)a;
+	__uint64_t		ub = *(const __uint64_t *)b;
+
+	return ua < ub ? -1 : ua > ub;
+}
+
+/* max-heap of extent indices, by image order */
+static void
+mdi_heap_push(
+	struct mdi_extent	*ext,
+	int			*heap,
+	int			*n,
+	int			e)
+{
+	int			i = (*n)++;
+
+	while (i && ext[heap[(i - 1) / 2]].me_seq < ext[e].me_seq) {
+		heap[i] = heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	heap[i] = e;
+}
+
+static void
+mdi_heap_pop(
+	struct mdi_extent	*ext,
+	int			*heap,
+	int			*n)
+{
+	int			e = heap[--(*n)];
+	int			i = 0;
+	int			c;
+
+	while ((c = 2 * i + 1) < *n) {
+		if (c + 1 < *n && ext[heap[c + 1]].me_seq > ext[heap[c]].me_seq)
+			c++;
+		if (ext[heap[c]].me_seq <= ext[e].me_seq)
+			break;
+		heap[i] = heap[c];
+		i = c;
+	}
+	heap[i] = e;
+}
+
+/*
+ * A sector can be in an image more than once, in which case the last copy
+ * is the one a restore would leave behind. Split the (sorted) extents at
+ * every extent boundary and give each piece to the newest extent covering
+ * it, then merge the pieces back up.
+ */
+static int
+mdi_resolve_overlaps(
+	struct xfs_mdimage	*mi,
+	const char		*path)
+{
+	struct mdi_extent	*ext = mi->mi_ext;
+	struct mdi_extent	*out;
+	__uint64_t		*pts;
+	int			*heap;
+	int			npts = 0;
+	int			nheap = 0;
+	int			nout = 0;
+	int			i, j, k;
+
+	pts = malloc(2 * mi->mi_next * sizeof(*pts));
+	heap = malloc(mi->mi_next * sizeof(*heap));
+	out = malloc(2 * mi->mi_next * sizeof(*out));
+	if (!pts || !heap || !out) {
+		free(pts);
+		free(heap);
+		free(out);
+		return mdi_error(path, strerror(ENOMEM));
+	}
+
+	for (i = 0; i < mi->mi_next; i++) {
+		pts[npts++] = ext[i].me_daddr;
+		pts[npts++] = ext[i].me_daddr + ext[i].me_len;
+	}
+	qsort(pts, npts, sizeof(*pts), mdi_u64_cmp);
+
+	for (k = 0, j = 0; k < npts - 1; k++) {
+		__uint64_t		p = pts[k];
+		__uint64_t		q = pts[k + 1];
+		struct mdi_extent	*w;
+		struct mdi_extent	*o;
+
+		if (p == q)
+			continue;
+		while (j < mi->mi_next && ext[j].me_daddr <= p)
+			mdi_heap_push(ext, heap, &nheap, j++);
+		while (nheap &&
+		       ext[heap[0]].me_daddr + ext[heap[0]].me_len <= p)
+			mdi_heap_pop(ext, heap, &nheap);
+		if (!nheap)
+			continue;
+
+		w = &ext[heap[0]];
+		o = nout ? &out[nout - 1] : NULL;
+		if (o && o->me_seq == w->me_seq &&
+		    o->me_daddr + o->me_len == p) {
+			o->me_len += q - p;
+			continue;
+		}
+		o = &out[nout++];
+		*o = *w;
+		o->me_daddr = p;
+		o->me_len = q - p;
+		o->me_off = w->me_off + BBTOB(p - w->me_daddr);
+	}
+
+	free(pts);
+	free(heap);
+	free(mi->mi_ext);
+	mi->mi_ext = out;
+	mi->mi_maxext = 2 * mi->mi_next;
+	mi->mi_next = nout;
+	return 0;
+}
+
+static int
+mdi_build_index(
+	struct xfs_mdimage	*mi,
+	const char		*path)
+{
+	int			i;
+
+	qsort(mi->mi_ext, mi->mi_next, sizeof(*mi->mi_ext), mdi_extent_cmp);
+	for (i = 1; i < mi->mi_next; i++) {
+		if (mi->mi_ext[i].me_daddr <
+		    mi->mi_ext[i - 1].me_daddr + mi->mi_ext[i - 1].me_len)
+			return mdi_resolve_overlaps(mi, path);
+	}
+	return 0;
+}
+
+/* the device is as big as the (newest) filesystem in it */
+static int
+mdi_set_size(
+	struct xfs_mdimage	*mi,
+	const char		*path)
+{
+	struct xfs_dsb		dsb;
+
+	if (!mi->mi_next || mi->mi_ext[0].me_daddr != XFS_SB_DADDR)
+		return mdi_error(path, _("no primary superblock"));
+	mi->mi_size = BBTOB(mi->mi_ext[0].me_len);
+	if (libxfs_mdimage_pread(mi, &dsb, sizeof(dsb), 0) != sizeof(dsb) ||
+	    be32_to_cpu(dsb.sb_magicnum) != XFS_SB_MAGIC)
+		return mdi_error(path, _("bad primary superblock"));
+	mi->mi_size = be64_to_cpu(dsb.sb_dblocks) *
+		      be32_to_cpu(dsb.sb_blocksize);
+	return 0;
+}
+
+static int
+mdi_read_header(
+	int			fd,
+	const char		*path,
+	struct xfs_md2_header	*hdr)
+{
+	if (mdi_read(fd, path, hdr, sizeof(*hdr), 0))
+		return -1;
+	if (be32_to_cpu(hdr->mh_magic) != XFS_MD2_MAGIC)
+		return mdi_error(path, _("not a version 2 metadump"));
+	if (be32_to_cpu(hdr->mh_version) != XFS_MD2_VERSION)
+		return mdi_error(path, _("unsupported metadump version"));
+	return 0;
+}
+
+/*
+ * Open @path as a metadump image if it is one. Returns 0 with *@mip set to
+ * the image, or to NULL if the file isn't a metadump; returns nonzero if it
+ * is a metadump that can't be used.
+ */
+int
+libxfs_mdimage_open(
+	const char		*path,
+	struct xfs_mdimage	**mip)
+{
+	struct xfs_mdimage	*mi;
+	struct xfs_metablock	tmb;
+	int			error;
+	int			fd;
+	int			i;
+
+	*mip = NULL;
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	if (pread(fd, &tmb, sizeof(tmb), 0) != sizeof(tmb) ||
+	    (be32_to_cpu(tmb.mb_magic) != XFS_MD_MAGIC &&
+	     be32_to_cpu(tmb.mb_magic) != XFS_MD2_MAGIC)) {
+		close(fd);
+		return 0;
+	}
+
+	mi = calloc(1, sizeof(*mi));
+	if (!mi) {
+		close(fd);
+		return mdi_error(path, strerror(ENOMEM));
+	}
+	mi->mi_fd = fd;
+	pthread_mutex_init(&mi->mi_lock, NULL);
+	pthread_cond_init(&mi->mi_fcwait, NULL);
+	for (i = 0; i < MDI_FCACHE_SLOTS; i++)
+		mi->mi_fcache[i].fs_frame = MDI_NONE;
+
+	if (be32_to_cpu(tmb.mb_magic) == XFS_MD_MAGIC) {
+		error = mdi_scan_v1(mi, path, &tmb);
+	} else {
+		struct xfs_md2_header	hdr;
+
+		error = mdi_read_header(fd, path, &hdr);
+		if (!error && (be32_to_cpu(hdr.mh_info) & XFS_METADUMP_DELTA))
+			error = mdi_error(path,
+		_("delta image, it can only be used on top of its base"));
+		if (!error) {
+			mi->mi_v2 = true;
+			mi->mi_id = be64_to_cpu(hdr.mh_id);
+			error = mdi_scan_v2(mi, path, fd);
+		}
+	}
+	if (!error)
+		error = mdi_build_index(mi, path);
+	if (!error)
+		error = mdi_set_size(mi, path);
+	if (error) {
+		libxfs_mdimage_close(mi);
+		return error;
+	}
+	*mip = mi;
+	return 0;
+}
+
+/*
+ * Stack the delta image @path on top of @mi, which must hold the image it
+ * was taken against (and that image's own base, and so on). If that fails,
+ * @mi may only be closed.
+ */
+int
+libxfs_mdimage_stack(
+	struct xfs_mdimage	*mi,
+	const char		*path)
+{
+	struct xfs_md2_header	hdr;
+	int			*deltas;
+	int			error;
+	int			fd;
+
+	if (!mi->mi_v2)
+		return mdi_error(path, _("a delta needs a version 2 base image"));
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return mdi_error(path, strerror(errno));
+	error = mdi_read_header(fd, path, &hdr);
+	if (!error && !(be32_to_cpu(hdr.mh_info) & XFS_METADUMP_DELTA))
+		error = mdi_error(path, _("not a delta image"));
+	if (!error && be64_to_cpu(hdr.mh_base) != mi->mi_id)
+		error = mdi_error(path, _("not a delta of the preceding image"));
+	if (error) {
+		close(fd);
+		return error;
+	}
+
+	deltas = realloc(mi->mi_deltas, (mi->mi_ndeltas + 1) * sizeof(int));
+	if (!deltas) {
+		close(fd);
+		return mdi_error(path, strerror(ENOMEM));
+	}
+	mi->mi_deltas = deltas;
+	mi->mi_deltas[mi->mi_ndeltas++] = fd;
+	mi->mi_id = be64_to_cpu(hdr.mh_id);
+
+	/* the frame cache is indexed by frame number, which doesn't change */
+	error = mdi_scan_v2(mi, path, fd);
+	if (!error)
+		error = mdi_build_index(mi, path);
+	if (!error)
+		error = mdi_set_size(mi, path);
+	return error;
+}
+
+void
+libxfs_mdimage_close(
+	struct xfs_mdimage	*mi)
+{
+	int			i;
+
+	if (!mi)
+		return;
+	for (i = 0; i < MDI_FCACHE_SLOTS; i++) {
+		free(mi->mi_fcache[i].fs_data);
+		free(mi->mi_fcache[i].fs_zbuf);
+	}
+	pthread_cond_destroy(&mi->mi_fcwait);
+	pthread_mutex_destroy(&mi->mi_lock);
+	close(mi->mi_fd);
+	for (i = 0; i < mi->mi_ndeltas; i++)
+		close(mi->mi_deltas[i]);
+	free(mi->mi_deltas);
+	free(mi->mi_frames);
+	free(mi->mi_ext);
+	free(mi);
+}
+
+__uint64_t
+libxfs_mdimage_size(
+	struct xfs_mdimage	*mi)
+{
+	return mi->mi_size;
+}
+
+/* mh_id of the newest image in the stack, which a new delta is taken of */
+__uint64_t
+libxfs_mdimage_id(
+	struct xfs_mdimage	*mi)
+{
+	return mi->mi_id;
+}
+
+/*
+ * Find the cache slot holding v2 frame @frame, or claim one to decode it
+ * into and set *@fill, and take a reference to it. Returns NULL if every
+ * slot is in use. Call with mi_lock held.
+ */
+static struct mdi_fslot *
+mdi_grab_slot(
+	struct xfs_mdimage	*mi,
+	int			frame,
+	bool			*fill)
+{
+	struct mdi_fslot	*fs;
+	int			i;
+
+	for (i = 0; i < MDI_FCACHE_SLOTS; i++) {
+		fs = &mi->mi_fcache[i];
+		if (fs->fs_frame == frame) {
+			fs->fs_users++;
+			*fill = false;
+			return fs;
+		}
+	}
+
+	for (i = 0; i < MDI_FCACHE_SLOTS; i++) {
+		fs = &mi->mi_fcache[mi->mi_fclock];
+		mi->mi_fclock = (mi->mi_fclock + 1) % MDI_FCACHE_SLOTS;
+		if (fs->fs_users)
+			continue;
+		fs->fs_frame = frame;
+		fs->fs_filling = true;
+		fs->fs_users = 1;
+		*fill = true;
+		return fs;
+	}
+	return NULL;
+}
+
+/*
+ * Read, check and decode a v2 frame into the slot claimed for it.
+ */
+static int
+mdi_fill_slot(
+	struct xfs_mdimage	*mi,
+	struct mdi_fslot	*fs)
+{
+	struct mdi_frame	*f = &mi->mi_frames[fs->fs_frame];
+	size_t			zlen = be32_to_cpu(f->mf_hdr.mf_zlen);
+
+	if (!fs->fs_data)
+		fs->fs_data = malloc(XFS_MD2_FRAME_BYTES);
+	if (!fs->fs_zbuf)
+		fs->fs_zbuf = malloc(libxfs_md2_bound(XFS_MD2_FRAME_BYTES));
+	if (!fs->fs_data || !fs->fs_zbuf)
+		return -1;
+
+	if (pread(f->mf_fd, fs->fs_zbuf, zlen, f->mf_off) != zlen ||
+	    crc32c(XFS_CRC_SEED, fs->fs_zbuf, zlen) !=
+			be32_to_cpu(f->mf_hdr.mf_crc) ||
+	    libxfs_md2_decompress(f->mf_hdr.mf_codec, fs->fs_data,
+			be32_to_cpu(f->mf_hdr.mf_len), fs->fs_zbuf, zlen))
+		return -1;
+	return 0;
+}
+
+static int
+mdi_copy(
+	struct xfs_mdimage	*mi,
+	struct mdi_extent	*e,
+	char			*buf,
+	size_t			len,
+	__uint64_t		off)
+{
+	struct mdi_fslot	*fs;
+	bool			fill;
+	int			error = 0;
+
+	if (e->me_frame == MDI_NONE)
+		return pread(mi->mi_fd, buf, len, e->me_off + off) == len ?
+			0 : -1;
+
+	pthread_mutex_lock(&mi->mi_lock);
+	while (!(fs = mdi_grab_slot(mi, e->me_frame, &fill)))
+		pthread_cond_wait(&mi->mi_fcwait, &mi->mi_lock);
+
+	if (fill) {
+		/* others wait for fs_filling to clear before using it */
+		pthread_mutex_unlock(&mi->mi_lock);
+		error = mdi_fill_slot(mi, fs);
+		pthread_mutex_lock(&mi->mi_lock);
+		fs->fs_filling = false;
+		if (error)
+			fs->fs_frame = MDI_NONE;
+		pthread_cond_broadcast(&mi->mi_fcwait);
+	} else {
+		while (fs->fs_filling)
+			pthread_cond_wait(&mi->mi_fcwait, &mi->mi_lock);
+		if (fs->fs_frame != e->me_frame)
+			error = -1;
+	}
+	pthread_mutex_unlock(&mi->mi_lock);
+
+	if (!error)
+		memcpy(buf, fs->fs_data + e->me_off + off, len);
+
+	pthread_mutex_lock(&mi->mi_lock);
+	if (--fs->fs_users == 0)
+		pthread_cond_broadcast(&mi->mi_fcwait);
+	pthread_mutex_unlock(&mi->mi_lock);
+	return error;
+}
+
+/*
+ * pread(2) from the filesystem in the image: sectors the image holds come
+ * from the image, the rest read as zeroes. Reads are cut short at the end
+ * of the filesystem.
+ */
+ssize_t
+libxfs_mdimage_pread(
+	struct xfs_mdimage	*mi,
+	void			*buf,
+	size_t			len,
+	off64_t			offset)
+{
+	struct mdi_extent	*e;
+	__uint64_t		start = offset;
+	__uint64_t		end;
+	int			lo = 0;
+	int			hi = mi->mi_next;
+
+	if (offset < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (start >= mi->mi_size)
+		return 0;
+	len = min_t(__uint64_t, len, mi->mi_size - start);
+	end = start + len;
+	memset(buf, 0, len);
+
+	/* first extent ending beyond the start of the read */
+	while (lo < hi) {
+		int	mid = (lo + hi) / 2;
+
+		e = &mi->mi_ext[mid];
+		if (BBTOB(e->me_daddr + e->me_len) <= start)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (e = &mi->mi_ext[lo];
+	     e < &mi->mi_ext[mi->mi_next] && BBTOB(e->me_daddr) < end; e++) {
+		__uint64_t	s = BBTOB(e->me_daddr);
+		__uint64_t	t = BBTOB(e->me_daddr + e->me_len);
+
+		s = max(s, start);
+		t = min(t, end);
+
+		if (mdi_copy(mi, e, (char *)buf + (s - start), t - s,
+			     s - BBTOB(e->me_daddr))) {
+			errno = EIO;
+			return -1;
+		}
+	}
+	return len;
+}
@@ -0,0 +1,166 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>.  All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "libxfs_priv.h"
+#include "xfs_cksum.h"
+#include "xfs_metadump.h"
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+/*
+ * Frame encoding for v2 metadump images, shared by xfs_metadump (in xfs_db)
+ * and xfs_mdrestore. The format itself is described in xfs_metadump.h.
+ */
+
+/*
+ * Largest payload that encoding @len bytes of extent data can produce.
+ */
+size_t
+libxfs_md2_bound(
+	size_t		len)
+{
+#ifdef HAVE_ZLIB
+	return max_t(size_t, len, compressBound(len));
+#else
+	return len;
+#endif
+}
+
+/*
+ * Try to compress @src_len bytes at @src into @dst, which has room for
+ * *@dst_len bytes (at least libxfs_md2_bound(@src_len)). Returns the codec
+ * the payload ended up encoded with and sets *@dst_len to the encoded
+ * length. If the data is better stored as it is (no compression support, or
+ * it didn't get any smaller), XFS_MD2_CODEC_NONE is returned, @dst is
+ * undefined and the caller writes out @src itself.
+ */
+int
+libxfs_md2_compress(
+	int		codec,
+	void		*dst,
+	size_t		*dst_len,
+	const void	*src,
+	size_t		src_len)
+{
+#ifdef HAVE_ZLIB
+	uLongf		zlen = *dst_len;
+
+	if (codec == XFS_MD2_CODEC_ZLIB &&
+	    compress2(dst, &zlen, src, src_len, Z_DEFAULT_COMPRESSION) == Z_OK &&
+	    zlen < src_len) {
+		*dst_len = zlen;
+		return XFS_MD2_CODEC_ZLIB;
+	}
+#endif
+	*dst_len = src_len;
+	return XFS_MD2_CODEC_NONE;
+}
+
+/*
+ * Decode a frame payload back into exactly @dst_len bytes of extent data.
+ * Returns 0 or a negative errno.
+ */
+int
+libxfs_md2_decompress(
+	int		codec,
+	void		*dst,
+	size_t		dst_len,
+	const void	*src,
+	size_t		src_len)
+{
+#ifdef HAVE_ZLIB
+	uLongf		len = dst_len;
+#endif
+
+	switch (codec) {
+	case XFS_MD2_CODEC_NONE:
+		if (src_len != dst_len)
+			return -EINVAL;
+		memcpy(dst, src, dst_len);
+		return 0;
+	case XFS_MD2_CODEC_ZLIB:
+#ifdef HAVE_ZLIB
+		if (uncompress(dst, &len, src, src_len) != Z_OK ||
+		    len != dst_len)
+			return -EINVAL;
+		return 0;
+#else
+		return -EOPNOTSUPP;
+#endif
+	default:
+		return -EINVAL;
+	}
+}
+
+/*
+ * Sanity check a frame header before trusting its lengths.
+ */
+int
+libxfs_md2_frame_check(
+	struct xfs_md2_frame	*frame)
+{
+	size_t			len = be32_to_cpu(frame->mf_len);
+	size_t			zlen = be32_to_cpu(frame->mf_zlen);
+
+	if (be32_to_cpu(frame->mf_magic) != XFS_MD2_FRAME_MAGIC)
+		return -EINVAL;
+	if (be16_to_cpu(frame->mf_nextents) > XFS_MD2_FRAME_EXTENTS ||
+	    len > XFS_MD2_FRAME_BYTES || (len & (BBSIZE - 1)))
+		return -EINVAL;
+	if (frame->mf_nextents == 0 && len != 0)
+		return -EINVAL;
+
+	switch (frame->mf_codec) {
+	case XFS_MD2_CODEC_NONE:
+		if (zlen != len)
+			return -EINVAL;
+		break;
+	case XFS_MD2_CODEC_ZLIB:
+		if (zlen > libxfs_md2_bound(len))
+			return -EINVAL;
+		break;
+	default:
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * Check the extent index of a frame against its checksum and its header.
+ */
+int
+libxfs_md2_index_check(
+	struct xfs_md2_frame	*frame,
+	struct xfs_md2_extent	*ext)
+{
+	int			nextents = be16_to_cpu(frame->mf_nextents);
+	__uint64_t		bbs = 0;
+	int			i;
+
+	if (crc32c(XFS_CRC_SEED, ext, nextents * sizeof(*ext)) !=
+	    be32_to_cpu(frame->mf_icrc))
+		return -EFSBADCRC;
+	for (i = 0; i < nextents; i++) {
+		if (ext[i].me_len == 0)
+			return -EINVAL;
+		bbs += be32_to_cpu(ext[i].me_len);
+	}
+	if (BBTOB(bbs) != be32_to_cpu(frame->mf_len))
+		return -EINVAL;
+	return 0;
+}
@@ -32,6 +32,10 @@
 
 #include "libxfs.h"		/* for LIBXFS_EXIT_ON_FAILURE */
 
+#ifdef HAVE_PREADV
+#include <sys/uio.h>
+#endif
+
 /*
  * Important design/architecture note:
  *
@@ -911,11 +915,11 @@ libxfs_balloc(cache_key_t key)
 
 
 static int
-__read_buf(int fd, void *buf, int len, off64_t offset, int flags)
+__read_buf(dev_t dev, void *buf, int len, off64_t offset, int flags)
 {
 	int	sts;
 
-	sts = pread(fd, buf, len, offset);
+	sts = libxfs_device_pread(dev, buf, len, offset);
 	if (sts < 0) {
 		int error = errno;
 		fprintf(stderr, _("%s: read failed: %s\n"),
@@ -937,13 +941,12 @@ int
 libxfs_readbufr(struct xfs_buftarg *btp, xfs_daddr_t blkno, xfs_buf_t *bp,
 		int len, int flags)
 {
-	int	fd = libxfs_device_to_fd(btp->dev);
 	int	bytes = BBTOB(len);
 	int	error;
 
 	ASSERT(BBTOB(len) <= bp->b_bcount);
 
-	error = __read_buf(fd, bp->b_addr, bytes, LIBXFS_BBTOOFF64(blkno), flags);
+	error = __read_buf(btp->dev, bp->b_addr, bytes, LIBXFS_BBTOOFF64(blkno), flags);
 	if (!error &&
 	    bp->b_target->dev == btp->dev &&
 	    bp->b_bn == blkno &&
@@ -967,6 +970,87 @@ libxfs_readbuf_verify(struct xfs_buf *bp, const struct xfs_buf_ops *ops)
 	bp->b_flags &= ~LIBXFS_B_UNCHECKED;
 }
 
+/*
+ * Per buffer type cache hit/miss counters, keyed by the verifier ops the
+ * caller asked for. The counters are not atomic; they are statistics, and
+ * losing the odd increment to a race doesn't matter. Slots are looked up
+ * without the lock though, so a new slot's ops are published by a release
+ * store of buf_type_nstats, and readers load the count with acquire.
+ */
+#define BUF_TYPE_STATS	32
+
+struct buf_type_stats {
+	const struct xfs_buf_ops *ops;
+	unsigned long long	hits;
+	unsigned long long	misses;
+};
+
+static struct buf_type_stats	buf_type_stats[BUF_TYPE_STATS];
+static int			buf_type_nstats;
+static pthread_mutex_t		buf_type_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+libxfs_buf_type_count(
+	const struct xfs_buf_ops *ops,
+	bool			hit)
+{
+	struct buf_type_stats	*bts;
+	int			nstats;
+	int			i;
+
+	nstats = __atomic_load_n(&buf_type_nstats, __ATOMIC_ACQUIRE);
+	for (i = 0; i < nstats; i++) {
+		if (buf_type_stats[i].ops == ops)
+			goto found;
+	}
+
+	pthread_mutex_lock(&buf_type_lock);
+	for (i = 0; i < buf_type_nstats; i++) {
+		if (buf_type_stats[i].ops == ops)
+			break;
+	}
+	if (i == buf_type_nstats) {
+		if (i == BUF_TYPE_STATS) {
+			pthread_mutex_unlock(&buf_type_lock);
+			return;
+		}
+		buf_type_stats[i].ops = ops;
+		__atomic_store_n(&buf_type_nstats, i + 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&buf_type_lock);
+found:
+	bts = &buf_type_stats[i];
+	if (hit)
+		bts->hits++;
+	else
+		bts->misses++;
+}
+
+void
+libxfs_buf_type_report(FILE *fp)
+{
+	struct buf_type_stats	*bts;
+	unsigned long long	total;
+	int			nstats;
+	int			i;
+
+	nstats = __atomic_load_n(&buf_type_nstats, __ATOMIC_ACQUIRE);
+	if (!nstats)
+		return;
+
+	fprintf(fp, "%-24s %12s %12s %9s\n",
+		"Buffer type", "Hits", "Misses", "Hit ratio");
+	for (i = 0; i < nstats; i++) {
+		bts = &buf_type_stats[i];
+		total = bts->hits + bts->misses;
+		if (!total)
+			continue;
+		fprintf(fp, "%-24s %12llu %12llu %8.2f%%\n",
+			bts->ops ? bts->ops->name : "untyped",
+			bts->hits, bts->misses,
+			(double)bts->hits * 100 / total);
+	}
+}
 
 xfs_buf_t *
 libxfs_readbuf(struct xfs_buftarg *btp, xfs_daddr_t blkno, int len, int flags,
@@ -993,10 +1077,12 @@ libxfs_readbuf(struct xfs_buftarg *btp, xfs_daddr_t blkno, int len, int flags,
 	 */
 	bp->b_error = 0;
 	if ((bp->b_flags & (LIBXFS_B_UPTODATE|LIBXFS_B_DIRTY))) {
+		libxfs_buf_type_count(ops, true);
 		if (bp->b_flags & LIBXFS_B_UNCHECKED)
 			libxfs_readbuf_verify(bp, ops);
 		return bp;
 	}
+	libxfs_buf_type_count(ops, false);
 
 	/*
 	 * Set the ops on a cache miss (i.e. first physical read) as the
@@ -1016,18 +1102,16 @@ libxfs_readbuf(struct xfs_buftarg *btp, xfs_daddr_t blkno, int len, int flags,
 int
 libxfs_readbufr_map(struct xfs_buftarg *btp, struct xfs_buf *bp, int flags)
 {
-	int	fd;
 	int	error = 0;
 	char	*buf;
 	int	i;
 
-	fd = libxfs_device_to_fd(btp->dev);
 	buf = bp->b_addr;
 	for (i = 0; i < bp->b_nmaps; i++) {
 		off64_t	offset = LIBXFS_BBTOOFF64(bp->b_maps[i].bm_bn);
 		int len = BBTOB(bp->b_maps[i].bm_len);
 
-		error = __read_buf(fd, buf, len, offset, flags);
+		error = __read_buf(btp->dev, buf, len, offset, flags);
 		if (error) {
 			bp->b_error = error;
 			break;
@@ -1062,10 +1146,12 @@ libxfs_readbuf_map(struct xfs_buftarg *btp, struct xfs_buf_map *map, int nmaps,
 
 	bp->b_error = 0;
 	if ((bp->b_flags & (LIBXFS_B_UPTODATE|LIBXFS_B_DIRTY))) {
+		libxfs_buf_type_count(ops, true);
 		if (bp->b_flags & LIBXFS_B_UNCHECKED)
 			libxfs_readbuf_verify(bp, ops);
 		return bp;
 	}
+	libxfs_buf_type_count(ops, false);
 	error = libxfs_readbufr_map(btp, bp, flags);
 	if (!error)
 		libxfs_readbuf_verify(bp, ops);
@@ -1101,11 +1187,14 @@ __write_buf(int fd, void *buf, int len, off64_t offset, int flags)
 	return 0;
 }
 
+/*
+ * Run the write verifier and stale buffer checks that must pass before a
+ * buffer is allowed to go to disk. Shared by the synchronous write path and
+ * the async submission engine.
+ */
 int
-libxfs_writebufr(xfs_buf_t *bp)
+libxfs_writebufr_verify(xfs_buf_t *bp)
 {
-	int	fd = libxfs_device_to_fd(bp->b_target->dev);
-
 	/*
 	 * we never write buffers that are marked stale. This indicates they
 	 * contain data that has been invalidated, and even if the buffer is
@@ -1133,6 +1222,31 @@ libxfs_writebufr(xfs_buf_t *bp)
 			return bp->b_error;
 		}
 	}
+	return 0;
+}
+
+/*
+ * Update buffer state once a physical read or write has finished.
+ */
+void
+libxfs_buf_ioend(xfs_buf_t *bp, int rw, int error)
+{
+	bp->b_error = error;
+	if (error)
+		return;
+	bp->b_flags |= LIBXFS_B_UPTODATE;
+	if (rw == LIBXFS_BWRITE)
+		bp->b_flags &= ~(LIBXFS_B_DIRTY | LIBXFS_B_EXIT |
+				 LIBXFS_B_UNCHECKED);
+}
+
+int
+libxfs_writebufr(xfs_buf_t *bp)
+{
+	int	fd = libxfs_device_to_fd(bp->b_target->dev);
+
+	if (libxfs_writebufr_verify(bp))
+		return bp->b_error;
 
 	if (!(bp->b_flags & LIBXFS_B_DISCONTIG)) {
 		bp->b_error = __write_buf(fd, bp->b_addr, bp->b_bcount,
@@ -1159,11 +1273,7 @@ libxfs_writebufr(xfs_buf_t *bp)
 			(long long)LIBXFS_BBTOOFF64(bp->b_bn),
 			(long long)bp->b_bn, bp, bp->b_error);
 #endif
-	if (!bp->b_error) {
-		bp->b_flags |= LIBXFS_B_UPTODATE;
-		bp->b_flags &= ~(LIBXFS_B_DIRTY | LIBXFS_B_EXIT |
-				 LIBXFS_B_UNCHECKED);
-	}
+	libxfs_buf_ioend(bp, LIBXFS_BWRITE, bp->b_error);
 	return bp->b_error;
 }
 
@@ -1284,6 +1394,338 @@ libxfs_bflush(
 	return bp->b_error;
 }
 
+/*
+ * Elevator sorted, parallel writeback of the buffer cache.
+ *
+ * Flushing the cache one hash chain at a time writes dirty buffers back in
+ * hash order, which for a cache full of dirty metadata is a storm of small
+ * random writes. Instead, pick out the dirty buffers, sort them by device and
+ * disk address, and split the sorted list into one contiguous region per
+ * writeback thread. Each thread then keeps a queue of async writes in flight,
+ * or if native AIO isn't available merges physically adjacent buffers into a
+ * single vectored write.
+ */
+#define BFLUSH_MIN_PER_THREAD	1024		/* dirty buffers per thread */
+#define BFLUSH_MAX_BYTES	(1024 * 1024)	/* largest merged write */
+#ifdef HAVE_PREADV
+#define BFLUSH_MAX_IOVS		256		/* buffers per merged write */
+#else
+#define BFLUSH_MAX_IOVS		1
+#endif
+#define BFLUSH_AIO_DEPTH	64		/* async writes in flight */
+
+struct bflush_work {
+	pthread_t		thread;
+	struct xfs_buf		**bufs;
+	unsigned int		nbufs;
+};
+
+/* a dirty buffer and where it was in the list the cache handed us */
+struct bflush_key {
+	struct xfs_buf		*bp;
+	unsigned int		pos;
+};
+
+/*
+ * Sort by device and disk address. qsort isn't stable, so buffers starting
+ * at the same address are ordered by length and then by list position, so
+ * that overlapping buffers are always written in the same order.
+ */
+static int
+bflush_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct bflush_key	*ka = a;
+	const struct bflush_key	*kb = b;
+	const struct xfs_buf	*ba = ka->bp;
+	const struct xfs_buf	*bb = kb->bp;
+
+	if (ba->b_target->dev != bb->b_target->dev)
+		return ba->b_target->dev < bb->b_target->dev ? -1 : 1;
+	if (ba->b_bn != bb->b_bn)
+		return ba->b_bn < bb->b_bn ? -1 : 1;
+	if (ba->b_length != bb->b_length)
+		return ba->b_length < bb->b_length ? -1 : 1;
+	if (ka->pos != kb->pos)
+		return ka->pos < kb->pos ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Write out a run of verified, physically contiguous buffers. If the merged
+ * write fails, redo the buffers one at a time so that the error ends up on
+ * the buffer that caused it.
+ */
+static void
+bflush_write_run(
+	struct xfs_buf		**bufs,
+	int			nr)
+{
+	struct xfs_buf		*bp = bufs[0];
+	int			fd = libxfs_device_to_fd(bp->b_target->dev);
+	int			i;
+#ifdef HAVE_PREADV
+	struct iovec		iov[BFLUSH_MAX_IOVS];
+	ssize_t			bytes = 0;
+#endif
+
+	if (nr == 1) {
+		libxfs_buf_ioend(bp, LIBXFS_BWRITE,
+				 __write_buf(fd, bp->b_addr, bp->b_bcount,
+					     LIBXFS_BBTOOFF64(bp->b_bn),
+					     bp->b_flags));
+		return;
+	}
+
+#ifdef HAVE_PREADV
+	for (i = 0; i < nr; i++) {
+		iov[i].iov_base = bufs[i]->b_addr;
+		iov[i].iov_len = bufs[i]->b_bcount;
+		bytes += bufs[i]->b_bcount;
+	}
+	if (pwritev(fd, iov, nr, LIBXFS_BBTOOFF64(bp->b_bn)) == bytes) {
+		for (i = 0; i < nr; i++)
+			libxfs_buf_ioend(bufs[i], LIBXFS_BWRITE, 0);
+		return;
+	}
+#endif
+	for (i = 0; i < nr; i++)
+		libxfs_writebufr(bufs[i]);
+}
+
+/*
+ * Wait for every write in flight on an aio context to complete.
+ */
+static void
+bflush_aio_drain(
+	struct xfs_aio_ctx	*ac)
+{
+	struct xfs_buf		*done[BFLUSH_AIO_DEPTH];
+
+	while (libxfs_aio_reap(ac, done, 1, BFLUSH_AIO_DEPTH) > 0)
+		;
+}
+
+/*
+ * Write out the sorted buffers through an aio context, keeping up to
+ * BFLUSH_AIO_DEPTH of them in flight. Each batch goes to the kernel in one
+ * submission, so the block layer merges adjacent buffers without the merged
+ * writes being built here. Overlapping buffers must still reach the disk in
+ * sorted order, so a buffer overlapping one in flight waits for the queue to
+ * drain first.
+ *
+ * Returns the number of buffers dealt with. That falls short of the whole
+ * list if native AIO can't be set up for a device, in which case the caller
+ * writes the rest synchronously.
+ */
+static unsigned int
+bflush_aio(
+	struct bflush_work	*bw)
+{
+	struct xfs_buf		**bufs = bw->bufs;
+	struct xfs_aio_ctx	*ac = NULL;
+	dev_t			dev = 0;
+	xfs_daddr_t		end = 0;
+	unsigned int		i;
+	unsigned int		next;
+	unsigned int		n;
+
+	for (i = 0; i < bw->nbufs; i = next) {
+		struct xfs_buf	*bp = bufs[i];
+
+		next = i + 1;
+		if (bp->b_flags & LIBXFS_B_DISCONTIG) {
+			libxfs_writebufr(bp);
+			continue;
+		}
+
+		if (!ac || bp->b_target->dev != dev) {
+			libxfs_aio_destroy(ac);
+			ac = libxfs_aio_init(bp->b_target, BFLUSH_AIO_DEPTH);
+			if (!ac || !libxfs_aio_is_async(ac))
+				break;
+			dev = bp->b_target->dev;
+			end = 0;
+		}
+		if (bp->b_bn < end) {
+			bflush_aio_drain(ac);
+			end = 0;
+		}
+		end = max(end, bp->b_bn + bp->b_length);
+
+		while (next < bw->nbufs && next - i < BFLUSH_AIO_DEPTH) {
+			struct xfs_buf	*nbp = bufs[next];
+
+			if ((nbp->b_flags & LIBXFS_B_DISCONTIG) ||
+			    nbp->b_target->dev != dev ||
+			    nbp->b_bn < end)
+				break;
+			end = max(end, nbp->b_bn + nbp->b_length);
+			next++;
+		}
+
+		for (n = i; n < next; ) {
+			struct xfs_buf	*done[BFLUSH_AIO_DEPTH];
+
+			n += libxfs_aio_submit(ac, &bufs[n], next - n,
+					       LIBXFS_BWRITE, 0);
+			if (n < next)
+				libxfs_aio_reap(ac, done, 1, BFLUSH_AIO_DEPTH);
+		}
+	}
+
+	libxfs_aio_destroy(ac);
+	return i;
+}
+
+static void *
+bflush_worker(
+	void			*arg)
+{
+	struct bflush_work	*bw = arg;
+	struct xfs_buf		**bufs = bw->bufs;
+	unsigned int		i;
+	unsigned int		next;
+
+	for (i = bflush_aio(bw); i < bw->nbufs; i = next) {
+		struct xfs_buf	*bp = bufs[i];
+		unsigned int	bytes = bp->b_bcount;
+		int		nr = 1;
+
+		next = i + 1;
+		if (bp->b_flags & LIBXFS_B_DISCONTIG) {
+			libxfs_writebufr(bp);
+			continue;
+		}
+		if (libxfs_writebufr_verify(bp))
+			continue;
+
+		while (next < bw->nbufs && nr < BFLUSH_MAX_IOVS &&
+		       bytes < BFLUSH_MAX_BYTES) {
+			struct xfs_buf	*last = bufs[next - 1];
+			struct xfs_buf	*nbp = bufs[next];
+
+			if ((nbp->b_flags & LIBXFS_B_DISCONTIG) ||
+			    nbp->b_target->dev != last->b_target->dev ||
+			    nbp->b_bn != last->b_bn + last->b_length)
+				break;
+			/* a buffer failing verification ends the run */
+			next++;
+			if (libxfs_writebufr_verify(nbp))
+				break;
+			bytes += nbp->b_bcount;
+			nr++;
+		}
+		bflush_write_run(&bufs[i], nr);
+	}
+	return NULL;
+}
+
+static void
+libxfs_bulkflush(
+	struct cache		*cache,
+	struct cache_node	**nodes,
+	unsigned int		count)
+{
+	struct xfs_buf		**bufs = (struct xfs_buf **)nodes;
+	struct bflush_work	*work;
+	struct bflush_key	*keys;
+	bool			sorted = false;
+	unsigned int		ndirty = 0;
+	unsigned int		nthreads;
+	unsigned int		start;
+	unsigned int		i;
+
+	/*
+	 * Move the buffers that need writing to the front of the array. Same
+	 * rules as libxfs_bflush(): buffers with errors have already failed a
+	 * flush and will be redirtied once they are fixed. The cache still
+	 * needs every node it gave us, so only permute the array.
+	 */
+	for (i = 0; i < count; i++) {
+		struct xfs_buf	*bp = bufs[i];
+
+		if (!bp->b_error && (bp->b_flags & LIBXFS_B_DIRTY)) {
+			bufs[i] = bufs[ndirty];
+			bufs[ndirty++] = bp;
+		}
+	}
+	if (!ndirty)
+		return;
+
+	/*
+	 * Without the memory to sort, write the buffers out in list order
+	 * from this thread alone.
+	 */
+	keys = malloc(ndirty * sizeof(struct bflush_key));
+	if (keys) {
+		for (i = 0; i < ndirty; i++) {
+			keys[i].bp = bufs[i];
+			keys[i].pos = i;
+		}
+		qsort(keys, ndirty, sizeof(struct bflush_key), bflush_cmp);
+		for (i = 0; i < ndirty; i++)
+			bufs[i] = keys[i].bp;
+		free(keys);
+		sorted = true;
+	}
+
+	nthreads = min_t(unsigned int, libxfs_nproc(),
+			 ndirty / BFLUSH_MIN_PER_THREAD);
+	if (!sorted || nthreads <= 1 ||
+	    !(work = calloc(nthreads, sizeof(struct bflush_work)))) {
+		struct bflush_work	bw = { .bufs = bufs, .nbufs = ndirty };
+
+		bflush_worker(&bw);
+		return;
+	}
+
+	/*
+	 * Carve the sorted list into equal regions, nudging each boundary
+	 * forward so that overlapping buffers are never split between threads
+	 * and hence are still written in a deterministic order. A buffer can
+	 * overlap any earlier one on the same device that reaches past its
+	 * start, not just its neighbour, so track how far the region reaches.
+	 */
+	for (start = 0, i = 0; i < nthreads && start < ndirty; i++) {
+		unsigned int	end = (unsigned long long)ndirty * (i + 1) /
+				      nthreads;
+		unsigned int	j;
+		xfs_daddr_t	reach = 0;
+
+		if (end <= start)
+			continue;
+		for (j = start; j < end; j++) {
+			if (j > start && bufs[j]->b_target->dev !=
+					 bufs[j - 1]->b_target->dev)
+				reach = 0;
+			reach = max(reach, bufs[j]->b_bn + bufs[j]->b_length);
+		}
+		while (end < ndirty &&
+		       bufs[end]->b_target->dev == bufs[end - 1]->b_target->dev &&
+		       bufs[end]->b_bn < reach) {
+			reach = max(reach,
+				    bufs[end]->b_bn + bufs[end]->b_length);
+			end++;
+		}
+
+		work[i].bufs = &bufs[start];
+		work[i].nbufs = end - start;
+		start = end;
+		if (pthread_create(&work[i].thread, NULL, bflush_worker,
+				   &work[i])) {
+			bflush_worker(&work[i]);
+			work[i].nbufs = 0;
+		}
+	}
+	for (i = 0; i < nthreads; i++) {
+		if (work[i].nbufs)
+			pthread_join(work[i].thread, NULL);
+	}
+	free(work);
+}
+
 void
 libxfs_putbufr(xfs_buf_t *bp)
 {
@@ -1317,7 +1759,8 @@ struct cache_operations libxfs_bcache_operations = {
 	.flush		= libxfs_bflush,
 	.relse		= libxfs_brelse,
 	.compare	= libxfs_bcompare,
-	.bulkrelse	= libxfs_bulkrelse
+	.bulkrelse	= libxfs_bulkrelse,
+	.bulkflush	= libxfs_bulkflush,
 };
 
 
@@ -583,6 +583,59 @@ libxfs_log2_roundup(unsigned int i)
 	return rval;
 }
 
+/*
+ * Verify the checksums of a batch of equally sized objects that keep their
+ * crc at the same offset, such as the inodes of a cluster buffer.  good[i]
+ * is set to whether buffers[i] checks out and the number of bad ones is
+ * returned.
+ *
+ * This is the same as calling xfs_verify_cksum() on each buffer, but hands
+ * the buffers to crc32c_le_multi() so several crcs are computed at once.
+ */
+#define CKSUM_BATCH	16
+
+int
+libxfs_verify_cksums(
+	char			**buffers,
+	int			nr,
+	size_t			length,
+	unsigned long		cksum_offset,
+	bool			*good)
+{
+	unsigned char const	*p[CKSUM_BATCH];
+	__uint32_t		crc[CKSUM_BATCH];
+	__uint32_t		zero = 0;
+	int			bad = 0;
+	int			i, j, n;
+
+	for (i = 0; i < nr; i += n) {
+		n = min(nr - i, CKSUM_BATCH);
+
+		/* up to the checksum, the zeroed checksum, and the rest */
+		for (j = 0; j < n; j++) {
+			crc[j] = XFS_CRC_SEED;
+			p[j] = (unsigned char const *)buffers[i + j];
+		}
+		crc32c_le_multi(crc, p, cksum_offset, n);
+		for (j = 0; j < n; j++) {
+			crc[j] = crc32c(crc[j], &zero, sizeof(__u32));
+			p[j] += cksum_offset + sizeof(__be32);
+		}
+		crc32c_le_multi(crc, p,
+				length - (cksum_offset + sizeof(__be32)), n);
+
+		for (j = 0; j < n; j++) {
+			char	*buf = buffers[i + j];
+
+			good[i + j] = *(__le32 *)(buf + cksum_offset) ==
+					xfs_end_cksum(crc[j]);
+			if (!good[i + j])
+				bad++;
+		}
+	}
+	return bad;
+}
+
 /*
  * Wrapper around call to libxfs_ialloc. Takes care of committing and
  * allocating a new transaction as needed.
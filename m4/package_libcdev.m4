@@ -146,6 +146,37 @@ AC_DEFUN([AC_HAVE_PREADV],
     AC_SUBST(have_preadv)
   ])
 
+#
+# Check if we have the Linux native AIO system calls
+#
+AC_DEFUN([AC_HAVE_LINUX_AIO],
+  [ AC_MSG_CHECKING([for Linux native AIO])
+    AC_TRY_LINK([
+#define _GNU_SOURCE
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/aio_abi.h>
+    ], [
+         aio_context_t ctx = 0;
+         syscall(__NR_io_setup, 1, &ctx);
+    ], have_linux_aio=yes
+       AC_MSG_RESULT(yes),
+       AC_MSG_RESULT(no))
+    AC_SUBST(have_linux_aio)
+  ])
+
+#
+# Check if we have zlib, used to compress metadump images
+#
+AC_DEFUN([AC_HAVE_ZLIB],
+  [ AC_CHECK_HEADER([zlib.h],
+      [ AC_CHECK_LIB([z], [deflate],
+          [ have_zlib=yes
+            libz="-lz" ]) ])
+    AC_SUBST(have_zlib)
+    AC_SUBST(libz)
+  ])
+
 #
 # Check if we have a copy_file_range system call (Linux)
 #
@@ -16,12 +16,21 @@
  * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#if defined(HAVE_FALLOCATE)
+#include <linux/falloc.h>
+#endif
+#include <pthread.h>
 #include "libxfs.h"
 #include "xfs_metadump.h"
 
+#ifndef FALLOC_FL_PUNCH_HOLE
+#define FALLOC_FL_PUNCH_HOLE	0x02
+#endif
+
 char 		*progname;
 int		show_progress = 0;
 int		show_info = 0;
+int		verify_only = 0;
 int		progress_since_warning = 0;
 
 static void
@@ -51,81 +60,856 @@ print_progress(const char *fmt, ...)
 	progress_since_warning = 1;
 }
 
+/*
+ * Restore engine.
+ *
+ * The image is read sequentially (it may be a pipe) by the main thread,
+ * which turns each v1 metablock or v2 frame into a job: a list of disk
+ * extents and the data for them. A pool of writer threads then checks and
+ * decodes the jobs and writes each extent out with a single pwrite, so
+ * decompression and the scattered writes to the target run in parallel
+ * with reading the image.
+ *
+ * A sector can appear in an image more than once, and the last copy must
+ * win. The reader therefore doesn't hand out a job while any of its
+ * extents overlap a job still being written.
+ *
+ * When the target is a freshly truncated file, runs of zeroed sectors are
+ * punched out rather than written, which keeps the restored image sparse.
+ * They can't simply be skipped: a zeroed copy of a sector may have to
+ * replace an earlier copy that wasn't.
+ *
+ * In verify mode (-v) nothing is written. The workers instead run the
+ * libxfs read verifiers over each job's metadata, and overlapping jobs
+ * don't have to wait for each other. A delta can change single sectors of
+ * a block, so the blocks it touches are read back whole from the chain
+ * stacked up to that delta and verified there.
+ */
+#define MDR_HOLE_MIN	8		/* smallest hole worth leaving, sectors */
+
+struct restore_range {
+	__uint64_t		start;
+	__uint64_t		end;
+};
+
+struct verify_stats {
+	__uint64_t		checked;	/* blocks verified */
+	__uint64_t		badcrc;		/* failed the checksum */
+	__uint64_t		corrupt;	/* failed a structure check */
+	__uint64_t		split;		/* couldn't be put together */
+};
+
+/*
+ * A structure that runs off the end of one job and on into the next,
+ * being put back together in the pool.
+ */
+struct verify_carry {
+	__uint64_t		daddr;
+	size_t			len;		/* bytes so far */
+	size_t			need;		/* bytes in all, 0 if unused */
+	char			*buf;
+};
+
+struct restore_job {
+	struct restore_job	*next;		/* free list or work queue */
+	bool			busy;		/* queued or being written */
+	bool			decoded;	/* data[] is valid */
+	int			nextents;
+	struct xfs_md2_extent	*ext;		/* extents in image order */
+	struct restore_range	*ranges;	/* same, sorted and merged */
+	int			nranges;
+	struct xfs_md2_frame	frame;		/* v2 frame header */
+	char			*payload;	/* encoded payload (v2) */
+	char			*data;		/* extent data */
+	__uint64_t		seq;		/* position in the image */
+	struct verify_stats	stats;
+	struct verify_carry	tail;		/* buf points into data */
+	char			*block;		/* read back from the chain */
+};
+
+static struct restore_pool {
+	pthread_mutex_t		lock;
+	pthread_cond_t		wait;
+	struct restore_job	*jobs;
+	int			njobs;
+	struct restore_job	*free;
+	struct restore_job	*head;		/* work queue */
+	struct restore_job	*tail;
+	bool			done;		/* no more jobs coming */
+	pthread_t		*threads;
+	int			nthreads;
+	int			dst_fd;
+	bool			sparse;		/* skip zeroed sectors */
+	bool			delta;		/* verify against verify_view */
+	__uint64_t		queued;		/* jobs handed out */
+	__uint64_t		stitched;	/* jobs whose edges are done */
+	struct verify_carry	carry;
+} pool;
+
+int		nr_threads;
+static struct xfs_mount		*verify_mp;	/* geometry for -v */
+static struct xfs_mdimage	*verify_view;	/* the chain so far, for -v */
+static struct verify_stats	verify_totals;
+
+static int
+range_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct restore_range *ra = a;
+	const struct restore_range *rb = b;
+
+	if (ra->start != rb->start)
+		return ra->start < rb->start ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Build the sorted, merged list of sectors a job writes, for the overlap
+ * checks.
+ */
 static void
-perform_restore(
-	FILE			*src_f,
-	int			dst_fd,
-	int			is_target_file)
+job_build_ranges(
+	struct restore_job	*job)
 {
-	xfs_metablock_t 	*metablock;	/* header + index + blocks */
-	__be64			*block_index;
-	char			*block_buffer;
-	int			block_size;
-	int			max_indices;
-	int			cur_index;
-	int			mb_count;
-	xfs_metablock_t		tmb;
-	xfs_sb_t		sb;
-	__int64_t		bytes_read;
+	struct restore_range	*r = job->ranges;
+	int			n = 0;
+	int			i;
 
-	/*
-	 * read in first blocks (superblock 0), set "inprogress" flag for it,
-	 * read in the rest of the file, and if complete, clear SB 0's
-	 * "inprogress flag"
-	 */
+	for (i = 0; i < job->nextents; i++) {
+		r[i].start = be64_to_cpu(job->ext[i].me_daddr);
+		r[i].end = r[i].start + be32_to_cpu(job->ext[i].me_len);
+	}
+	qsort(r, job->nextents, sizeof(*r), range_cmp);
+	for (i = 0; i < job->nextents; i++) {
+		if (n && r[i].start <= r[n - 1].end)
+			r[n - 1].end = max(r[n - 1].end, r[i].end);
+		else
+			r[n++] = r[i];
+	}
+	job->nranges = n;
+}
 
-	if (fread(&tmb, sizeof(tmb), 1, src_f) != 1)
-		fatal("error reading from file: %s\n", strerror(errno));
+static bool
+jobs_overlap(
+	struct restore_job	*a,
+	struct restore_job	*b)
+{
+	int			i = 0;
+	int			j = 0;
 
-	if (be32_to_cpu(tmb.mb_magic) != XFS_MD_MAGIC)
-		fatal("specified file is not a metadata dump\n");
+	if (!a->nranges || !b->nranges ||
+	    a->ranges[0].start >= b->ranges[b->nranges - 1].end ||
+	    b->ranges[0].start >= a->ranges[a->nranges - 1].end)
+		return false;
 
-	block_size = 1 << tmb.mb_blocklog;
-	max_indices = (block_size - sizeof(xfs_metablock_t)) / sizeof(__be64);
+	while (i < a->nranges && j < b->nranges) {
+		if (a->ranges[i].end <= b->ranges[j].start)
+			i++;
+		else if (b->ranges[j].end <= a->ranges[i].start)
+			j++;
+		else
+			return true;
+	}
+	return false;
+}
 
-	metablock = (xfs_metablock_t *)calloc(max_indices + 1, block_size);
-	if (metablock == NULL)
+/* call with the pool lock held */
+static bool
+job_conflicts(
+	struct restore_job	*job)
+{
+	int			i;
+
+	for (i = 0; i < pool.njobs; i++) {
+		if (pool.jobs[i].busy && jobs_overlap(job, &pool.jobs[i]))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Check a v2 frame's payload and decode it into the job's data buffer.
+ */
+static void
+job_decode(
+	struct restore_job	*job)
+{
+	struct xfs_md2_frame	*frame = &job->frame;
+	size_t			zlen = be32_to_cpu(frame->mf_zlen);
+
+	if (job->decoded)
+		return;
+	if (crc32c(XFS_CRC_SEED, job->payload, zlen) !=
+			be32_to_cpu(frame->mf_crc))
+		fatal("bad frame checksum in metadump image\n");
+	if (libxfs_md2_decompress(frame->mf_codec, job->data,
+			be32_to_cpu(frame->mf_len), job->payload, zlen))
+		fatal("cannot decode frame in metadump image\n");
+	job->decoded = true;
+}
+
+static bool
+is_zero(
+	const char		*p,
+	size_t			len)
+{
+	const __uint64_t	*q = (const __uint64_t *)p;
+
+	for (len /= sizeof(*q); len > 0; len--, q++) {
+		if (*q)
+			return false;
+	}
+	return true;
+}
+
+static void
+write_run(
+	char			*p,
+	__uint64_t		daddr,
+	__uint64_t		len)
+{
+	if (pwrite(pool.dst_fd, p, BBTOB(len), BBTOB(daddr)) < 0)
+		fatal("error writing block %llu: %s\n",
+			(unsigned long long)BBTOB(daddr), strerror(errno));
+}
+
+/*
+ * Zero a run of sectors on a sparse target. Punching a hole is much cheaper
+ * than writing the zeroes, and usually a no-op on a new file.
+ */
+static void
+zero_run(
+	char			*p,
+	__uint64_t		daddr,
+	__uint64_t		len)
+{
+#if defined(HAVE_FALLOCATE)
+	if (fallocate(pool.dst_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      BBTOB(daddr), BBTOB(len)) == 0)
+		return;
+#endif
+	write_run(p, daddr, len);
+}
+
+/*
+ * Write one extent, leaving holes for any long enough runs of zeroes if
+ * the target is sparse.
+ */
+static void
+write_extent(
+	char			*p,
+	__uint64_t		daddr,
+	__uint64_t		len)
+{
+	__uint64_t		start = 0;	/* of the pending data run */
+	__uint64_t		i = 0;
+	__uint64_t		z;
+
+	if (!pool.sparse) {
+		write_run(p, daddr, len);
+		return;
+	}
+
+	while (i < len) {
+		if (!is_zero(p + BBTOB(i), BBSIZE)) {
+			i++;
+			continue;
+		}
+		for (z = i + 1; z < len && is_zero(p + BBTOB(z), BBSIZE); z++)
+			;
+		if (z - i >= MDR_HOLE_MIN) {
+			if (i > start)
+				write_run(p + BBTOB(start), daddr + start,
+					  i - start);
+			zero_run(p + BBTOB(i), daddr + i, z - i);
+			start = z;
+		}
+		i = z;
+	}
+	if (len > start)
+		write_run(p + BBTOB(start), daddr + start, len - start);
+}
+
+static void
+job_write(
+	struct restore_job	*job)
+{
+	char			*p = job->data;
+	int			i;
+
+	for (i = 0; i < job->nextents; i++) {
+		__uint64_t	len = be32_to_cpu(job->ext[i].me_len);
+
+		write_extent(p, be64_to_cpu(job->ext[i].me_daddr), len);
+		p += BBTOB(len);
+	}
+}
+
+/*
+ * Work out which verifier checks the metadata block at @p from its magic
+ * number, and how many bytes long the block is. Blocks without a magic
+ * number we know (file data, v4 symlinks, ...) give NULL.
+ */
+static const struct xfs_buf_ops *
+verify_classify(
+	char			*p,
+	size_t			avail,
+	size_t			*len)
+{
+	struct xfs_mount	*mp = verify_mp;
+	size_t			bsize = mp->m_sb.sb_blocksize;
+	size_t			dsize = mp->m_dir_geo->blksize;
+
+	*len = bsize;
+	switch (be32_to_cpu(*(__be32 *)p)) {
+	case XFS_ABTB_MAGIC:
+	case XFS_ABTB_CRC_MAGIC:
+	case XFS_ABTC_MAGIC:
+	case XFS_ABTC_CRC_MAGIC:
+		return &xfs_allocbt_buf_ops;
+	case XFS_IBT_MAGIC:
+	case XFS_IBT_CRC_MAGIC:
+	case XFS_FIBT_MAGIC:
+	case XFS_FIBT_CRC_MAGIC:
+		return &xfs_inobt_buf_ops;
+	case XFS_BMAP_MAGIC:
+	case XFS_BMAP_CRC_MAGIC:
+		return &xfs_bmbt_buf_ops;
+	case XFS_RMAP_CRC_MAGIC:
+		return &xfs_rmapbt_buf_ops;
+	case XFS_REFC_CRC_MAGIC:
+		return &xfs_refcountbt_buf_ops;
+	case XFS_SYMLINK_MAGIC:
+		return &xfs_symlink_buf_ops;
+	case XFS_ATTR3_RMT_MAGIC:
+		return &xfs_attr3_rmt_buf_ops;
+	case XFS_DIR2_BLOCK_MAGIC:
+	case XFS_DIR3_BLOCK_MAGIC:
+		*len = dsize;
+		return &xfs_dir3_block_buf_ops;
+	case XFS_DIR2_DATA_MAGIC:
+	case XFS_DIR3_DATA_MAGIC:
+		*len = dsize;
+		return &xfs_dir3_data_buf_ops;
+	case XFS_DIR2_FREE_MAGIC:
+	case XFS_DIR3_FREE_MAGIC:
+		*len = dsize;
+		return &xfs_dir3_free_buf_ops;
+	}
+
+	switch (be16_to_cpu(*(__be16 *)p)) {
+	case XFS_DINODE_MAGIC:
+		return &xfs_inode_buf_ops;
+	case XFS_DQUOT_MAGIC:
+		return &xfs_dquot_buf_ops;
+	}
+	/* so that a trashed first inode doesn't hide the rest */
+	if (mp->m_sb.sb_inopblock > 1 && avail >= 2 * mp->m_sb.sb_inodesize &&
+	    be16_to_cpu(*(__be16 *)(p + mp->m_sb.sb_inodesize)) ==
+			XFS_DINODE_MAGIC)
+		return &xfs_inode_buf_ops;
+
+	switch (be16_to_cpu(((struct xfs_da_blkinfo *)p)->magic)) {
+	case XFS_DIR2_LEAF1_MAGIC:
+	case XFS_DIR3_LEAF1_MAGIC:
+		*len = dsize;
+		return &xfs_dir3_leaf1_buf_ops;
+	case XFS_DIR2_LEAFN_MAGIC:
+	case XFS_DIR3_LEAFN_MAGIC:
+		*len = dsize;
+		return &xfs_dir3_leafn_buf_ops;
+	case XFS_ATTR_LEAF_MAGIC:
+	case XFS_ATTR3_LEAF_MAGIC:
+		return &xfs_attr3_leaf_buf_ops;
+	case XFS_DA_NODE_MAGIC:
+	case XFS_DA3_NODE_MAGIC:
+		/*
+		 * Attribute fork nodes are a filesystem block long and
+		 * directory ones a directory block. Only the checksum can
+		 * tell them apart, so v4 nodes are taken to be one block.
+		 */
+		if (dsize != bsize && xfs_sb_version_hascrc(&mp->m_sb) &&
+		    (avail < bsize ||
+		     !xfs_verify_cksum(p, bsize, XFS_DA3_NODE_CRC_OFF)))
+			*len = dsize;
+		return &xfs_da3_node_buf_ops;
+	}
+	return NULL;
+}
+
+static void
+verify_block(
+	struct restore_job	*job,
+	const struct xfs_buf_ops *ops,
+	char			*p,
+	__uint64_t		daddr,
+	size_t			len)
+{
+	struct xfs_buf		bp;
+
+	memset(&bp, 0, sizeof(bp));
+	bp.b_bn = daddr;
+	bp.b_bcount = len;
+	bp.b_length = BTOBB(len);
+	bp.b_target = verify_mp->m_ddev_targp;
+	bp.b_addr = p;
+	bp.b_ops = ops;
+
+	/* the verifiers report what they find themselves */
+	ops->verify_read(&bp);
+	job->stats.checked++;
+	if (bp.b_error == -EFSBADCRC)
+		job->stats.badcrc++;
+	else if (bp.b_error)
+		job->stats.corrupt++;
+}
+
+/*
+ * The AG headers are a sector each, and a sector is all that need be in
+ * the image.
+ */
+static void
+verify_ag_headers(
+	struct restore_job	*job,
+	char			*p,
+	__uint64_t		daddr,
+	__uint64_t		end)
+{
+	struct xfs_mount	*mp = verify_mp;
+	__uint64_t		sectbb = XFS_FSS_TO_BB(mp, 1);
+	xfs_agnumber_t		agno;
+	__uint64_t		d;
+	int			i;
+	struct {
+		xfs_daddr_t		daddr;
+		const struct xfs_buf_ops *ops;
+	} hdrs[] = {
+		{ XFS_SB_DADDR,		&xfs_sb_buf_ops },
+		{ XFS_AGF_DADDR(mp),	&xfs_agf_buf_ops },
+		{ XFS_AGI_DADDR(mp),	&xfs_agi_buf_ops },
+		{ XFS_AGFL_DADDR(mp),	&xfs_agfl_buf_ops },
+	};
+
+	for (agno = xfs_daddr_to_agno(mp, daddr);
+	     agno <= xfs_daddr_to_agno(mp, end - 1) &&
+	     agno < mp->m_sb.sb_agcount;
+	     agno++) {
+		for (i = 0; i < ARRAY_SIZE(hdrs); i++) {
+			d = XFS_AG_DADDR(mp, agno, hdrs[i].daddr);
+			if (d >= daddr && d + sectbb <= end)
+				verify_block(job, hdrs[i].ops,
+					     p + BBTOB(d - daddr), d,
+					     BBTOB(sectbb));
+		}
+	}
+}
+
+/*
+ * Verify the metadata blocks in one extent of a job. A block that starts
+ * in the last extent and runs past the end of the job is saved so that it
+ * can be finished off with the start of the next job.
+ */
+static void
+verify_extent(
+	struct restore_job	*job,
+	char			*p,
+	__uint64_t		daddr,
+	__uint64_t		len,
+	bool			last)
+{
+	struct xfs_mount	*mp = verify_mp;
+	const struct xfs_buf_ops *ops;
+	__uint64_t		bbs = XFS_FSB_TO_BB(mp, 1);
+	__uint64_t		end = daddr + len;
+	__uint64_t		logstart = 0;
+	__uint64_t		logend = 0;
+	__uint64_t		d;
+	size_t			blen;
+
+	verify_ag_headers(job, p, daddr, end);
+
+	if (mp->m_sb.sb_logstart) {
+		logstart = XFS_FSB_TO_DADDR(mp, mp->m_sb.sb_logstart);
+		logend = logstart + XFS_FSB_TO_BB(mp, mp->m_sb.sb_logblocks);
+	}
+
+	d = (daddr + bbs - 1) / bbs * bbs;
+	while (d < end) {
+		if (xfs_daddr_to_agbno(mp, d) <= XFS_AGFL_BLOCK(mp) ||
+		    (d >= logstart && d < logend)) {
+			d += bbs;
+			continue;
+		}
+		ops = verify_classify(p + BBTOB(d - daddr), BBTOB(end - d),
+				      &blen);
+		if (!ops) {
+			d += bbs;
+			continue;
+		}
+		if (d + BTOBB(blen) > end) {
+			if (!last || blen > XFS_MAX_BLOCKSIZE) {
+				job->stats.split++;
+			} else {
+				job->tail.daddr = d;
+				job->tail.len = BBTOB(end - d);
+				job->tail.need = blen;
+				job->tail.buf = p + BBTOB(d - daddr);
+			}
+			break;
+		}
+		verify_block(job, ops, p + BBTOB(d - daddr), d, blen);
+		d += BTOBB(blen);
+	}
+}
+
+/*
+ * Verify the metadata blocks that an extent of a delta touches, as they
+ * are once the delta is applied. @done is the range of blocks the last
+ * extent verified, so that a block touched by neighbouring extents is
+ * only checked once.
+ */
+static void
+verify_delta_extent(
+	struct restore_job	*job,
+	__uint64_t		daddr,
+	__uint64_t		len,
+	struct restore_range	*done)
+{
+	struct xfs_mount	*mp = verify_mp;
+	const struct xfs_buf_ops *ops;
+	__uint64_t		bbs = XFS_FSB_TO_BB(mp, 1);
+	__uint64_t		end = daddr + len;
+	__uint64_t		logstart = 0;
+	__uint64_t		logend = 0;
+	__uint64_t		d;
+	size_t			want;
+	ssize_t			got;
+	size_t			blen;
+
+	if (mp->m_sb.sb_logstart) {
+		logstart = XFS_FSB_TO_DADDR(mp, mp->m_sb.sb_logstart);
+		logend = logstart + XFS_FSB_TO_BB(mp, mp->m_sb.sb_logblocks);
+	}
+	want = max(mp->m_sb.sb_blocksize, mp->m_dir_geo->blksize);
+
+	d = daddr / bbs * bbs;
+	if (d >= done->start && d < done->end)
+		d = done->end;
+	else
+		done->start = done->end = d;
+	while (d < end) {
+		if (d >= logstart && d < logend) {
+			d += bbs;
+			continue;
+		}
+		got = libxfs_mdimage_pread(verify_view, job->block, want,
+					   BBTOB(d));
+		if (got < (ssize_t)BBTOB(bbs)) {
+			job->stats.split++;
+			d += bbs;
+			continue;
+		}
+		if (xfs_daddr_to_agbno(mp, d) <= XFS_AGFL_BLOCK(mp)) {
+			verify_ag_headers(job, job->block, d, d + bbs);
+			d += bbs;
+			continue;
+		}
+		ops = verify_classify(job->block, got, &blen);
+		if (!ops) {
+			d += bbs;
+			continue;
+		}
+		if (blen > got)
+			job->stats.split++;
+		else
+			verify_block(job, ops, job->block, d, blen);
+		d += BTOBB(blen);
+	}
+	done->end = max(d, done->end);
+}
+
+static void
+job_verify(
+	struct restore_job	*job)
+{
+	char			*p = job->data;
+	struct restore_range	done = { 0, 0 };
+	int			i;
+
+	for (i = 0; i < job->nextents; i++) {
+		__uint64_t	len = be32_to_cpu(job->ext[i].me_len);
+
+		if (pool.delta)
+			verify_delta_extent(job,
+					be64_to_cpu(job->ext[i].me_daddr), len,
+					&done);
+		else
+			verify_extent(job, p,
+				      be64_to_cpu(job->ext[i].me_daddr), len,
+				      i == job->nextents - 1);
+		p += BBTOB(len);
+	}
+}
+
+/*
+ * Finish off a block carried over from the previous job with the start of
+ * this one, and carry this job's own tail over to the next. Called with the
+ * pool lock held, for each job in turn.
+ */
+static void
+job_stitch(
+	struct restore_job	*job)
+{
+	struct verify_carry	*c = &pool.carry;
+	const struct xfs_buf_ops *ops;
+	size_t			avail;
+	size_t			n;
+	size_t			blen;
+
+	if (c->need && (!job->nextents ||
+			be64_to_cpu(job->ext[0].me_daddr) !=
+					c->daddr + BTOBB(c->len))) {
+		job->stats.split++;
+		c->need = 0;
+	}
+	if (c->need) {
+		avail = BBTOB(be32_to_cpu(job->ext[0].me_len));
+		n = min(avail, c->need - c->len);
+		memcpy(c->buf + c->len, job->data, n);
+		c->len += n;
+		if (c->len == c->need) {
+			/* a directory node guess may turn out to be too long */
+			ops = verify_classify(c->buf, c->len, &blen);
+			if (ops && blen <= c->len)
+				verify_block(job, ops, c->buf, c->daddr, blen);
+			c->need = 0;
+		} else if (job->nextents > 1) {
+			job->stats.split++;
+			c->need = 0;
+		}
+	}
+	if (job->tail.need) {
+		if (c->need)
+			job->stats.split++;
+		c->daddr = job->tail.daddr;
+		c->len = job->tail.len;
+		c->need = job->tail.need;
+		memcpy(c->buf, job->tail.buf, c->len);
+	}
+}
+
+static void *
+restore_worker(
+	void			*arg)
+{
+	struct restore_job	*job;
+
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		while (!pool.head && !pool.done)
+			pthread_cond_wait(&pool.wait, &pool.lock);
+		job = pool.head;
+		if (!job)
+			break;
+		pool.head = job->next;
+		if (!pool.head)
+			pool.tail = NULL;
+		pthread_mutex_unlock(&pool.lock);
+
+		job_decode(job);
+		if (verify_only)
+			job_verify(job);
+		else
+			job_write(job);
+
+		pthread_mutex_lock(&pool.lock);
+		if (verify_only) {
+			while (pool.stitched != job->seq)
+				pthread_cond_wait(&pool.wait, &pool.lock);
+			job_stitch(job);
+			pool.stitched++;
+			verify_totals.checked += job->stats.checked;
+			verify_totals.badcrc += job->stats.badcrc;
+			verify_totals.corrupt += job->stats.corrupt;
+			verify_totals.split += job->stats.split;
+		}
+		job->busy = false;
+		job->next = pool.free;
+		pool.free = job;
+		pthread_cond_broadcast(&pool.wait);
+	}
+	pthread_mutex_unlock(&pool.lock);
+	return NULL;
+}
+
+static void
+pool_init(
+	int			dst_fd,
+	bool			sparse,
+	size_t			payload_size,
+	size_t			data_size,
+	int			max_extents)
+{
+	struct restore_job	*job;
+	int			i;
+
+	pool.nthreads = nr_threads > 0 ? nr_threads : libxfs_nproc();
+	pool.njobs = pool.nthreads * 2;
+	pool.dst_fd = dst_fd;
+#if defined(HAVE_FALLOCATE)
+	pool.sparse = sparse;
+#endif
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.wait, NULL);
+	pool.jobs = calloc(pool.njobs, sizeof(struct restore_job));
+	pool.threads = calloc(pool.nthreads, sizeof(pthread_t));
+	if (verify_only)
+		pool.carry.buf = malloc(XFS_MAX_BLOCKSIZE);
+	if (!pool.jobs || !pool.threads || (verify_only && !pool.carry.buf))
 		fatal("memory allocation failure\n");
 
-	mb_count = be16_to_cpu(tmb.mb_count);
-	if (mb_count == 0 || mb_count > max_indices)
-		fatal("bad block count: %u\n", mb_count);
+	for (i = 0; i < pool.njobs; i++) {
+		job = &pool.jobs[i];
+		job->ext = calloc(max_extents, sizeof(struct xfs_md2_extent));
+		job->ranges = calloc(max_extents, sizeof(struct restore_range));
+		job->data = malloc(data_size);
+		if (payload_size)
+			job->payload = malloc(payload_size);
+		if (verify_only)
+			job->block = malloc(XFS_MAX_BLOCKSIZE);
+		if (!job->ext || !job->ranges || !job->data ||
+		    (payload_size && !job->payload) ||
+		    (verify_only && !job->block))
+			fatal("memory allocation failure\n");
+		job->next = pool.free;
+		pool.free = job;
+	}
 
-	block_index = (__be64 *)((char *)metablock + sizeof(xfs_metablock_t));
-	block_buffer = (char *)metablock + block_size;
+	for (i = 0; i < pool.nthreads; i++) {
+		if (pthread_create(&pool.threads[i], NULL, restore_worker,
+				   NULL))
+			fatal("cannot create writer thread\n");
+	}
+}
 
-	if (fread(block_index, block_size - sizeof(tmb), 1, src_f) != 1)
-		fatal("error reading from file: %s\n", strerror(errno));
+static struct restore_job *
+pool_get_job(void)
+{
+	struct restore_job	*job;
 
-	if (block_index[0] != 0)
-		fatal("first block is not the primary superblock\n");
+	pthread_mutex_lock(&pool.lock);
+	while (!pool.free)
+		pthread_cond_wait(&pool.wait, &pool.lock);
+	job = pool.free;
+	pool.free = job->next;
+	pthread_mutex_unlock(&pool.lock);
 
+	job->next = NULL;
+	job->decoded = false;
+	job->nranges = 0;
+	memset(&job->stats, 0, sizeof(job->stats));
+	memset(&job->tail, 0, sizeof(job->tail));
+	return job;
+}
 
-	if (fread(block_buffer, mb_count << tmb.mb_blocklog,
-			1, src_f) != 1)
-		fatal("error reading from file: %s\n", strerror(errno));
+static void
+pool_queue_job(
+	struct restore_job	*job)
+{
+	job_build_ranges(job);
+
+	pthread_mutex_lock(&pool.lock);
+	while (!verify_only && job_conflicts(job))
+		pthread_cond_wait(&pool.wait, &pool.lock);
+	job->seq = pool.queued++;
+	job->busy = true;
+	if (pool.tail)
+		pool.tail->next = job;
+	else
+		pool.head = job;
+	pool.tail = job;
+	pthread_cond_broadcast(&pool.wait);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+/*
+ * Wait for everything queued to be written and tear the pool down.
+ */
+static void
+pool_destroy(void)
+{
+	int			i;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.done = true;
+	pthread_cond_broadcast(&pool.wait);
+	pthread_mutex_unlock(&pool.lock);
 
-	libxfs_sb_from_disk(&sb, (xfs_dsb_t *)block_buffer);
+	for (i = 0; i < pool.nthreads; i++)
+		pthread_join(pool.threads[i], NULL);
+	if (pool.carry.need)
+		verify_totals.split++;
+	for (i = 0; i < pool.njobs; i++) {
+		free(pool.jobs[i].ext);
+		free(pool.jobs[i].ranges);
+		free(pool.jobs[i].data);
+		free(pool.jobs[i].payload);
+		free(pool.jobs[i].block);
+	}
+	free(pool.jobs);
+	free(pool.threads);
+	free(pool.carry.buf);
+	pthread_mutex_destroy(&pool.lock);
+	pthread_cond_destroy(&pool.wait);
+
+	/* each image of a chain gets a fresh pool */
+	memset(&pool, 0, sizeof(pool));
+}
+
+/*
+ * Check the primary superblock at @block, flag it as being restored and make
+ * sure the target is big enough to take the filesystem. When verifying, set
+ * up the geometry the verifiers need instead.
+ */
+static void
+start_restore(
+	char			*block,
+	xfs_sb_t		*sb,
+	int			max_sectsize,
+	int			dst_fd,
+	int			is_target_file)
+{
+	libxfs_sb_from_disk(sb, (xfs_dsb_t *)block);
 
-	if (sb.sb_magicnum != XFS_SB_MAGIC)
+	if (sb->sb_magicnum != XFS_SB_MAGIC)
 		fatal("bad magic number for primary superblock\n");
 
-	/*
-	 * Normally the upper bound would be simply XFS_MAX_SECTORSIZE
-	 * but the metadump format has a maximum number of BBSIZE blocks
-	 * it can store in a single metablock.
-	 */
-	if (sb.sb_sectsize < XFS_MIN_SECTORSIZE ||
-	    sb.sb_sectsize > XFS_MAX_SECTORSIZE ||
-	    sb.sb_sectsize > max_indices * block_size)
-		fatal("bad sector size %u in metadump image\n", sb.sb_sectsize);
+	if (sb->sb_sectsize < XFS_MIN_SECTORSIZE ||
+	    sb->sb_sectsize > XFS_MAX_SECTORSIZE ||
+	    sb->sb_sectsize > max_sectsize)
+		fatal("bad sector size %u in metadump image\n", sb->sb_sectsize);
 
-	((xfs_dsb_t*)block_buffer)->sb_inprogress = 1;
+	if (verify_only) {
+		/* a delta brings its own superblock if it changed */
+		if (verify_mp) {
+			libxfs_umount(verify_mp);
+			free(verify_mp);
+		}
+		verify_mp = calloc(1, sizeof(struct xfs_mount));
+		if (!verify_mp)
+			fatal("memory allocation failure\n");
+		if (!libxfs_mount(verify_mp, sb, 0, 0, 0, 0))
+			fatal("cannot set up filesystem geometry\n");
+		return;
+	}
+
+	((xfs_dsb_t*)block)->sb_inprogress = 1;
 
 	if (is_target_file)  {
 		/* ensure regular files are correctly sized */
 
-		if (ftruncate(dst_fd, sb.sb_dblocks * sb.sb_blocksize))
+		if (ftruncate(dst_fd, sb->sb_dblocks * sb->sb_blocksize))
 			fatal("cannot set filesystem image size: %s\n",
 				strerror(errno));
 	} else  {
@@ -134,11 +918,123 @@ perform_restore(
 		char		*lb[XFS_MAX_SECTORSIZE] = { NULL };
 		off64_t		off;
 
-		off = sb.sb_dblocks * sb.sb_blocksize - sizeof(lb);
+		off = sb->sb_dblocks * sb->sb_blocksize - sizeof(lb);
 		if (pwrite(dst_fd, lb, sizeof(lb), off) < 0)
 			fatal("failed to write last block, is target too "
 				"small? (error: %s)\n", strerror(errno));
 	}
+}
+
+/*
+ * The whole image is on the target, so rewrite the primary superblock
+ * without the "inprogress" flag.
+ */
+static void
+finish_restore(
+	xfs_sb_t		*sb,
+	int			dst_fd)
+{
+	char			*block;
+
+	if (progress_since_warning)
+		putchar('\n');
+
+	block = calloc(1, sb->sb_sectsize);
+	if (!block)
+		fatal("memory allocation failure\n");
+	sb->sb_inprogress = 0;
+	libxfs_sb_to_disk((xfs_dsb_t *)block, sb);
+	if (xfs_sb_version_hascrc(sb)) {
+		xfs_update_cksum(block, sb->sb_sectsize,
+				 offsetof(struct xfs_sb, sb_crc));
+	}
+
+	if (pwrite(dst_fd, block, sb->sb_sectsize, 0) < 0)
+		fatal("error writing primary superblock: %s\n", strerror(errno));
+	free(block);
+}
+
+/*
+ * Turn the index of a v1 metablock into a job, merging runs of blocks that
+ * are contiguous on disk (and hence in the metablock) into one extent.
+ */
+static void
+job_from_metablock(
+	struct restore_job	*job,
+	__be64			*block_index,
+	int			mb_count,
+	int			blocklog)
+{
+	struct xfs_md2_extent	*ext = NULL;
+	__uint64_t		daddr;
+	__uint32_t		bbs = 1 << (blocklog - BBSHIFT);
+	int			i;
+
+	job->nextents = 0;
+	for (i = 0; i < mb_count; i++) {
+		daddr = be64_to_cpu(block_index[i]);
+		if (ext && be64_to_cpu(ext->me_daddr) +
+				be32_to_cpu(ext->me_len) == daddr) {
+			be32_add_cpu(&ext->me_len, bbs);
+			continue;
+		}
+		ext = &job->ext[job->nextents++];
+		ext->me_daddr = cpu_to_be64(daddr);
+		ext->me_len = cpu_to_be32(bbs);
+	}
+	job->decoded = true;
+}
+
+static void
+perform_restore_v1(
+	FILE			*src_f,
+	int			dst_fd,
+	int			is_target_file,
+	xfs_metablock_t		*tmb,
+	xfs_sb_t		*sb)
+{
+	xfs_metablock_t 	*metablock;	/* header + index */
+	__be64			*block_index;
+	struct restore_job	*job;
+	int			block_size;
+	int			max_indices;
+	int			mb_count;
+	__int64_t		bytes_read;
+
+	block_size = 1 << tmb->mb_blocklog;
+	max_indices = (block_size - sizeof(xfs_metablock_t)) / sizeof(__be64);
+
+	metablock = (xfs_metablock_t *)calloc(1, block_size);
+	if (metablock == NULL)
+		fatal("memory allocation failure\n");
+
+	mb_count = be16_to_cpu(tmb->mb_count);
+	if (mb_count == 0 || mb_count > max_indices)
+		fatal("bad block count: %u\n", mb_count);
+
+	block_index = (__be64 *)((char *)metablock + sizeof(xfs_metablock_t));
+
+	if (fread(block_index, block_size - sizeof(*tmb), 1, src_f) != 1)
+		fatal("error reading from file: %s\n", strerror(errno));
+
+	if (block_index[0] != 0)
+		fatal("first block is not the primary superblock\n");
+
+	pool_init(dst_fd, is_target_file, 0, max_indices * block_size,
+		  max_indices);
+	job = pool_get_job();
+
+	if (fread(job->data, mb_count << tmb->mb_blocklog,
+			1, src_f) != 1)
+		fatal("error reading from file: %s\n", strerror(errno));
+
+	/*
+	 * Normally the upper bound would be simply XFS_MAX_SECTORSIZE
+	 * but the metadump format has a maximum number of BBSIZE blocks
+	 * it can store in a single metablock.
+	 */
+	start_restore(job->data, sb, max_indices * block_size, dst_fd,
+		      is_target_file);
 
 	bytes_read = 0;
 
@@ -146,15 +1042,9 @@ perform_restore(
 		if (show_progress && (bytes_read & ((1 << 20) - 1)) == 0)
 			print_progress("%lld MB read", bytes_read >> 20);
 
-		for (cur_index = 0; cur_index < mb_count; cur_index++) {
-			if (pwrite(dst_fd, &block_buffer[cur_index <<
-					tmb.mb_blocklog], block_size,
-					be64_to_cpu(block_index[cur_index]) <<
-						BBSHIFT) < 0)
-				fatal("error writing block %llu: %s\n",
-					be64_to_cpu(block_index[cur_index]) << BBSHIFT,
-					strerror(errno));
-		}
+		job_from_metablock(job, block_index, mb_count,
+				   tmb->mb_blocklog);
+		pool_queue_job(job);
 		if (mb_count < max_indices)
 			break;
 
@@ -167,39 +1057,287 @@ perform_restore(
 		if (mb_count > max_indices)
 			fatal("bad block count: %u\n", mb_count);
 
-		if (fread(block_buffer, mb_count << tmb.mb_blocklog,
+		job = pool_get_job();
+		if (fread(job->data, mb_count << tmb->mb_blocklog,
 								1, src_f) != 1)
 			fatal("error reading from file: %s\n", strerror(errno));
 
-		bytes_read += block_size + (mb_count << tmb.mb_blocklog);
+		bytes_read += block_size + (mb_count << tmb->mb_blocklog);
 	}
 
-	if (progress_since_warning)
-		putchar('\n');
+	pool_destroy();
+	free(metablock);
+}
 
-	memset(block_buffer, 0, sb.sb_sectsize);
-	sb.sb_inprogress = 0;
-	libxfs_sb_to_disk((xfs_dsb_t *)block_buffer, &sb);
-	if (xfs_sb_version_hascrc(&sb)) {
-		xfs_update_cksum(block_buffer, sb.sb_sectsize,
-				 offsetof(struct xfs_sb, sb_crc));
+/*
+ * Read the next frame of a v2 image into @job, leaving the payload to be
+ * checked and decoded by the writer. Returns the number of bytes of image
+ * consumed; a job with no extents marks the end of the image.
+ */
+static size_t
+read_frame_v2(
+	FILE			*src_f,
+	struct restore_job	*job)
+{
+	struct xfs_md2_frame	*frame = &job->frame;
+	size_t			zlen;
+
+	if (fread(frame, sizeof(*frame), 1, src_f) != 1)
+		fatal("error reading from file: %s\n", strerror(errno));
+	if (libxfs_md2_frame_check(frame))
+		fatal("bad frame header in metadump image\n");
+
+	job->nextents = be16_to_cpu(frame->mf_nextents);
+	zlen = be32_to_cpu(frame->mf_zlen);
+	if (job->nextents == 0)
+		return sizeof(*frame);
+
+	if (fread(job->ext, job->nextents * sizeof(struct xfs_md2_extent), 1,
+		  src_f) != 1)
+		fatal("error reading from file: %s\n", strerror(errno));
+	if (libxfs_md2_index_check(frame, job->ext))
+		fatal("bad frame index in metadump image\n");
+
+	if (fread(job->payload, zlen, 1, src_f) != 1)
+		fatal("error reading from file: %s\n", strerror(errno));
+	return sizeof(*frame) +
+	       job->nextents * sizeof(struct xfs_md2_extent) + zlen;
+}
+
+/*
+ * A delta only holds the primary superblock if it changed, in which case it
+ * comes first as it does in a full image.
+ */
+static void
+perform_restore_v2(
+	FILE			*src_f,
+	int			dst_fd,
+	int			is_target_file,
+	xfs_sb_t		*sb,
+	bool			delta)
+{
+	struct restore_job	*job;
+	__int64_t		bytes_read = 0;
+	size_t			len;
+	bool			first = true;
+
+	pool_init(dst_fd, is_target_file,
+		  libxfs_md2_bound(XFS_MD2_FRAME_BYTES), XFS_MD2_FRAME_BYTES,
+		  XFS_MD2_FRAME_EXTENTS);
+	pool.delta = verify_only && delta;
+
+	for (;;) {
+		job = pool_get_job();
+		len = read_frame_v2(src_f, job);
+		if (!job->nextents)
+			break;
+
+		if (first && job->ext[0].me_daddr == 0) {
+			job_decode(job);
+			start_restore(job->data, sb,
+				      BBTOB(be32_to_cpu(job->ext[0].me_len)),
+				      dst_fd, is_target_file);
+		} else if (first && !delta) {
+			fatal("first block is not the primary superblock\n");
+		}
+		first = false;
+		pool_queue_job(job);
+
+		if (show_progress &&
+		    (bytes_read >> 20) != ((bytes_read + len) >> 20))
+			print_progress("%lld MB read", (bytes_read + len) >> 20);
+		bytes_read += len;
 	}
+	if (first && !delta)
+		fatal("metadump image contains no metadata\n");
 
-	if (pwrite(dst_fd, block_buffer, sb.sb_sectsize, 0) < 0)
-		fatal("error writing primary superblock: %s\n", strerror(errno));
+	pool_destroy();
+}
 
-	free(metablock);
+/*
+ * Restore image number @nimage of a chain onto the target. The first must
+ * be a full image and each one after it a delta of the one before, whose
+ * mh_id is passed in @id.
+ */
+static void
+perform_restore(
+	FILE			*src_f,
+	const char		*src_name,
+	int			dst_fd,
+	int			is_target_file,
+	xfs_sb_t		*sb,
+	int			nimage,
+	__uint64_t		*id)
+{
+	xfs_metablock_t		tmb;
+	struct xfs_md2_header	hdr;
+	bool			delta;
+
+	/*
+	 * read in first blocks (superblock 0), set "inprogress" flag for it,
+	 * read in the rest of the file, and if complete, clear SB 0's
+	 * "inprogress flag"
+	 */
+
+	if (fread(&tmb, sizeof(tmb), 1, src_f) != 1)
+		fatal("error reading from file: %s\n", strerror(errno));
+
+	if (be32_to_cpu(tmb.mb_magic) == XFS_MD_MAGIC) {
+		if (nimage)
+			fatal("%s is not a delta of the preceding image\n",
+				src_name);
+		perform_restore_v1(src_f, dst_fd, is_target_file, &tmb, sb);
+		return;
+	}
+	if (be32_to_cpu(tmb.mb_magic) != XFS_MD2_MAGIC)
+		fatal("specified file is not a metadata dump\n");
+
+	memcpy(&hdr, &tmb, sizeof(tmb));
+	if (fread((char *)&hdr + sizeof(tmb), sizeof(hdr) - sizeof(tmb), 1,
+		  src_f) != 1)
+		fatal("error reading from file: %s\n", strerror(errno));
+	if (be32_to_cpu(hdr.mh_version) != XFS_MD2_VERSION)
+		fatal("unsupported metadump version %u\n",
+			be32_to_cpu(hdr.mh_version));
+
+	delta = be32_to_cpu(hdr.mh_info) & XFS_METADUMP_DELTA;
+	if (!nimage && delta)
+		fatal("%s is a delta, restore the image it was taken "
+			"against first\n", src_name);
+	if (nimage && (!delta || be64_to_cpu(hdr.mh_base) != *id))
+		fatal("%s is not a delta of the preceding image\n", src_name);
+	*id = be64_to_cpu(hdr.mh_id);
+
+	perform_restore_v2(src_f, dst_fd, is_target_file, sb, delta);
 }
 
 static void
 usage(void)
 {
-	fprintf(stderr, "Usage: %s [-V] [-g] source target\n", progname);
+	fprintf(stderr,
+		"Usage: %s [-V] [-g] [-t threads] source [delta ...] target\n"
+		"       %s -v [-g] [-t threads] source [delta ...]\n",
+		progname, progname);
 	exit(1);
 }
 
 extern int	platform_check_ismounted(char *, char *, struct stat *, int);
 
+static FILE *
+open_source(
+	const char	*name)
+{
+	FILE		*src_f;
+
+	if (strcmp(name, "-") == 0) {
+		src_f = stdin;
+		if (isatty(fileno(stdin)))
+			fatal("cannot read from a terminal\n");
+	} else {
+		src_f = fopen(name, "rb");
+		if (src_f == NULL)
+			fatal("cannot open source dump file\n");
+	}
+	return src_f;
+}
+
+static void
+print_info(
+	FILE			*src_f,
+	const char		*name)
+{
+	struct xfs_md2_header	hdr;
+	__uint32_t		info;
+	int			version = 1;
+
+	if (fread(&hdr, sizeof(xfs_metablock_t), 1, src_f) != 1)
+		fatal("error reading from file: %s\n", strerror(errno));
+
+	if (be32_to_cpu(hdr.mh_magic) == XFS_MD2_MAGIC) {
+		if (fread((char *)&hdr + sizeof(xfs_metablock_t),
+			  sizeof(hdr) - sizeof(xfs_metablock_t), 1,
+			  src_f) != 1)
+			fatal("error reading from file: %s\n",
+				strerror(errno));
+		version = be32_to_cpu(hdr.mh_version);
+		info = be32_to_cpu(hdr.mh_info);
+	} else if (be32_to_cpu(hdr.mh_magic) == XFS_MD_MAGIC) {
+		info = ((xfs_metablock_t *)&hdr)->mb_info;
+	} else
+		fatal("specified file is not a metadata dump\n");
+
+	if (info & XFS_METADUMP_INFO_FLAGS) {
+		printf("%s: %sobfuscated, %s log, %s metadata blocks, "
+			"version %d%s\n",
+		name,
+		info & XFS_METADUMP_OBFUSCATED ? "":"not ",
+		info & XFS_METADUMP_DIRTYLOG ? "dirty":"clean",
+		info & XFS_METADUMP_FULLBLOCKS ? "full":"zeroed",
+		version,
+		info & XFS_METADUMP_DELTA ? ", delta" : "");
+	} else {
+		printf("%s: no informational flags present\n", name);
+	}
+
+	/* Go back to the beginning for the restore function */
+	fseek(src_f, 0L, SEEK_SET);
+}
+
+/*
+ * Run the verifiers over a chain of images rather than restoring it, and
+ * report what they found. The blocks a delta changes are checked in the
+ * chain as it stands with that delta applied, so the images after the
+ * first have to be opened by name.
+ */
+static int
+verify_images(
+	int		nimages,
+	char		**names)
+{
+	FILE		*src_f;
+	xfs_sb_t	sb;
+	__uint64_t	id = 0;
+	int		i;
+
+	for (i = 0; nimages > 1 && i < nimages; i++) {
+		if (strcmp(names[i], "-") == 0)
+			fatal("a chain of images can't be verified from "
+				"standard input\n");
+	}
+
+	for (i = 0; i < nimages; i++) {
+		if (i == 1) {
+			if (libxfs_mdimage_open(names[0], &verify_view))
+				exit(1);
+			if (!verify_view)
+				fatal("cannot read %s back as an image\n",
+					names[0]);
+		}
+		if (i >= 1 && libxfs_mdimage_stack(verify_view, names[i]))
+			exit(1);
+		src_f = open_source(names[i]);
+		if (show_info)
+			print_info(src_f, names[i]);
+		perform_restore(src_f, names[i], -1, 0, &sb, i, &id);
+		if (src_f != stdin)
+			fclose(src_f);
+	}
+	libxfs_mdimage_close(verify_view);
+
+	if (progress_since_warning)
+		putchar('\n');
+	printf("%llu metadata blocks verified, %llu with bad checksums, "
+		"%llu corrupt\n",
+		(unsigned long long)verify_totals.checked,
+		(unsigned long long)verify_totals.badcrc,
+		(unsigned long long)verify_totals.corrupt);
+	if (verify_totals.split)
+		printf("%llu blocks only partly in the image were not "
+			"checked\n",
+			(unsigned long long)verify_totals.split);
+	return verify_totals.badcrc || verify_totals.corrupt;
+}
+
 int
 main(
 	int 		argc,
@@ -211,10 +1349,14 @@ main(
 	int		open_flags;
 	struct stat	statbuf;
 	int		is_target_file;
+	char		*target;
+	xfs_sb_t	sb;
+	__uint64_t	id = 0;
+	int		i;
 
 	progname = basename(argv[0]);
 
-	while ((c = getopt(argc, argv, "giV")) != EOF) {
+	while ((c = getopt(argc, argv, "git:vV")) != EOF) {
 		switch (c) {
 			case 'g':
 				show_progress = 1;
@@ -222,6 +1364,14 @@ main(
 			case 'i':
 				show_info = 1;
 				break;
+			case 't':
+				nr_threads = atoi(optarg);
+				if (nr_threads <= 0)
+					fatal("bad thread count %s\n", optarg);
+				break;
+			case 'v':
+				verify_only = 1;
+				break;
 			case 'V':
 				printf("%s version %s\n", progname, VERSION);
 				exit(0);
@@ -230,57 +1380,25 @@ main(
 		}
 	}
 
-	if (argc - optind < 1 || argc - optind > 2)
+	if (argc - optind < 1)
 		usage();
 
-	/* show_info without a target is ok */
-	if (!show_info && argc - optind != 2)
-		usage();
+	if (verify_only)
+		return verify_images(argc - optind, argv + optind);
 
-	/* open source */
-	if (strcmp(argv[optind], "-") == 0) {
-		src_f = stdin;
-		if (isatty(fileno(stdin)))
-			fatal("cannot read from a terminal\n");
-	} else {
-		src_f = fopen(argv[optind], "rb");
-		if (src_f == NULL)
-			fatal("cannot open source dump file\n");
-	}
-
-	if (show_info) {
-		xfs_metablock_t		mb;
-
-		if (fread(&mb, sizeof(mb), 1, src_f) != 1)
-			fatal("error reading from file: %s\n", strerror(errno));
-
-		if (be32_to_cpu(mb.mb_magic) != XFS_MD_MAGIC)
-			fatal("specified file is not a metadata dump\n");
-
-		if (mb.mb_info & XFS_METADUMP_INFO_FLAGS) {
-			printf("%s: %sobfuscated, %s log, %s metadata blocks\n",
-			argv[optind],
-			mb.mb_info & XFS_METADUMP_OBFUSCATED ? "":"not ",
-			mb.mb_info & XFS_METADUMP_DIRTYLOG ? "dirty":"clean",
-			mb.mb_info & XFS_METADUMP_FULLBLOCKS ? "full":"zeroed");
-		} else {
-			printf("%s: no informational flags present\n",
-				argv[optind]);
-		}
-
-		if (argc - optind == 1)
-			exit(0);
-
-		/* Go back to the beginning for the restore function */
-		fseek(src_f, 0L, SEEK_SET);
+	/* show_info without a target is ok */
+	if (argc - optind == 1) {
+		if (!show_info)
+			usage();
+		print_info(open_source(argv[optind]), argv[optind]);
+		exit(0);
 	}
 
-	optind++;
-
 	/* check and open target */
+	target = argv[argc - 1];
 	open_flags = O_RDWR;
 	is_target_file = 0;
-	if (stat(argv[optind], &statbuf) < 0)  {
+	if (stat(target, &statbuf) < 0)  {
 		/* ok, assume it's a file and create it */
 		open_flags |= O_CREAT;
 		is_target_file = 1;
@@ -291,21 +1409,28 @@ main(
 		/*
 		 * check to make sure a filesystem isn't mounted on the device
 		 */
-		if (platform_check_ismounted(argv[optind], NULL, &statbuf, 0))
+		if (platform_check_ismounted(target, NULL, &statbuf, 0))
 			fatal("a filesystem is mounted on target device \"%s\","
 				" cannot restore to a mounted filesystem.\n",
-				argv[optind]);
+				target);
 	}
 
-	dst_fd = open(argv[optind], open_flags, 0644);
+	dst_fd = open(target, open_flags, 0644);
 	if (dst_fd < 0)
-		fatal("couldn't open target \"%s\"\n", argv[optind]);
+		fatal("couldn't open target \"%s\"\n", target);
 
-	perform_restore(src_f, dst_fd, is_target_file);
+	/* a full image, then any deltas in the order they were taken */
+	for (i = 0; optind + i < argc - 1; i++) {
+		src_f = open_source(argv[optind + i]);
+		if (show_info)
+			print_info(src_f, argv[optind + i]);
+		perform_restore(src_f, argv[optind + i], dst_fd,
+				is_target_file, &sb, i, &id);
+		if (src_f != stdin)
+			fclose(src_f);
+	}
+	finish_restore(&sb, dst_fd);
 
 	close(dst_fd);
-	if (src_f != stdin)
-		fclose(src_f);
-
 	return 0;
 }
@@ -479,6 +479,125 @@ btree_uncached_lookup(
 	return key_found ? node : NULL;
 }
 
+/*
+ * Cursor-less lookups.  These never touch the lookup cache, so unlike the
+ * functions above they can be run by several threads at once as long as
+ * nobody is modifying the tree.
+ */
+
+/*
+ * Find the item with the largest key that is less than or equal to @key.
+ *
+ * The last item in each leaf but the rightmost has its key stored in the
+ * closest ancestor that bounds it, and the item before the first one in a
+ * leaf is the last item in the rightmost leaf of the subtree to the left,
+ * so remember both on the way down.
+ */
+void *
+btree_uncached_find_le(
+	struct btree_root	*root,
+	unsigned long		key,
+	unsigned long		*actual_key)
+{
+	struct btree_node	*node = root->root_node;
+	struct btree_node	*lo_node = NULL;
+	unsigned long		lo_key = 0;
+	unsigned long		hi_key = 0;
+	int			hi_found = 0;
+	int			lo_height = 0;
+	int			height = root->height - 1;
+	int			i;
+
+	for (;;) {
+		for (i = 0; i < node->num_keys; i++)
+			if (node->keys[i] >= key)
+				break;
+		if (height == 0)
+			break;
+		if (i < node->num_keys) {
+			hi_key = node->keys[i];
+			hi_found = 1;
+		}
+		if (i > 0) {
+			lo_key = node->keys[i - 1];
+			lo_node = node->ptrs[i - 1];
+			lo_height = height - 1;
+		}
+		node = node->ptrs[i];
+		height--;
+	}
+
+	if (i < node->num_keys) {
+		if (node->keys[i] == key)
+			goto found;
+	} else if (hi_found && hi_key == key) {
+		lo_key = hi_key;
+		goto found;
+	}
+	if (i > 0) {
+		i--;
+		goto found;
+	}
+	if (!lo_node)
+		return NULL;
+
+	node = lo_node;
+	while (lo_height-- > 0)
+		node = node->ptrs[node->num_keys];
+	if (actual_key)
+		*actual_key = lo_key;
+	return node->ptrs[node->num_keys];
+
+found:
+	if (actual_key)
+		*actual_key = i < node->num_keys ? node->keys[i] : lo_key;
+	return node->ptrs[i];
+}
+
+void *
+btree_uncached_first(
+	struct btree_root	*root,
+	unsigned long		*key)
+{
+	struct btree_node	*node = root->root_node;
+	int			height = root->height;
+
+	if (height == 1 && node->num_keys == 0)
+		return NULL;
+
+	/* the first item's key lives in the lowest node that has any keys */
+	while (--height >= 0) {
+		if (key && node->num_keys)
+			*key = node->keys[0];
+		if (height)
+			node = node->ptrs[0];
+	}
+	return node->ptrs[0];
+}
+
+void *
+btree_uncached_last(
+	struct btree_root	*root,
+	unsigned long		*key)
+{
+	struct btree_node	*node = root->root_node;
+	int			height = root->height;
+
+	if (height == 1 && node->num_keys == 0)
+		return NULL;
+
+	/*
+	 * The rightmost leaf has no bounding key above it, so its items are
+	 * exactly those with keys in the leaf itself.
+	 */
+	while (--height > 0)
+		node = node->ptrs[node->num_keys];
+	ASSERT(node->num_keys > 0);
+	if (key)
+		*key = node->keys[node->num_keys - 1];
+	return node->ptrs[node->num_keys - 1];
+}
+
 /* Update functions */
 
 static inline void
@@ -92,6 +92,26 @@ void
 btree_clear(
 	struct btree_root	*root);
 
+/*
+ * Lookups that leave the cursor alone, for trees searched by several
+ * threads at once.
+ */
+void *
+btree_uncached_find_le(
+	struct btree_root	*root,
+	unsigned long		key,
+	unsigned long		*actual_key);
+
+void *
+btree_uncached_first(
+	struct btree_root	*root,
+	unsigned long		*key);
+
+void *
+btree_uncached_last(
+	struct btree_root	*root,
+	unsigned long		*key);
+
 #ifdef BTREE_STATS
 void
 btree_print_stats(
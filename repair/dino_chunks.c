@@ -17,7 +17,6 @@
  */
 
 #include "libxfs.h"
-#include "avl.h"
 #include "globals.h"
 #include "agheader.h"
 #include "incore.h"
@@ -291,7 +290,7 @@ verify_inode_chunk(xfs_mount_t		*mp,
 	 * if we have known inode chunks in our search range, establish
 	 * their start and end-points to tighten our search range.  range
 	 * is [start, end) -- e.g. max/end agbno is one beyond the
-	 * last block to be examined.  the avl routines work this way.
+	 * last block to be examined.  the tree routines work this way.
 	 */
 	if (irec_before_p)  {
 		/*
@@ -607,6 +606,7 @@ process_inode_chunk(
 	xfs_ino_t		parent;
 	ino_tree_node_t		*ino_rec;
 	xfs_buf_t		**bplist;
+	int			*bad_crc;
 	xfs_dinode_t		*dino;
 	int			icnt;
 	int			status;
@@ -653,6 +653,10 @@ process_inode_chunk(
 	if (bplist == NULL)
 		do_error(_("failed to allocate %zd bytes of memory\n"),
 			cluster_count * sizeof(xfs_buf_t *));
+	bad_crc = malloc(cluster_count * inodes_per_cluster * sizeof(int));
+	if (bad_crc == NULL)
+		do_error(_("failed to allocate %zd bytes of memory\n"),
+			cluster_count * inodes_per_cluster * sizeof(int));
 
 	for (bp_index = 0; bp_index < cluster_count; bp_index++) {
 		/*
@@ -684,6 +688,7 @@ process_inode_chunk(
 				libxfs_putbuf(bplist[bp_index]);
 			}
 			free(bplist);
+			free(bad_crc);
 			return(1);
 		}
 
@@ -692,6 +697,8 @@ process_inode_chunk(
 			XFS_BUF_COUNT(bplist[bp_index]), agno);
 
 		bplist[bp_index]->b_ops = &xfs_inode_buf_ops;
+		dinode_bad_crcs(mp, bplist[bp_index],
+				&bad_crc[bp_index * inodes_per_cluster]);
 
 next_readbuf:
 		irec_offset += mp->m_sb.sb_inopblock * blks_per_cluster;
@@ -728,7 +735,10 @@ next_readbuf:
 				 * to reset them later to keep from losing the
 				 * chunk that they're in
 				 */
-				if (verify_dinode(mp, dino, agno, agino) == 0 ||
+				if (verify_dinode(mp, dino, agno, agino,
+						bad_crc[bp_index *
+							inodes_per_cluster +
+							cluster_offset]) == 0 ||
 						(agno == 0 &&
 						(mp->m_sb.sb_rootino == agino ||
 						 mp->m_sb.sb_rsumino == agino ||
@@ -771,6 +781,7 @@ next_readbuf:
 				if (bplist[bp_index])
 					libxfs_putbuf(bplist[bp_index]);
 			free(bplist);
+			free(bad_crc);
 			return(0);
 		}
 
@@ -810,7 +821,10 @@ next_readbuf:
 		status = process_dinode(mp, dino, agno, agino,
 				is_inode_free(ino_rec, irec_offset),
 				&ino_dirty, &is_used,ino_discovery, check_dups,
-				extra_attr_check, &isa_dir, &parent);
+				extra_attr_check,
+				bad_crc[bp_index * inodes_per_cluster +
+					cluster_offset],
+				&isa_dir, &parent);
 
 		ASSERT(is_used != 3);
 		if (ino_dirty) {
@@ -955,6 +969,7 @@ process_next:
 					libxfs_putbuf(bplist[bp_index]);
 			}
 			free(bplist);
+			free(bad_crc);
 			break;
 		} else if (ibuf_offset == mp->m_sb.sb_inopblock)  {
 			/*
@@ -17,7 +17,6 @@
  */
 
 #include "libxfs.h"
-#include "avl.h"
 #include "globals.h"
 #include "agheader.h"
 #include "incore.h"
@@ -2220,6 +2219,7 @@ process_dinode_int(xfs_mount_t *mp,
 		int check_dups,		/* 1 == check if inode claims
 					 * duplicate blocks		*/
 		int extra_attr_check, /* 1 == do attribute format and value checks */
+		int bad_crc,		/* 1 == inode failed its crc check */
 		int *isa_dir,		/* out == 1 if inode is a directory */
 		xfs_ino_t *parent)	/* out -- parent if ino is a dir */
 {
@@ -2263,10 +2263,11 @@ process_dinode_int(xfs_mount_t *mp,
 	 *
 	 * Of course if we make any modifications after this, the inode gets
 	 * rewritten, and the CRC is updated automagically.
+	 *
+	 * The caller checks the CRC so that it can do a whole cluster of
+	 * inodes at once, see dinode_bad_crcs().
 	 */
-	if (xfs_sb_version_hascrc(&mp->m_sb) &&
-	    !libxfs_verify_cksum((char *)dino, mp->m_sb.sb_inodesize,
-				XFS_DINODE_CRC_OFF)) {
+	if (xfs_sb_version_hascrc(&mp->m_sb) && bad_crc) {
 		retval = 1;
 		if (!uncertain)
 			do_warn(_("bad CRC for inode %" PRIu64 "%c"),
@@ -2832,6 +2833,7 @@ process_dinode(
 	int		ino_discovery,
 	int		check_dups,
 	int		extra_attr_check,
+	int		bad_crc,
 	int		*isa_dir,
 	xfs_ino_t	*parent)
 {
@@ -2843,7 +2845,8 @@ process_dinode(
 #endif
 	return process_dinode_int(mp, dino, agno, ino, was_free, dirty, used,
 				verify_mode, uncertain, ino_discovery,
-				check_dups, extra_attr_check, isa_dir, parent);
+				check_dups, extra_attr_check, bad_crc,
+				isa_dir, parent);
 }
 
 /*
@@ -2857,7 +2860,8 @@ verify_dinode(
 	xfs_mount_t	*mp,
 	xfs_dinode_t	*dino,
 	xfs_agnumber_t	agno,
-	xfs_agino_t	ino)
+	xfs_agino_t	ino,
+	int		bad_crc)
 {
 	xfs_ino_t	parent;
 	int		used = 0;
@@ -2870,7 +2874,7 @@ verify_dinode(
 
 	return process_dinode_int(mp, dino, agno, ino, 0, &dirty, &used,
 				verify_mode, uncertain, ino_discovery,
-				check_dups, 0, &isa_dir, &parent);
+				check_dups, 0, bad_crc, &isa_dir, &parent);
 }
 
 /*
@@ -2893,8 +2897,45 @@ verify_uncertain_dinode(
 	const int	check_dups = 0;
 	const int	ino_discovery = 0;
 	const int	uncertain = 1;
+	int		bad_crc;
+
+	bad_crc = !libxfs_verify_cksum((char *)dino, mp->m_sb.sb_inodesize,
+				XFS_DINODE_CRC_OFF);
 
 	return process_dinode_int(mp, dino, agno, ino, 0, &dirty, &used,
 				verify_mode, uncertain, ino_discovery,
-				check_dups, 0, &isa_dir, &parent);
+				check_dups, 0, bad_crc, &isa_dir, &parent);
+}
+
+/*
+ * Check the CRCs of all the inodes in a cluster buffer in one go, setting
+ * bad_crc[i] for each inode i that fails.  Computing them together rather
+ * than inode by inode lets the crc32c code keep several of them in flight.
+ */
+void
+dinode_bad_crcs(
+	xfs_mount_t	*mp,
+	xfs_buf_t	*bp,
+	int		*bad_crc)
+{
+	char		*inodes[XFS_INODES_PER_CHUNK];
+	bool		good[XFS_INODES_PER_CHUNK];
+	int		icount;
+	int		i, j, n;
+
+	icount = XFS_BUF_COUNT(bp) >> mp->m_sb.sb_inodelog;
+	if (!xfs_sb_version_hascrc(&mp->m_sb)) {
+		memset(bad_crc, 0, icount * sizeof(*bad_crc));
+		return;
+	}
+
+	for (i = 0; i < icount; i += n) {
+		n = min(icount - i, XFS_INODES_PER_CHUNK);
+		for (j = 0; j < n; j++)
+			inodes[j] = (char *)xfs_make_iptr(mp, bp, i + j);
+		libxfs_verify_cksums(inodes, n, mp->m_sb.sb_inodesize,
+				XFS_DINODE_CRC_OFF, good);
+		for (j = 0; j < n; j++)
+			bad_crc[i + j] = !good[j];
+	}
 }
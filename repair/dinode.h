@@ -74,6 +74,7 @@ process_dinode(xfs_mount_t *mp,
 		int check_dirs,
 		int check_dups,
 		int extra_attr_check,
+		int bad_crc,
 		int *isa_dir,
 		xfs_ino_t *parent);
 
@@ -81,7 +82,8 @@ int
 verify_dinode(xfs_mount_t *mp,
 		xfs_dinode_t *dino,
 		xfs_agnumber_t agno,
-		xfs_agino_t ino);
+		xfs_agino_t ino,
+		int bad_crc);
 
 int
 verify_uncertain_dinode(xfs_mount_t *mp,
@@ -89,6 +91,11 @@ verify_uncertain_dinode(xfs_mount_t *mp,
 		xfs_agnumber_t agno,
 		xfs_agino_t ino);
 
+void
+dinode_bad_crcs(xfs_mount_t *mp,
+		xfs_buf_t *bp,
+		int *bad_crc);
+
 int
 verify_inum(xfs_mount_t		*mp,
 		xfs_ino_t	ino);
@@ -183,4 +183,6 @@ EXTERN __uint64_t 	*prog_rpt_done;
 EXTERN int		ag_stride;
 EXTERN int		thread_count;
 
+EXTERN int		bcache_flags;	/* buffer cache_init() flags */
+
 #endif /* _XFS_REPAIR_GLOBAL_H */
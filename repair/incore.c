@@ -17,7 +17,6 @@
  */
 
 #include "libxfs.h"
-#include "avl.h"
 #include "btree.h"
 #include "globals.h"
 #include "incore.h"
@@ -26,25 +25,116 @@
 #include "err_protos.h"
 #include "threads.h"
 
+/* block records fit into __uint64_t's units */
+#define XR_BB_UNIT	64			/* number of bits/unit */
+#define XR_BB		4			/* bits per block record */
+#define XR_BB_NUM	(XR_BB_UNIT/XR_BB)	/* number of records per unit */
+#define XR_BB_MASK	0xF			/* block record mask */
+#define XR_BB_FILL	0x1111111111111111ULL	/* 1 in each record */
+
+/*
+ * Packed block maps hold XR_BB bits of state for each block.
+ */
+static inline int
+packed_get(
+	__uint64_t	*map,
+	unsigned long	bno)
+{
+	return (map[bno / XR_BB_NUM] >> ((bno % XR_BB_NUM) * XR_BB)) &
+		XR_BB_MASK;
+}
+
+static inline void
+packed_set(
+	__uint64_t	*map,
+	unsigned long	bno,
+	int		state)
+{
+	__uint64_t	*unit = &map[bno / XR_BB_NUM];
+	int		shift = (bno % XR_BB_NUM) * XR_BB;
+
+	*unit = (*unit & ~((__uint64_t)XR_BB_MASK << shift)) |
+		((__uint64_t)state << shift);
+}
+
+static void
+packed_set_range(
+	__uint64_t	*map,
+	unsigned long	bno,
+	unsigned long	end,
+	int		state)
+{
+	for (; bno < end && (bno % XR_BB_NUM); bno++)
+		packed_set(map, bno, state);
+	for (; bno + XR_BB_NUM <= end; bno += XR_BB_NUM)
+		map[bno / XR_BB_NUM] = XR_BB_FILL * state;
+	for (; bno < end; bno++)
+		packed_set(map, bno, state);
+}
+
+/*
+ * Return the end of the run of blocks with the same state as @bno, looking
+ * no further than @end.
+ */
+static unsigned long
+packed_run_end(
+	__uint64_t	*map,
+	unsigned long	bno,
+	unsigned long	end)
+{
+	int		state = packed_get(map, bno);
+	__uint64_t	fill = XR_BB_FILL * state;
+
+	for (bno++; bno < end && (bno % XR_BB_NUM); bno++)
+		if (packed_get(map, bno) != state)
+			return bno;
+	for (; bno + XR_BB_NUM <= end; bno += XR_BB_NUM)
+		if (map[bno / XR_BB_NUM] != fill)
+			break;
+	for (; bno < end; bno++)
+		if (packed_get(map, bno) != state)
+			return bno;
+	return end;
+}
+
 /*
- * The following manages the in-core bitmap of the entire filesystem
- * using extents in a btree.
+ * The following manages the in-core bitmap of the entire filesystem.
  *
- * The btree items will point to one of the state values below,
- * rather than storing the value itself in the pointer.
+ * Each AG starts out mapped by extents in a btree. The btree items will point
+ * to one of the state values below, rather than storing the value itself in
+ * the pointer. That is compact while the AG has few extents, but on a badly
+ * fragmented AG the btree can need far more memory than simply storing the
+ * state of every block, and every lookup is a tree descent. So once an AG's
+ * btree grows beyond the size of a packed map of the AG, the AG is converted
+ * to a packed map until the maps are next reset.
+ *
+ * Both forms rely on the caller to serialise access to an AG's map, either by
+ * being the only thread working on the AG or by holding its ag_locks entry.
  */
 static int states[16] =
 	{0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
 
-static struct btree_root	**ag_bmap;
+/* approximate memory used by each btree record */
+#define XR_BMAP_BTREE_REC	24
+
+struct ag_bmap {
+	struct btree_root	*btree;		/* extent map */
+	__uint64_t		*packed;	/* or packed map, if not NULL */
+	xfs_agblock_t		size;		/* blocks in the AG */
+	unsigned long		nrecs;		/* records in btree */
+	unsigned long		max_recs;	/* convert beyond this */
+};
+
+static struct ag_bmap		*ag_bmap;
 
 static void
 update_bmap(
-	struct btree_root	*bmap,
+	struct ag_bmap		*agb,
 	unsigned long		offset,
 	xfs_extlen_t		blen,
 	void			*new_state)
 {
+	struct btree_root	*bmap = agb->btree;
 	unsigned long		end = offset + blen;
 	int			*cur_state;
 	unsigned long		cur_key;
@@ -79,6 +169,7 @@ update_bmap(
 			/* #4: insert new extent after, update current value */
 			btree_update_value(bmap, offset, new_state);
 			btree_insert(bmap, end, cur_state);
+			agb->nrecs++;
 			return;
 		}
 
@@ -89,12 +180,14 @@ update_bmap(
 				/* #3: merge prev & next */
 				btree_delete(bmap, offset);
 				btree_delete(bmap, end);
+				agb->nrecs -= 2;
 				return;
 			}
 
 			/* #8: merge next */
 			btree_update_value(bmap, offset, new_state);
 			btree_delete(bmap, end);
+			agb->nrecs--;
 			return;
 		}
 
@@ -102,6 +195,7 @@ update_bmap(
 		if (new_state == prev_state) {
 			/* #5: prev has same state */
 			btree_delete(bmap, offset);
+			agb->nrecs--;
 			return;
 		}
 
@@ -126,12 +220,49 @@ update_bmap(
 
 		/* #9: different start, same end, add new extent */
 		btree_insert(bmap, offset, new_state);
+		agb->nrecs++;
 		return;
 	}
 
 	/* #2: insert an extent into the middle of another extent */
 	btree_insert(bmap, offset, new_state);
 	btree_insert(bmap, end, prev_state);
+	agb->nrecs += 2;
+}
+
+/*
+ * Switch an AG from the btree to a packed map.  If we can't get the memory
+ * for the packed map, carry on with the btree.
+ */
+static void
+convert_bmap_to_packed(
+	struct ag_bmap		*agb)
+{
+	__uint64_t		*packed;
+	int			*statep;
+	unsigned long		key;
+	unsigned long		next_key;
+
+	packed = malloc(roundup(agb->size, XR_BB_NUM) / NBBY * XR_BB);
+	if (!packed) {
+		agb->max_recs = ULONG_MAX;
+		return;
+	}
+
+	statep = btree_find(agb->btree, 0, &key);
+	while (statep && key < agb->size) {
+		int		state = *statep;
+
+		statep = btree_lookup_next(agb->btree, &next_key);
+		packed_set_range(packed, key,
+				 statep ? MIN(next_key, agb->size) : agb->size,
+				 state);
+		key = next_key;
+	}
+
+	btree_clear(agb->btree);
+	agb->nrecs = 0;
+	agb->packed = packed;
 }
 
 void
@@ -141,7 +272,19 @@ set_bmap_ext(
 	xfs_extlen_t		blen,
 	int			state)
 {
-	update_bmap(ag_bmap[agno], agbno, blen, &states[state]);
+	struct ag_bmap		*agb = &ag_bmap[agno];
+
+	if (agb->packed) {
+		if (agbno >= agb->size)
+			return;
+		packed_set_range(agb->packed, agbno,
+				 MIN(agbno + blen, agb->size), state);
+		return;
+	}
+
+	update_bmap(agb, agbno, blen, &states[state]);
+	if (agb->nrecs > agb->max_recs)
+		convert_bmap_to_packed(agb);
 }
 
 int
@@ -151,23 +294,37 @@ get_bmap_ext(
 	xfs_agblock_t		maxbno,
 	xfs_extlen_t		*blen)
 {
+	struct ag_bmap		*agb = &ag_bmap[agno];
 	int			*statep;
 	unsigned long		key;
 
-	statep = btree_find(ag_bmap[agno], agbno, &key);
+	if (agb->packed) {
+		/* everything past the end of the AG is a single bad extent */
+		if (agbno >= agb->size) {
+			if (agbno > agb->size || blen)
+				return -1;
+			return XR_E_BAD_STATE;
+		}
+		if (blen)
+			*blen = packed_run_end(agb->packed, agbno,
+					MIN(maxbno, agb->size)) - agbno;
+		return packed_get(agb->packed, agbno);
+	}
+
+	statep = btree_find(agb->btree, agbno, &key);
 	if (!statep)
 		return -1;
 
 	if (key == agbno) {
 		if (blen) {
-			if (!btree_peek_next(ag_bmap[agno], &key))
+			if (!btree_peek_next(agb->btree, &key))
 				return -1;
 			*blen = MIN(maxbno, key) - agbno;
 		}
 		return *statep;
 	}
 
-	statep = btree_peek_prev(ag_bmap[agno], NULL);
+	statep = btree_peek_prev(agb->btree, NULL);
 	if (!statep)
 		return -1;
 	if (blen)
@@ -179,12 +336,6 @@ get_bmap_ext(
 static uint64_t		*rt_bmap;
 static size_t		rt_bmap_size;
 
-/* block records fit into __uint64_t's units */
-#define XR_BB_UNIT	64			/* number of bits/unit */
-#define XR_BB		4			/* bits per block record */
-#define XR_BB_NUM	(XR_BB_UNIT/XR_BB)	/* number of records per unit */
-#define XR_BB_MASK	0xF			/* block record mask */
-
 /*
  * these work in real-time extents (e.g. fsbno == rt extent number)
  */
@@ -192,8 +343,7 @@ int
 get_rtbmap(
 	xfs_rtblock_t	bno)
 {
-	return (*(rt_bmap + bno /  XR_BB_NUM) >>
-		((bno % XR_BB_NUM) * XR_BB)) & XR_BB_MASK;
+	return packed_get(rt_bmap, bno);
 }
 
 void
@@ -201,10 +351,7 @@ set_rtbmap(
 	xfs_rtblock_t	bno,
 	int		state)
 {
-	*(rt_bmap + bno / XR_BB_NUM) =
-	 ((*(rt_bmap + bno / XR_BB_NUM) &
-	  (~((__uint64_t) XR_BB_MASK << ((bno % XR_BB_NUM) * XR_BB)))) |
-	 (((__uint64_t) state) << ((bno % XR_BB_NUM) * XR_BB)));
+	packed_set(rt_bmap, bno, state);
 }
 
 static void
@@ -252,15 +399,22 @@ reset_bmaps(xfs_mount_t *mp)
 	ag_size = mp->m_sb.sb_agblocks;
 
 	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		struct ag_bmap	*agb = &ag_bmap[agno];
+
 		if (agno == mp->m_sb.sb_agcount - 1)
 			ag_size = (xfs_extlen_t)(mp->m_sb.sb_dblocks -
 				   (xfs_rfsblock_t)mp->m_sb.sb_agblocks * agno);
 #ifdef BTREE_STATS
-		if (btree_find(ag_bmap[agno], 0, NULL)) {
+		if (btree_find(agb->btree, 0, NULL)) {
 			printf("ag_bmap[%d] btree stats:\n", i);
-			btree_print_stats(ag_bmap[agno], stdout);
+			btree_print_stats(agb->btree, stdout);
 		}
 #endif
+		free(agb->packed);
+		agb->packed = NULL;
+		agb->size = ag_size;
+		agb->max_recs = (ag_size / NBBY * XR_BB) / XR_BMAP_BTREE_REC;
+
 		/*
 		 * We always insert an item for the first block having a
 		 * given state.  So the code below means:
@@ -269,11 +423,11 @@ reset_bmaps(xfs_mount_t *mp)
 		 *	ag_hdr_block..ag_size:		XR_E_UNKNOWN
 		 *	ag_size...			XR_E_BAD_STATE
 		 */
-		btree_clear(ag_bmap[agno]);
-		btree_insert(ag_bmap[agno], 0, &states[XR_E_INUSE_FS]);
-		btree_insert(ag_bmap[agno],
-				ag_hdr_block, &states[XR_E_UNKNOWN]);
-		btree_insert(ag_bmap[agno], ag_size, &states[XR_E_BAD_STATE]);
+		btree_clear(agb->btree);
+		btree_insert(agb->btree, 0, &states[XR_E_INUSE_FS]);
+		btree_insert(agb->btree, ag_hdr_block, &states[XR_E_UNKNOWN]);
+		btree_insert(agb->btree, ag_size, &states[XR_E_BAD_STATE]);
+		agb->nrecs = 3;
 	}
 
 	if (mp->m_sb.sb_logstart != 0) {
@@ -290,7 +444,7 @@ init_bmaps(xfs_mount_t *mp)
 {
 	xfs_agnumber_t i;
 
-	ag_bmap = calloc(mp->m_sb.sb_agcount, sizeof(struct btree_root *));
+	ag_bmap = calloc(mp->m_sb.sb_agcount, sizeof(struct ag_bmap));
 	if (!ag_bmap)
 		do_error(_("couldn't allocate block map btree roots\n"));
 
@@ -299,7 +453,7 @@ init_bmaps(xfs_mount_t *mp)
 		do_error(_("couldn't allocate block map locks\n"));
 
 	for (i = 0; i < mp->m_sb.sb_agcount; i++)  {
-		btree_init(&ag_bmap[i]);
+		btree_init(&ag_bmap[i].btree);
 		pthread_mutex_init(&ag_locks[i].lock, NULL);
 	}
 
@@ -312,8 +466,10 @@ free_bmaps(xfs_mount_t *mp)
 {
 	xfs_agnumber_t i;
 
-	for (i = 0; i < mp->m_sb.sb_agcount; i++)
-		btree_destroy(ag_bmap[i]);
+	for (i = 0; i < mp->m_sb.sb_agcount; i++) {
+		btree_destroy(ag_bmap[i].btree);
+		free(ag_bmap[i].packed);
+	}
 	free(ag_bmap);
 	ag_bmap = NULL;
 
@@ -19,7 +19,8 @@
 #ifndef XFS_REPAIR_INCORE_H
 #define XFS_REPAIR_INCORE_H
 
-#include "avl.h"
+#include "avl64.h"
+#include "btree.h"
 
 
 /*
@@ -67,7 +68,6 @@ get_bmap(xfs_agnumber_t agno, xfs_agblock_t agbno)
 typedef unsigned char extent_state_t;
 
 typedef struct extent_tree_node  {
-	avlnode_t		avl_node;
 	xfs_agblock_t		ex_startblock;	/* starting block (agbno) */
 	xfs_extlen_t		ex_blockcount;	/* number of blocks in extent */
 	extent_state_t		ex_state;	/* see state flags below */
@@ -81,7 +81,7 @@ typedef struct extent_tree_node  {
 } extent_tree_node_t;
 
 typedef struct rt_extent_tree_node  {
-	avlnode_t		avl_node;
+	avl64node_t		avl_node;
 	xfs_rtblock_t		rt_startblock;	/* starting realtime block */
 	xfs_extlen_t		rt_blockcount;	/* number of blocks in extent */
 	extent_state_t		rt_state;	/* see state flags below */
@@ -134,8 +134,8 @@ find_bno_extent(xfs_agnumber_t agno, xfs_agblock_t agbno);
 extent_tree_node_t *
 findfirst_bno_extent(xfs_agnumber_t agno);
 
-#define findnext_bno_extent(exent_ptr)	\
-		((extent_tree_node_t *) ((exent_ptr)->avl_node.avl_nextino))
+extent_tree_node_t *
+findnext_bno_extent(xfs_agnumber_t agno, extent_tree_node_t *ext);
 
 void
 get_bno_extent(xfs_agnumber_t agno, extent_tree_node_t *ext);
@@ -278,7 +278,7 @@ typedef struct ino_ex_data  {
 } ino_ex_data_t;
 
 typedef struct ino_tree_node  {
-	avlnode_t		avl_node;
+	struct ino_tree_node	*next;		/* next record in inode order */
 	xfs_agino_t		ino_startnum;	/* starting inode # */
 	xfs_inofree_t		ir_free;	/* inode free bit mask */
 	__uint64_t		ir_sparse;	/* sparse inode bitmask */
@@ -311,7 +311,7 @@ void		free_inode_rec(xfs_agnumber_t agno, ino_tree_node_t *ino_rec);
 void		get_inode_rec(struct xfs_mount *mp, xfs_agnumber_t agno,
 			      ino_tree_node_t *ino_rec);
 
-extern avltree_desc_t     **inode_tree_ptrs;
+extern struct btree_root	**inode_tree_ptrs;
 
 static inline int
 get_inode_offset(struct xfs_mount *mp, xfs_ino_t ino, ino_tree_node_t *irec)
@@ -321,18 +321,22 @@ get_inode_offset(struct xfs_mount *mp, xfs_ino_t ino, ino_tree_node_t *irec)
 static inline ino_tree_node_t *
 findfirst_inode_rec(xfs_agnumber_t agno)
 {
-	return((ino_tree_node_t *) inode_tree_ptrs[agno]->avl_firstino);
+	return btree_uncached_first(inode_tree_ptrs[agno], NULL);
 }
 static inline ino_tree_node_t *
 find_inode_rec(struct xfs_mount *mp, xfs_agnumber_t agno, xfs_agino_t ino)
 {
+	ino_tree_node_t		*irec;
+
 	/*
 	 * Is the AG inside the file system
 	 */
 	if (agno >= mp->m_sb.sb_agcount)
 		return NULL;
-	return((ino_tree_node_t *)
-		avl_findrange(inode_tree_ptrs[agno], ino));
+	irec = btree_uncached_find_le(inode_tree_ptrs[agno], ino, NULL);
+	if (irec && ino - irec->ino_startnum < XFS_INODES_PER_CHUNK)
+		return irec;
+	return NULL;
 }
 void		find_inode_rec_range(struct xfs_mount *mp, xfs_agnumber_t agno,
 			xfs_agino_t start_ino, xfs_agino_t end_ino,
@@ -370,14 +374,7 @@ void			clear_uncertain_ino_cache(xfs_agnumber_t agno);
 /*
  * return next in-order inode tree node.  takes an "ino_tree_node_t *"
  */
-#define next_ino_rec(ino_node_ptr)	\
-		((ino_tree_node_t *) ((ino_node_ptr)->avl_node.avl_nextino))
-/*
- * return the next linked inode (forward avl tree link)-- meant to be used
- * by linked list routines (uncertain inode routines/records)
- */
-#define next_link_rec(ino_node_ptr)	\
-		((ino_tree_node_t *) ((ino_node_ptr)->avl_node.avl_forw))
+#define next_ino_rec(ino_node_ptr)	((ino_node_ptr)->next)
 
 /*
  * finobt helpers
@@ -17,7 +17,6 @@
  */
 
 #include "libxfs.h"
-#include "avl.h"
 #include "btree.h"
 #include "globals.h"
 #include "incore.h"
@@ -26,14 +25,16 @@
 #include "err_protos.h"
 #include "avl64.h"
 #include "threads.h"
+#include "spill.h"
 
 /*
  * note:  there are 4 sets of incore things handled here:
  * block bitmaps, extent trees, uncertain inode list,
- * and inode tree.  The tree-based code uses the AVL
- * tree package used by the IRIX kernel VM code
- * (sys/avl.h).  The inode list code uses the same records
- * as the inode tree code for convenience.  The bitmaps
+ * and inode tree.  The tree-based code uses the btree
+ * code in btree.c, except for the realtime duplicate
+ * extent tree which needs 64-bit keys and so uses the
+ * AVL tree package in avl64.c.  The inode list code uses
+ * the same records as the inode tree code for convenience.  The bitmaps
  * and bitmap operators are mostly macros defined in incore.h.
  * There are one of everything per AG except for extent
  * trees.  There's one duplicate extent tree, one bno and
@@ -50,13 +51,13 @@ static pthread_mutex_t	rt_ext_tree_lock;
 static struct btree_root **dup_extent_trees;	/* per ag dup extent trees */
 static pthread_mutex_t *dup_extent_tree_locks;
 
-static avltree_desc_t	**extent_bno_ptrs;	/*
+static struct btree_root **extent_bno_ptrs;	/*
 						 * array of extent tree ptrs
 						 * one per ag for free extents
 						 * sorted by starting block
 						 * number
 						 */
-static avltree_desc_t	**extent_bcnt_ptrs;	/*
+static struct btree_root **extent_bcnt_ptrs;	/*
 						 * array of extent tree ptrs
 						 * one per ag for free extents
 						 * sorted by size
@@ -120,8 +121,8 @@ out:
 
 
 /*
- * extent tree stuff is avl trees of duplicate extents,
- * sorted in order by block number.  there is one tree per ag.
+ * extent tree stuff is btrees of free extents, sorted in order
+ * by block number or size.  there is one of each per ag.
  */
 
 static extent_tree_node_t *
@@ -130,11 +131,10 @@ mk_extent_tree_nodes(xfs_agblock_t new_startblock,
 {
 	extent_tree_node_t *new;
 
-	new = malloc(sizeof(*new));
+	new = spill_malloc(sizeof(*new));
 	if (!new)
 		do_error(_("couldn't allocate new extent descriptor.\n"));
 
-	new->avl_node.avl_nextino = NULL;
 	new->ex_startblock = new_startblock;
 	new->ex_blockcount = new_blockcount;
 	new->ex_state = new_state;
@@ -147,7 +147,7 @@ mk_extent_tree_nodes(xfs_agblock_t new_startblock,
 void
 release_extent_tree_node(extent_tree_node_t *node)
 {
-	free(node);
+	spill_free(node);
 }
 
 /*
@@ -156,41 +156,31 @@ release_extent_tree_node(extent_tree_node_t *node)
  * reused.  the duplicate and bno/bcnt extent trees for each AG
  * are recycled after they're no longer needed to save memory
  */
-void
-release_extent_tree(avltree_desc_t *tree)
+static void
+release_extent_tree(struct btree_root *tree)
 {
 	extent_tree_node_t	*ext;
-	extent_tree_node_t	*tmp;
 	extent_tree_node_t	*lext;
 	extent_tree_node_t	*ltmp;
 
-	if (tree->avl_firstino == NULL)
-		return;
-
-	ext = (extent_tree_node_t *) tree->avl_firstino;
+	ext = btree_find(tree, 0, NULL);
 
 	while (ext != NULL)  {
-		tmp = (extent_tree_node_t *) ext->avl_node.avl_nextino;
-
 		/*
 		 * ext->next is guaranteed to be set only in bcnt trees
 		 */
-		if (ext->next != NULL)  {
-			lext = ext->next;
-			while (lext != NULL)  {
-				ltmp = lext->next;
-				release_extent_tree_node(lext);
-				lext = ltmp;
-			}
+		lext = ext->next;
+		while (lext != NULL)  {
+			ltmp = lext->next;
+			release_extent_tree_node(lext);
+			lext = ltmp;
 		}
 
 		release_extent_tree_node(ext);
-		ext = tmp;
+		ext = btree_lookup_next(tree, NULL);
 	}
 
-	tree->avl_root = tree->avl_firstino = NULL;
-
-	return;
+	btree_clear(tree);
 }
 
 /*
@@ -228,7 +218,7 @@ add_bno_extent(xfs_agnumber_t agno, xfs_agblock_t startblock,
 
 	ext = mk_extent_tree_nodes(startblock, blockcount, XR_E_FREE);
 
-	if (avl_insert(extent_bno_ptrs[agno], (avlnode_t *) ext) == NULL)  {
+	if (btree_insert(extent_bno_ptrs[agno], startblock, ext) != 0)  {
 		do_error(_("duplicate bno extent range\n"));
 	}
 }
@@ -239,7 +229,19 @@ findfirst_bno_extent(xfs_agnumber_t agno)
 	ASSERT(extent_bno_ptrs != NULL);
 	ASSERT(extent_bno_ptrs[agno] != NULL);
 
-	return((extent_tree_node_t *) extent_bno_ptrs[agno]->avl_firstino);
+	return btree_find(extent_bno_ptrs[agno], 0, NULL);
+}
+
+/*
+ * the btree cursor is left on ext by whichever find routine returned it,
+ * so stepping to the next extent is normally just a cursor move
+ */
+extent_tree_node_t *
+findnext_bno_extent(xfs_agnumber_t agno, extent_tree_node_t *ext)
+{
+	if (btree_lookup(extent_bno_ptrs[agno], ext->ex_startblock) != ext)
+		return NULL;
+	return btree_lookup_next(extent_bno_ptrs[agno], NULL);
 }
 
 extent_tree_node_t *
@@ -248,8 +250,7 @@ find_bno_extent(xfs_agnumber_t agno, xfs_agblock_t startblock)
 	ASSERT(extent_bno_ptrs != NULL);
 	ASSERT(extent_bno_ptrs[agno] != NULL);
 
-	return((extent_tree_node_t *) avl_find(extent_bno_ptrs[agno],
-						startblock));
+	return btree_lookup(extent_bno_ptrs[agno], startblock);
 }
 
 /*
@@ -261,32 +262,25 @@ get_bno_extent(xfs_agnumber_t agno, extent_tree_node_t *ext)
 	ASSERT(extent_bno_ptrs != NULL);
 	ASSERT(extent_bno_ptrs[agno] != NULL);
 
-	avl_delete(extent_bno_ptrs[agno], &ext->avl_node);
+	btree_delete(extent_bno_ptrs[agno], ext->ex_startblock);
 
 	return;
 }
 
-/*
- * normalizing constant for bcnt size -> address conversion (see avl ops)
- * used by the AVL tree code to convert sizes and must be used when
- * doing an AVL search in the tree (e.g. avl_findrange(s))
- */
-#define MAXBCNT		0xFFFFFFFF
-#define BCNT_ADDR(cnt)	((unsigned int) MAXBCNT - (cnt))
-
 /*
  * the next 4 routines manage the trees of free extents -- 2 trees
  * per AG.  The first tree is sorted by block number.  The second
  * tree is sorted by extent size.  This is the bcnt tree.
+ *
+ * The btree is keyed by size and can't hold duplicate keys, so it points
+ * at the first of a list of equal sized extents kept in increasing
+ * startblock order.  The list head's last field points at the tail.
  */
 void
 add_bcnt_extent(xfs_agnumber_t agno, xfs_agblock_t startblock,
 		xfs_extlen_t blockcount)
 {
-	extent_tree_node_t *ext, *prev, *current, *top;
-	xfs_agblock_t		tmp_startblock;
-	xfs_extlen_t		tmp_blockcount;
-	extent_state_t		tmp_state;
+	extent_tree_node_t	*ext, *prev, *current;
 
 	ASSERT(extent_bcnt_ptrs != NULL);
 	ASSERT(extent_bcnt_ptrs[agno] != NULL);
@@ -299,79 +293,43 @@ add_bcnt_extent(xfs_agnumber_t agno, xfs_agblock_t startblock,
 	fprintf(stderr, "adding bcnt: agno = %d, start = %u, count = %u\n",
 			agno, startblock, blockcount);
 #endif
-	if ((current = (extent_tree_node_t *) avl_find(extent_bcnt_ptrs[agno],
-							blockcount)) != NULL)  {
-		/*
-		 * avl tree code doesn't handle dups so insert
-		 * onto linked list in increasing startblock order
-		 *
-		 * when called from mk_incore_fstree,
-		 * startblock is in increasing order.
-		 * current is an "anchor" node.
-		 * quick check if the new ext goes to the end.
-		 * if so, append at the end, using the last field
-		 * of the "anchor".
-		 */
-		ASSERT(current->last != NULL);
-		if (startblock > current->last->ex_startblock) {
-			current->last->next = ext;
-			current->last = ext;
-			return;
-		}
+	current = btree_lookup(extent_bcnt_ptrs[agno], blockcount);
+	if (current == NULL)  {
+		if (btree_insert(extent_bcnt_ptrs[agno], blockcount, ext) != 0)
+			do_error(_(":  duplicate bno extent range\n"));
+		ext->last = ext;
+		return;
+	}
 
+	/*
+	 * when called from mk_incore_fstree, startblock is in
+	 * increasing order, so check the tail of the list first.
+	 */
+	ASSERT(current->last != NULL);
+	if (startblock > current->last->ex_startblock) {
+		current->last->next = ext;
+		current->last = ext;
+		return;
+	}
+
+	if (startblock < current->ex_startblock) {
 		/*
-		 * scan, to find the proper location for new entry.
-		 * this scan is *very* expensive and gets worse with
-		 * with increasing entries.
+		 * new head of the list
 		 */
-		top = prev = current;
-		while (current != NULL &&
-				startblock > current->ex_startblock)  {
-			prev = current;
-			current = current->next;
-		}
-
-		if (top == current)  {
-			ASSERT(top == prev);
-			/*
-			 * new entry should be ahead of current.
-			 * to keep the avl tree intact,
-			 * swap the values of to-be-inserted element
-			 * and the values of the head of the list.
-			 * then insert as the 2nd element on the list.
-			 *
-			 * see the comment in get_bcnt_extent()
-			 * as to why we have to do this.
-			 */
-			tmp_startblock = top->ex_startblock;
-			tmp_blockcount = top->ex_blockcount;
-			tmp_state = top->ex_state;
-
-			top->ex_startblock = ext->ex_startblock;
-			top->ex_blockcount = ext->ex_blockcount;
-			top->ex_state = ext->ex_state;
-
-			ext->ex_startblock = tmp_startblock;
-			ext->ex_blockcount = tmp_blockcount;
-			ext->ex_state = tmp_state;
-
-			current = top->next;
-			prev = top;
-		}
-
-		prev->next = ext;
 		ext->next = current;
-
+		ext->last = current->last;
+		current->last = NULL;
+		btree_update_value(extent_bcnt_ptrs[agno], blockcount, ext);
 		return;
 	}
 
-	if (avl_insert(extent_bcnt_ptrs[agno], (avlnode_t *) ext) == NULL)  {
-		do_error(_(":  duplicate bno extent range\n"));
+	prev = current;
+	while (current != NULL && startblock > current->ex_startblock)  {
+		prev = current;
+		current = current->next;
 	}
-
-	ext->last = ext;	/* ext is an "anchor" node */
-
-	return;
+	prev->next = ext;
+	ext->next = current;
 }
 
 extent_tree_node_t *
@@ -380,7 +338,7 @@ findfirst_bcnt_extent(xfs_agnumber_t agno)
 	ASSERT(extent_bcnt_ptrs != NULL);
 	ASSERT(extent_bcnt_ptrs[agno] != NULL);
 
-	return((extent_tree_node_t *) extent_bcnt_ptrs[agno]->avl_firstino);
+	return btree_find(extent_bcnt_ptrs[agno], 0, NULL);
 }
 
 extent_tree_node_t *
@@ -389,32 +347,23 @@ findbiggest_bcnt_extent(xfs_agnumber_t agno)
 	ASSERT(extent_bcnt_ptrs != NULL);
 	ASSERT(extent_bcnt_ptrs[agno] != NULL);
 
-	return((extent_tree_node_t *) avl_lastino(extent_bcnt_ptrs[agno]->avl_root));
+	return btree_uncached_last(extent_bcnt_ptrs[agno], NULL);
 }
 
 extent_tree_node_t *
 findnext_bcnt_extent(xfs_agnumber_t agno, extent_tree_node_t *ext)
 {
-	avlnode_t *nextino;
-
 	if (ext->next != NULL)  {
 		ASSERT(ext->ex_blockcount == ext->next->ex_blockcount);
 		ASSERT(ext->ex_startblock < ext->next->ex_startblock);
 		return(ext->next);
-	} else  {
-		/*
-		 * have to look at the top of the list to get the
-		 * correct avl_nextino pointer since that pointer
-		 * is maintained and altered by the AVL code.
-		 */
-		nextino = avl_find(extent_bcnt_ptrs[agno], ext->ex_blockcount);
-		ASSERT(nextino != NULL);
-		if (nextino->avl_nextino != NULL)  {
-			ASSERT(ext->ex_blockcount < ((extent_tree_node_t *)
-					nextino->avl_nextino)->ex_blockcount);
-		}
-		return((extent_tree_node_t *) nextino->avl_nextino);
 	}
+
+	/*
+	 * end of the list, move on to the head of the next size up
+	 */
+	return btree_find(extent_bcnt_ptrs[agno],
+			(unsigned long)ext->ex_blockcount + 1, NULL);
 }
 
 /*
@@ -427,126 +376,49 @@ get_bcnt_extent(xfs_agnumber_t agno, xfs_agblock_t startblock,
 		xfs_extlen_t blockcount)
 {
 	extent_tree_node_t	*ext, *prev, *top;
-	xfs_agblock_t		tmp_startblock;
-	xfs_extlen_t		tmp_blockcount;
-	extent_state_t		tmp_state;
 
 	prev = NULL;
 	ASSERT(extent_bcnt_ptrs != NULL);
 	ASSERT(extent_bcnt_ptrs[agno] != NULL);
 
-	if ((ext = (extent_tree_node_t *) avl_find(extent_bcnt_ptrs[agno],
-							blockcount)) == NULL)
+	top = btree_lookup(extent_bcnt_ptrs[agno], blockcount);
+	if (top == NULL)
 		return(NULL);
 
-	top = ext;
-
-	if (ext->next != NULL)  {
+	if (top->ex_startblock == startblock)  {
 		/*
-		 * pull it off the list
+		 * pull the head off the list, the next extent
+		 * (if any) becomes the head
 		 */
+		ext = top;
+		if (ext->next != NULL)  {
+			ext->next->last = ext->last;
+			btree_update_value(extent_bcnt_ptrs[agno], blockcount,
+					ext->next);
+		} else
+			btree_delete(extent_bcnt_ptrs[agno], blockcount);
+	} else  {
+		ext = top;
 		while (ext != NULL && startblock != ext->ex_startblock)  {
 			prev = ext;
 			ext = ext->next;
 		}
 		ASSERT(ext != NULL);
-		if (ext == top)  {
-			/*
-			 * this node is linked into the tree so we
-			 * swap the core values so we can delete
-			 * the next item on the list instead of
-			 * the head of the list.  This is because
-			 * the rest of the tree undoubtedly has
-			 * pointers to the piece of memory that
-			 * is the head of the list so pulling
-			 * the item out of the list and hence
-			 * the avl tree would be a bad idea.
-			 *
-			 * (cheaper than the alternative, a tree
-			 * delete of this node followed by a tree
-			 * insert of the next node on the list).
-			 */
-			tmp_startblock = ext->next->ex_startblock;
-			tmp_blockcount = ext->next->ex_blockcount;
-			tmp_state = ext->next->ex_state;
-
-			ext->next->ex_startblock = ext->ex_startblock;
-			ext->next->ex_blockcount = ext->ex_blockcount;
-			ext->next->ex_state = ext->ex_state;
-
-			ext->ex_startblock = tmp_startblock;
-			ext->ex_blockcount = tmp_blockcount;
-			ext->ex_state = tmp_state;
-
-			ext = ext->next;
-			prev = top;
-		}
 		/*
 		 * now, a simple list deletion
 		 */
 		prev->next = ext->next;
-		ext->next = NULL;
-	} else  {
-		/*
-		 * no list, just one node.  simply delete
-		 */
-		avl_delete(extent_bcnt_ptrs[agno], &ext->avl_node);
+		if (top->last == ext)
+			top->last = prev;
 	}
+	ext->next = NULL;
+	ext->last = NULL;
 
 	ASSERT(ext->ex_startblock == startblock);
 	ASSERT(ext->ex_blockcount == blockcount);
 	return(ext);
 }
 
-static uintptr_t
-avl_ext_start(avlnode_t *node)
-{
-	return((uintptr_t)
-		((extent_tree_node_t *) node)->ex_startblock);
-}
-
-static uintptr_t
-avl_ext_end(avlnode_t *node)
-{
-	return((uintptr_t) (
-		((extent_tree_node_t *) node)->ex_startblock +
-		((extent_tree_node_t *) node)->ex_blockcount));
-}
-
-/*
- * convert size to an address for the AVL tree code -- the bigger the size,
- * the lower the address so the biggest extent will be first in the tree
- */
-static uintptr_t
-avl_ext_bcnt_start(avlnode_t *node)
-{
-/*
-	return((uintptr_t) (BCNT_ADDR(((extent_tree_node_t *)
-						node)->ex_blockcount)));
-*/
-	return((uintptr_t) ((extent_tree_node_t *)node)->ex_blockcount);
-}
-
-static uintptr_t
-avl_ext_bcnt_end(avlnode_t *node)
-{
-/*
-	return((uintptr_t) (BCNT_ADDR(((extent_tree_node_t *)
-						node)->ex_blockcount)));
-*/
-	return((uintptr_t) ((extent_tree_node_t *)node)->ex_blockcount);
-}
-
-avlops_t avl_extent_bcnt_tree_ops = {
-	avl_ext_bcnt_start,
-	avl_ext_bcnt_end
-};
-
-avlops_t avl_extent_tree_ops = {
-	avl_ext_start,
-	avl_ext_end
-};
-
 /*
  * for real-time extents -- have to dup code since realtime extent
  * startblocks can be 64-bit values.
@@ -557,7 +429,7 @@ mk_rt_extent_tree_nodes(xfs_rtblock_t new_startblock,
 {
 	rt_extent_tree_node_t *new;
 
-	new = malloc(sizeof(*new));
+	new = spill_malloc(sizeof(*new));
 	if (!new)
 		do_error(_("couldn't allocate new extent descriptor.\n"));
 
@@ -572,7 +444,7 @@ mk_rt_extent_tree_nodes(xfs_rtblock_t new_startblock,
 void
 release_rt_extent_tree_node(rt_extent_tree_node_t *node)
 {
-	free(node);
+	spill_free(node);
 }
 
 void
@@ -756,31 +628,20 @@ incore_ext_init(xfs_mount_t *mp)
 		do_error(_("couldn't malloc dup extent tree descriptor table\n"));
 
 	if ((extent_bno_ptrs = malloc(agcount *
-					sizeof(avltree_desc_t *))) == NULL)
+					sizeof(struct btree_root *))) == NULL)
 		do_error(
 	_("couldn't malloc free by-bno extent tree descriptor table\n"));
 
 	if ((extent_bcnt_ptrs = malloc(agcount *
-					sizeof(avltree_desc_t *))) == NULL)
+					sizeof(struct btree_root *))) == NULL)
 		do_error(
 	_("couldn't malloc free by-bcnt extent tree descriptor table\n"));
 
-	for (i = 0; i < agcount; i++)  {
-		if ((extent_bno_ptrs[i] =
-				malloc(sizeof(avltree_desc_t))) == NULL)
-			do_error(
-			_("couldn't malloc bno extent tree descriptor\n"));
-		if ((extent_bcnt_ptrs[i] =
-				malloc(sizeof(avltree_desc_t))) == NULL)
-			do_error(
-			_("couldn't malloc bcnt extent tree descriptor\n"));
-	}
-
 	for (i = 0; i < agcount; i++)  {
 		btree_init(&dup_extent_trees[i]);
 		pthread_mutex_init(&dup_extent_tree_locks[i], NULL);
-		avl_init_tree(extent_bno_ptrs[i], &avl_extent_tree_ops);
-		avl_init_tree(extent_bcnt_ptrs[i], &avl_extent_bcnt_tree_ops);
+		btree_init(&extent_bno_ptrs[i]);
+		btree_init(&extent_bcnt_ptrs[i]);
 	}
 
 	if ((rt_ext_tree_ptr = malloc(sizeof(avl64tree_desc_t))) == NULL)
@@ -799,8 +660,8 @@ incore_ext_teardown(xfs_mount_t *mp)
 
 	for (i = 0; i < mp->m_sb.sb_agcount; i++)  {
 		btree_destroy(dup_extent_trees[i]);
-		free(extent_bno_ptrs[i]);
-		free(extent_bcnt_ptrs[i]);
+		btree_destroy(extent_bno_ptrs[i]);
+		btree_destroy(extent_bcnt_ptrs[i]);
 	}
 
 	free(dup_extent_trees);
@@ -813,19 +674,19 @@ incore_ext_teardown(xfs_mount_t *mp)
 }
 
 int
-count_extents(xfs_agnumber_t agno, avltree_desc_t *tree, int whichtree)
+count_extents(xfs_agnumber_t agno, struct btree_root *tree, int whichtree)
 {
 	extent_tree_node_t *node;
 	int i = 0;
 
-	node = (extent_tree_node_t *) tree->avl_firstino;
+	node = btree_find(tree, 0, NULL);
 
 	while (node != NULL)  {
 		i++;
 		if (whichtree)
 			node = findnext_bcnt_extent(agno, node);
 		else
-			node = findnext_bno_extent(node);
+			node = findnext_bno_extent(agno, node);
 	}
 
 	return(i);
@@ -842,12 +703,12 @@ count_bno_extents_blocks(xfs_agnumber_t agno, uint *numblocks)
 
 	nblocks = 0;
 
-	node = (extent_tree_node_t *) extent_bno_ptrs[agno]->avl_firstino;
+	node = findfirst_bno_extent(agno);
 
 	while (node != NULL) {
 		nblocks += node->ex_blockcount;
 		i++;
-		node = findnext_bno_extent(node);
+		node = findnext_bno_extent(agno, node);
 	}
 
 	*numblocks = nblocks;
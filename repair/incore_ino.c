@@ -17,23 +17,23 @@
  */
 
 #include "libxfs.h"
-#include "avl.h"
 #include "globals.h"
 #include "incore.h"
 #include "agheader.h"
 #include "protos.h"
 #include "threads.h"
 #include "err_protos.h"
+#include "spill.h"
 
 /*
  * array of inode tree ptrs, one per ag
  */
-avltree_desc_t	**inode_tree_ptrs;
+struct btree_root	**inode_tree_ptrs;
 
 /*
  * ditto for uncertain inodes
  */
-static avltree_desc_t	**inode_uncertain_tree_ptrs;
+static struct btree_root **inode_uncertain_tree_ptrs;
 
 /* memory optimised nlink counting for all inodes */
 
@@ -42,7 +42,7 @@ alloc_nlink_array(__uint8_t nlink_size)
 {
 	void *ptr;
 
-	ptr = calloc(XFS_INODES_PER_CHUNK, nlink_size);
+	ptr = spill_calloc(XFS_INODES_PER_CHUNK, nlink_size);
 	if (!ptr)
 		do_error(_("could not allocate nlink array\n"));
 	return ptr;
@@ -59,7 +59,7 @@ nlink_grow_8_to_16(ino_tree_node_t *irec)
 	new_nlinks = alloc_nlink_array(irec->nlink_size);
 	for (i = 0; i < XFS_INODES_PER_CHUNK; i++)
 		new_nlinks[i] = irec->disk_nlinks.un8[i];
-	free(irec->disk_nlinks.un8);
+	spill_free(irec->disk_nlinks.un8);
 	irec->disk_nlinks.un16 = new_nlinks;
 
 	if (full_ino_ex_data) {
@@ -68,7 +68,7 @@ nlink_grow_8_to_16(ino_tree_node_t *irec)
 			new_nlinks[i] =
 				irec->ino_un.ex_data->counted_nlinks.un8[i];
 		}
-		free(irec->ino_un.ex_data->counted_nlinks.un8);
+		spill_free(irec->ino_un.ex_data->counted_nlinks.un8);
 		irec->ino_un.ex_data->counted_nlinks.un16 = new_nlinks;
 	}
 }
@@ -84,7 +84,7 @@ nlink_grow_16_to_32(ino_tree_node_t *irec)
 	new_nlinks = alloc_nlink_array(irec->nlink_size);
 	for (i = 0; i < XFS_INODES_PER_CHUNK; i++)
 		new_nlinks[i] = irec->disk_nlinks.un16[i];
-	free(irec->disk_nlinks.un16);
+	spill_free(irec->disk_nlinks.un16);
 	irec->disk_nlinks.un32 = new_nlinks;
 
 	if (full_ino_ex_data) {
@@ -94,7 +94,7 @@ nlink_grow_16_to_32(ino_tree_node_t *irec)
 			new_nlinks[i] =
 				irec->ino_un.ex_data->counted_nlinks.un16[i];
 		}
-		free(irec->ino_un.ex_data->counted_nlinks.un16);
+		spill_free(irec->ino_un.ex_data->counted_nlinks.un16);
 		irec->ino_un.ex_data->counted_nlinks.un32 = new_nlinks;
 	}
 }
@@ -220,7 +220,7 @@ alloc_ftypes_array(
 	if (!xfs_sb_version_hasftype(&mp->m_sb))
 		return NULL;
 
-	ptr = calloc(XFS_INODES_PER_CHUNK, sizeof(*ptr));
+	ptr = spill_calloc(XFS_INODES_PER_CHUNK, sizeof(*ptr));
 	if (!ptr)
 		do_error(_("could not allocate ftypes array\n"));
 	return ptr;
@@ -246,14 +246,11 @@ alloc_ino_node(
 {
 	struct ino_tree_node 	*irec;
 
-	irec = malloc(sizeof(*irec));
+	irec = spill_malloc(sizeof(*irec));
 	if (!irec)
 		do_error(_("inode map malloc failed\n"));
 
-	irec->avl_node.avl_nextino = NULL;
-	irec->avl_node.avl_forw = NULL;
-	irec->avl_node.avl_back = NULL;
-
+	irec->next = NULL;
 	irec->ino_startnum = starting_ino;
 	irec->ino_confirmed = 0;
 	irec->ino_isa_dir = 0;
@@ -273,13 +270,13 @@ free_nlink_array(union ino_nlink nlinks, __uint8_t nlink_size)
 {
 	switch (nlink_size) {
 	case sizeof(__uint8_t):
-		free(nlinks.un8);
+		spill_free(nlinks.un8);
 		break;
 	case sizeof(__uint16_t):
-		free(nlinks.un16);
+		spill_free(nlinks.un16);
 		break;
 	case sizeof(__uint32_t):
-		free(nlinks.un32);
+		spill_free(nlinks.un32);
 		break;
 	default:
 		ASSERT(0);
@@ -290,23 +287,88 @@ static void
 free_ino_tree_node(
 	struct ino_tree_node	*irec)
 {
-	irec->avl_node.avl_nextino = NULL;
-	irec->avl_node.avl_forw = NULL;
-	irec->avl_node.avl_back = NULL;
+	irec->next = NULL;
 
 	free_nlink_array(irec->disk_nlinks, irec->nlink_size);
 	if (irec->ino_un.ex_data != NULL)  {
 		if (full_ino_ex_data) {
-			free(irec->ino_un.ex_data->parents);
+			spill_free(irec->ino_un.ex_data->parents);
 			free_nlink_array(irec->ino_un.ex_data->counted_nlinks,
 					 irec->nlink_size);
 		}
-		free(irec->ino_un.ex_data);
+		spill_free(irec->ino_un.ex_data);
 
 	}
 
-	free(irec->ftypes);
-	free(irec);
+	spill_free(irec->ftypes);
+	spill_free(irec);
+}
+
+/*
+ * The inode trees are btrees of inode records keyed by starting inode.
+ * The records are also chained in inode order through their next pointers
+ * so that walking a tree costs a pointer dereference per record.
+ *
+ * Lookups don't touch the btree cursor since prefetch and the phase 6/7
+ * directory walks search the trees from several threads at once.
+ */
+static ino_tree_node_t *
+ino_tree_find(
+	struct btree_root	*tree,
+	xfs_agino_t		ino)
+{
+	ino_tree_node_t		*irec;
+
+	irec = btree_uncached_find_le(tree, ino, NULL);
+	if (irec && ino - irec->ino_startnum < XFS_INODES_PER_CHUNK)
+		return irec;
+	return NULL;
+}
+
+/*
+ * Returns EEXIST if the new record overlaps one already in the tree.
+ */
+static int
+ino_tree_insert(
+	struct btree_root	*tree,
+	ino_tree_node_t		*irec)
+{
+	ino_tree_node_t		*prev;
+	ino_tree_node_t		*next;
+	int			error;
+
+	prev = btree_uncached_find_le(tree,
+			irec->ino_startnum + XFS_INODES_PER_CHUNK - 1, NULL);
+	if (prev &&
+	    prev->ino_startnum + XFS_INODES_PER_CHUNK > irec->ino_startnum)
+		return EEXIST;
+	next = prev ? prev->next : btree_uncached_first(tree, NULL);
+
+	error = btree_insert(tree, irec->ino_startnum, irec);
+	if (error)
+		return error;
+
+	irec->next = next;
+	if (prev)
+		prev->next = irec;
+	return 0;
+}
+
+static void
+ino_tree_delete(
+	struct btree_root	*tree,
+	ino_tree_node_t		*irec)
+{
+	ino_tree_node_t		*prev = NULL;
+
+	if (irec->ino_startnum > 0)
+		prev = btree_uncached_find_le(tree, irec->ino_startnum - 1,
+				NULL);
+
+	btree_delete(tree, irec->ino_startnum);
+	if (prev)
+		prev->next = irec->next;
+	irec->next = NULL;
 }
 
 /*
@@ -356,13 +418,11 @@ add_aginode_uncertain(
 	 * check to see if record containing inode is already in the tree.
 	 * if not, add it
 	 */
-	ino_rec = (ino_tree_node_t *)
-		avl_findrange(inode_uncertain_tree_ptrs[agno], s_ino);
+	ino_rec = ino_tree_find(inode_uncertain_tree_ptrs[agno], s_ino);
 	if (!ino_rec) {
 		ino_rec = alloc_ino_node(mp, s_ino);
 
-		if (!avl_insert(inode_uncertain_tree_ptrs[agno],
-				&ino_rec->avl_node))
+		if (ino_tree_insert(inode_uncertain_tree_ptrs[agno], ino_rec))
 			do_error(
 	_("add_aginode_uncertain - duplicate inode range\n"));
 	}
@@ -400,25 +460,19 @@ get_uncertain_inode_rec(struct xfs_mount *mp, xfs_agnumber_t agno,
 	ASSERT(agno < mp->m_sb.sb_agcount);
 	ASSERT(inode_tree_ptrs[agno] != NULL);
 
-	avl_delete(inode_uncertain_tree_ptrs[agno], &ino_rec->avl_node);
-
-	ino_rec->avl_node.avl_nextino = NULL;
-	ino_rec->avl_node.avl_forw = NULL;
-	ino_rec->avl_node.avl_back = NULL;
+	ino_tree_delete(inode_uncertain_tree_ptrs[agno], ino_rec);
 }
 
 ino_tree_node_t *
 findfirst_uncertain_inode_rec(xfs_agnumber_t agno)
 {
-	return((ino_tree_node_t *)
-		inode_uncertain_tree_ptrs[agno]->avl_firstino);
+	return btree_uncached_first(inode_uncertain_tree_ptrs[agno], NULL);
 }
 
 ino_tree_node_t *
 find_uncertain_inode_rec(xfs_agnumber_t agno, xfs_agino_t ino)
 {
-	return((ino_tree_node_t *)
-		avl_findrange(inode_uncertain_tree_ptrs[agno], ino));
+	return ino_tree_find(inode_uncertain_tree_ptrs[agno], ino);
 }
 
 void
@@ -429,7 +483,7 @@ clear_uncertain_ino_cache(xfs_agnumber_t agno)
 
 
 /*
- * Next comes the inode trees.  One per AG,  AVL trees of inode records, each
+ * Next comes the inode trees.  One per AG,  btrees of inode records, each
  * inode record tracking 64 inodes
  */
 
@@ -458,7 +512,7 @@ add_inode(
 	struct ino_tree_node	*irec;
 
 	irec = alloc_ino_node(mp, agino);
-	if (!avl_insert(inode_tree_ptrs[agno],	&irec->avl_node))
+	if (ino_tree_insert(inode_tree_ptrs[agno], irec))
 		do_warn(_("add_inode - duplicate inode range\n"));
 	return irec;
 }
@@ -473,11 +527,7 @@ get_inode_rec(struct xfs_mount *mp, xfs_agnumber_t agno, ino_tree_node_t *ino_re
 	ASSERT(agno < mp->m_sb.sb_agcount);
 	ASSERT(inode_tree_ptrs[agno] != NULL);
 
-	avl_delete(inode_tree_ptrs[agno], &ino_rec->avl_node);
-
-	ino_rec->avl_node.avl_nextino = NULL;
-	ino_rec->avl_node.avl_forw = NULL;
-	ino_rec->avl_node.avl_back = NULL;
+	ino_tree_delete(inode_tree_ptrs[agno], ino_rec);
 }
 
 /*
@@ -495,14 +545,31 @@ find_inode_rec_range(struct xfs_mount *mp, xfs_agnumber_t agno,
 			xfs_agino_t start_ino, xfs_agino_t end_ino,
 			ino_tree_node_t **first, ino_tree_node_t **last)
 {
+	struct btree_root	*tree;
+	ino_tree_node_t		*irec;
+
 	*first = *last = NULL;
 
 	/*
 	 * Is the AG inside the file system ?
 	 */
-	if (agno < mp->m_sb.sb_agcount)
-		avl_findranges(inode_tree_ptrs[agno], start_ino,
-			end_ino, (avlnode_t **) first, (avlnode_t **) last);
+	if (agno >= mp->m_sb.sb_agcount)
+		return;
+	tree = inode_tree_ptrs[agno];
+
+	/*
+	 * return the first and last records overlapping [start_ino, end_ino)
+	 */
+	irec = btree_uncached_find_le(tree, start_ino, NULL);
+	if (!irec)
+		irec = btree_uncached_first(tree, NULL);
+	else if (irec->ino_startnum + XFS_INODES_PER_CHUNK <= start_ino)
+		irec = irec->next;
+	if (!irec || irec->ino_startnum >= end_ino)
+		return;
+
+	*first = irec;
+	*last = btree_uncached_find_le(tree, end_ino - 1, NULL);
 }
 
 /*
@@ -618,7 +685,7 @@ set_inode_parent(
 		ptbl = irec->ino_un.plist;
 
 	if (ptbl == NULL)  {
-		ptbl = (parent_list_t *)malloc(sizeof(parent_list_t));
+		ptbl = (parent_list_t *)spill_malloc(sizeof(parent_list_t));
 		if (!ptbl)
 			do_error(_("couldn't malloc parent list table\n"));
 
@@ -628,10 +695,9 @@ set_inode_parent(
 			irec->ino_un.plist = ptbl;
 
 		ptbl->pmask = 1ULL << offset;
-		ptbl->pentries = (xfs_ino_t*)memalign(sizeof(xfs_ino_t),
-							sizeof(xfs_ino_t));
+		ptbl->pentries = (xfs_ino_t *)spill_malloc(sizeof(xfs_ino_t));
 		if (!ptbl->pentries)
-			do_error(_("couldn't memalign pentries table\n"));
+			do_error(_("couldn't malloc pentries table\n"));
 #ifdef DEBUG
 		ptbl->cnt = 1;
 #endif
@@ -675,9 +741,9 @@ set_inode_parent(
 #endif
 	ASSERT(cnt >= target);
 
-	tmp = (xfs_ino_t*)memalign(sizeof(xfs_ino_t), (cnt + 1) * sizeof(xfs_ino_t));
+	tmp = (xfs_ino_t *)spill_malloc((cnt + 1) * sizeof(xfs_ino_t));
 	if (!tmp)
-		do_error(_("couldn't memalign pentries table\n"));
+		do_error(_("couldn't malloc pentries table\n"));
 
 	memmove(tmp, ptbl->pentries, target * sizeof(parent_entry_t));
 
@@ -685,7 +751,7 @@ set_inode_parent(
 		memmove(tmp + target + 1, ptbl->pentries + target,
 				(cnt - target) * sizeof(parent_entry_t));
 
-	free(ptbl->pentries);
+	spill_free(ptbl->pentries);
 
 	ptbl->pentries = tmp;
 
@@ -733,7 +799,8 @@ alloc_ex_data(ino_tree_node_t *irec)
 	parent_list_t 	*ptbl;
 
 	ptbl = irec->ino_un.plist;
-	irec->ino_un.ex_data  = (ino_ex_data_t *)calloc(1, sizeof(ino_ex_data_t));
+	irec->ino_un.ex_data  = (ino_ex_data_t *)spill_calloc(1,
+							sizeof(ino_ex_data_t));
 	if (irec->ino_un.ex_data == NULL)
 		do_error(_("could not malloc inode extra data\n"));
 
@@ -774,25 +841,6 @@ add_ino_ex_data(xfs_mount_t *mp)
 	full_ino_ex_data = 1;
 }
 
-static uintptr_t
-avl_ino_start(avlnode_t *node)
-{
-	return((uintptr_t) ((ino_tree_node_t *) node)->ino_startnum);
-}
-
-static uintptr_t
-avl_ino_end(avlnode_t *node)
-{
-	return((uintptr_t) (
-		((ino_tree_node_t *) node)->ino_startnum +
-		XFS_INODES_PER_CHUNK));
-}
-
-avlops_t avl_ino_tree_ops = {
-	avl_ino_start,
-	avl_ino_end
-};
-
 void
 incore_ino_init(xfs_mount_t *mp)
 {
@@ -800,25 +848,16 @@ incore_ino_init(xfs_mount_t *mp)
 	int agcount = mp->m_sb.sb_agcount;
 
 	if ((inode_tree_ptrs = malloc(agcount *
-					sizeof(avltree_desc_t *))) == NULL)
+					sizeof(struct btree_root *))) == NULL)
 		do_error(_("couldn't malloc inode tree descriptor table\n"));
 	if ((inode_uncertain_tree_ptrs = malloc(agcount *
-					sizeof(avltree_desc_t *))) == NULL)
+					sizeof(struct btree_root *))) == NULL)
 		do_error(
 		_("couldn't malloc uncertain ino tree descriptor table\n"));
 
 	for (i = 0; i < agcount; i++)  {
-		if ((inode_tree_ptrs[i] =
-				malloc(sizeof(avltree_desc_t))) == NULL)
-			do_error(_("couldn't malloc inode tree descriptor\n"));
-		if ((inode_uncertain_tree_ptrs[i] =
-				malloc(sizeof(avltree_desc_t))) == NULL)
-			do_error(
-			_("couldn't malloc uncertain ino tree descriptor\n"));
-	}
-	for (i = 0; i < agcount; i++)  {
-		avl_init_tree(inode_tree_ptrs[i], &avl_ino_tree_ops);
-		avl_init_tree(inode_uncertain_tree_ptrs[i], &avl_ino_tree_ops);
+		btree_init(&inode_tree_ptrs[i]);
+		btree_init(&inode_uncertain_tree_ptrs[i]);
 	}
 
 	if ((last_rec = malloc(sizeof(ino_tree_node_t *) * agcount)) == NULL)
@@ -22,7 +22,6 @@
 #include "protos.h"
 #include "err_protos.h"
 #include "pthread.h"
-#include "avl.h"
 #include "bmap.h"
 #include "incore.h"
 #include "prefetch.h"
@@ -88,6 +87,7 @@ xfs_init(libxfs_init_t *args)
 	}
 
 	args->usebuflock = do_prefetch;
+	args->bcache_flags = bcache_flags;
 	args->setblksize = 0;
 	args->isdirect = LIBXFS_DIRECT;
 	if (no_modify)
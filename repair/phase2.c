@@ -18,7 +18,6 @@
 
 #include "libxfs.h"
 #include "libxlog.h"
-#include "avl.h"
 #include "globals.h"
 #include "agheader.h"
 #include "protos.h"
@@ -19,7 +19,6 @@
 #include "libxfs.h"
 #include "threads.h"
 #include "prefetch.h"
-#include "avl.h"
 #include "globals.h"
 #include "agheader.h"
 #include "incore.h"
@@ -17,7 +17,6 @@
  */
 
 #include "libxfs.h"
-#include "avl.h"
 #include "globals.h"
 #include "agheader.h"
 #include "incore.h"
@@ -90,6 +89,15 @@ static __uint64_t	*sb_icount_ag;		/* allocated inodes per ag */
 static __uint64_t	*sb_ifree_ag;		/* free inodes per ag */
 static __uint64_t	*sb_fdblocks_ag;	/* free data blocks per ag */
 
+/*
+ * AGs are rebuilt in parallel. libxfs transactions update the incore
+ * superblock counters and log the superblock as they commit, so the steps
+ * that run them (fixing up the AGFL and loading the rmapbt) are done one AG
+ * at a time under trans_lock.
+ */
+static pthread_mutex_t	trans_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t	lost_fsb_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static int
 mk_incore_fstree(xfs_mount_t *mp, xfs_agnumber_t agno)
 {
@@ -149,7 +157,7 @@ mk_incore_fstree(xfs_mount_t *mp, xfs_agnumber_t agno)
 			if (in_extent)  {
 				/*
 				 * free extent ends here, add extent to the
-				 * 2 incore extent (avl-to-be-B+) trees
+				 * 2 incore extent trees
 				 */
 				in_extent = 0;
 #if defined(XR_BLD_FREE_TRACE) && defined(XR_BLD_ADD_EXTENT)
@@ -829,7 +837,7 @@ build_freespace_tree(xfs_mount_t *mp, xfs_agnumber_t agno,
 							ext_ptr->ex_blockcount);
 			freeblks += ext_ptr->ex_blockcount;
 			if (btnum == XFS_BTNUM_BNO)
-				ext_ptr = findnext_bno_extent(ext_ptr);
+				ext_ptr = findnext_bno_extent(agno, ext_ptr);
 			else
 				ext_ptr = findnext_bcnt_extent(agno, ext_ptr);
 #if 0
@@ -2091,7 +2099,9 @@ build_agf_agfl(
 		while (bno_bt->num_free_blocks > 0) {
 			fsb = XFS_AGB_TO_FSB(mp, agno,
 					get_next_blockaddr(agno, 0, bno_bt));
+			pthread_mutex_lock(&lost_fsb_lock);
 			error = slab_add(lost_fsb, &fsb);
+			pthread_mutex_unlock(&lost_fsb_lock);
 			if (error)
 				do_error(
 _("Insufficient memory saving lost blocks.\n"));
@@ -2099,7 +2109,9 @@ _("Insufficient memory saving lost blocks.\n"));
 		while (bcnt_bt->num_free_blocks > 0) {
 			fsb = XFS_AGB_TO_FSB(mp, agno,
 					get_next_blockaddr(agno, 0, bcnt_bt));
+			pthread_mutex_lock(&lost_fsb_lock);
 			error = slab_add(lost_fsb, &fsb);
+			pthread_mutex_unlock(&lost_fsb_lock);
 			if (error)
 				do_error(
 _("Insufficient memory saving lost blocks.\n"));
@@ -2138,7 +2150,9 @@ _("Insufficient memory saving lost blocks.\n"));
 	/*
 	 * now fix up the free list appropriately
 	 */
+	pthread_mutex_lock(&trans_lock);
 	fix_freelist(mp, agno, true);
+	pthread_mutex_unlock(&trans_lock);
 
 #ifdef XR_BLD_FREE_TRACE
 	fprintf(stderr, "wrote agf for ag %u\n", agno);
@@ -2407,7 +2421,9 @@ phase5_func(
 		/*
 		 * Put the per-AG btree rmap data into the rmapbt
 		 */
+		pthread_mutex_lock(&trans_lock);
 		error = rmap_store_ag_btree_rec(mp, agno);
+		pthread_mutex_unlock(&trans_lock);
 		if (error)
 			do_error(
 _("unable to add AG %u reverse-mapping data to btree.\n"), agno);
@@ -2422,6 +2438,48 @@ _("unable to add AG %u reverse-mapping data to btree.\n"), agno);
 	PROG_RPT_INC(prog_rpt_done[agno], 1);
 }
 
+static void
+phase5_work(
+	struct work_queue	*wq,
+	xfs_agnumber_t		agno,
+	void			*arg)
+{
+	phase5_func(wq->mp, agno, arg);
+}
+
+/*
+ * Rebuild the AGs on a work queue. Like the inode prefetch in phases 3
+ * and 4, an ag_stride gives each segment of the filesystem a thread of its
+ * own that works through its AGs in order; otherwise there is a thread per
+ * CPU taking whichever AG is next.
+ */
+static void
+rebuild_ags(
+	struct xfs_mount	*mp,
+	struct xfs_slab		*lost_fsb)
+{
+	struct work_queue	*queues;
+	int			nqueues;
+	xfs_agnumber_t		agno;
+	int			i;
+
+	nqueues = ag_stride ? thread_count : 1;
+	queues = calloc(nqueues, sizeof(struct work_queue));
+	if (!queues)
+		do_error(_("cannot allocate phase 5 work queues\n"));
+
+	for (i = 0; i < nqueues; i++)
+		create_work_queue(&queues[i], mp,
+				  ag_stride ? 1 : libxfs_nproc());
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		i = ag_stride ? min(agno / ag_stride, nqueues - 1) : 0;
+		queue_work(&queues[i], phase5_work, agno, lost_fsb);
+	}
+	for (i = 0; i < nqueues; i++)
+		destroy_work_queue(&queues[i]);
+	free(queues);
+}
+
 /* Inject lost blocks back into the filesystem. */
 static int
 inject_lost_blocks(
@@ -2513,8 +2571,7 @@ phase5(xfs_mount_t *mp)
 	if (error)
 		do_error(_("cannot alloc lost block slab\n"));
 
-	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++)
-		phase5_func(mp, agno, lost_fsb);
+	rebuild_ags(mp, lost_fsb);
 
 	print_final_rpt();
 
@@ -19,7 +19,6 @@
 #include "libxfs.h"
 #include "threads.h"
 #include "prefetch.h"
-#include "avl.h"
 #include "globals.h"
 #include "agheader.h"
 #include "incore.h"
@@ -33,11 +32,38 @@
 static struct cred		zerocr;
 static struct fsxattr 		zerofsx;
 static xfs_ino_t		orphanage_ino;
+static pthread_mutex_t		orphanage_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static struct xfs_name		xfs_name_dot = {(unsigned char *)".",
 						1,
 						XFS_DIR3_FT_DIR};
 
+/*
+ * The root directory is processed before the other directories are traversed
+ * in parallel, so the orphanage is always found before any other directory
+ * can junk an entry pointing at it. Entries can be junked by several threads
+ * at once though, so the orphanage inode number is only changed under a lock.
+ */
+static void
+set_orphanage_ino(
+	xfs_ino_t		ino)
+{
+	pthread_mutex_lock(&orphanage_lock);
+	if (!orphanage_ino)
+		orphanage_ino = ino;
+	pthread_mutex_unlock(&orphanage_lock);
+}
+
+static void
+junk_orphanage_ino(
+	xfs_ino_t		ino)
+{
+	pthread_mutex_lock(&orphanage_lock);
+	if (ino == orphanage_ino)
+		orphanage_ino = 0;
+	pthread_mutex_unlock(&orphanage_lock);
+}
+
 /*
  * Data structures used to keep track of directories where the ".."
  * entries are updated. These must be rebuilt after the initial pass
@@ -51,6 +77,63 @@ typedef struct dotdot_update {
 
 static LIST_HEAD(dotdot_update_list);
 static int			dotdot_update;
+static pthread_mutex_t		dotdot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Directories are traversed by several threads at once. The reached, link
+ * count and parent state of the inodes a directory points at lives in the
+ * incore inode records, which are shared by all of the threads, so updates to
+ * an inode record are made under a lock hashed from the record. A directory
+ * entry takes the locks for both the child's and the directory's own record
+ * so that checking and connecting the child is atomic.
+ *
+ * Transactions that can allocate or free blocks change the free space
+ * btrees and the superblock counters, so only one thread at a time may run
+ * one of those.
+ */
+#define IREC_LOCKS		256
+
+static pthread_mutex_t		irec_locks[IREC_LOCKS];
+static pthread_mutex_t		dir_alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_mutex_t *
+irec_lock(
+	ino_tree_node_t		*irec)
+{
+	return &irec_locks[((uintptr_t)irec / sizeof(*irec)) % IREC_LOCKS];
+}
+
+static void
+lock_irecs(
+	ino_tree_node_t		*a,
+	ino_tree_node_t		*b)
+{
+	pthread_mutex_t		*la = irec_lock(a);
+	pthread_mutex_t		*lb = irec_lock(b);
+
+	if (la == lb) {
+		pthread_mutex_lock(la);
+	} else if (la < lb) {
+		pthread_mutex_lock(la);
+		pthread_mutex_lock(lb);
+	} else {
+		pthread_mutex_lock(lb);
+		pthread_mutex_lock(la);
+	}
+}
+
+static void
+unlock_irecs(
+	ino_tree_node_t		*a,
+	ino_tree_node_t		*b)
+{
+	pthread_mutex_t		*la = irec_lock(a);
+	pthread_mutex_t		*lb = irec_lock(b);
+
+	pthread_mutex_unlock(la);
+	if (la != lb)
+		pthread_mutex_unlock(lb);
+}
 
 static void
 add_dotdot_update(
@@ -69,17 +152,24 @@ add_dotdot_update(
 	dir->agno = agno;
 	dir->ino_offset = ino_offset;
 
+	pthread_mutex_lock(&dotdot_lock);
 	list_add(&dir->list, &dotdot_update_list);
+	pthread_mutex_unlock(&dotdot_lock);
 }
 
 /*
  * Data structures and routines to keep track of directory entries
  * and whether their leaf entry has been seen. Also used for name
  * duplicate checking and rebuilding step if required.
+ *
+ * Entries (and, once duplicated, their names) are carved out of a
+ * per-directory arena that is thrown away in one go when the directory
+ * is done, rather than being malloced and freed one at a time. Lookups
+ * by name hash and by data address go through two open addressed tables
+ * of entry pointers which are doubled whenever they become half full,
+ * so large directories don't degrade into long bucket chains.
  */
 typedef struct dir_hash_ent {
-	struct dir_hash_ent	*nextbyaddr;	/* next in addr bucket */
-	struct dir_hash_ent	*nextbyhash;	/* next in name bucket */
 	struct dir_hash_ent	*nextbyorder;	/* next in order added */
 	xfs_dahash_t		hashval;	/* hash value of name */
 	__uint32_t		address;	/* offset of data entry */
@@ -89,18 +179,39 @@ typedef struct dir_hash_ent {
 	struct xfs_name		name;
 } dir_hash_ent_t;
 
+typedef struct dir_hash_arena {
+	struct dir_hash_arena	*next;		/* previously filled arena */
+	size_t			size;		/* bytes in data[] */
+	size_t			used;		/* bytes handed out */
+	char			data[];
+} dir_hash_arena_t;
+
 typedef struct dir_hash_tab {
-	int			size;		/* size of hash tables */
-	int			names_duped;	/* 1 = ent names malloced */
+	int			size;		/* slots in each table, 2^n */
+	int			bits;		/* n, log2 of size */
+	int			naddr;		/* entries in byaddr */
+	int			names_duped;	/* 1 = ent names in arena */
 	dir_hash_ent_t		*first;		/* ptr to first added entry */
 	dir_hash_ent_t		*last;		/* ptr to last added entry */
-	dir_hash_ent_t		**byhash;	/* ptr to name hash buckets */
-	dir_hash_ent_t		**byaddr;	/* ptr to addr hash buckets */
+	dir_hash_ent_t		**byhash;	/* name hash slots */
+	dir_hash_ent_t		**byaddr;	/* data address slots */
+	dir_hash_arena_t	*arena;		/* current arena */
 } dir_hash_tab_t;
 
-#define	DIR_HASH_TAB_SIZE(n)	\
-	(sizeof(dir_hash_tab_t) + (sizeof(dir_hash_ent_t *) * (n) * 2))
-#define	DIR_HASH_FUNC(t,a)	((a) % (t)->size)
+#define	DIR_HASH_MIN_BITS	4
+#define	DIR_HASH_MIN_SLOTS	(1 << DIR_HASH_MIN_BITS)
+#define	DIR_HASH_INIT_MAX	65536
+#define	DIR_HASH_ARENA_MIN	4096
+#define	DIR_HASH_ARENA_MAX	(1024 * 1024)
+
+/*
+ * Data addresses are 8 byte aligned and name hashes are not particularly
+ * well mixed in their low bits, so scramble the key with a multiplicative
+ * hash and take the top bits of the product as the slot.
+ */
+#define	DIR_HASH_FUNC(t,a)	\
+	((((__uint32_t)(a)) * 0x9e3779b1U) >> (32 - (t)->bits))
+#define	DIR_HASH_NEXT(t,i)	(((i) + 1) & ((t)->size - 1))
 
 /*
  * Track the contents of the freespace table in a directory.
@@ -163,6 +274,73 @@ dir_read_buf(
 	return 0;
 }
 
+/*
+ * Hand out @len bytes from the hash table's arena, starting a new (bigger)
+ * arena when the current one is full.
+ */
+static void *
+dir_hash_alloc(
+	dir_hash_tab_t		*hashtab,
+	size_t			len)
+{
+	dir_hash_arena_t	*arena = hashtab->arena;
+	size_t			size;
+	void			*p;
+
+	len = roundup(len, sizeof(void *));
+	if (!arena || arena->used + len > arena->size) {
+		size = arena ? min(arena->size * 2, DIR_HASH_ARENA_MAX) :
+			       DIR_HASH_ARENA_MIN;
+		size = max(size, len);
+		arena = malloc(sizeof(*arena) + size);
+		if (!arena)
+			do_error(_("malloc failed in dir_hash_alloc (%zu bytes)\n"),
+				sizeof(*arena) + size);
+		arena->next = hashtab->arena;
+		arena->size = size;
+		arena->used = 0;
+		hashtab->arena = arena;
+	}
+	p = arena->data + arena->used;
+	arena->used += len;
+	return p;
+}
+
+/*
+ * Double the size of both lookup tables and rehash every entry into them.
+ */
+static void
+dir_hash_grow(
+	dir_hash_tab_t		*hashtab)
+{
+	dir_hash_ent_t		**slots;
+	dir_hash_ent_t		*p;
+	int			i;
+
+	slots = calloc(hashtab->size * 4, sizeof(dir_hash_ent_t *));
+	if (!slots)
+		do_error(_("calloc failed in dir_hash_grow\n"));
+	free(hashtab->byhash);
+	hashtab->size *= 2;
+	hashtab->bits++;
+	hashtab->byhash = slots;
+	hashtab->byaddr = slots + hashtab->size;
+
+	for (p = hashtab->first; p; p = p->nextbyorder) {
+		i = DIR_HASH_FUNC(hashtab, p->address);
+		while (hashtab->byaddr[i])
+			i = DIR_HASH_NEXT(hashtab, i);
+		hashtab->byaddr[i] = p;
+
+		if (p->junkit)
+			continue;
+		i = DIR_HASH_FUNC(hashtab, p->hashval);
+		while (hashtab->byhash[i])
+			i = DIR_HASH_NEXT(hashtab, i);
+		hashtab->byhash[i] = p;
+	}
+}
+
 /*
  * Returns 0 if the name already exists (ie. a duplicate)
  */
@@ -177,8 +355,8 @@ dir_hash_add(
 	__uint8_t		ftype)
 {
 	xfs_dahash_t		hash = 0;
-	int			byaddr;
 	int			byhash = 0;
+	int			i;
 	dir_hash_ent_t		*p;
 	int			dup;
 	short			junk;
@@ -191,17 +369,21 @@ dir_hash_add(
 	xname.type = ftype;
 
 	junk = name[0] == '/';
-	byaddr = DIR_HASH_FUNC(hashtab, addr);
 	dup = 0;
 
+	if (hashtab->naddr + 1 > hashtab->size / 2)
+		dir_hash_grow(hashtab);
+
 	if (!junk) {
 		hash = mp->m_dirnameops->hashname(&xname);
-		byhash = DIR_HASH_FUNC(hashtab, hash);
 
 		/*
-		 * search hash bucket for existing name.
+		 * search the probe sequence for an existing name, which
+		 * leaves byhash at the free slot for a new one.
 		 */
-		for (p = hashtab->byhash[byhash]; p; p = p->nextbyhash) {
+		for (byhash = DIR_HASH_FUNC(hashtab, hash);
+		     (p = hashtab->byhash[byhash]) != NULL;
+		     byhash = DIR_HASH_NEXT(hashtab, byhash)) {
 			if (p->hashval == hash && p->name.len == namelen) {
 				if (memcmp(p->name.name, name, namelen) == 0) {
 					dup = 1;
@@ -212,12 +394,13 @@ dir_hash_add(
 		}
 	}
 
-	if ((p = malloc(sizeof(*p))) == NULL)
-		do_error(_("malloc failed in dir_hash_add (%zu bytes)\n"),
-			sizeof(*p));
+	p = dir_hash_alloc(hashtab, sizeof(*p));
 
-	p->nextbyaddr = hashtab->byaddr[byaddr];
-	hashtab->byaddr[byaddr] = p;
+	for (i = DIR_HASH_FUNC(hashtab, addr); hashtab->byaddr[i];
+	     i = DIR_HASH_NEXT(hashtab, i))
+		;
+	hashtab->byaddr[i] = p;
+	hashtab->naddr++;
 	if (hashtab->last)
 		hashtab->last->nextbyorder = p;
 	else
@@ -227,7 +410,6 @@ dir_hash_add(
 
 	if (!(p->junkit = junk)) {
 		p->hashval = hash;
-		p->nextbyhash = hashtab->byhash[byhash];
 		hashtab->byhash[byhash] = p;
 	}
 	p->address = addr;
@@ -245,14 +427,11 @@ static int
 dir_hash_unseen(
 	dir_hash_tab_t	*hashtab)
 {
-	int		i;
 	dir_hash_ent_t	*p;
 
-	for (i = 0; i < hashtab->size; i++) {
-		for (p = hashtab->byaddr[i]; p; p = p->nextbyaddr) {
-			if (p->seen == 0)
-				return 1;
-		}
+	for (p = hashtab->first; p; p = p->nextbyorder) {
+		if (p->seen == 0)
+			return 1;
 	}
 	return 0;
 }
@@ -291,20 +470,16 @@ dir_hash_check(
 
 static void
 dir_hash_done(
-	dir_hash_tab_t	*hashtab)
+	dir_hash_tab_t		*hashtab)
 {
-	int		i;
-	dir_hash_ent_t	*n;
-	dir_hash_ent_t	*p;
+	dir_hash_arena_t	*arena;
+	dir_hash_arena_t	*next;
 
-	for (i = 0; i < hashtab->size; i++) {
-		for (p = hashtab->byaddr[i]; p; p = n) {
-			n = p->nextbyaddr;
-			if (hashtab->names_duped)
-				free((void *)p->name.name);
-			free(p);
-		}
+	for (arena = hashtab->arena; arena; arena = next) {
+		next = arena->next;
+		free(arena);
 	}
+	free(hashtab->byhash);
 	free(hashtab);
 }
 
@@ -314,19 +489,26 @@ dir_hash_init(
 {
 	dir_hash_tab_t	*hashtab;
 	int		hsize;
+	int		bits;
 
-	hsize = size / (16 * 4);
-	if (hsize > 65536)
-		hsize = 63336;
-	else if (hsize < 16)
-		hsize = 16;
-	if ((hashtab = calloc(DIR_HASH_TAB_SIZE(hsize), 1)) == NULL)
+	/*
+	 * Start with a slot per 64 bytes of directory and let the tables
+	 * grow from there if the guess is too small.
+	 */
+	hsize = DIR_HASH_MIN_SLOTS;
+	bits = DIR_HASH_MIN_BITS;
+	while (hsize < DIR_HASH_INIT_MAX && hsize < size / (16 * 4)) {
+		hsize *= 2;
+		bits++;
+	}
+	if ((hashtab = calloc(1, sizeof(dir_hash_tab_t))) == NULL)
+		do_error(_("calloc failed in dir_hash_init\n"));
+	hashtab->byhash = calloc(hsize * 2, sizeof(dir_hash_ent_t *));
+	if (!hashtab->byhash)
 		do_error(_("calloc failed in dir_hash_init\n"));
 	hashtab->size = hsize;
-	hashtab->byhash = (dir_hash_ent_t**)((char *)hashtab +
-		sizeof(dir_hash_tab_t));
-	hashtab->byaddr = (dir_hash_ent_t**)((char *)hashtab +
-		sizeof(dir_hash_tab_t) + sizeof(dir_hash_ent_t*) * hsize);
+	hashtab->bits = bits;
+	hashtab->byaddr = hashtab->byhash + hsize;
 	return hashtab;
 }
 
@@ -339,8 +521,8 @@ dir_hash_see(
 	int			i;
 	dir_hash_ent_t		*p;
 
-	i = DIR_HASH_FUNC(hashtab, addr);
-	for (p = hashtab->byaddr[i]; p; p = p->nextbyaddr) {
+	for (i = DIR_HASH_FUNC(hashtab, addr); (p = hashtab->byaddr[i]);
+	     i = DIR_HASH_NEXT(hashtab, i)) {
 		if (p->address != addr)
 			continue;
 		if (p->seen)
@@ -362,8 +544,8 @@ dir_hash_update_ftype(
 	int			i;
 	dir_hash_ent_t		*p;
 
-	i = DIR_HASH_FUNC(hashtab, addr);
-	for (p = hashtab->byaddr[i]; p; p = p->nextbyaddr) {
+	for (i = DIR_HASH_FUNC(hashtab, addr); (p = hashtab->byaddr[i]);
+	     i = DIR_HASH_NEXT(hashtab, i)) {
 		if (p->address != addr)
 			continue;
 		p->name.type = ftype;
@@ -412,7 +594,7 @@ dir_hash_dup_names(dir_hash_tab_t *hashtab)
 		return;
 
 	for (p = hashtab->first; p; p = p->nextbyorder) {
-		name = malloc(p->name.len);
+		name = dir_hash_alloc(hashtab, p->name.len);
 		memcpy(name, p->name.name, p->name.len);
 		p->name.name = name;
 	}
@@ -971,7 +1153,7 @@ mk_orphanage(xfs_mount_t *mp)
 		 * This inode is allocated from a newly created inode
 		 * chunk and therefore did not exist when inode chunks
 		 * were processed in phase3. Add this group of inodes to
-		 * the entry avl tree as if they were discovered in phase3.
+		 * the inode tree as if they were discovered in phase3.
 		 */
 		irec = set_inode_free_alloc(mp, XFS_INO_TO_AGNO(mp, ino),
 					    XFS_INO_TO_AGINO(mp, ino));
@@ -984,7 +1166,7 @@ mk_orphanage(xfs_mount_t *mp)
 	ino_offset = get_inode_offset(mp, ino, irec);
 
 	/*
-	 * Mark the inode allocated to lost+found as used in the AVL tree
+	 * Mark the inode allocated to lost+found as used in the inode tree
 	 * so it is not skipped in phase 7
 	 */
 	set_inode_used(irec, ino_offset);
@@ -1562,7 +1744,9 @@ longform_dir2_entry_check_data(
 		}
 		if (!no_modify) {
 			do_warn(_("junking block\n"));
+			pthread_mutex_lock(&dir_alloc_lock);
 			dir2_kill_block(mp, ip, da_bno, bp);
+			pthread_mutex_unlock(&dir_alloc_lock);
 		} else {
 			do_warn(_("would junk block\n"));
 			libxfs_putbuf(bp);
@@ -1706,8 +1890,7 @@ longform_dir2_entry_check_data(
 			 * if this is a dup, it will be picked up below,
 			 * otherwise, mark it as the orphanage for later.
 			 */
-			if (!orphanage_ino)
-				orphanage_ino = inum;
+			set_orphanage_ino(inum);
 		}
 
 		/*
@@ -1722,8 +1905,7 @@ longform_dir2_entry_check_data(
 				dep->name[0] = '/';
 				libxfs_dir2_data_log_entry(&da, bp, dep);
 			}
-			if (inum == orphanage_ino)
-				orphanage_ino = 0;
+			junk_orphanage_ino(inum);
 			continue;
 		}
 
@@ -1768,7 +1950,9 @@ longform_dir2_entry_check_data(
 		 */
 		if (ip->i_ino == inum)  {
 			ASSERT(dep->name[0] == '.' && dep->namelen == 1);
+			lock_irecs(current_irec, current_irec);
 			add_inode_ref(current_irec, current_ino_offset);
+			unlock_irecs(current_irec, current_irec);
 			if (da_bno != 0 ||
 			    dep != M_DIROPS(mp)->data_entry_p(d)) {
 				/* "." should be the first entry */
@@ -1822,9 +2006,12 @@ longform_dir2_entry_check_data(
 		 * the link count and continue
 		 */
 		if (!inode_isadir(irec, ino_offset))  {
+			lock_irecs(irec, irec);
 			add_inode_reached(irec, ino_offset);
+			unlock_irecs(irec, irec);
 			continue;
 		}
+		lock_irecs(irec, current_irec);
 		parent = get_inode_parent(irec, ino_offset);
 		ASSERT(parent != 0);
 		junkit = 0;
@@ -1860,9 +2047,9 @@ _("entry \"%s\" in dir %" PRIu64" points to an already connected directory inode
 _("entry \"%s\" in dir inode %" PRIu64 " inconsistent with .. value (%" PRIu64 ") in ino %" PRIu64 "\n"),
 				fname, ip->i_ino, parent, inum);
 		}
+		unlock_irecs(irec, current_irec);
 		if (junkit)  {
-			if (inum == orphanage_ino)
-				orphanage_ino = 0;
+			junk_orphanage_ino(inum);
 			nbad++;
 			if (!no_modify)  {
 				dep->name[0] = '/';
@@ -2371,7 +2558,9 @@ out_fix:
 		for (i = 0; i < num_bps; i++)
 			if (bplist[i])
 				libxfs_putbuf(bplist[i]);
+		pthread_mutex_lock(&dir_alloc_lock);
 		longform_dir2_rebuild(mp, ino, ip, irec, ino_offset, hashtab);
+		pthread_mutex_unlock(&dir_alloc_lock);
 		*num_illegal = 0;
 		*need_dot = 0;
 	} else {
@@ -2403,8 +2592,7 @@ shortform_dir2_junk(
 	int			next_len;
 	int			next_elen;
 
-	if (lino == orphanage_ino)
-		orphanage_ino = 0;
+	junk_orphanage_ino(lino);
 
 	next_elen = M_DIROPS(mp)->sf_entsize(sfp, sfep->namelen);
 	next_sfep = M_DIROPS(mp)->sf_nextentry(sfp, sfep);
@@ -2468,6 +2656,7 @@ shortform_dir2_entry_check(xfs_mount_t	*mp,
 	int			bytes_deleted;
 	char			fname[MAXNAMELEN + 1];
 	int			i8;
+	int			junkit;
 
 	ifp = &ip->i_df;
 	sfp = (struct xfs_dir2_sf_hdr *) ifp->if_u1.if_data;
@@ -2502,7 +2691,9 @@ shortform_dir2_entry_check(xfs_mount_t	*mp,
 	 * the directory is reached or will be taken care of when the
 	 * directory is moved to orphanage.
 	 */
+	lock_irecs(current_irec, current_irec);
 	add_inode_ref(current_irec, current_ino_offset);
+	unlock_irecs(current_irec, current_irec);
 
 	/*
 	 * Initialise i8 counter -- the parent inode number counts as well.
@@ -2632,8 +2823,7 @@ shortform_dir2_entry_check(xfs_mount_t	*mp,
 			 * if this is a dup, it will be picked up below,
 			 * otherwise, mark it as the orphanage for later.
 			 */
-			if (!orphanage_ino)
-				orphanage_ino = lino;
+			set_orphanage_ino(lino);
 		}
 		/*
 		 * check for duplicate names in directory.
@@ -2656,9 +2846,13 @@ _("entry \"%s\" (ino %" PRIu64 ") in dir %" PRIu64 " is a duplicate name"),
 			 * check easy case first, regular inode, just bump
 			 * the link count
 			 */
+			lock_irecs(irec, irec);
 			add_inode_reached(irec, ino_offset);
+			unlock_irecs(irec, irec);
 		} else  {
+			lock_irecs(irec, current_irec);
 			parent = get_inode_parent(irec, ino_offset);
+			junkit = 0;
 
 			/*
 			 * bump up the link counts in parent and child.
@@ -2666,14 +2860,11 @@ _("entry \"%s\" (ino %" PRIu64 ") in dir %" PRIu64 " is a duplicate name"),
 			 * the .. in the child, blow out the entry
 			 */
 			if (is_inode_reached(irec, ino_offset))  {
+				junkit = 1;
 				do_warn(
 	_("entry \"%s\" in directory inode %" PRIu64
 	  " references already connected inode %" PRIu64 ".\n"),
 					fname, ino, lino);
-				next_sfep = shortform_dir2_junk(mp, sfp, sfep,
-						lino, &max_size, &i,
-						&bytes_deleted, ino_dirty);
-				continue;
 			} else if (parent == ino)  {
 				add_inode_reached(irec, ino_offset);
 				add_inode_ref(current_irec, current_ino_offset);
@@ -2689,11 +2880,15 @@ _("entry \"%s\" (ino %" PRIu64 ") in dir %" PRIu64 " is a duplicate name"),
 				add_dotdot_update(XFS_INO_TO_AGNO(mp, lino),
 							irec, ino_offset);
 			} else  {
+				junkit = 1;
 				do_warn(
 	_("entry \"%s\" in directory inode %" PRIu64
 	  " not consistent with .. value (%" PRIu64
 	  ") in inode %" PRIu64 ",\n"),
 					fname, ino, parent, lino);
+			}
+			unlock_irecs(irec, current_irec);
+			if (junkit) {
 				next_sfep = shortform_dir2_junk(mp, sfp, sfep,
 						lino, &max_size, &i,
 						&bytes_deleted, ino_dirty);
@@ -2833,18 +3028,23 @@ process_dir_inode(
 			 * to ensure that the root doesn't show up
 			 * as being disconnected in the no_modify case.
 			 */
+			lock_irecs(irec, irec);
 			if (mp->m_sb.sb_rootino == ino)  {
 				add_inode_reached(irec, 0);
 				add_inode_ref(irec, 0);
 			}
+			unlock_irecs(irec, irec);
 		}
 
+		lock_irecs(irec, irec);
 		add_inode_refchecked(irec, 0);
+		unlock_irecs(irec, irec);
 		return;
 	}
 
 	need_dot = dirty = num_illegal = 0;
 
+	lock_irecs(irec, irec);
 	if (mp->m_sb.sb_rootino == ino)  {
 		/*
 		 * mark root inode reached and bump up
@@ -2858,6 +3058,7 @@ process_dir_inode(
 	}
 
 	add_inode_refchecked(irec, ino_offset);
+	unlock_irecs(irec, irec);
 
 	hashtab = dir_hash_init(ip->i_d.di_size);
 
@@ -2923,11 +3124,12 @@ process_dir_inode(
 	 * in hash-value order so the simulation won't get confused
 	 * if it has to move them around.
 	 */
-	if (!no_modify && need_root_dotdot && ino == mp->m_sb.sb_rootino)  {
+	if (!no_modify && ino == mp->m_sb.sb_rootino && need_root_dotdot)  {
 		ASSERT(ip->i_d.di_format != XFS_DINODE_FMT_LOCAL);
 
 		do_warn(_("recreating root directory .. entry\n"));
 
+		pthread_mutex_lock(&dir_alloc_lock);
 		nres = XFS_MKDIR_SPACE_RES(mp, 2);
 		error = -libxfs_trans_alloc(mp, &M_RES(mp)->tr_mkdir,
 					    nres, 0, 0, &tp);
@@ -2949,9 +3151,10 @@ process_dir_inode(
 		error = -libxfs_defer_finish(&tp, &dfops, ip);
 		ASSERT(error == 0);
 		libxfs_trans_commit(tp);
+		pthread_mutex_unlock(&dir_alloc_lock);
 
 		need_root_dotdot = 0;
-	} else if (need_root_dotdot && ino == mp->m_sb.sb_rootino)  {
+	} else if (ino == mp->m_sb.sb_rootino && need_root_dotdot)  {
 		do_warn(_("would recreate root directory .. entry\n"));
 	}
 
@@ -2972,7 +3175,9 @@ process_dir_inode(
 		 * it turns out to be wrong, we'll catch
 		 * that in phase 7.
 		 */
+		lock_irecs(irec, irec);
 		add_inode_ref(irec, ino_offset);
+		unlock_irecs(irec, irec);
 
 		if (no_modify)  {
 			do_warn(
@@ -2985,6 +3190,7 @@ process_dir_inode(
 			do_warn(
 	_("creating missing \".\" entry in dir ino %" PRIu64 "\n"), ino);
 
+			pthread_mutex_lock(&dir_alloc_lock);
 			nres = XFS_MKDIR_SPACE_RES(mp, 1);
 			error = -libxfs_trans_alloc(mp, &M_RES(mp)->tr_mkdir,
 						    nres, 0, 0, &tp);
@@ -3007,6 +3213,7 @@ process_dir_inode(
 			error = -libxfs_defer_finish(&tp, &dfops, ip);
 			ASSERT(error == 0);
 			libxfs_trans_commit(tp);
+			pthread_mutex_unlock(&dir_alloc_lock);
 		}
 	}
 	IRELE(ip);
@@ -3115,6 +3322,96 @@ check_for_orphaned_inodes(
 	}
 }
 
+/*
+ * The root directory is processed on its own before the traversal starts, so
+ * need_root_dotdot is never touched by more than one thread and the orphanage
+ * has been found before any other directory can junk an entry for it.
+ */
+static void
+traverse_dir_inode(
+	struct xfs_mount	*mp,
+	xfs_agnumber_t		agno,
+	ino_tree_node_t		*irec,
+	int			ino_offset)
+{
+	if (XFS_AGINO_TO_INO(mp, agno, irec->ino_startnum + ino_offset) ==
+			mp->m_sb.sb_rootino)
+		return;
+	process_dir_inode(mp, agno, irec, ino_offset);
+}
+
+/*
+ * When all the directories are already in the buffer cache there is no
+ * prefetch to keep in step with, so each AG is broken up into runs of inode
+ * records containing directories. Other workers steal runs from the AG's
+ * queue, so one AG full of directories doesn't leave everyone else idle.
+ *
+ * Buffers aren't locked when prefetch is turned off, so two workers must
+ * never have directory inodes from the same inode cluster buffer. A run only
+ * ends where the next record starts a new cluster, which may make it a little
+ * longer than TRAVERSE_DIR_RECS.
+ */
+#define TRAVERSE_DIR_RECS	64
+
+struct traverse_run {
+	ino_tree_node_t		*first;		/* first record in the run */
+	int			nrecs;		/* directory records in run */
+};
+
+static void
+traverse_run(
+	work_queue_t		*wq,
+	xfs_agnumber_t		agno,
+	void			*arg)
+{
+	struct traverse_run	*run = arg;
+	ino_tree_node_t		*irec;
+	int			n = 0;
+	int			i;
+
+	for (irec = run->first; irec && n < run->nrecs;
+	     irec = next_ino_rec(irec)) {
+		if (irec->ino_isa_dir == 0)
+			continue;
+		n++;
+		for (i = 0; i < XFS_INODES_PER_CHUNK; i++)  {
+			if (inode_isadir(irec, i))
+				traverse_dir_inode(wq->mp, agno, irec, i);
+		}
+	}
+	free(run);
+}
+
+static void
+queue_traverse_runs(
+	work_queue_t		*wq,
+	xfs_agnumber_t		agno)
+{
+	struct traverse_run	*run = NULL;
+	ino_tree_node_t		*irec;
+
+	for (irec = findfirst_inode_rec(agno); irec; irec = next_ino_rec(irec)) {
+		if (irec->ino_isa_dir == 0)
+			continue;
+		if (run && run->nrecs >= TRAVERSE_DIR_RECS &&
+		    irec->ino_startnum % inodes_per_cluster == 0) {
+			queue_work(wq, traverse_run, agno, run);
+			run = NULL;
+		}
+		if (!run) {
+			run = malloc(sizeof(struct traverse_run));
+			if (!run)
+				do_error(
+				_("could not allocate directory work item\n"));
+			run->first = irec;
+			run->nrecs = 0;
+		}
+		run->nrecs++;
+	}
+	if (run)
+		queue_work(wq, traverse_run, agno, run);
+}
+
 static void
 traverse_function(
 	work_queue_t		*wq,
@@ -3130,6 +3427,11 @@ traverse_function(
 	if (verbose)
 		do_log(_("        - agno = %d\n"), agno);
 
+	if (!pf_args && wq->thread_count > 1) {
+		queue_traverse_runs(wq, agno);
+		return;
+	}
+
 	for (irec = findfirst_inode_rec(agno); irec; irec = next_ino_rec(irec)) {
 		if (irec->ino_isa_dir == 0)
 			continue;
@@ -3146,7 +3448,7 @@ traverse_function(
 
 		for (i = 0; i < XFS_INODES_PER_CHUNK; i++)  {
 			if (inode_isadir(irec, i))
-				process_dir_inode(wq->mp, agno, irec, i);
+				traverse_dir_inode(wq->mp, agno, irec, i);
 		}
 	}
 	cleanup_inode_prefetch(pf_args);
@@ -3172,11 +3474,16 @@ update_missing_dotdot_entries(
 	}
 }
 
+/*
+ * Directories are traversed in parallel the same way inodes are processed in
+ * phases 3 and 4: a prefetch thread per ag_stride segment of the filesystem,
+ * or a worker per CPU if everything is still in the buffer cache.
+ */
 static void
 traverse_ags(
 	struct xfs_mount	*mp)
 {
-	do_inode_prefetch(mp, 0, traverse_function, false, true);
+	do_inode_prefetch(mp, ag_stride, traverse_function, true, true);
 }
 
 void
@@ -3188,6 +3495,8 @@ phase6(xfs_mount_t *mp)
 	memset(&zerocr, 0, sizeof(struct cred));
 	memset(&zerofsx, 0, sizeof(struct fsxattr));
 	orphanage_ino = 0;
+	for (i = 0; i < IREC_LOCKS; i++)
+		pthread_mutex_init(&irec_locks[i], NULL);
 
 	do_log(_("Phase 6 - check inode connectivity...\n"));
 
@@ -3259,6 +3568,9 @@ _("        - resetting contents of realtime bitmap and summary inodes\n"));
 	 */
 	if (is_inode_free(irec, 0) || !inode_isadir(irec, 0))  {
 		need_root_inode = 1;
+	} else  {
+		process_dir_inode(mp,
+			XFS_INO_TO_AGNO(mp, mp->m_sb.sb_rootino), irec, 0);
 	}
 
 	/*
@@ -17,7 +17,6 @@
  */
 
 #include "libxfs.h"
-#include "avl.h"
 #include "globals.h"
 #include "agheader.h"
 #include "incore.h"
@@ -92,6 +91,36 @@ update_inode_nlinks(
 	IRELE(ip);
 }
 
+/*
+ * Link count checking is queued in runs of inode records rather than whole
+ * AGs, so a single AG with most of the inodes in it can be spread over all
+ * the workers. A cluster or block can hold more than one inode record, and
+ * sparse records need not fill one, so a run only ends where the next record
+ * starts a new inode cluster buffer. That keeps two runs from ever touching
+ * the same buffer.
+ */
+#define LINK_RECS_PER_ITEM	1024
+
+struct link_range {
+	ino_tree_node_t		*first;		/* first inode record */
+	int			nrecs;		/* records in this run */
+};
+
+/*
+ * Runs of each AG still to finish. The queueing holds a reference until all
+ * of an AG's runs are queued, and whoever drops the last one reports the AG
+ * as done.
+ */
+static int		*link_runs_left;
+
+static void
+link_runs_put(
+	xfs_agnumber_t		agno)
+{
+	if (__atomic_sub_fetch(&link_runs_left[agno], 1, __ATOMIC_ACQ_REL) == 0)
+		PROG_RPT_INC(prog_rpt_done[agno], 1);
+}
+
 /*
  * for each ag, look at each inode 1 at a time. If the number of
  * links is bad, reset it, log the inode core, commit the transaction
@@ -102,12 +131,14 @@ do_link_updates(
 	xfs_agnumber_t		agno,
 	void			*arg)
 {
+	struct link_range	*lr = arg;
 	ino_tree_node_t		*irec;
+	int			i;
 	int			j;
 	__uint32_t		nrefs;
 
-	for (irec = findfirst_inode_rec(agno); irec;
-	     irec = next_ino_rec(irec)) {
+	for (irec = lr->first, i = 0; irec && i < lr->nrecs;
+	     irec = next_ino_rec(irec), i++) {
 		for (j = 0; j < XFS_INODES_PER_CHUNK; j++)  {
 			ASSERT(is_inode_confirmed(irec, j));
 
@@ -127,7 +158,43 @@ do_link_updates(
 		}
 	}
 
-	PROG_RPT_INC(prog_rpt_done[agno], 1);
+	free(lr);
+	link_runs_put(agno);
+}
+
+static void
+queue_link_updates(
+	struct work_queue	*wq,
+	xfs_agnumber_t		agno)
+{
+	struct link_range	*lr = NULL;
+	ino_tree_node_t		*irec;
+
+	link_runs_left[agno] = 1;
+	for (irec = findfirst_inode_rec(agno); irec;
+	     irec = next_ino_rec(irec)) {
+		if (lr && lr->nrecs >= LINK_RECS_PER_ITEM &&
+		    irec->ino_startnum % inodes_per_cluster == 0) {
+			__atomic_add_fetch(&link_runs_left[agno], 1,
+					__ATOMIC_RELAXED);
+			queue_work(wq, do_link_updates, agno, lr);
+			lr = NULL;
+		}
+		if (!lr) {
+			lr = malloc(sizeof(struct link_range));
+			if (!lr)
+				do_error(
+				_("could not allocate link count work item\n"));
+			lr->first = irec;
+			lr->nrecs = 0;
+		}
+		lr->nrecs++;
+	}
+	if (lr) {
+		__atomic_add_fetch(&link_runs_left[agno], 1, __ATOMIC_RELAXED);
+		queue_work(wq, do_link_updates, agno, lr);
+	}
+	link_runs_put(agno);
 }
 
 void
@@ -145,12 +212,18 @@ phase7(
 
 	set_progress_msg(PROGRESS_FMT_CORR_LINK, (__uint64_t) glob_agcount);
 
+	link_runs_left = calloc(mp->m_sb.sb_agcount, sizeof(int));
+	if (!link_runs_left)
+		do_error(_("could not allocate link count work item\n"));
+
 	create_work_queue(&wq, mp, scan_threads);
 
 	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++)
-		queue_work(&wq, do_link_updates, agno, NULL);
+		queue_link_updates(&wq, agno);
 
 	destroy_work_queue(&wq);
+	free(link_runs_left);
+	link_runs_left = NULL;
 
 	print_final_rpt();
 }
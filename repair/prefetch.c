@@ -1,6 +1,8 @@
 #include "libxfs.h"
 #include <pthread.h>
-#include "avl.h"
+#ifdef HAVE_PREADV
+#include <sys/uio.h>
+#endif
 #include "btree.h"
 #include "globals.h"
 #include "agheader.h"
@@ -25,7 +27,7 @@ int do_prefetch = 1;
  */
 
 static xfs_mount_t	*mp;
-static int 		mp_fd;
+static dev_t		mp_dev;
 static int		pf_max_bytes;
 static int		pf_max_bbs;
 static int		pf_max_fsbs;
@@ -454,6 +456,55 @@ pf_read_inode_dirs(
 		XFS_BUF_SET_PRIORITY(bp, B_DIR_INODE);
 }
 
+/*
+ * Read the byte range [@first_off, @last_off) covering the sorted buffers in
+ * @bplist. Where we can, the data is scattered straight into the buffers and
+ * only the gaps between them land in @buf, so there is no copy to do
+ * afterwards. Returns the number of bytes of the range that were read.
+ */
+static ssize_t
+pf_read_bufs(
+	xfs_buf_t		**bplist,
+	int			num,
+	off64_t			first_off,
+	off64_t			last_off,
+	char			*buf)
+{
+	off64_t			off;
+	ssize_t			len;
+	int			i;
+#ifdef HAVE_PREADV
+	struct iovec		iov[MAX_BUFS * 2];
+	int			niov = 0;
+
+	for (i = 0, off = first_off; i < num; i++) {
+		off64_t		boff = LIBXFS_BBTOOFF64(XFS_BUF_ADDR(bplist[i]));
+
+		if (boff > off) {
+			iov[niov].iov_base = buf + (off - first_off);
+			iov[niov].iov_len = boff - off;
+			niov++;
+		}
+		iov[niov].iov_base = XFS_BUF_PTR(bplist[i]);
+		iov[niov].iov_len = XFS_BUF_SIZE(bplist[i]);
+		niov++;
+		off = boff + XFS_BUF_SIZE(bplist[i]);
+	}
+	len = libxfs_device_preadv(mp_dev, iov, niov, first_off);
+#else
+	len = libxfs_device_pread(mp_dev, buf, (int)(last_off - first_off),
+				  first_off);
+	for (i = 0; i < num && len > 0; i++) {
+		off = LIBXFS_BBTOOFF64(XFS_BUF_ADDR(bplist[i])) - first_off;
+		if (off + XFS_BUF_SIZE(bplist[i]) > len)
+			break;
+		memcpy(XFS_BUF_PTR(bplist[i]), buf + off,
+		       XFS_BUF_SIZE(bplist[i]));
+	}
+#endif
+	return len;
+}
+
 /*
  * pf_batch_read must be called with the lock locked.
  */
@@ -466,12 +517,11 @@ pf_batch_read(
 	xfs_buf_t		*bplist[MAX_BUFS];
 	unsigned int		num;
 	off64_t			first_off, last_off, next_off;
-	int			len, size;
+	ssize_t			len;
 	int			i;
 	int			inode_bufs;
 	unsigned long		fsbno = 0;
 	unsigned long		max_fsbno;
-	char			*pbuf;
 
 	for (;;) {
 		num = 0;
@@ -537,6 +587,18 @@ pf_batch_read(
 			num = i;
 		}
 
+		/*
+		 * Corrupt metadata can point us at buffers that overlap each
+		 * other, and those can't be scattered into by the same read.
+		 */
+		for (i = 1; i < num; i++) {
+			if (LIBXFS_BBTOOFF64(XFS_BUF_ADDR(bplist[i])) <
+			    LIBXFS_BBTOOFF64(XFS_BUF_ADDR(bplist[i - 1])) +
+					XFS_BUF_SIZE(bplist[i - 1]))
+				break;
+		}
+		num = i;
+
 		for (i = 0; i < num; i++) {
 			if (btree_delete(args->io_queue, XFS_DADDR_TO_FSB(mp,
 					XFS_BUF_ADDR(bplist[i]))) == NULL)
@@ -562,11 +624,6 @@ pf_batch_read(
 #endif
 		pthread_mutex_unlock(&args->lock);
 
-		/*
-		 * now read the data and put into the xfs_but_t's
-		 */
-		len = pread(mp_fd, buf, (int)(last_off - first_off), first_off);
-
 		/*
 		 * Check the last buffer on the list to see if we need to
 		 * process a discontiguous buffer. The gather above loop
@@ -578,32 +635,34 @@ pf_batch_read(
 			bplist[num - 1]->b_flags |= LIBXFS_B_UNCHECKED;
 			libxfs_putbuf(bplist[num - 1]);
 			num--;
+			if (num)
+				last_off = LIBXFS_BBTOOFF64(XFS_BUF_ADDR(bplist[num - 1])) +
+					XFS_BUF_SIZE(bplist[num - 1]);
 		}
 
-		if (len > 0) {
-			/*
-			 * go through the xfs_buf_t list copying from the
-			 * read buffer into the xfs_buf_t's and release them.
-			 */
-			for (i = 0; i < num; i++) {
+		/*
+		 * now read the data into the xfs_buf_t's
+		 */
+		len = num ? pf_read_bufs(bplist, num, first_off, last_off,
+					 buf) : 0;
 
-				pbuf = ((char *)buf) + (LIBXFS_BBTOOFF64(XFS_BUF_ADDR(bplist[i])) - first_off);
-				size = XFS_BUF_SIZE(bplist[i]);
-				if (len < size)
-					break;
-				memcpy(XFS_BUF_PTR(bplist[i]), pbuf, size);
-				bplist[i]->b_flags |= (LIBXFS_B_UPTODATE |
-						       LIBXFS_B_UNCHECKED);
-				len -= size;
-				if (B_IS_INODE(XFS_BUF_PRIORITY(bplist[i])))
-					pf_read_inode_dirs(args, bplist[i]);
-				else if (which == PF_META_ONLY)
-					XFS_BUF_SET_PRIORITY(bplist[i],
-								B_DIR_META_H);
-				else if (which == PF_PRIMARY && num == 1)
-					XFS_BUF_SET_PRIORITY(bplist[i],
-								B_DIR_META_S);
-			}
+		/*
+		 * go through the xfs_buf_t list marking the ones the read
+		 * covered as valid and release them.
+		 */
+		for (i = 0; i < num && len > 0; i++) {
+			next_off = LIBXFS_BBTOOFF64(XFS_BUF_ADDR(bplist[i])) +
+					XFS_BUF_SIZE(bplist[i]);
+			if (next_off - first_off > len)
+				break;
+			bplist[i]->b_flags |= (LIBXFS_B_UPTODATE |
+					       LIBXFS_B_UNCHECKED);
+			if (B_IS_INODE(XFS_BUF_PRIORITY(bplist[i])))
+				pf_read_inode_dirs(args, bplist[i]);
+			else if (which == PF_META_ONLY)
+				XFS_BUF_SET_PRIORITY(bplist[i], B_DIR_META_H);
+			else if (which == PF_PRIMARY && num == 1)
+				XFS_BUF_SET_PRIORITY(bplist[i], B_DIR_META_S);
 		}
 		for (i = 0; i < num; i++) {
 			pftrace("putbuf %c %p (%llu) in AG %d",
@@ -643,6 +702,7 @@ pf_io_worker(
 	void			*param)
 {
 	prefetch_args_t		*args = param;
+	/* catches the gaps between the buffers of a batch */
 	void			*buf = memalign(libxfs_device_alignment(),
 						pf_max_bytes);
 
@@ -827,7 +887,7 @@ init_prefetch(
 	xfs_mount_t		*pmp)
 {
 	mp = pmp;
-	mp_fd = libxfs_device_to_fd(mp->m_ddev_targp->dev);
+	mp_dev = mp->m_ddev_targp->dev;
 	pf_max_bytes = sysconf(_SC_PAGE_SIZE) << 7;
 	pf_max_bbs = pf_max_bytes >> BBSHIFT;
 	pf_max_fsbs = pf_max_bytes >> mp->m_sb.sb_blocklog;
@@ -985,9 +1045,11 @@ do_inode_prefetch(
 
 	/*
 	 * single threaded behaviour - single prefetch thread, processed
-	 * directly after each AG is queued.
+	 * directly after each AG is queued. There are no workers behind the
+	 * queue, and func must be able to tell that from its thread_count.
 	 */
 	if (!stride) {
+		memset(&queue, 0, sizeof(queue));
 		queue.mp = mp;
 		prefetch_ag_range(&queue, 0, mp->m_sb.sb_agcount,
 				  dirs_only, func);
@@ -54,6 +54,17 @@ static inline int rmap_compare(const void *a, const void *b)
 	return libxfs_rmap_compare(a, b);
 }
 
+/*
+ * Radix sort key for rmaps: the start block and the top half of the owner,
+ * which is as much of the rmap_compare() order as fits in 64 bits.
+ */
+static uint64_t rmap_key(const void *a)
+{
+	const struct xfs_rmap_irec	*rmap = a;
+
+	return ((uint64_t)rmap->rm_startblock << 32) | (rmap->rm_owner >> 32);
+}
+
 /*
  * Returns true if we must reconstruct either the reference count or reverse
  * mapping trees.
@@ -302,7 +313,7 @@ rmap_fold_raw_recs(
 	old_sz = slab_count(ag_rmaps[agno].ar_rmaps);
 	if (slab_count(ag_rmaps[agno].ar_raw_rmaps) == 0)
 		goto no_raw;
-	qsort_slab(ag_rmaps[agno].ar_raw_rmaps, rmap_compare);
+	radix_sort_slab(ag_rmaps[agno].ar_raw_rmaps, rmap_key, rmap_compare);
 	error = init_slab_cursor(ag_rmaps[agno].ar_raw_rmaps, rmap_compare,
 			&cur);
 	if (error)
@@ -335,7 +346,8 @@ rmap_fold_raw_recs(
 _("Insufficient memory while allocating raw metadata reverse mapping slabs."));
 no_raw:
 	if (old_sz)
-		qsort_slab(ag_rmaps[agno].ar_rmaps, rmap_compare);
+		radix_sort_slab(ag_rmaps[agno].ar_rmaps, rmap_key,
+				rmap_compare);
 err:
 	free_slab_cursor(&cur);
 	return error;
@@ -138,13 +138,9 @@ __find_secondary_sb(
 		/*
 		 * read disk 1 MByte at a time.
 		 */
-		if (lseek(x.dfd, off, SEEK_SET) != off)  {
+		bsize = libxfs_device_pread(x.ddev, sb, BSIZE, off);
+		if (bsize <= 0)
 			done = 1;
-		}
-
-		if (!done && (bsize = read(x.dfd, sb, BSIZE)) <= 0)  {
-			done = 1;
-		}
 
 		do_warn(".");
 
@@ -558,15 +554,8 @@ get_sb(xfs_sb_t *sbp, xfs_off_t off, int size, xfs_agnumber_t agno)
 
 	/* try and read it first */
 
-	if (lseek(x.dfd, off, SEEK_SET) != off)  {
-		do_warn(
-	_("error reading superblock %u -- seek to offset %" PRId64 " failed\n"),
-			agno, off);
-		free(buf);
-		return(XR_EOF);
-	}
-
-	if ((rval = read(x.dfd, buf, size)) != size)  {
+	rval = libxfs_device_pread(x.ddev, buf, size, off);
+	if (rval != size)  {
 		error = errno;
 		do_warn(
 	_("superblock read failed, offset %" PRId64 ", size %d, ag %u, rval %d\n"),
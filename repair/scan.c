@@ -17,7 +17,6 @@
  */
 
 #include "libxfs.h"
-#include "avl.h"
 #include "globals.h"
 #include "agheader.h"
 #include "incore.h"
@@ -1676,7 +1675,7 @@ _("inode chunk claims used block, inobt block - agno %d, bno %d, inopb %d\n"),
 	}
 
 	/*
-	 * ensure only one avl entry per chunk
+	 * ensure only one tree entry per chunk
 	 */
 	find_inode_rec_range(mp, agno, ino, ino + XFS_INODES_PER_CHUNK,
 			     &first_rec, &last_rec);
@@ -1917,7 +1916,7 @@ _("invalid inode count, inode chunk %d/%u, count %d ninodes %d\n"),
 
 /*
  * this one walks the inode btrees sucking the info there into
- * the incore avl tree.  We try and rescue corrupted btree records
+ * the incore inode tree.  We try and rescue corrupted btree records
  * to minimize our chances of losing inodes.  Inode info from potentially
  * corrupt sources could be bogus so rather than put the info straight
  * into the tree, instead we put it on a list and try and verify the
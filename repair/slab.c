@@ -19,6 +19,7 @@
  */
 #include <libxfs.h>
 #include "slab.h"
+#include "spill.h"
 
 #undef SLAB_DEBUG
 
@@ -73,8 +74,13 @@ struct xfs_slab {
  * Slab cursors -- each slab_hdr_cursor tracks a slab_hdr; the slab_cursor
  * tracks the slab_hdr_cursors.  If a compare_fn is specified, the cursor
  * returns objects in increasing order (if you've previously sorted the
- * slabs with qsort_slab()).  If compare_fn == NULL, it returns slab items
- * in order.
+ * slabs with qsort_slab() or radix_sort_slab()).  If compare_fn == NULL, it
+ * returns slab items in order.
+ *
+ * Sorted cursors merge the slabs with a binary min-heap of the slab_hdr
+ * cursors that still have items, keyed on the item each one points at, so
+ * taking an item costs O(log(slabs)) compares instead of a scan over every
+ * slab.  Equal items are returned from the earliest slab first.
  */
 struct xfs_slab_hdr_cursor {
 	struct xfs_slab_hdr	*hdr;		/* a slab header */
@@ -88,6 +94,8 @@ struct xfs_slab_cursor {
 	struct xfs_slab			*slab;		/* pointer to the slab */
 	struct xfs_slab_hdr_cursor	*last_hcur;	/* last header we took from */
 	xfs_slab_compare_fn		compare_fn;	/* compare items */
+	size_t				heap_nr;	/* # of cursors in heap */
+	struct xfs_slab_hdr_cursor	**heap;		/* merge heap */
 	struct xfs_slab_hdr_cursor	hcur[0];	/* per-slab cursors */
 };
 
@@ -141,7 +149,7 @@ free_slab(
 	hdr = ptr->s_first;
 	while (hdr) {
 		nhdr = hdr->sh_next;
-		free(hdr);
+		spill_free(hdr);
 		hdr = nhdr;
 	}
 	free(ptr);
@@ -180,7 +188,8 @@ slab_add(
 		n = (hdr ? hdr->sh_nr * 2 : MIN_SLAB_NR);
 		if (n * slab->s_item_sz > MAX_SLAB_SIZE)
 			n = MAX_SLAB_SIZE / slab->s_item_sz;
-		hdr = malloc(sizeof(struct xfs_slab_hdr) + (n * slab->s_item_sz));
+		hdr = spill_malloc(sizeof(struct xfs_slab_hdr) +
+				   (n * slab->s_item_sz));
 		if (!hdr)
 			return -ENOMEM;
 		hdr->sh_nr = n;
@@ -207,8 +216,115 @@ struct qsort_slab {
 	struct xfs_slab		*slab;
 	struct xfs_slab_hdr	*hdr;
 	int			(*compare_fn)(const void *, const void *);
+	uint64_t		(*key_fn)(const void *);
+};
+
+/*
+ * Radix sort entries: the item's key and where the item sits in the slab.
+ */
+struct radix_ent {
+	uint64_t		key;
+	uint32_t		idx;
 };
 
+/*
+ * Sort one slab by the keys returned by key_fn with an LSD radix sort on a
+ * side array of (key, index) pairs, skipping key bytes that are the same in
+ * every item, then move the items into place by following the cycles of the
+ * permutation.  Runs of items with equal keys are finished off with qsort.
+ *
+ * Returns false if there wasn't enough memory for the side arrays.
+ */
+static bool
+radix_sort_slab_hdr(
+	struct xfs_slab		*slab,
+	struct xfs_slab_hdr	*hdr,
+	uint64_t		(*key_fn)(const void *),
+	int			(*compare_fn)(const void *, const void *))
+{
+	struct radix_ent	*ents, *tmp, *e;
+	size_t			count[sizeof(uint64_t)][256];
+	size_t			nr = hdr->sh_inuse;
+	size_t			sz = slab->s_item_sz;
+	size_t			i, j, k, pos, sum;
+	unsigned int		shift, b;
+	char			*base = slab_ptr(slab, hdr, 0);
+	char			*item;
+
+	ents = malloc(nr * sizeof(struct radix_ent));
+	tmp = malloc(nr * sizeof(struct radix_ent));
+	item = malloc(sz);
+	if (!ents || !tmp || !item) {
+		free(ents);
+		free(tmp);
+		free(item);
+		return false;
+	}
+
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < nr; i++) {
+		ents[i].key = key_fn(base + i * sz);
+		ents[i].idx = i;
+		for (b = 0; b < sizeof(uint64_t); b++)
+			count[b][(ents[i].key >> (b * NBBY)) & 0xff]++;
+	}
+
+	for (b = 0; b < sizeof(uint64_t); b++) {
+		shift = b * NBBY;
+		if (count[b][(ents[0].key >> shift) & 0xff] == nr)
+			continue;
+		for (j = 0, sum = 0; j < 256; j++) {
+			pos = sum;
+			sum += count[b][j];
+			count[b][j] = pos;
+		}
+		for (i = 0; i < nr; i++)
+			tmp[count[b][(ents[i].key >> shift) & 0xff]++] = ents[i];
+		e = ents;
+		ents = tmp;
+		tmp = e;
+	}
+	free(tmp);
+
+	/* Slot i gets the item at ents[i].idx. */
+	for (i = 0; i < nr; i++) {
+		if (ents[i].idx == i)
+			continue;
+		memcpy(item, base + i * sz, sz);
+		for (j = i; ents[j].idx != i; j = k) {
+			k = ents[j].idx;
+			memcpy(base + j * sz, base + k * sz, sz);
+			ents[j].idx = j;
+		}
+		memcpy(base + j * sz, item, sz);
+		ents[j].idx = j;
+	}
+	free(item);
+
+	for (i = 0; i < nr; i = j) {
+		for (j = i + 1; j < nr && ents[j].key == ents[i].key; j++)
+			;
+		if (j - i > 1)
+			qsort(base + i * sz, j - i, sz, compare_fn);
+	}
+	free(ents);
+	return true;
+}
+
+static void
+sort_slab_hdr(
+	struct xfs_slab		*slab,
+	struct xfs_slab_hdr	*hdr,
+	int			(*compare_fn)(const void *, const void *),
+	uint64_t		(*key_fn)(const void *))
+{
+	if (key_fn && hdr->sh_inuse > 1 &&
+	    radix_sort_slab_hdr(slab, hdr, key_fn, compare_fn))
+		return;
+	qsort(slab_ptr(slab, hdr, 0), hdr->sh_inuse, slab->s_item_sz,
+			compare_fn);
+}
+
 static void
 qsort_slab_helper(
 	struct work_queue	*wq,
@@ -217,19 +333,15 @@ qsort_slab_helper(
 {
 	struct qsort_slab	*qs = arg;
 
-	qsort(slab_ptr(qs->slab, qs->hdr, 0), qs->hdr->sh_inuse,
-			qs->slab->s_item_sz, qs->compare_fn);
+	sort_slab_hdr(qs->slab, qs->hdr, qs->compare_fn, qs->key_fn);
 	free(qs);
 }
 
-/*
- * Sort the items in the slab.  Do not run this method if there are any
- * cursors holding on to the slab.
- */
-void
-qsort_slab(
+static void
+sort_slab(
 	struct xfs_slab		*slab,
-	int (*compare_fn)(const void *, const void *))
+	int			(*compare_fn)(const void *, const void *),
+	uint64_t		(*key_fn)(const void *))
 {
 	struct work_queue	wq;
 	struct xfs_slab_hdr	*hdr;
@@ -242,8 +354,8 @@ qsort_slab(
 	if (slab->s_nr_slabs <= 4) {
 		hdr = slab->s_first;
 		while (hdr) {
-			qsort(slab_ptr(slab, hdr, 0), hdr->sh_inuse,
-					slab->s_item_sz, compare_fn);
+			if (hdr->sh_inuse)
+				sort_slab_hdr(slab, hdr, compare_fn, key_fn);
 			hdr = hdr->sh_next;
 		}
 		return;
@@ -256,12 +368,85 @@ qsort_slab(
 		qs->slab = slab;
 		qs->hdr = hdr;
 		qs->compare_fn = compare_fn;
+		qs->key_fn = key_fn;
 		queue_work(&wq, qsort_slab_helper, 0, qs);
 		hdr = hdr->sh_next;
 	}
 	destroy_work_queue(&wq);
 }
 
+/*
+ * Sort the items in the slab.  Do not run this method if there are any
+ * cursors holding on to the slab.
+ */
+void
+qsort_slab(
+	struct xfs_slab		*slab,
+	int (*compare_fn)(const void *, const void *))
+{
+	sort_slab(slab, compare_fn, NULL);
+}
+
+/*
+ * Sort the items in the slab with a radix sort on an unsigned 64-bit key.
+ * The key must be a prefix of the order defined by compare_fn, i.e. if
+ * compare_fn(a, b) < 0 then key_fn(a) <= key_fn(b); items with equal keys
+ * are then ordered with compare_fn.  The slabs are sorted in parallel like
+ * qsort_slab(), which is used instead if memory for the sort is short.  Do
+ * not run this method if there are any cursors holding on to the slab.
+ */
+void
+radix_sort_slab(
+	struct xfs_slab		*slab,
+	uint64_t (*key_fn)(const void *),
+	int (*compare_fn)(const void *, const void *))
+{
+	sort_slab(slab, compare_fn, key_fn);
+}
+
+/*
+ * Is the item under slab cursor a less than the one under b?  Ties go to the
+ * earlier slab so that equal items come out in slab order.
+ */
+static inline bool
+slab_heap_less(
+	struct xfs_slab_cursor		*cur,
+	struct xfs_slab_hdr_cursor	*a,
+	struct xfs_slab_hdr_cursor	*b)
+{
+	int				diff;
+
+	diff = cur->compare_fn(slab_ptr(cur->slab, a->hdr, a->loc),
+			       slab_ptr(cur->slab, b->hdr, b->loc));
+	if (diff)
+		return diff < 0;
+	return a < b;
+}
+
+/*
+ * Move the heap entry at i down until neither child is smaller than it.
+ */
+static void
+slab_heap_sift_down(
+	struct xfs_slab_cursor		*cur,
+	size_t				i)
+{
+	struct xfs_slab_hdr_cursor	**heap = cur->heap;
+	struct xfs_slab_hdr_cursor	*hcur = heap[i];
+	size_t				child;
+
+	while ((child = 2 * i + 1) < cur->heap_nr) {
+		if (child + 1 < cur->heap_nr &&
+		    slab_heap_less(cur, heap[child + 1], heap[child]))
+			child++;
+		if (!slab_heap_less(cur, heap[child], hcur))
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = hcur;
+}
+
 /*
  * init_slab_cursor() -- Create a slab cursor to iterate the slab items.
  *
@@ -278,23 +463,31 @@ init_slab_cursor(
 	struct xfs_slab_cursor	*c;
 	struct xfs_slab_hdr_cursor	*hcur;
 	struct xfs_slab_hdr	*hdr;
+	size_t			i;
 
 	c = malloc(sizeof(struct xfs_slab_cursor) +
-		   (sizeof(struct xfs_slab_hdr_cursor) * slab->s_nr_slabs));
+		   ((sizeof(struct xfs_slab_hdr_cursor) +
+		     sizeof(struct xfs_slab_hdr_cursor *)) * slab->s_nr_slabs));
 	if (!c)
 		return -ENOMEM;
 	c->nr = slab->s_nr_slabs;
 	c->slab = slab;
 	c->compare_fn = compare_fn;
 	c->last_hcur = NULL;
+	c->heap_nr = 0;
+	c->heap = (struct xfs_slab_hdr_cursor **)&c->hcur[c->nr];
 	hcur = (struct xfs_slab_hdr_cursor *)(c + 1);
 	hdr = slab->s_first;
 	while (hdr) {
 		hcur->hdr = hdr;
 		hcur->loc = 0;
+		if (compare_fn && hdr->sh_inuse)
+			c->heap[c->heap_nr++] = hcur;
 		hcur++;
 		hdr = hdr->sh_next;
 	}
+	for (i = c->heap_nr / 2; i > 0; i--)
+		slab_heap_sift_down(c, i - 1);
 	*cur = c;
 	return 0;
 }
@@ -321,11 +514,6 @@ peek_slab_cursor(
 	struct xfs_slab_cursor	*cur)
 {
 	struct xfs_slab_hdr_cursor	*hcur;
-	void			*p = NULL;
-	void			*q;
-	size_t			i;
-
-	cur->last_hcur = NULL;
 
 	/* no compare function; inorder traversal */
 	if (!cur->compare_fn) {
@@ -337,23 +525,18 @@ peek_slab_cursor(
 			hcur++;
 		if (hcur == &cur->hcur[cur->nr])
 			return NULL;
-		p = slab_ptr(cur->slab, hcur->hdr, hcur->loc);
 		cur->last_hcur = hcur;
-		return p;
+		return slab_ptr(cur->slab, hcur->hdr, hcur->loc);
 	}
 
 	/* otherwise return things in increasing order */
-	for (i = 0, hcur = &cur->hcur[i]; i < cur->nr; i++, hcur++) {
-		if (hcur->loc >= hcur->hdr->sh_inuse)
-			continue;
-		q = slab_ptr(cur->slab, hcur->hdr, hcur->loc);
-		if (!p || cur->compare_fn(p, q) > 0) {
-			p = q;
-			cur->last_hcur = hcur;
-		}
+	if (!cur->heap_nr) {
+		cur->last_hcur = NULL;
+		return NULL;
 	}
-
-	return p;
+	hcur = cur->heap[0];
+	cur->last_hcur = hcur;
+	return slab_ptr(cur->slab, hcur->hdr, hcur->loc);
 }
 
 /*
@@ -365,6 +548,15 @@ advance_slab_cursor(
 {
 	ASSERT(cur->last_hcur);
 	cur->last_hcur->loc++;
+	if (!cur->compare_fn)
+		return;
+
+	/* the item we took came from the top of the heap */
+	ASSERT(cur->last_hcur == cur->heap[0]);
+	if (cur->last_hcur->loc >= cur->last_hcur->hdr->sh_inuse)
+		cur->heap[0] = cur->heap[--cur->heap_nr];
+	if (cur->heap_nr)
+		slab_heap_sift_down(cur, 0);
 }
 
 /*
@@ -28,6 +28,8 @@ extern void free_slab(struct xfs_slab **);
 
 extern int slab_add(struct xfs_slab *, void *);
 extern void qsort_slab(struct xfs_slab *, int (*)(const void *, const void *));
+extern void radix_sort_slab(struct xfs_slab *, uint64_t (*)(const void *),
+	int (*)(const void *, const void *));
 extern size_t slab_count(struct xfs_slab *);
 
 extern int init_slab_cursor(struct xfs_slab *,
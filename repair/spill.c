@@ -0,0 +1,286 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>.  All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#if defined(HAVE_FALLOCATE)
+#include <linux/falloc.h>
+#endif
+#include <sys/mman.h>
+#include "libxfs.h"
+#include "spill.h"
+
+#ifndef FALLOC_FL_PUNCH_HOLE
+#define FALLOC_FL_PUNCH_HOLE	0x02
+#endif
+
+/*
+ * Spill memory.
+ *
+ * The inode records, extent tree nodes and rmap slabs grow with the size of
+ * the filesystem, not with the size of the machine, so on very large
+ * filesystems they can exceed physical memory. When a scratch directory is
+ * given, these structures are allocated from a MAP_SHARED mapping of an
+ * unlinked scratch file instead of anonymous memory. The kernel is then free
+ * to write cold pages (typically the records of AGs we're not working on) to
+ * the scratch file and drop them from memory, rather than running the system
+ * out of memory and swap, and the hot working set stays resident because it
+ * is being referenced.
+ *
+ * Small allocations are rounded up to a power of two size class and carved
+ * out of large arenas of the file, with a free list per size class. Large
+ * allocations get their own mapping of a fresh range of the file, and the
+ * range is punched out again when they are freed. Each allocation carries a
+ * small header describing where it came from.
+ */
+
+#define SPILL_MAGIC		0x5350
+#define SPILL_MIN_SHIFT		4			/* 16 bytes */
+#define SPILL_MAX_SHIFT		16			/* 64k */
+#define SPILL_NR_CLASSES	(SPILL_MAX_SHIFT - SPILL_MIN_SHIFT + 1)
+#define SPILL_ARENA_SIZE	(4 * 1048576)
+#define SPILL_LARGE		(-1)
+
+struct spill_hdr {
+	__int16_t		sh_class;	/* size class or SPILL_LARGE */
+	__uint16_t		sh_magic;
+	__uint32_t		sh_pages;	/* large: pages mapped */
+	__uint64_t		sh_offset;	/* large: file offset */
+};
+
+struct spill_free_obj {
+	struct spill_free_obj	*next;
+};
+
+struct spill_class {
+	pthread_mutex_t		lock;
+	struct spill_free_obj	*free;		/* freed objects */
+	char			*next;		/* next uncarved object */
+	char			*end;		/* end of current arena */
+};
+
+static int			spill_fd = -1;
+static __uint64_t		spill_eof;	/* file space handed out */
+static pthread_mutex_t		spill_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct spill_class	spill_classes[SPILL_NR_CLASSES];
+static size_t			spill_pagesize;
+
+/*
+ * Create the (already unlinked) scratch file in @dir.  From here on the
+ * spill allocators hand out file backed memory.
+ */
+int
+spill_init(
+	const char		*dir)
+{
+	char			*path;
+	int			fd;
+	int			i;
+
+	path = malloc(strlen(dir) + sizeof("/xfs_repair.XXXXXX"));
+	if (!path)
+		return ENOMEM;
+	sprintf(path, "%s/xfs_repair.XXXXXX", dir);
+	fd = mkstemp(path);
+	if (fd < 0) {
+		free(path);
+		return errno;
+	}
+	unlink(path);
+	free(path);
+
+	for (i = 0; i < SPILL_NR_CLASSES; i++) {
+		pthread_mutex_init(&spill_classes[i].lock, NULL);
+		spill_classes[i].free = NULL;
+		spill_classes[i].next = NULL;
+		spill_classes[i].end = NULL;
+	}
+	spill_pagesize = getpagesize();
+	spill_fd = fd;
+	return 0;
+}
+
+bool
+spill_enabled(void)
+{
+	return spill_fd >= 0;
+}
+
+/*
+ * Bytes of scratch file handed out so far, including space since punched
+ * out again by large frees.
+ */
+unsigned long long
+spill_size(void)
+{
+	return spill_eof;
+}
+
+/*
+ * Extend the scratch file by @len bytes and map the new range.
+ */
+static void *
+spill_map(
+	size_t			len,
+	__uint64_t		*offset)
+{
+	void			*p;
+
+	pthread_mutex_lock(&spill_lock);
+	*offset = spill_eof;
+	if (ftruncate(spill_fd, spill_eof + len) < 0) {
+		pthread_mutex_unlock(&spill_lock);
+		return NULL;
+	}
+	spill_eof += len;
+	pthread_mutex_unlock(&spill_lock);
+
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, spill_fd,
+		 *offset);
+	if (p == MAP_FAILED)
+		return NULL;
+	return p;
+}
+
+static void *
+spill_alloc_large(
+	size_t			size)
+{
+	struct spill_hdr	*hdr;
+	__uint64_t		offset;
+	size_t			len;
+
+	len = roundup(size + sizeof(*hdr), spill_pagesize);
+	hdr = spill_map(len, &offset);
+	if (!hdr)
+		return NULL;
+	hdr->sh_class = SPILL_LARGE;
+	hdr->sh_magic = SPILL_MAGIC;
+	hdr->sh_pages = len / spill_pagesize;
+	hdr->sh_offset = offset;
+	return hdr + 1;
+}
+
+static void
+spill_free_large(
+	struct spill_hdr	*hdr)
+{
+	__uint64_t		offset = hdr->sh_offset;
+	size_t			len = (size_t)hdr->sh_pages * spill_pagesize;
+
+	munmap(hdr, len);
+#if defined(HAVE_FALLOCATE)
+	/* give the space back; if we can't, it is only scratch space */
+	fallocate(spill_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		  offset, len);
+#endif
+}
+
+void *
+spill_malloc(
+	size_t			size)
+{
+	struct spill_class	*sc;
+	struct spill_hdr	*hdr;
+	size_t			objsize;
+	int			shift;
+
+	if (!spill_enabled())
+		return malloc(size);
+
+	objsize = size + sizeof(*hdr);
+	for (shift = SPILL_MIN_SHIFT; shift <= SPILL_MAX_SHIFT; shift++) {
+		if (objsize <= (1UL << shift))
+			break;
+	}
+	if (shift > SPILL_MAX_SHIFT)
+		return spill_alloc_large(size);
+
+	objsize = 1UL << shift;
+	sc = &spill_classes[shift - SPILL_MIN_SHIFT];
+	pthread_mutex_lock(&sc->lock);
+	if (sc->free) {
+		hdr = (struct spill_hdr *)sc->free;
+		sc->free = sc->free->next;
+	} else {
+		if (sc->next == sc->end) {
+			__uint64_t	offset;
+
+			sc->next = spill_map(SPILL_ARENA_SIZE, &offset);
+			if (!sc->next) {
+				sc->end = NULL;
+				pthread_mutex_unlock(&sc->lock);
+				return NULL;
+			}
+			sc->end = sc->next + SPILL_ARENA_SIZE;
+		}
+		hdr = (struct spill_hdr *)sc->next;
+		sc->next += objsize;
+	}
+	pthread_mutex_unlock(&sc->lock);
+
+	hdr->sh_class = shift - SPILL_MIN_SHIFT;
+	hdr->sh_magic = SPILL_MAGIC;
+	return hdr + 1;
+}
+
+void *
+spill_calloc(
+	size_t			nmemb,
+	size_t			size)
+{
+	void			*p;
+
+	if (!spill_enabled())
+		return calloc(nmemb, size);
+
+	if (size && nmemb > SIZE_MAX / size)
+		return NULL;
+	p = spill_malloc(nmemb * size);
+	if (p)
+		memset(p, 0, nmemb * size);
+	return p;
+}
+
+void
+spill_free(
+	void			*ptr)
+{
+	struct spill_class	*sc;
+	struct spill_hdr	*hdr;
+	struct spill_free_obj	*obj;
+
+	if (!spill_enabled()) {
+		free(ptr);
+		return;
+	}
+	if (!ptr)
+		return;
+
+	hdr = (struct spill_hdr *)ptr - 1;
+	ASSERT(hdr->sh_magic == SPILL_MAGIC);
+	if (hdr->sh_class == SPILL_LARGE) {
+		spill_free_large(hdr);
+		return;
+	}
+
+	ASSERT(hdr->sh_class >= 0 && hdr->sh_class < SPILL_NR_CLASSES);
+	sc = &spill_classes[hdr->sh_class];
+	obj = (struct spill_free_obj *)hdr;
+	pthread_mutex_lock(&sc->lock);
+	obj->next = sc->free;
+	sc->free = obj;
+	pthread_mutex_unlock(&sc->lock);
+}
@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>.  All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#ifndef SPILL_H_
+#define SPILL_H_
+
+/*
+ * File backed memory for the large incore structures. Until spill_init() is
+ * called these are just malloc, calloc and free.
+ */
+extern int spill_init(const char *dir);
+extern bool spill_enabled(void);
+extern void *spill_malloc(size_t size);
+extern void *spill_calloc(size_t nmemb, size_t size);
+extern void spill_free(void *ptr);
+extern unsigned long long spill_size(void);
+
+#endif /* SPILL_H_ */
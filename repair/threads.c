@@ -6,45 +6,162 @@
 #include "protos.h"
 #include "globals.h"
 
+static pthread_key_t	work_deque_key;
+static pthread_once_t	work_deque_once = PTHREAD_ONCE_INIT;
+
+static void
+work_deque_key_init(void)
+{
+	pthread_key_create(&work_deque_key, NULL);
+}
+
+static void
+deque_push_tail(
+	struct work_deque	*dq,
+	work_item_t		*wi)
+{
+	pthread_mutex_lock(&dq->lock);
+	wi->next = NULL;
+	wi->prev = dq->tail;
+	if (dq->tail)
+		dq->tail->next = wi;
+	else
+		dq->head = wi;
+	dq->tail = wi;
+	pthread_mutex_unlock(&dq->lock);
+}
+
+static work_item_t *
+deque_pop_head(
+	struct work_deque	*dq)
+{
+	work_item_t		*wi;
+
+	pthread_mutex_lock(&dq->lock);
+	wi = dq->head;
+	if (wi) {
+		dq->head = wi->next;
+		if (dq->head)
+			dq->head->prev = NULL;
+		else
+			dq->tail = NULL;
+	}
+	pthread_mutex_unlock(&dq->lock);
+	return wi;
+}
+
+/*
+ * Steal from the tail of another worker's queue. Unless told to wait, don't
+ * queue up behind the owner as there may be other victims; *busy is set if
+ * the queue was skipped because it was locked.
+ */
+static work_item_t *
+deque_pop_tail(
+	struct work_deque	*dq,
+	bool			wait,
+	bool			*busy)
+{
+	work_item_t		*wi;
+
+	if (wait) {
+		pthread_mutex_lock(&dq->lock);
+	} else if (pthread_mutex_trylock(&dq->lock) != 0) {
+		*busy = true;
+		return NULL;
+	}
+	wi = dq->tail;
+	if (wi) {
+		dq->tail = wi->prev;
+		if (dq->tail)
+			dq->tail->next = NULL;
+		else
+			dq->head = NULL;
+	}
+	pthread_mutex_unlock(&dq->lock);
+	return wi;
+}
+
+/*
+ * Take the next piece of work from our own queue, or steal one from another
+ * worker if we have run out. If nothing was stolen but some queues were
+ * locked, go round again waiting for the locks, otherwise a worker that keeps
+ * losing the race for them spins here while work is still counted.
+ */
+static work_item_t *
+dequeue_work(
+	work_queue_t		*wq,
+	struct work_deque	*self)
+{
+	work_item_t		*wi;
+	int			me = self - wq->deques;
+	bool			busy = false;
+	int			i;
+
+	wi = deque_pop_head(self);
+	for (i = 1; !wi && i < wq->thread_count; i++)
+		wi = deque_pop_tail(&wq->deques[(me + i) % wq->thread_count],
+				false, &busy);
+	for (i = 1; !wi && busy && i < wq->thread_count; i++)
+		wi = deque_pop_tail(&wq->deques[(me + i) % wq->thread_count],
+				true, &busy);
+	if (!wi)
+		return NULL;
+
+	pthread_mutex_lock(&wq->lock);
+	ASSERT(wq->item_count > 0);
+	wq->item_count--;
+	wq->active_count++;
+	pthread_mutex_unlock(&wq->lock);
+	return wi;
+}
+
 static void *
 worker_thread(void *arg)
 {
-	work_queue_t	*wq;
-	work_item_t	*wi;
+	struct work_deque	*self = arg;
+	work_queue_t		*wq = self->queue;
+	work_item_t		*wi;
 
-	wq = (work_queue_t*)arg;
+	pthread_setspecific(work_deque_key, self);
 
 	/*
 	 * Loop pulling work from the passed in work queue.
 	 * Check for notification to exit after every chunk of work.
 	 */
 	while (1) {
-		pthread_mutex_lock(&wq->lock);
+		wi = dequeue_work(wq, self);
+		if (wi) {
+			(wi->function)(wi->queue, wi->agno, wi->arg);
+			free(wi);
+
+			/*
+			 * The last item to finish after termination was asked
+			 * for has to wake the workers waiting on it to exit.
+			 */
+			pthread_mutex_lock(&wq->lock);
+			wq->active_count--;
+			if (wq->terminate && !wq->active_count &&
+			    !wq->item_count)
+				pthread_cond_broadcast(&wq->wakeup);
+			pthread_mutex_unlock(&wq->lock);
+			continue;
+		}
 
 		/*
-		 * Wait for work.
+		 * Wait for work. Work we can't see yet may still be on its
+		 * way onto a queue, so go around again if any is counted.
+		 * Running work may queue more, so don't exit until it is
+		 * all done either.
 		 */
-		while (wq->next_item == NULL && !wq->terminate) {
-			ASSERT(wq->item_count == 0);
+		pthread_mutex_lock(&wq->lock);
+		while (wq->item_count == 0 &&
+		       (!wq->terminate || wq->active_count))
 			pthread_cond_wait(&wq->wakeup, &wq->lock);
-		}
-		if (wq->next_item == NULL && wq->terminate) {
+		if (wq->item_count == 0) {
 			pthread_mutex_unlock(&wq->lock);
 			break;
 		}
-
-		/*
-		 *  Dequeue work from the head of the list.
-		 */
-		ASSERT(wq->item_count > 0);
-		wi = wq->next_item;
-		wq->next_item = wi->next;
-		wq->item_count--;
-
 		pthread_mutex_unlock(&wq->lock);
-
-		(wi->function)(wi->queue, wi->agno, wi->arg);
-		free(wi);
 	}
 
 	return NULL;
@@ -74,6 +191,7 @@ create_work_queue(
 	int			err;
 	int			i;
 
+	pthread_once(&work_deque_once, work_deque_key_init);
 	memset(wq, 0, sizeof(work_queue_t));
 
 	pthread_cond_init(&wq->wakeup, NULL);
@@ -82,10 +200,19 @@ create_work_queue(
 	wq->mp = mp;
 	wq->thread_count = nworkers;
 	wq->threads = malloc(nworkers * sizeof(pthread_t));
+	wq->deques = calloc(nworkers, sizeof(struct work_deque));
+	if (!wq->threads || !wq->deques)
+		do_error(_("cannot allocate worker threads\n"));
 	wq->terminate = 0;
 
 	for (i = 0; i < nworkers; i++) {
-		err = pthread_create(&wq->threads[i], NULL, worker_thread, wq);
+		pthread_mutex_init(&wq->deques[i].lock, NULL);
+		wq->deques[i].queue = wq;
+	}
+
+	for (i = 0; i < nworkers; i++) {
+		err = pthread_create(&wq->threads[i], NULL, worker_thread,
+				     &wq->deques[i]);
 		if (err != 0) {
 			do_error(_("cannot create worker threads, error = [%d] %s\n"),
 				err, strerror(err));
@@ -102,6 +229,7 @@ queue_work(
 	void		*arg)
 {
 	work_item_t	*wi;
+	struct work_deque *dq;
 
 	wi = (work_item_t *)malloc(sizeof(work_item_t));
 	if (wi == NULL)
@@ -112,21 +240,18 @@ queue_work(
 	wi->agno = agno;
 	wi->arg = arg;
 	wi->queue = wq;
-	wi->next = NULL;
 
 	/*
-	 *  Now queue the new work structure to the work queue.
+	 *  Now queue the new work structure to the work queue - our own if
+	 *  we are one of its workers, otherwise the next one round robin.
 	 */
 	pthread_mutex_lock(&wq->lock);
-	if (wq->next_item == NULL) {
-		wq->next_item = wi;
-		ASSERT(wq->item_count == 0);
-		pthread_cond_signal(&wq->wakeup);
-	} else {
-		wq->last_item->next = wi;
-	}
-	wq->last_item = wi;
+	dq = pthread_getspecific(work_deque_key);
+	if (!dq || dq->queue != wq)
+		dq = &wq->deques[wq->next_deque++ % wq->thread_count];
+	deque_push_tail(dq, wi);
 	wq->item_count++;
+	pthread_cond_signal(&wq->wakeup);
 	pthread_mutex_unlock(&wq->lock);
 }
 
@@ -145,6 +270,11 @@ destroy_work_queue(
 	for (i = 0; i < wq->thread_count; i++)
 		pthread_join(wq->threads[i], NULL);
 
+	for (i = 0; i < wq->thread_count; i++) {
+		ASSERT(wq->deques[i].head == NULL);
+		pthread_mutex_destroy(&wq->deques[i].lock);
+	}
+	free(wq->deques);
 	free(wq->threads);
 	pthread_mutex_destroy(&wq->lock);
 	pthread_cond_destroy(&wq->wakeup);
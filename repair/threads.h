@@ -9,16 +9,33 @@ typedef void work_func_t(struct work_queue *, xfs_agnumber_t, void *);
 
 typedef struct work_item {
 	struct work_item	*next;
+	struct work_item	*prev;
 	work_func_t		*function;
 	struct work_queue	*queue;
 	xfs_agnumber_t		agno;
 	void			*arg;
 } work_item_t;
 
+/*
+ * Each worker thread has its own queue of work. Work queued from outside the
+ * pool is spread over the workers round robin, while work queued by a worker
+ * goes on its own queue. A worker takes work from the head of its own queue
+ * and, when that is empty, steals from the tail of the other workers' queues.
+ * So work can be queued in pieces smaller than an AG and idle workers will
+ * pick up the pieces rather than waiting for the busiest worker to finish.
+ */
+struct work_deque {
+	pthread_mutex_t		lock;
+	work_item_t		*head;
+	work_item_t		*tail;
+	struct work_queue	*queue;
+};
+
 typedef struct  work_queue {
-	work_item_t		*next_item;
-	work_item_t		*last_item;
-	int			item_count;
+	struct work_deque	*deques;	/* one per worker */
+	int			item_count;	/* queued, not started */
+	int			active_count;	/* started, not finished */
+	int			next_deque;	/* round robin queueing */
 	int			thread_count;
 	pthread_t		*threads;
 	xfs_mount_t		*mp;
@@ -20,7 +20,6 @@
 #include "libxlog.h"
 #include <sys/resource.h>
 #include "xfs_multidisk.h"
-#include "avl.h"
 #include "avl64.h"
 #include "globals.h"
 #include "versions.h"
@@ -34,6 +33,7 @@
 #include "dinode.h"
 #include "slab.h"
 #include "rmap.h"
+#include "spill.h"
 
 #define	rounddown(x, y)	(((x)/(y))*(y))
 
@@ -61,6 +61,10 @@ static char *o_opts[] = {
 	"force_geometry",
 #define PHASE2_THREADS	6
 	"phase2_threads",
+#define BCACHE_POLICY	7
+	"bcache_policy",
+#define TMPDIR		8
+	"tmpdir",
 	NULL
 };
 
@@ -77,6 +81,7 @@ static char *c_opts[] = {
 static int	bhash_option_used;
 static long	max_mem_specified;	/* in megabytes */
 static int	phase2_threads = 32;
+static char	*spill_dir;
 
 static void
 usage(void)
@@ -269,6 +274,24 @@ process_args(int argc, char **argv)
 				case PHASE2_THREADS:
 					phase2_threads = (int)strtol(val, NULL, 0);
 					break;
+				case BCACHE_POLICY:
+					if (!val)
+						do_abort(
+		_("-o bcache_policy requires a parameter\n"));
+					if (!strcmp(val, "adaptive"))
+						bcache_flags |= CACHE_ADAPTIVE_RECLAIM;
+					else if (!strcmp(val, "priority"))
+						bcache_flags &= ~CACHE_ADAPTIVE_RECLAIM;
+					else
+						do_abort(
+		_("-o bcache_policy must be \"priority\" or \"adaptive\"\n"));
+					break;
+				case TMPDIR:
+					if (!val)
+						do_abort(
+		_("-o tmpdir requires a parameter\n"));
+					spill_dir = val;
+					break;
 				default:
 					unknown('o', val);
 					break;
@@ -339,6 +362,14 @@ process_args(int argc, char **argv)
 
 	if ((fs_name = argv[optind]) == NULL)
 		usage();
+
+	if (spill_dir) {
+		int	error = spill_init(spill_dir);
+
+		if (error)
+			do_abort(_("cannot create scratch file in %s: %s\n"),
+				spill_dir, strerror(error));
+	}
 }
 
 void __attribute__((noreturn))
@@ -831,9 +862,9 @@ main(int argc, char **argv)
 	 * filesystem size and inode count.
 	 *
 	 * We'll set the cache size based on 3/4s the memory minus
-	 * space used by the inode AVL tree and block usage map.
+	 * space used by the inode tree and block usage map.
 	 *
-	 * Inode AVL tree space is approximately 4 bytes per inode,
+	 * Inode tree space is approximately 4 bytes per inode,
 	 * block usage map is currently 1 byte for 2 blocks.
 	 *
 	 * We assume most blocks will be inode clusters.
@@ -849,9 +880,14 @@ main(int argc, char **argv)
 		libxfs_bcache_purge();
 		cache_destroy(libxfs_bcache);
 
-		mem_used = (mp->m_sb.sb_icount >> (10 - 2)) +
-					(mp->m_sb.sb_dblocks >> (10 + 1)) +
-					50000;	/* rough estimate of 50MB overhead */
+		/*
+		 * The incore inode and extent records live in the scratch
+		 * file if we have one, so don't count them against memory.
+		 */
+		mem_used = 50000;	/* rough estimate of 50MB overhead */
+		if (!spill_enabled())
+			mem_used += (mp->m_sb.sb_icount >> (10 - 2)) +
+					(mp->m_sb.sb_dblocks >> (10 + 1));
 		max_mem = max_mem_specified ? max_mem_specified * 1024 :
 						libxfs_physmem() * 3 / 4;
 
@@ -907,7 +943,7 @@ main(int argc, char **argv)
 			do_log(_("        - block cache size set to %d entries\n"),
 				libxfs_bhash_size * HASH_CACHE_RATIO);
 
-		libxfs_bcache = cache_init(0, libxfs_bhash_size,
+		libxfs_bcache = cache_init(bcache_flags, libxfs_bhash_size,
 						&libxfs_bcache_operations);
 	}
 
@@ -1085,6 +1121,9 @@ _("Note - stripe unit (%d) and width (%d) were copied from a backup superblock.\
 
 	if (verbose)
 		summary_report();
+	if (verbose && spill_enabled())
+		do_log(_("        - used %lluMB of scratch file\n"),
+			spill_size() >> 20);
 	do_log(_("done\n"));
 
 	if (dangerously && !no_modify)